@@ -789,16 +789,26 @@ flow_config_dump(const struct rl_flow_config *c)
                  "   msg_boundaries=%u\n"
                  "   in_order_delivery=%u\n"
                  "   max_sdu_gap=%llu\n"
+                 "   seqq_max_len=%u\n"
+                 "   cc_algo=%.*s\n"
+                 "   ack.pdus=%u\n"
+                 "   ack.bytes=%u\n"
+                 "   ack.flags=%x\n"
                  "   dtcp_flags=%x\n"
                  "   dtcp.initial_a=%u\n"
                  "   dtcp.bandwidth=%u\n"
                  "   dtcp.flow_control=%x\n"
-                 "   dtcp.rtx_control=%x\n",
+                 "   dtcp.rtx_control=%x\n"
+                 "   dtcp.sack=%x\n",
                  c->msg_boundaries, c->in_order_delivery,
-                 (long long unsigned)c->max_sdu_gap, c->dtcp.flags,
+                 (long long unsigned)c->max_sdu_gap, c->seqq_max_len,
+                 RL_CC_NAME_MAX, c->cc_algo, c->ack.pdus, c->ack.bytes,
+                 c->ack.flags,
+                 c->dtcp.flags,
                  c->dtcp.initial_a, c->dtcp.bandwidth,
                  !!(c->dtcp.flags & DTCP_CFG_FLOW_CTRL),
-                 !!(c->dtcp.flags & DTCP_CFG_RTX_CTRL));
+                 !!(c->dtcp.flags & DTCP_CFG_RTX_CTRL),
+                 !!(c->dtcp.flags & DTCP_CFG_SACK));
 
     if (c->dtcp.fc.fc_type == RLITE_FC_T_WIN) {
         COMMON_PRINT("   dtcp.fc.max_cwq_len=%lu\n"
@@ -221,6 +221,42 @@ void rina_flow_spec_unreliable(struct rina_flow_spec *spec);
  */
 unsigned int rina_flow_mss_get(int fd);
 
+/*
+ * Descriptor of an SDU buffer, used for batched I/O on flow file
+ * descriptors.
+ */
+struct rina_sdu {
+    void *buf;  /* SDU buffer */
+    size_t len; /* SDU length */
+};
+
+/*
+ * Write up to @num SDUs to the flow file descriptor @fd, with a single
+ * system call. For each descriptor, @len bytes are sent from @buf as a
+ * separate SDU. The flow file descriptor is used in blocking or
+ * non-blocking mode, as for write().
+ *
+ * On success, it returns the number of SDUs actually written, which may be
+ * less than @num. On error -1 is returned, with the errno code properly set.
+ */
+int rina_flow_write_batch(int fd, const struct rina_sdu *sdus,
+                          unsigned int num);
+
+/*
+ * Read up to @num SDUs from the flow file descriptor @fd, with a single
+ * system call. On input, the @len field of each descriptor must contain the
+ * size of the @buf buffer. On output, the @len field of the first N
+ * descriptors is set to the length of the SDUs received, where N is the
+ * return value. SDUs that do not fit the buffer are truncated. The function
+ * blocks (unless @fd is in non-blocking mode) until at least one SDU is
+ * available.
+ *
+ * On success, it returns the number of SDUs actually read, which may be
+ * less than @num; 0 is returned if the flow has been deallocated. On
+ * error -1 is returned, with the errno code properly set.
+ */
+int rina_flow_read_batch(int fd, struct rina_sdu *sdus, unsigned int num);
+
 #ifdef __cplusplus
 }
 #endif
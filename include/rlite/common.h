@@ -43,7 +43,7 @@ extern "C" {
 #endif
 
 /* Expected control API version. */
-#define RL_API_VERSION 7
+#define RL_API_VERSION 8
 
 #define RLITE_CTRLDEV_NAME "/dev/rlite"
 #define RLITE_IODEV_NAME "/dev/rlite-io"
@@ -167,9 +167,40 @@ struct rl_ioctl_info {
     rl_ipcp_id_t ipcp_id;
 };
 
+/* Descriptor of a single SDU, used for batched I/O on rlite-io devices
+ * bound to a flow (RLITE_IO_MODE_APPL_BIND). On a write batch, 'len'
+ * is the length of the SDU to be sent. On a read batch, 'len' is the
+ * size of the user buffer on input, and the length of the received SDU
+ * on output; SDUs larger than the user buffer are truncated. */
+struct rl_ioctl_sdu {
+    uint64_t buf; /* user pointer */
+    uint32_t len;
+    uint32_t pad1;
+};
+
+/* Maximum number of SDUs that can be moved with a single batch ioctl. */
+#define RLITE_IO_BATCH_MAX 32
+
+struct rl_ioctl_batch {
+    uint64_t sdus; /* user pointer to an array of struct rl_ioctl_sdu */
+    uint32_t num;  /* number of descriptors in the array */
+    uint32_t pad1;
+};
+
+/* Argument of RLITE_IOCTL_RING_SETUP, see rlite/ring.h. */
+struct rl_ioctl_ring {
+    uint32_t num_slots; /* slots per ring, a power of two */
+    uint32_t slot_size; /* bytes per slot, including the slot header */
+    uint64_t mmap_size; /* output: size of the region to be mmap()ed */
+};
+
 #define RLITE_IOCTL_FLOW_BIND _IOW(0xAF, 0x00, struct rl_ioctl_info)
 #define RLITE_IOCTL_CHFLAGS _IOW(0xAF, 0x01, uint64_t)
 #define RLITE_IOCTL_MSS_GET _IOW(0xAF, 0x02, uint32_t *)
+#define RLITE_IOCTL_WRITE_BATCH _IOW(0xAF, 0x03, struct rl_ioctl_batch)
+#define RLITE_IOCTL_READ_BATCH _IOWR(0xAF, 0x04, struct rl_ioctl_batch)
+#define RLITE_IOCTL_RING_SETUP _IOWR(0xAF, 0x05, struct rl_ioctl_ring)
+#define RLITE_IOCTL_RING_SYNC _IO(0xAF, 0x06)
 
 #define RLITE_MGMT_HDR_T_OUT_LOCAL_PORT 1
 #define RLITE_MGMT_HDR_T_OUT_DST_ADDR 2
@@ -201,6 +232,7 @@ struct dtcp_config {
 #define DTCP_CFG_FLOW_CTRL (1 << 0)
 #define DTCP_CFG_RTX_CTRL (1 << 1)
 #define DTCP_CFG_SHAPER (1 << 2)
+#define DTCP_CFG_SACK (1 << 3) /* selective ACKs, requires RTX_CTRL */
 
     /* Flow control. */
     struct {
@@ -232,15 +264,32 @@ struct dtcp_config {
 
     uint32_t initial_a; /* A */
     uint32_t bandwidth; /* in bps */
+    uint32_t burst;     /* shaper burst allowance, in bytes */
+    uint32_t pad3;
 };
 
 struct rl_flow_config {
     /* Used by normal IPCP. */
     uint8_t msg_boundaries;
     uint8_t in_order_delivery;
-    uint8_t pad1[6];
+    uint8_t pad1[2];
+    uint32_t seqq_max_len; /* in PDUs, 0 means RL_SEQQ_MAX_LEN_DFLT */
     rlm_seq_t max_sdu_gap;
     struct dtcp_config dtcp;
+#define RL_CC_NAME_MAX 16
+    char cc_algo[RL_CC_NAME_MAX]; /* empty for the IPCP default */
+
+    /* Receiver ACK policy. If no threshold is set and no flag is
+     * set, control PDUs are sent on every PDU when the A timeout
+     * is zero, and every half window otherwise. */
+    struct {
+        uint32_t pdus;  /* ACK every N PDUs */
+        uint32_t bytes; /* ACK every N bytes received */
+        uint8_t flags;
+#define RL_ACK_F_OOO (1 << 0)      /* immediate ACK on out-of-order PDUs */
+#define RL_ACK_F_ADAPTIVE (1 << 1) /* thin ACKs as the window grows */
+        uint8_t pad1[7];
+    } ack;
 
     /* Currently used by shim-tcp4 and shim-udp4. */
     int32_t fd;
@@ -252,6 +301,8 @@ struct rl_flow_config {
 #define RL_MPL_MSECS_DFLT 1000
 #define RL_DATA_RXMS_MAX_DFLT 10
 #define RL_TTL_DFLT 64 /* default TTL */
+#define RL_SEQQ_MAX_LEN_DFLT 64
+#define RL_SEQQ_MAX_LEN_MAX 4096
 
 /* Does a flow specification correspond to best effort QoS? */
 static inline int
@@ -283,6 +334,15 @@ struct rl_rmt_stats {
     uint64_t ttl_drop;
     uint64_t noflow_drop;
     uint64_t other_drop;
+    uint64_t ecn_mark;
+    uint64_t frr_pkt; /* PDUs forwarded to a backup next hop */
+
+    /* Per-class counters, for PDUs going through a PDU scheduler.
+     * Classes are indexed by min(qos_id, RL_RMT_STATS_CLASSES - 1). */
+#define RL_RMT_STATS_CLASSES 8
+    uint64_t class_enq[RL_RMT_STATS_CLASSES];
+    uint64_t class_drop[RL_RMT_STATS_CLASSES];
+    uint64_t class_backlog[RL_RMT_STATS_CLASSES]; /* in bytes */
 };
 
 /* IPCP statistics. All counters must be 64 bits wide. */
@@ -298,6 +358,23 @@ struct rl_ipcp_stats {
     uint64_t rtx_pkt;
     uint64_t rtx_byte;
 
+    /* Transmissions that needed to copy the PDU into a new buffer. */
+    uint64_t tx_copy;
+
+    /* Frames (or datagrams) transmitted as aggregates of PDUs by the
+     * shim IPCPs, and the number of PDUs they contained. */
+    uint64_t tx_agg_frames;
+    uint64_t tx_agg_pdus;
+
+    /* Packet buffer cache, shared by all the IPCPs. */
+    uint64_t bufcache_hit;
+    uint64_t bufcache_miss;
+
+    /* DTP timer wheel. */
+    uint64_t tmr_ticks; /* wheel ticks */
+    uint64_t tmr_fired; /* expired timers */
+    uint64_t tmr_ns;    /* time spent servicing timers, in nanoseconds */
+
     struct rl_rmt_stats rmt;
 } __attribute__((aligned(64)));
 
@@ -315,7 +392,15 @@ struct rl_flow_dtp {
     uint32_t max_rtxq_len;
     uint32_t rtt;        /* estimated round trip time, in usecs. */
     uint32_t rtt_stddev; /* stddev in usecs */
-    uint32_t cgwin;      /* congestion window size, in PDUs */
+    uint32_t rtt_min;    /* minimum RTT sample, in usecs */
+    uint32_t rto;        /* retransmission timeout, in usecs */
+    uint32_t cgwin;       /* congestion window size, in PDUs */
+    uint32_t ssthresh;    /* slow start threshold, in PDUs */
+    uint64_t pacing_rate; /* in bytes per second */
+    uint64_t paced_pkts;       /* PDUs that went through the shaper */
+    uint32_t pacing_delay_avg; /* average shaper delay, in usecs */
+    uint32_t pacing_delay_max; /* maximum shaper delay, in usecs */
+    uint32_t pacing_qlen;      /* PDUs waiting in the shaper queue */
     uint32_t pad1;
 
     /* Receiver state. */
@@ -326,7 +411,13 @@ struct rl_flow_dtp {
     rlm_seq_t last_lwe_sent;
     rlm_seq_t last_seq_num_acked;
     rlm_seq_t next_snd_ctl_seq;
+    uint64_t data_pdus_rcvd; /* data transfer PDUs received */
+    uint64_t ctrl_pdus_sent; /* control PDUs sent */
     uint32_t seqq_len;
+    uint32_t seqq_hwm; /* seqq_len high-water mark */
+    uint32_t seqq_max_len;
+    uint32_t rx_qsize;   /* bytes in the userspace receive queue */
+    uint32_t rx_qbudget; /* memory budget for the receive queue */
     uint32_t pad2;
 };
 
@@ -67,6 +67,8 @@ enum {
     RLITE_KER_IPCP_CONFIG_GET_RESP,  /* 35 */
     RLITE_KER_IPCP_SCHED_WRR,        /* 36 */
     RLITE_KER_IPCP_SCHED_PFIFO,      /* 37 */
+    RLITE_KER_IPCP_PDUFT_REPLACE,    /* 38 */
+    RLITE_KER_IPCP_SCHED_DRR,        /* 39 */
 
     RLITE_KER_MSG_MAX,
 };
@@ -320,6 +322,27 @@ struct rl_kmsg_ipcp_pduft_mod {
 /* application --> kernel message to flush the PDUFT of an IPC Process. */
 #define rl_kmsg_ipcp_pduft_flush rl_kmsg_ipcp_create_resp
 
+/* application --> kernel message to atomically replace the whole PDUFT
+ * of an IPC Process. Entry i maps dst_addrs[i] to local_ports[i]; an
+ * RL_ADDR_NULL address specifies the default entry. An address may be
+ * repeated to specify multiple equal-cost next hops, which the kernel
+ * uses to spread the traffic. Next hops flagged with RL_PDUFT_NH_F_BACKUP
+ * are only used when all the other next hops are down. */
+struct rl_kmsg_ipcp_pduft_replace {
+    struct rl_msg_hdr hdr;
+
+    rl_ipcp_id_t ipcp_id;
+    uint16_t pad1[3];
+
+    /* Destination addresses are qwords. */
+    struct rl_msg_array_field dst_addrs;
+    /* Local ports are words. */
+    struct rl_msg_array_field local_ports;
+    /* Next hop flags are bytes, optional (no elements means no flags). */
+    struct rl_msg_array_field nhop_flags;
+#define RL_PDUFT_NH_F_BACKUP (1 << 0)
+};
+
 /* uipcp (application) --> kernel to tell the kernel that this event
  * loop corresponds to an uipcp. */
 struct rl_kmsg_ipcp_uipcp_set {
@@ -471,4 +494,17 @@ struct rl_kmsg_ipcp_sched_pfifo {
     rlm_qosid_t prio_levels;
 };
 
+/* application --> kernel message to configure a DRR PDU scheduler,
+ * or a strict priority + DRR one. */
+struct rl_kmsg_ipcp_sched_drr {
+    struct rl_msg_ipcp ipcp_hdr;
+
+    /* Max queue size in bytes. */
+    uint32_t max_queue_size;
+    uint32_t pad1;
+
+    /* DRR quanta (in bytes) are dwords, one per queue. */
+    struct rl_msg_array_field quanta;
+};
+
 #endif /* __RLITE_KER_H__ */
@@ -0,0 +1,147 @@
+/*
+ * Shared-memory rings for the rlite-io data path.
+ *
+ * Copyright (C) 2026 The rlite contributors
+ *
+ * This file is part of rlite.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __RLITE_RING_H__
+#define __RLITE_RING_H__
+
+/*
+ * A file descriptor bound to a flow (RLITE_IO_MODE_APPL_BIND) can be
+ * switched to ring mode with the RLITE_IOCTL_RING_SETUP ioctl. The
+ * kernel allocates a memory region containing a pair of single-producer
+ * single-consumer rings, that the application maps with
+ *
+ *     mmap(NULL, req.mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+ *
+ * The region starts with the TX ring, followed by the RX ring at offset
+ * RL_RING_BYTES(num_slots, slot_size). Each ring is made of a struct
+ * rl_ring header, followed by 'num_slots' slots of 'slot_size' bytes.
+ * Each slot starts with a struct rl_ring_slot header, followed by the
+ * SDU payload.
+ *
+ * Indices are free-running 32 bit counters: a ring contains (head - tail)
+ * slots, and index 'i' refers to slot (i & (num_slots - 1)). The producer
+ * only writes 'head', the consumer only writes 'tail'.
+ *
+ * TX ring: the application is the producer. It fills the slots at 'head',
+ * then advances 'head'. The kernel consumes the slots when the
+ * RLITE_IOCTL_RING_SYNC doorbell ioctl is issued, or when poll() is
+ * called; it is enough to ring the doorbell when the TX ring goes from
+ * empty to non-empty. If the flow cannot accept more SDUs, the kernel
+ * leaves the remaining slots in the ring, and POLLOUT can be used to wait
+ * for the flow to become writable again.
+ *
+ * RX ring: the kernel is the producer. Received SDUs are moved into the
+ * RX ring on RLITE_IOCTL_RING_SYNC and on poll(), which reports POLLIN
+ * when the RX ring is not empty. SDUs longer than the slot payload are
+ * truncated and marked with RL_RING_SLOT_F_TRUNC. When the flow is
+ * deallocated, the kernel sets RL_RING_F_EOF in the RX ring flags.
+ *
+ * Once the ring mode is enabled, read() and write() should not be used
+ * on the file descriptor.
+ */
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rl_ring {
+    /* Written by the producer only. */
+    uint32_t head;
+    uint32_t pad1[15];
+
+    /* Written by the consumer only. */
+    uint32_t tail;
+    uint32_t pad2[15];
+
+    /* Written by the kernel only. */
+    uint32_t num_slots; /* a power of two */
+    uint32_t slot_size; /* including struct rl_ring_slot */
+    uint32_t flags;
+#define RL_RING_F_EOF (1 << 0)
+    uint32_t pad3[13];
+};
+
+struct rl_ring_slot {
+    uint32_t len; /* SDU length */
+    uint16_t flags;
+#define RL_RING_SLOT_F_TRUNC (1 << 0)
+    uint16_t pad1;
+};
+
+/* Limits enforced by RLITE_IOCTL_RING_SETUP. */
+#define RL_RING_SLOTS_MAX 4096
+#define RL_RING_SLOT_SIZE_MAX (65536 + sizeof(struct rl_ring_slot))
+
+/* Size of a ring, rounded up to a multiple of 4096 bytes. */
+#define RL_RING_BYTES(_num_slots, _slot_size)                                  \
+    (((sizeof(struct rl_ring) + (_num_slots) * (_slot_size)) + 4095) &         \
+     ~((unsigned long)4095))
+
+#define RL_RING_SLOT(_ring, _idx)                                              \
+    ((struct rl_ring_slot *)((char *)(_ring) + sizeof(struct rl_ring) +        \
+                             ((_idx) & ((_ring)->num_slots - 1)) *             \
+                                 (_ring)->slot_size))
+
+#define RL_RING_SLOT_DATA(_slot) ((void *)((_slot) + 1))
+
+#ifndef __KERNEL__
+/* Helpers for the application side. The producer publishes slots with
+ * a release store on 'head', the consumer releases slots with a release
+ * store on 'tail'. */
+static inline uint32_t
+rl_ring_load(const uint32_t *idx)
+{
+    return __atomic_load_n(idx, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+rl_ring_store(uint32_t *idx, uint32_t val)
+{
+    __atomic_store_n(idx, val, __ATOMIC_RELEASE);
+}
+
+/* Number of slots that the producer can fill. */
+static inline uint32_t
+rl_ring_space(struct rl_ring *ring)
+{
+    return ring->num_slots - (ring->head - rl_ring_load(&ring->tail));
+}
+
+/* Number of slots that the consumer can process. */
+static inline uint32_t
+rl_ring_avail(struct rl_ring *ring)
+{
+    return rl_ring_load(&ring->head) - ring->tail;
+}
+#endif /* !__KERNEL__ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __RLITE_RING_H__ */
@@ -24,8 +24,116 @@
 
 #include <linux/types.h>
 #include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/skbuff.h>
+#include <linux/moduleparam.h>
 #include "rlite-kernel.h"
 
+#ifndef RL_SKB
+/*
+ * Per-CPU magazine cache of rl_buf objects. When the last reference to
+ * a buffer is dropped, the rl_buf header and its raw buffer are kept
+ * together in a per-CPU magazine, bucketed by raw buffer size, so that
+ * a subsequent rl_buf_alloc() on the same CPU can skip the allocator.
+ * Cached objects are still accounted as RL_MT_BUFHDR and RL_MT_BUFDATA
+ * by memtrack, until the cache is drained.
+ */
+#define RL_BUFCACHE_DEPTH_MAX 128
+
+/* Size of the raw buffer that exactly fills a kmalloc slab of 'slab'
+ * bytes, once the struct rl_rawbuf header is taken into account. */
+#define RL_BUFCACHE_SIZE(slab) ((slab) - sizeof(struct rl_rawbuf))
+
+/* Raw buffer sizes, covering control PDUs, Ethernet sized PDUs and
+ * jumbo PDUs, including any headroom and tailroom. There is a class for
+ * each power-of-two kmalloc slab, so that rounding a buffer up to its
+ * class never moves it into a larger slab. */
+static const size_t rl_bufcache_sizes[] = {
+    RL_BUFCACHE_SIZE(256),  RL_BUFCACHE_SIZE(512),  RL_BUFCACHE_SIZE(1024),
+    RL_BUFCACHE_SIZE(2048), RL_BUFCACHE_SIZE(4096), RL_BUFCACHE_SIZE(8192),
+    RL_BUFCACHE_SIZE(16384)};
+#define RL_BUFCACHE_CLASSES ARRAY_SIZE(rl_bufcache_sizes)
+
+struct rl_bufcache {
+    unsigned int cnt[RL_BUFCACHE_CLASSES];
+    struct rl_buf *objs[RL_BUFCACHE_CLASSES][RL_BUFCACHE_DEPTH_MAX];
+    uint64_t hit;
+    uint64_t miss;
+};
+
+static struct rl_bufcache __percpu *rl_bufcache;
+
+static unsigned int bufcache_depth = 64;
+module_param(bufcache_depth, uint, 0644);
+MODULE_PARM_DESC(bufcache_depth,
+                 "Per-CPU depth of the rl_buf cache (0 to disable)");
+
+static inline int
+rl_bufcache_class(size_t size)
+{
+    int i;
+
+    for (i = 0; i < RL_BUFCACHE_CLASSES; i++) {
+        if (size <= rl_bufcache_sizes[i]) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static struct rl_buf *
+rl_bufcache_get(int cls)
+{
+    struct rl_buf *rb = NULL;
+    struct rl_bufcache *bc;
+    unsigned long flags;
+
+    if (unlikely(!rl_bufcache)) {
+        return NULL;
+    }
+
+    local_irq_save(flags);
+    bc = this_cpu_ptr(rl_bufcache);
+    if (cls >= 0 && bc->cnt[cls]) {
+        rb = bc->objs[cls][--bc->cnt[cls]];
+        bc->hit++;
+    } else {
+        bc->miss++;
+    }
+    local_irq_restore(flags);
+
+    return rb;
+}
+
+/* Returns true if the buffer has been stored in the cache. */
+static bool
+rl_bufcache_put(struct rl_buf *rb)
+{
+    unsigned int depth = min_t(unsigned int, READ_ONCE(bufcache_depth),
+                               RL_BUFCACHE_DEPTH_MAX);
+    int cls            = rl_bufcache_class(rb->raw->size);
+    struct rl_bufcache *bc;
+    unsigned long flags;
+    bool ret = false;
+
+    if (unlikely(!rl_bufcache) || cls < 0 ||
+        rl_bufcache_sizes[cls] != rb->raw->size) {
+        return false;
+    }
+
+    local_irq_save(flags);
+    bc = this_cpu_ptr(rl_bufcache);
+    if (bc->cnt[cls] < depth) {
+        bc->objs[cls][bc->cnt[cls]++] = rb;
+        ret                           = true;
+    }
+    local_irq_restore(flags);
+
+    return ret;
+}
+#endif /* !RL_SKB */
+
 /*
  * Allocate a buffer to hold PDU header and data.
  * The returned buffer has zero length (i.e. it's empty).
@@ -36,8 +144,23 @@ rl_buf_alloc(size_t size, size_t hdroom, size_t tailroom, gfp_t gfp)
     struct rl_buf *rb;
 #ifndef RL_SKB
     size_t real_size = hdroom + size + tailroom;
+    int cls          = -1;
     uint8_t *kbuf;
 
+    if (READ_ONCE(bufcache_depth)) {
+        cls = rl_bufcache_class(real_size);
+        if (cls >= 0) {
+            /* Round up to the cache bucket size, so that the buffer can
+             * be recycled. */
+            real_size = rl_bufcache_sizes[cls];
+        }
+    }
+
+    rb = rl_bufcache_get(cls);
+    if (rb) {
+        goto init;
+    }
+
     rb = rl_alloc(sizeof(*rb), gfp, RL_MT_BUFHDR);
     if (unlikely(!rb)) {
         RPV(1, "Out of memory\n");
@@ -53,6 +176,7 @@ rl_buf_alloc(size_t size, size_t hdroom, size_t tailroom, gfp_t gfp)
 
     rb->raw       = (struct rl_rawbuf *)kbuf;
     rb->raw->size = real_size;
+init:
     atomic_set(&rb->raw->refcnt, 1);
     rb->pci = (struct rina_pci *)(rb->raw->buf + hdroom);
     rb->len = 0;
@@ -115,6 +239,9 @@ __rl_buf_free(struct rl_buf *rb)
 {
 #ifndef RL_SKB
     if (atomic_dec_and_test(&rb->raw->refcnt)) {
+        if (rl_bufcache_put(rb)) {
+            return;
+        }
         rl_free(rb->raw, RL_MT_BUFDATA);
     }
 
@@ -124,3 +251,282 @@ __rl_buf_free(struct rl_buf *rb)
 #endif /* RL_SKB */
 }
 EXPORT_SYMBOL(__rl_buf_free);
+
+#ifndef RL_SKB
+/*
+ * Turn a buffer into an sk_buff without copying the PDU, by building the
+ * skb around the raw buffer. This is only possible if the raw buffer is
+ * not shared (e.g. with a retransmission queue), and if there is enough
+ * room for 'hdroom' bytes in front of the PDU and for 'tailroom' bytes
+ * plus the skb_shared_info after it.
+ * On success the ownership of the raw buffer is passed to the skb and
+ * 'rb' is freed. Otherwise NULL is returned and 'rb' is not modified.
+ */
+struct sk_buff *
+rl_buf_to_skb(struct rl_buf *rb, size_t hdroom, size_t tailroom)
+{
+    uint8_t *head = (uint8_t *)rb->raw;
+    uint8_t *data = (uint8_t *)rb->pci;
+    struct sk_buff *skb;
+
+    if (atomic_read(&rb->raw->refcnt) != 1 || data - head < hdroom ||
+        data + rb->len + tailroom > head + SKB_WITH_OVERHEAD(ksize(head))) {
+        return NULL;
+    }
+
+#ifdef RL_HAVE_SLAB_BUILD_SKB
+    skb = slab_build_skb(head);
+#else  /* !RL_HAVE_SLAB_BUILD_SKB */
+    skb = build_skb(head, 0);
+#endif /* !RL_HAVE_SLAB_BUILD_SKB */
+    if (unlikely(!skb)) {
+        return NULL;
+    }
+
+    skb_reserve(skb, data - head);
+    skb_put(skb, rb->len);
+
+    /* The raw buffer now belongs to the skb. */
+    rl_memtrack_release(rb->raw, RL_MT_BUFDATA);
+    rl_free(rb, RL_MT_BUFHDR);
+
+    return skb;
+}
+EXPORT_SYMBOL(rl_buf_to_skb);
+#endif /* !RL_SKB */
+
+void
+rl_agg_init(struct rl_agg *agg)
+{
+    spin_lock_init(&agg->lock);
+    agg->cur = NULL;
+    rb_list_init(&agg->ready);
+    agg->ready_len = 0;
+    agg->stalled   = false;
+}
+EXPORT_SYMBOL(rl_agg_init);
+
+/* Drop all the pending aggregates. */
+void
+rl_agg_fini(struct rl_agg *agg)
+{
+    struct rl_buf *rb;
+
+    while ((rb = rl_agg_deq(agg)) != NULL) {
+        rl_buf_free(rb);
+    }
+}
+EXPORT_SYMBOL(rl_agg_fini);
+
+/* Append a PDU to the aggregate being filled. If there is not enough
+ * room left, the current aggregate becomes ready for transmission and a
+ * new one is started, reserving 'hdrlen' bytes for a shim-specific
+ * header. PDUs that do not fit an empty aggregate are queued as they are
+ * (with zero RL_BUF_AGG(rb).pdus), to preserve ordering. The PDU is
+ * consumed on success. */
+int
+rl_agg_enq(struct rl_agg *agg, struct rl_buf *rb, size_t budget,
+           size_t hdrlen, size_t hdroom, size_t tailroom)
+{
+    size_t need = RL_AGG_PFXLEN + rb->len;
+    bool plain  = hdrlen + need > budget || rb->len > 0xffff;
+    struct rl_buf *cur;
+    uint8_t *dst;
+
+    spin_lock_bh(&agg->lock);
+    cur = agg->cur;
+    if (cur && (plain || cur->len + need > budget)) {
+        /* The current aggregate is complete. */
+        if (agg->ready_len >= RL_AGG_READY_MAX) {
+            goto stall;
+        }
+        rb_list_enq(cur, &agg->ready);
+        agg->ready_len++;
+        cur = agg->cur = NULL;
+    }
+
+    if (unlikely(plain)) {
+        if (agg->ready_len >= RL_AGG_READY_MAX) {
+            goto stall;
+        }
+        RL_BUF_AGG(rb).pdus = 0;
+        rb_list_enq(rb, &agg->ready);
+        agg->ready_len++;
+        spin_unlock_bh(&agg->lock);
+
+        return 0;
+    }
+
+    if (!cur) {
+        cur = rl_buf_alloc(budget, hdroom, tailroom, GFP_ATOMIC);
+        if (unlikely(!cur)) {
+            spin_unlock_bh(&agg->lock);
+            return -ENOMEM;
+        }
+        rl_buf_append(cur, hdrlen);
+        RL_BUF_AGG(cur).pdus = 0;
+        agg->cur             = cur;
+    }
+
+    dst    = RL_BUF_DATA(cur) + cur->len;
+    dst[0] = (rb->len >> 8) & 0xff;
+    dst[1] = rb->len & 0xff;
+    memcpy(dst + RL_AGG_PFXLEN, RL_BUF_DATA(rb), rb->len);
+    rl_buf_append(cur, need);
+    RL_BUF_AGG(cur).pdus++;
+    spin_unlock_bh(&agg->lock);
+
+    rl_buf_free(rb);
+
+    return 0;
+
+stall:
+    agg->stalled = true;
+    spin_unlock_bh(&agg->lock);
+
+    return -EAGAIN;
+}
+EXPORT_SYMBOL(rl_agg_enq);
+
+/* Get the next aggregate to be transmitted, including the one being
+ * filled. Returns NULL if there is nothing to transmit. */
+struct rl_buf *
+rl_agg_deq(struct rl_agg *agg)
+{
+    struct rl_buf *rb = NULL;
+
+    spin_lock_bh(&agg->lock);
+    if (agg->ready_len) {
+        rb = rb_list_front(&agg->ready);
+        rb_list_del(rb);
+        agg->ready_len--;
+    } else if (agg->cur) {
+        rb       = agg->cur;
+        agg->cur = NULL;
+    }
+    spin_unlock_bh(&agg->lock);
+
+    return rb;
+}
+EXPORT_SYMBOL(rl_agg_deq);
+
+/* Returns true if a writer was stalled, so that the caller can restart
+ * the flow. */
+bool
+rl_agg_unstall(struct rl_agg *agg)
+{
+    bool stalled;
+
+    spin_lock_bh(&agg->lock);
+    stalled      = agg->stalled;
+    agg->stalled = false;
+    spin_unlock_bh(&agg->lock);
+
+    return stalled;
+}
+EXPORT_SYMBOL(rl_agg_unstall);
+
+/* Split an aggregate into its PDUs, appending a new buffer to 'pdus' for
+ * each of them. Returns the number of PDUs extracted, or a negative error
+ * code; in the latter case, the PDUs extracted so far are still appended
+ * to 'pdus'. */
+int
+rl_agg_split(const uint8_t *buf, size_t len, size_t hdroom,
+             size_t tailroom, struct rb_list *pdus)
+{
+    int n = 0;
+
+    while (len >= RL_AGG_PFXLEN) {
+        size_t pdulen = (buf[0] << 8) | buf[1];
+        struct rl_buf *rb;
+
+        if (pdulen == 0) {
+            break; /* padding */
+        }
+        buf += RL_AGG_PFXLEN;
+        len -= RL_AGG_PFXLEN;
+        if (unlikely(pdulen > len)) {
+            return -EINVAL;
+        }
+
+        rb = rl_buf_alloc(pdulen, hdroom, tailroom, GFP_ATOMIC);
+        if (unlikely(!rb)) {
+            return -ENOMEM;
+        }
+        memcpy(RL_BUF_DATA(rb), buf, pdulen);
+        rl_buf_append(rb, pdulen);
+        rb_list_enq(rb, pdus);
+        buf += pdulen;
+        len -= pdulen;
+        n++;
+    }
+
+    return n;
+}
+EXPORT_SYMBOL(rl_agg_split);
+
+int
+rl_bufcache_init(void)
+{
+#ifndef RL_SKB
+    rl_bufcache = alloc_percpu(struct rl_bufcache);
+    if (!rl_bufcache) {
+        return -ENOMEM;
+    }
+#endif /* !RL_SKB */
+
+    return 0;
+}
+
+void
+rl_bufcache_fini(void)
+{
+#ifndef RL_SKB
+    struct rl_bufcache *bc;
+    int cpu;
+    int i;
+
+    if (!rl_bufcache) {
+        return;
+    }
+
+    for_each_possible_cpu(cpu)
+    {
+        bc = per_cpu_ptr(rl_bufcache, cpu);
+        for (i = 0; i < RL_BUFCACHE_CLASSES; i++) {
+            while (bc->cnt[i]) {
+                struct rl_buf *rb = bc->objs[i][--bc->cnt[i]];
+
+                rl_free(rb->raw, RL_MT_BUFDATA);
+                rl_free(rb, RL_MT_BUFHDR);
+            }
+        }
+    }
+    free_percpu(rl_bufcache);
+    rl_bufcache = NULL;
+#endif /* !RL_SKB */
+}
+
+/* Report the buffer cache hit/miss counters, summed over all the CPUs. */
+void
+rl_bufcache_stats(uint64_t *hit, uint64_t *miss)
+{
+#ifndef RL_SKB
+    int cpu;
+
+    *hit = *miss = 0;
+    if (!rl_bufcache) {
+        return;
+    }
+
+    for_each_possible_cpu(cpu)
+    {
+        struct rl_bufcache *bc = per_cpu_ptr(rl_bufcache, cpu);
+
+        *hit += bc->hit;
+        *miss += bc->miss;
+    }
+#else  /* RL_SKB */
+    *hit = *miss = 0;
+#endif /* RL_SKB */
+}
@@ -1157,8 +1157,8 @@ __flow_put(struct flow_entry *entry, bool lock)
 
             /* No one can write or read from this flow anymore, so there
              * is no reason to have the inactivity timer running. */
-            del_timer(&dtp->snd_inact_tmr);
-            del_timer(&dtp->rcv_inact_tmr);
+            rl_wtimer_del(&dtp->snd_inact_tmr);
+            rl_wtimer_del(&dtp->rcv_inact_tmr);
         }
         spin_unlock_bh(&dtp->lock);
 
@@ -1198,7 +1198,7 @@ static void
 flow_del(struct flow_entry *entry)
 {
     struct rl_kmsg_flow_deallocated ntfy;
-    struct pduft_entry *pfte, *tmp_pfte;
+    struct pduft_nhop *nhop, *tmp_nhop;
     struct ipcp_entry *upper_ipcp;
     struct ipcp_entry *ipcp;
     struct rl_buf *tmp;
@@ -1230,14 +1230,14 @@ flow_del(struct flow_entry *entry)
     }
     entry->txrx.rx_qsize = 0;
 
-    list_for_each_entry_safe (pfte, tmp_pfte, &entry->pduft_entries, fnode) {
-        rlm_addr_t dst_addr = pfte->address;
+    list_for_each_entry_safe (nhop, tmp_nhop, &entry->pduft_entries, fnode) {
+        rlm_addr_t dst_addr = nhop->entry->address;
         int r;
 
         BUG_ON(!upper_ipcp || !upper_ipcp->ops.pduft_del);
         /* Here we are sure that 'upper_ipcp' will not be destroyed
          * before 'entry' is destroyed.. */
-        r = upper_ipcp->ops.pduft_del(upper_ipcp, pfte);
+        r = upper_ipcp->ops.pduft_del(upper_ipcp, nhop);
         if (r == 0) {
             PD("Removed IPC process %u PDUFT entry: %llu --> %u\n",
                upper_ipcp->id, (unsigned long long)dst_addr, entry->local_port);
@@ -1754,40 +1754,87 @@ ipcp_update_fill(struct ipcp_entry *ipcp, struct rl_kmsg_ipcp_update *upd,
     return ret;
 }
 
+/* Upqueue an RLITE_KER_IPCP_UPDATE message to each opened ctrl device
+ * that asked for IPCP updates. */
 static int
-ipcp_update_all(struct rl_ctrl *rc, rl_ipcp_id_t ipcp_id, int update_type)
+ipcp_update_notify(struct ipcp_entry *ipcp, int update_type)
 {
-    struct ipcp_entry *ipcp = ipcp_get(rc->dm, ipcp_id);
     struct rl_kmsg_ipcp_update upd;
     struct rl_ctrl *rcur;
     int ret = 0;
 
-    if (!ipcp) {
-        PE("IPCP %u unexpectedly disappeared\n", ipcp_id);
-        return -ENXIO;
-    }
-
     if (ipcp_update_fill(ipcp, &upd, update_type)) {
         RPV(1, "Out of memory\n");
         ret = -ENOMEM;
         goto out;
     }
 
-    mutex_lock(&rc->dm->general_lock);
-    list_for_each_entry (rcur, &rc->dm->ctrl_devs, node) {
+    mutex_lock(&ipcp->dm->general_lock);
+    list_for_each_entry (rcur, &ipcp->dm->ctrl_devs, node) {
         if (rcur->flags & RL_F_IPCPS) {
             rl_upqueue_append(rcur, RLITE_MB(&upd), false);
         }
     }
-    mutex_unlock(&rc->dm->general_lock);
+    mutex_unlock(&ipcp->dm->general_lock);
 
 out:
     rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(&upd));
+
+    return ret;
+}
+
+static int
+ipcp_update_all(struct rl_ctrl *rc, rl_ipcp_id_t ipcp_id, int update_type)
+{
+    struct ipcp_entry *ipcp = ipcp_get(rc->dm, ipcp_id);
+    int ret;
+
+    if (!ipcp) {
+        PE("IPCP %u unexpectedly disappeared\n", ipcp_id);
+        return -ENXIO;
+    }
+
+    ret = ipcp_update_notify(ipcp, update_type);
     ipcp_put(ipcp);
 
     return ret;
 }
 
+/* To be used by kernel-space IPCPs to report a change of their attributes
+ * (e.g. max_sdu_size) that did not come from an ipcp-config request. */
+int
+rl_ipcp_update_notify(struct ipcp_entry *ipcp)
+{
+    return ipcp_update_notify(ipcp, RL_IPCP_UPDATE_UPD);
+}
+EXPORT_SYMBOL(rl_ipcp_update_notify);
+
+/* To be used by kernel-space IPCPs to report that a flow went up or down
+ * (e.g. because of a link failure). The flow is marked, so that the
+ * datapath of the upper IPCP can immediately switch to backup next hops,
+ * and the uipcp of the upper IPCP is notified, so that it can recompute
+ * the forwarding table. */
+int
+rl_flow_state_set(struct flow_entry *flow, uint16_t state)
+{
+    struct rl_kmsg_flow_state ntfy;
+
+    WRITE_ONCE(flow->down, state == RL_FLOW_STATE_DOWN);
+    if (!flow->upper.ipcp) {
+        return 0;
+    }
+
+    memset(&ntfy, 0, sizeof(ntfy));
+    ntfy.hdr.msg_type = RLITE_KER_FLOW_STATE;
+    ntfy.hdr.event_id = 0;
+    ntfy.ipcp_id      = flow->upper.ipcp->id;
+    ntfy.local_port   = flow->local_port;
+    ntfy.flow_state   = state;
+
+    return rl_upqueue_append(flow->upper.ipcp->uipcp, RLITE_MB(&ntfy), false);
+}
+EXPORT_SYMBOL(rl_flow_state_set);
+
 static int
 rl_ipcp_create(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
 {
@@ -2113,6 +2160,8 @@ rl_ipcp_config(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
             ret = rl_configstr_to_u16(req->value, &entry->txhdroom, NULL);
         } else if (strcmp(req->name, "rxhdroom") == 0) {
             ret = rl_configstr_to_u16(req->value, &entry->rxhdroom, NULL);
+        } else if (strcmp(req->name, "tailroom") == 0) {
+            ret = rl_configstr_to_u16(req->value, &entry->tailroom, NULL);
         } else if (strcmp(req->name, "mss") == 0) {
             ret =
                 rl_configstr_to_u32(req->value, &entry->max_sdu_size, &notify);
@@ -2177,6 +2226,8 @@ rl_ipcp_config_get(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
             snprintf(valbuf, sizeof(valbuf), "%u", entry->txhdroom);
         } else if (strcmp(req->param_name, "rxhdroom") == 0) {
             snprintf(valbuf, sizeof(valbuf), "%u", entry->rxhdroom);
+        } else if (strcmp(req->param_name, "tailroom") == 0) {
+            snprintf(valbuf, sizeof(valbuf), "%u", entry->tailroom);
         } else if (strcmp(req->param_name, "mss") == 0) {
             snprintf(valbuf, sizeof(valbuf), "%u", entry->max_sdu_size);
         } else if (strcmp(req->param_name, "flow-del-wait-ms") == 0) {
@@ -2270,6 +2321,80 @@ rl_ipcp_pduft_mod(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
     return ret;
 }
 
+/* Maximum number of entries in a PDUFT replacement. */
+#define RL_PDUFT_REPLACE_MAX (1 << 16)
+
+static int
+rl_ipcp_pduft_replace(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
+{
+    struct rl_kmsg_ipcp_pduft_replace *req =
+        (struct rl_kmsg_ipcp_pduft_replace *)bmsg;
+    unsigned int n            = req->dst_addrs.num_elements;
+    struct flow_entry **flows = NULL;
+    const uint8_t *nhflags    = NULL;
+    struct ipcp_entry *ipcp;
+    unsigned int i = 0;
+    int ret        = -EINVAL;
+
+    if (n != req->local_ports.num_elements || n > RL_PDUFT_REPLACE_MAX ||
+        (n && (req->dst_addrs.elem_size != sizeof(rlm_addr_t) ||
+               req->local_ports.elem_size != sizeof(rl_port_t)))) {
+        return -EINVAL;
+    }
+    if (req->nhop_flags.num_elements) {
+        if (req->nhop_flags.num_elements != n ||
+            req->nhop_flags.elem_size != sizeof(uint8_t)) {
+            return -EINVAL;
+        }
+        nhflags = req->nhop_flags.slots.bytes;
+    }
+
+    ipcp = ipcp_get(rc->dm, req->ipcp_id);
+    if (!ipcp || !ipcp->ops.pduft_replace) {
+        goto out;
+    }
+
+    flows = rl_alloc((n ? n : 1) * sizeof(*flows), GFP_KERNEL, RL_MT_MISC);
+    if (!flows) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    /* As in rl_ipcp_pduft_mod(), all the flows must be used by
+     * the requesting IPCP. */
+    for (i = 0; i < n; i++) {
+        flows[i] = flow_get(rc->dm, req->local_ports.slots.words[i]);
+        if (!flows[i] || flows[i]->upper.ipcp != ipcp) {
+            PE("Invalid port %u in PDUFT replacement for IPCP %u\n",
+               req->local_ports.slots.words[i], ipcp->id);
+            flow_put(flows[i]);
+            goto out;
+        }
+    }
+
+    mutex_lock(&ipcp->lock);
+    if (!(ipcp->flags & RL_K_IPCP_ZOMBIE)) {
+        ret = ipcp->ops.pduft_replace(ipcp, req->dst_addrs.slots.qwords,
+                                      flows, nhflags, n);
+    }
+    mutex_unlock(&ipcp->lock);
+
+    if (ret == 0) {
+        PV("Replaced IPC process %u PDUFT with %u entries\n", req->ipcp_id,
+           n);
+    }
+out:
+    while (i > 0) {
+        flow_put(flows[--i]);
+    }
+    if (flows) {
+        rl_free(flows, RL_MT_MISC);
+    }
+    ipcp_put(ipcp);
+
+    return ret;
+}
+
 static int
 rl_ipcp_pduft_flush(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
 {
@@ -2417,6 +2542,9 @@ rl_ipcp_get_stats(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
                 *sdst += *ssrc;
             }
         }
+        /* The buffer cache is shared by all the IPCPs. */
+        rl_bufcache_stats(&resp.stats.bufcache_hit,
+                          &resp.stats.bufcache_miss);
         ret = rl_upqueue_append(rc, (const struct rl_msg_base *)&resp, false);
         rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(&resp));
     }
@@ -2544,15 +2672,28 @@ rl_flow_get_stats(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
     resp.dtp.snd_lwe                = dtp->snd_lwe;
     resp.dtp.snd_rwe                = dtp->snd_rwe;
     resp.dtp.next_seq_num_to_use    = dtp->next_seq_num_to_use;
-    resp.dtp.last_seq_num_sent      = dtp->last_seq_num_sent;
+    resp.dtp.last_seq_num_sent      = dtp_last_seq_num_sent(dtp);
     resp.dtp.last_ctrl_seq_num_rcvd = dtp->last_ctrl_seq_num_rcvd;
     resp.dtp.cwq_len                = dtp->cwq_len;
     resp.dtp.max_cwq_len            = dtp->max_cwq_len;
     resp.dtp.rtxq_len               = dtp->rtxq_len;
     resp.dtp.max_rtxq_len           = dtp->max_rtxq_len;
-    resp.dtp.rtt                    = jiffies_to_msecs(dtp->rtt) * 1000;
-    resp.dtp.rtt_stddev             = jiffies_to_msecs(dtp->rtt_stddev) * 1000;
+    resp.dtp.rtt                    = div_u64(dtp->rtt, NSEC_PER_USEC);
+    resp.dtp.rtt_stddev             = div_u64(dtp->rtt_stddev, NSEC_PER_USEC);
+    resp.dtp.rtt_min                = div_u64(dtp->rtt_min, NSEC_PER_USEC);
+    if (flow->cfg.dtcp.flags & DTCP_CFG_RTX_CTRL) {
+        resp.dtp.rto = div_u64(rtt_to_rtx(flow), NSEC_PER_USEC);
+    }
     resp.dtp.cgwin                  = dtp->cgwin;
+    resp.dtp.ssthresh               = dtp->ssthresh;
+    resp.dtp.pacing_rate            = dtp->pacing_rate;
+    resp.dtp.paced_pkts             = dtp->tkbk.pkts;
+    if (dtp->tkbk.pkts) {
+        resp.dtp.pacing_delay_avg =
+            div64_u64(dtp->tkbk.delay_sum_ns, dtp->tkbk.pkts * NSEC_PER_USEC);
+    }
+    resp.dtp.pacing_delay_max = div_u64(dtp->tkbk.delay_max_ns, NSEC_PER_USEC);
+    resp.dtp.pacing_qlen      = dtp->tkbk.qlen;
     resp.dtp.rcv_lwe                = dtp->rcv_lwe;
     resp.dtp.rcv_next_seq_num       = dtp->rcv_next_seq_num;
     resp.dtp.rcv_rwe                = dtp->rcv_rwe;
@@ -2560,7 +2701,13 @@ rl_flow_get_stats(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
     resp.dtp.last_lwe_sent          = dtp->last_lwe_sent;
     resp.dtp.last_seq_num_acked     = dtp->last_seq_num_acked;
     resp.dtp.next_snd_ctl_seq       = dtp->next_snd_ctl_seq;
+    resp.dtp.data_pdus_rcvd         = dtp->data_pdus_rcvd;
+    resp.dtp.ctrl_pdus_sent         = dtp->ctrl_pdus_sent;
     resp.dtp.seqq_len               = dtp->seqq_len;
+    resp.dtp.seqq_hwm               = dtp->seqq_hwm;
+    resp.dtp.seqq_max_len           = dtp->seqq_max_len;
+    resp.dtp.rx_qsize               = flow->txrx.rx_qsize;
+    resp.dtp.rx_qbudget             = flow->txrx.rx_qbudget;
 
     spin_unlock_bh(&dtp->lock);
     spin_unlock_bh(&flow->txrx.rx_lock);
@@ -3191,6 +3338,8 @@ static rl_msg_handler_t rl_ctrl_handlers[] = {
     [RLITE_KER_IPCP_CONFIG_GET_REQ]   = rl_ipcp_config_get,
     [RLITE_KER_IPCP_SCHED_WRR]        = rl_ipcp_sched_config,
     [RLITE_KER_IPCP_SCHED_PFIFO]      = rl_ipcp_sched_config,
+    [RLITE_KER_IPCP_PDUFT_REPLACE]    = rl_ipcp_pduft_replace,
+    [RLITE_KER_IPCP_SCHED_DRR]        = rl_ipcp_sched_config,
 #ifdef RL_MEMTRACK
     [RLITE_KER_MEMTRACK_DUMP] = rl_memtrack_dump,
 #endif /* RL_MEMTRACK */
@@ -3245,6 +3394,7 @@ rl_ctrl_write(struct file *f, const char __user *ubuf, size_t len, loff_t *ppos)
     case RLITE_KER_IPCP_CONFIG:
     case RLITE_KER_IPCP_PDUFT_SET:
     case RLITE_KER_IPCP_PDUFT_FLUSH:
+    case RLITE_KER_IPCP_PDUFT_REPLACE:
     case RLITE_KER_APPL_REGISTER_RESP:
     case RLITE_KER_IPCP_UIPCP_SET:
     case RLITE_KER_UIPCP_FA_REQ_ARRIVED:
@@ -3679,8 +3829,15 @@ rlite_init(void)
     INIT_LIST_HEAD(&rl_global.ipcp_factories);
     hash_init(rl_global.netns_table);
 
+    ret = rl_bufcache_init();
+    if (ret) {
+        PE("Failed to allocate buffer cache\n");
+        return ret;
+    }
+
     ret = misc_register(&rl_ctrl_misc);
     if (ret) {
+        rl_bufcache_fini();
         PE("Failed to register rlite misc device\n");
         return ret;
     }
@@ -3688,6 +3845,7 @@ rlite_init(void)
     ret = misc_register(&rl_io_misc);
     if (ret) {
         misc_deregister(&rl_ctrl_misc);
+        rl_bufcache_fini();
         PE("Failed to register rlite-io misc device\n");
         return ret;
     }
@@ -3710,6 +3868,7 @@ rlite_fini(void)
 {
     misc_deregister(&rl_io_misc);
     misc_deregister(&rl_ctrl_misc);
+    rl_bufcache_fini();
 }
 
 module_init(rlite_init);
@@ -21,6 +21,7 @@
 #include <linux/types.h>
 #include "rlite/kernel-msg.h"
 #include "rlite/utils.h"
+#include "rlite/ring.h"
 #include "rlite-kernel.h"
 
 #include <linux/module.h>
@@ -37,6 +38,8 @@
 #include <linux/hashtable.h>
 #include <linux/spinlock.h>
 #include <linux/uio.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
 #include <asm/compat.h>
 
 static LIST_HEAD(rl_iodevs);
@@ -65,6 +68,36 @@ hms_time(void)
 /* Userspace queue threshold in bytes. */
 #define RL_RXQ_SIZE_MAX (1 << 20)
 
+/* Append an SDU to the userspace receive queue. This must be called
+ * under the rx_lock. */
+static inline void
+rl_rxq_enq(struct txrx *txrx, struct flow_entry *flow, struct rl_buf *rb,
+           bool qlimit)
+{
+    if (unlikely(qlimit && txrx->rx_qsize > RL_RXQ_SIZE_MAX)) {
+        /* This is useful when flow control is not used on a flow. */
+        RPD(1,
+            "dropping PDU [length %lu] to avoid userspace rx queue "
+            "overrun\n",
+            (long unsigned)rb->len);
+        flow->stats.rx_overrun_pkt++;
+        flow->stats.rx_overrun_byte += rb->len;
+        rl_buf_free(rb);
+    } else {
+        unsigned int truesize = rl_buf_truesize(rb);
+        unsigned int avgsz    = txrx->rx_avgsz;
+
+        rb_list_enq(rb, &txrx->rx_q);
+        txrx->rx_qsize += truesize;
+        /* EWMA with weight 1/8, used to convert bytes into PDUs when
+         * computing the flow control window. */
+        avgsz = avgsz ? avgsz - (avgsz >> 3) + (truesize >> 3) : truesize;
+        WRITE_ONCE(txrx->rx_avgsz, avgsz);
+        flow->stats.rx_pkt++;
+        flow->stats.rx_byte += rb->len;
+    }
+}
+
 int
 rl_sdu_rx_flow(struct ipcp_entry *ipcp, struct flow_entry *flow,
                struct rl_buf *rb, bool qlimit)
@@ -89,27 +122,67 @@ rl_sdu_rx_flow(struct ipcp_entry *ipcp, struct flow_entry *flow,
     }
 
     spin_lock_bh(&txrx->rx_lock);
-    if (unlikely(qlimit && txrx->rx_qsize > RL_RXQ_SIZE_MAX)) {
-        /* This is useful when flow control is not used on a flow. */
-        RPD(1,
-            "dropping PDU [length %lu] to avoid userspace rx queue "
-            "overrun\n",
-            (long unsigned)rb->len);
-        flow->stats.rx_overrun_pkt++;
-        flow->stats.rx_overrun_byte += rb->len;
-        rl_buf_free(rb);
+    rl_rxq_enq(txrx, flow, rb, qlimit);
+    spin_unlock_bh(&txrx->rx_lock);
+    wake_up_interruptible_poll(&txrx->rx_wqh, POLLIN | POLLRDNORM | POLLRDBAND);
+
+    return 0;
+}
+EXPORT_SYMBOL(rl_sdu_rx_flow);
+
+/* Batched version of rl_sdu_rx_flow(), which consumes all the SDUs in
+ * @rbs. The SDUs are passed to the upper IPCP with a single call (if
+ * supported), or queued to userspace taking the rx_lock once and with
+ * a single wake up. */
+int
+rl_sdu_rx_flow_batch(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                     struct rb_list *rbs, bool qlimit)
+{
+    struct ipcp_entry *upper_ipcp = flow->upper.ipcp;
+    struct rl_buf *rb, *tmp;
+    struct txrx *txrx;
+
+    if (upper_ipcp) {
+        /* The flow is used by an upper IPCP. Management SDUs are left
+         * in the list, to be queued to userspace. */
+        if (upper_ipcp->ops.sdu_rx_batch) {
+            upper_ipcp->ops.sdu_rx_batch(upper_ipcp, rbs, flow);
+        } else {
+            struct rb_list mgmtq;
+
+            rb_list_init(&mgmtq);
+            rb_list_foreach_safe (rb, tmp, rbs) {
+                rb_list_del(rb);
+                rb = upper_ipcp->ops.sdu_rx(upper_ipcp, rb, flow);
+                if (rb) {
+                    rb_list_enq(rb, &mgmtq);
+                }
+            }
+            rb_list_foreach_safe (rb, tmp, &mgmtq) {
+                rb_list_del(rb);
+                rb_list_enq(rb, rbs);
+            }
+        }
+
+        if (likely(rb_list_empty(rbs))) {
+            return 0;
+        }
+        txrx = upper_ipcp->mgmt_txrx;
     } else {
-        rb_list_enq(rb, &txrx->rx_q);
-        txrx->rx_qsize += rl_buf_truesize(rb);
-        flow->stats.rx_pkt++;
-        flow->stats.rx_byte += rb->len;
+        txrx = &flow->txrx;
+    }
+
+    spin_lock_bh(&txrx->rx_lock);
+    rb_list_foreach_safe (rb, tmp, rbs) {
+        rb_list_del(rb);
+        rl_rxq_enq(txrx, flow, rb, qlimit);
     }
     spin_unlock_bh(&txrx->rx_lock);
     wake_up_interruptible_poll(&txrx->rx_wqh, POLLIN | POLLRDNORM | POLLRDBAND);
 
     return 0;
 }
-EXPORT_SYMBOL(rl_sdu_rx_flow);
+EXPORT_SYMBOL(rl_sdu_rx_flow_batch);
 
 int
 rl_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb, rl_port_t local_port)
@@ -173,6 +246,19 @@ struct rl_io {
     struct flow_entry *flow;
     struct txrx *txrx;
 
+    /* Shared-memory rings (see rlite/ring.h). The ring geometry and the
+     * indices owned by the kernel are kept here, since userspace can
+     * overwrite the shared copies. */
+    void *ring_mem;
+    size_t ring_size;
+    struct rl_ring *tx_ring;
+    struct rl_ring *rx_ring;
+    uint32_t ring_slots;
+    uint32_t ring_slot_size;
+    uint32_t tx_tail;
+    uint32_t rx_head;
+    struct mutex ring_lock;
+
     struct list_head node;
 };
 
@@ -187,6 +273,7 @@ rl_io_open(struct inode *inode, struct file *f)
         return -ENOMEM;
     }
 
+    mutex_init(&rio->ring_lock);
     f->private_data = rio;
     IODEVS_LOCK();
     list_add_tail(&rio->node, &rl_iodevs);
@@ -462,6 +549,493 @@ rl_io_read_iter(struct kiocb *iocb,
     return ret;
 }
 
+static int
+rl_io_batch_get(void __user *argp, struct rl_ioctl_batch *batch,
+                struct rl_ioctl_sdu *sdus)
+{
+    if (copy_from_user(batch, argp, sizeof(*batch))) {
+        return -EFAULT;
+    }
+
+    if (batch->num == 0) {
+        return -EINVAL;
+    }
+
+    if (batch->num > RLITE_IO_BATCH_MAX) {
+        batch->num = RLITE_IO_BATCH_MAX;
+    }
+
+    if (copy_from_user(sdus, (void __user *)(uintptr_t)batch->sdus,
+                       batch->num * sizeof(sdus[0]))) {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+/* Write a batch of SDUs to an application flow. All the SDUs are
+ * written while the process sits on the flow tx_wqh, so that we pay
+ * the wait queue management only once per batch. Returns the number of
+ * SDUs written, or a negative error code if nothing was written. */
+static long
+rl_io_write_batch(struct file *f, struct rl_io *rio, void __user *argp)
+{
+    struct rl_ioctl_sdu sdus[RLITE_IO_BATCH_MAX];
+    unsigned flags          = (f->f_flags & O_NONBLOCK) ? 0 : RL_RMT_F_MAYSLEEP;
+    struct flow_entry *flow = rio->flow;
+    struct rl_ioctl_batch batch;
+    struct ipcp_entry *ipcp;
+    DECLARE_WAITQUEUE(wait, current);
+    unsigned int i;
+    long ret;
+
+    if (unlikely(rio->mode != RLITE_IO_MODE_APPL_BIND || !flow)) {
+        return -ENXIO;
+    }
+
+    ret = rl_io_batch_get(argp, &batch, sdus);
+    if (ret) {
+        return ret;
+    }
+
+    ipcp = rio->txrx->ipcp;
+
+    if (flags & RL_RMT_F_MAYSLEEP) {
+        add_wait_queue(flow->txrx.tx_wqh, &wait);
+    }
+
+    for (i = 0; i < batch.num; i++) {
+        size_t len = sdus[i].len;
+        struct rl_buf *rb;
+
+        if (unlikely(len > ipcp->max_sdu_size)) {
+            /* Batched writes are never split. */
+            ret = -EMSGSIZE;
+            break;
+        }
+
+        rb = rl_buf_alloc(len, ipcp->txhdroom, ipcp->tailroom, GFP_KERNEL);
+        if (unlikely(!rb)) {
+            ret = -ENOMEM;
+            break;
+        }
+
+        if (unlikely(copy_from_user(RL_BUF_DATA(rb),
+                                    (void __user *)(uintptr_t)sdus[i].buf,
+                                    len))) {
+            rl_buf_free(rb);
+            ret = -EFAULT;
+            break;
+        }
+        rl_buf_append(rb, len);
+
+        for (;;) {
+            current->state = TASK_INTERRUPTIBLE;
+
+            ret = ipcp->ops.sdu_write(ipcp, flow, rb, flags);
+
+            if (ret == -EAGAIN) {
+                if (signal_pending(current)) {
+                    rl_buf_free(rb);
+                    ret = -EINTR;
+                    break;
+                }
+
+                if (!(flags & RL_RMT_F_MAYSLEEP)) {
+                    rl_buf_free(rb);
+                    break;
+                }
+
+                /* No room to write, let's sleep. */
+                schedule();
+                continue;
+            }
+            break;
+        }
+
+        current->state = TASK_RUNNING;
+
+        if (unlikely(ret < 0)) {
+            break;
+        }
+
+        flow->stats.tx_pkt++;
+        flow->stats.tx_byte += len;
+    }
+
+    if (flags & RL_RMT_F_MAYSLEEP) {
+        remove_wait_queue(flow->txrx.tx_wqh, &wait);
+    }
+
+    return i ? i : ret;
+}
+
+/* Read a batch of SDUs from an application flow. All the available SDUs
+ * (up to the batch size) are dequeued under a single rx_lock critical
+ * section, and copied to userspace afterwards. The SDUs that cannot be
+ * delivered are put back at the head of the queue. Returns the number of
+ * SDUs read, 0 on EOF, or a negative error code if nothing was read. */
+static long
+rl_io_read_batch(struct file *f, struct rl_io *rio, void __user *argp)
+{
+    struct rl_ioctl_sdu sdus[RLITE_IO_BATCH_MAX];
+    struct rl_buf *rbs[RLITE_IO_BATCH_MAX];
+    struct flow_entry *flow = rio->flow;
+    bool blocking           = !(f->f_flags & O_NONBLOCK);
+    struct txrx *txrx       = rio->txrx;
+    struct rl_ioctl_batch batch;
+    DECLARE_WAITQUEUE(wait, current);
+    unsigned int n = 0;
+    unsigned int i, k;
+    long ret;
+
+    if (unlikely(rio->mode != RLITE_IO_MODE_APPL_BIND || !flow)) {
+        return -ENXIO;
+    }
+
+    ret = rl_io_batch_get(argp, &batch, sdus);
+    if (ret) {
+        return ret;
+    }
+
+    if (blocking) {
+        add_wait_queue(&txrx->rx_wqh, &wait);
+    }
+
+    for (;;) {
+        current->state = TASK_INTERRUPTIBLE;
+
+        spin_lock_bh(&txrx->rx_lock);
+        if (rb_list_empty(&txrx->rx_q)) {
+            if (unlikely(txrx->flags & RL_TXRX_EOF)) {
+                /* Report the EOF condition to userspace reader. */
+                spin_unlock_bh(&txrx->rx_lock);
+                ret = 0;
+                break;
+            }
+
+            spin_unlock_bh(&txrx->rx_lock);
+            if (signal_pending(current)) {
+                ret = -EINTR; /* -ERESTARTSYS */
+                break;
+            }
+
+            if (!blocking) {
+                ret = -EAGAIN;
+                break;
+            }
+
+            /* Nothing to read, let's sleep. */
+            schedule();
+            continue;
+        }
+
+        /* Grab as many SDUs as we have descriptors for. */
+        for (n = 0; n < batch.num && !rb_list_empty(&txrx->rx_q); n++) {
+            rbs[n] = rb_list_front(&txrx->rx_q);
+            rb_list_del(rbs[n]);
+            txrx->rx_qsize -= rl_buf_truesize(rbs[n]);
+        }
+        spin_unlock_bh(&txrx->rx_lock);
+        break;
+    }
+
+    current->state = TASK_RUNNING;
+
+    if (blocking) {
+        remove_wait_queue(&txrx->rx_wqh, &wait);
+    }
+
+    /* Copy the SDUs out of the lock, stopping at the first failure. */
+    for (i = 0; i < n; i++) {
+        size_t len = min_t(size_t, rbs[i]->len, sdus[i].len);
+
+        ret = rl_buf_copy_to_ubuf(rbs[i],
+                                  (void __user *)(uintptr_t)sdus[i].buf, len);
+        if (unlikely(ret < 0)) {
+            break;
+        }
+        sdus[i].len = len;
+        ret         = 0;
+    }
+
+    if (i && copy_to_user((void __user *)(uintptr_t)batch.sdus, sdus,
+                          i * sizeof(sdus[0]))) {
+        i   = 0; /* nothing delivered */
+        ret = -EFAULT;
+    }
+
+    /* Release the SDUs delivered to userspace ... */
+    for (k = 0; k < i; k++) {
+        if (flow->sdu_rx_consumed) {
+            flow->sdu_rx_consumed(flow, RL_BUF_RX(rbs[k]).cons_seqnum,
+                                  blocking);
+        }
+        rl_buf_free(rbs[k]);
+    }
+
+    /* ... and put the other ones back, preserving their order. */
+    if (unlikely(i < n)) {
+        spin_lock_bh(&txrx->rx_lock);
+        for (k = n; k > i; k--) {
+            rb_list_enq_head(rbs[k - 1], &txrx->rx_q);
+            txrx->rx_qsize += rl_buf_truesize(rbs[k - 1]);
+        }
+        spin_unlock_bh(&txrx->rx_lock);
+    }
+
+    return i ? i : ret;
+}
+
+static long
+rl_io_ring_setup(struct rl_io *rio, void __user *argp)
+{
+    struct rl_ioctl_ring req;
+    size_t ring_bytes;
+
+    if (unlikely(rio->mode != RLITE_IO_MODE_APPL_BIND || !rio->flow)) {
+        return -ENXIO;
+    }
+
+    if (copy_from_user(&req, argp, sizeof(req))) {
+        return -EFAULT;
+    }
+
+    if (req.num_slots == 0 || req.num_slots > RL_RING_SLOTS_MAX ||
+        (req.num_slots & (req.num_slots - 1))) {
+        return -EINVAL;
+    }
+
+    if (req.slot_size <= sizeof(struct rl_ring_slot) ||
+        req.slot_size > RL_RING_SLOT_SIZE_MAX || (req.slot_size & 7)) {
+        return -EINVAL;
+    }
+
+    mutex_lock(&rio->ring_lock);
+    if (rio->ring_mem) {
+        /* The rings live as long as the file descriptor, since they
+         * may still be mapped in userspace. */
+        mutex_unlock(&rio->ring_lock);
+        return -EBUSY;
+    }
+
+    ring_bytes     = RL_RING_BYTES(req.num_slots, req.slot_size);
+    rio->ring_size = PAGE_ALIGN(2 * ring_bytes);
+    rio->ring_mem  = vmalloc_user(rio->ring_size);
+    if (!rio->ring_mem) {
+        mutex_unlock(&rio->ring_lock);
+        return -ENOMEM;
+    }
+
+    rio->ring_slots          = req.num_slots;
+    rio->ring_slot_size      = req.slot_size;
+    rio->tx_tail             = 0;
+    rio->rx_head             = 0;
+    rio->tx_ring             = rio->ring_mem;
+    rio->rx_ring             = rio->ring_mem + ring_bytes;
+    rio->tx_ring->num_slots  = rio->rx_ring->num_slots = req.num_slots;
+    rio->tx_ring->slot_size  = rio->rx_ring->slot_size = req.slot_size;
+    req.mmap_size            = rio->ring_size;
+    mutex_unlock(&rio->ring_lock);
+
+    if (copy_to_user(argp, &req, sizeof(req))) {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+static inline struct rl_ring_slot *
+rl_io_ring_slot(struct rl_io *rio, struct rl_ring *ring, uint32_t idx)
+{
+    return (struct rl_ring_slot *)((char *)(ring + 1) +
+                                   (idx & (rio->ring_slots - 1)) *
+                                       rio->ring_slot_size);
+}
+
+/* Push the SDUs produced by userspace in the TX ring to the flow.
+ * Called with the ring_lock held. */
+static int
+rl_io_ring_txsync(struct rl_io *rio)
+{
+    struct rl_ring *ring    = rio->tx_ring;
+    struct flow_entry *flow = rio->flow;
+    struct ipcp_entry *ipcp = rio->txrx->ipcp;
+    uint32_t tail           = rio->tx_tail;
+    uint32_t head           = smp_load_acquire(&ring->head);
+    uint32_t maxlen = rio->ring_slot_size - sizeof(struct rl_ring_slot);
+    int ret         = 0;
+
+    if (unlikely(head - tail > rio->ring_slots)) {
+        RPD(1, "Invalid TX ring head %u (tail %u)\n", head, tail);
+        return -EINVAL;
+    }
+
+    while (tail != head) {
+        struct rl_ring_slot *slot = rl_io_ring_slot(rio, ring, tail);
+        uint32_t len              = READ_ONCE(slot->len);
+        struct rl_buf *rb;
+        int wret;
+
+        if (unlikely(len > maxlen || len > ipcp->max_sdu_size)) {
+            /* The slot cannot be sent, drop it to avoid stalling
+             * the ring. */
+            RPD(1, "Dropping TX slot with invalid length %u\n", len);
+            ret = -EMSGSIZE;
+            tail++;
+            continue;
+        }
+
+        rb = rl_buf_alloc(len, ipcp->txhdroom, ipcp->tailroom, GFP_KERNEL);
+        if (unlikely(!rb)) {
+            ret = -ENOMEM;
+            break;
+        }
+        memcpy(RL_BUF_DATA(rb), RL_RING_SLOT_DATA(slot), len);
+        rl_buf_append(rb, len);
+
+        wret = ipcp->ops.sdu_write(ipcp, flow, rb, 0);
+        if (wret == -EAGAIN) {
+            /* Flow is blocked, userspace will retry on POLLOUT. */
+            rl_buf_free(rb);
+            break;
+        }
+        tail++;
+        if (unlikely(wret < 0)) {
+            ret = wret;
+            continue;
+        }
+        flow->stats.tx_pkt++;
+        flow->stats.tx_byte += len;
+    }
+
+    rio->tx_tail = tail;
+    smp_store_release(&ring->tail, tail);
+
+    return ret;
+}
+
+/* Move the SDUs queued on the flow to the RX ring.
+ * Called with the ring_lock held. */
+static int
+rl_io_ring_rxsync(struct rl_io *rio)
+{
+    struct rl_ring *ring    = rio->rx_ring;
+    struct flow_entry *flow = rio->flow;
+    struct txrx *txrx       = rio->txrx;
+    uint32_t head           = rio->rx_head;
+    uint32_t tail           = smp_load_acquire(&ring->tail);
+    uint32_t maxlen = rio->ring_slot_size - sizeof(struct rl_ring_slot);
+    struct rl_buf *rb, *tmp;
+    struct rb_list rbs;
+    uint32_t space;
+
+    if (unlikely(head - tail > rio->ring_slots)) {
+        RPD(1, "Invalid RX ring tail %u (head %u)\n", tail, head);
+        return -EINVAL;
+    }
+    space = rio->ring_slots - (head - tail);
+
+    rb_list_init(&rbs);
+    spin_lock_bh(&txrx->rx_lock);
+    for (; space && !rb_list_empty(&txrx->rx_q); space--) {
+        rb = rb_list_front(&txrx->rx_q);
+        rb_list_del(rb);
+        txrx->rx_qsize -= rl_buf_truesize(rb);
+        rb_list_enq(rb, &rbs);
+    }
+    if (rb_list_empty(&txrx->rx_q) && (txrx->flags & RL_TXRX_EOF)) {
+        WRITE_ONCE(ring->flags, RL_RING_F_EOF);
+    }
+    spin_unlock_bh(&txrx->rx_lock);
+
+    rb_list_foreach_safe (rb, tmp, &rbs) {
+        struct rl_ring_slot *slot = rl_io_ring_slot(rio, ring, head);
+        uint32_t len              = min_t(uint32_t, rb->len, maxlen);
+
+        rb_list_del(rb);
+        rl_buf_copy_bits(rb, RL_RING_SLOT_DATA(slot), len);
+        slot->len   = len;
+        slot->flags = (len < rb->len) ? RL_RING_SLOT_F_TRUNC : 0;
+        head++;
+        if (flow->sdu_rx_consumed) {
+            flow->sdu_rx_consumed(flow, RL_BUF_RX(rb).cons_seqnum, true);
+        }
+        rl_buf_free(rb);
+    }
+
+    rio->rx_head = head;
+    smp_store_release(&ring->head, head);
+
+    return 0;
+}
+
+/* Doorbell: process both rings. */
+static long
+rl_io_ring_sync(struct rl_io *rio)
+{
+    int ret;
+
+    if (unlikely(rio->mode != RLITE_IO_MODE_APPL_BIND || !rio->flow)) {
+        return -ENXIO;
+    }
+
+    mutex_lock(&rio->ring_lock);
+    if (unlikely(!rio->ring_mem)) {
+        mutex_unlock(&rio->ring_lock);
+        return -ENXIO;
+    }
+    ret = rl_io_ring_txsync(rio);
+    if (rl_io_ring_rxsync(rio)) {
+        ret = -EINVAL;
+    }
+    mutex_unlock(&rio->ring_lock);
+
+    return ret;
+}
+
+static int
+rl_io_mmap(struct file *f, struct vm_area_struct *vma)
+{
+    struct rl_io *rio = (struct rl_io *)f->private_data;
+    int ret;
+
+    mutex_lock(&rio->ring_lock);
+    if (!rio->ring_mem) {
+        ret = -ENXIO;
+    } else if (vma->vm_pgoff ||
+               vma->vm_end - vma->vm_start > rio->ring_size) {
+        ret = -EINVAL;
+    } else {
+        ret = remap_vmalloc_range(vma, rio->ring_mem, 0);
+    }
+    mutex_unlock(&rio->ring_lock);
+
+    return ret;
+}
+
+/* In ring mode, poll() processes both rings, and reports POLLIN if the
+ * RX ring is not empty and POLLOUT if the TX ring has been drained. */
+static unsigned int
+rl_io_ring_poll(struct rl_io *rio)
+{
+    unsigned int mask = 0;
+
+    mutex_lock(&rio->ring_lock);
+    rl_io_ring_txsync(rio);
+    rl_io_ring_rxsync(rio);
+    if (rio->rx_head != READ_ONCE(rio->rx_ring->tail) ||
+        (READ_ONCE(rio->rx_ring->flags) & RL_RING_F_EOF)) {
+        mask |= POLLIN | POLLRDNORM;
+    }
+    if (rio->tx_tail == READ_ONCE(rio->tx_ring->head)) {
+        mask |= POLLOUT | POLLWRNORM;
+    }
+    mutex_unlock(&rio->ring_lock);
+
+    return mask;
+}
+
 static unsigned int
 rl_io_poll(struct file *f, poll_table *wait)
 {
@@ -477,6 +1051,10 @@ rl_io_poll(struct file *f, poll_table *wait)
     poll_wait(f, &txrx->rx_wqh, wait);
     poll_wait(f, txrx->tx_wqh, wait);
 
+    if (rio->ring_mem && rio->mode == RLITE_IO_MODE_APPL_BIND) {
+        return rl_io_ring_poll(rio);
+    }
+
     spin_lock_bh(&txrx->rx_lock);
     if (!rb_list_empty(&txrx->rx_q) || (txrx->flags & RL_TXRX_EOF)) {
         /* Userspace can read when the flow rxq is not empty
@@ -706,6 +1284,22 @@ rl_io_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
         break;
     }
 
+    case RLITE_IOCTL_WRITE_BATCH:
+        ret = rl_io_write_batch(f, rio, argp);
+        break;
+
+    case RLITE_IOCTL_READ_BATCH:
+        ret = rl_io_read_batch(f, rio, argp);
+        break;
+
+    case RLITE_IOCTL_RING_SETUP:
+        ret = rl_io_ring_setup(rio, argp);
+        break;
+
+    case RLITE_IOCTL_RING_SYNC:
+        ret = rl_io_ring_sync(rio);
+        break;
+
     default:
         ret = -EINVAL;
         break;
@@ -723,6 +1317,9 @@ rl_io_release(struct inode *inode, struct file *f)
     IODEVS_LOCK();
     list_del(&rio->node);
     IODEVS_UNLOCK();
+    if (rio->ring_mem) {
+        vfree(rio->ring_mem);
+    }
     rl_free(rio, RL_MT_IODEV);
 
     return 0;
@@ -748,6 +1345,7 @@ static const struct file_operations rl_io_fops = {
     .aio_read  = rl_io_read_iter,
 #endif /* AIO_RW */
     .poll           = rl_io_poll,
+    .mmap           = rl_io_mmap,
     .unlocked_ioctl = rl_io_ioctl,
 #ifdef CONFIG_COMPAT
     .compat_ioctl = rl_io_compat_ioctl,
@@ -78,6 +78,16 @@ rl_free(void *obj, rl_memtrack_t type)
 }
 EXPORT_SYMBOL(rl_free);
 
+/* Stop tracking an object whose ownership has been passed to some other
+ * kernel subsystem, which is going to free it. */
+void
+rl_memtrack_release(void *obj, rl_memtrack_t type)
+{
+    BUG_ON(type >= RL_MT_MAX);
+    atomic_dec(mt_count + type);
+}
+EXPORT_SYMBOL(rl_memtrack_release);
+
 void
 rl_memtrack_dump_stats(void)
 {
@@ -25,6 +25,7 @@
 #include <linux/types.h>
 #include <linux/list.h>
 #include <linux/timer.h>
+#include <linux/log2.h>
 #include "rlite/utils.h"
 #include "rlite-kernel.h"
 
@@ -36,8 +37,8 @@ dtp_init(struct dtp *dtp)
     spin_lock_init(&dtp->lock);
     rb_list_init(&dtp->cwq);
     dtp->cwq_len = dtp->max_cwq_len = 0;
-    rb_list_init(&dtp->seqq);
-    dtp->seqq_len = 0;
+    dtp->seqq     = NULL;
+    dtp->seqq_len = dtp->seqq_hwm = 0;
     rb_list_init(&dtp->rtxq);
     dtp->rtxq_len = dtp->max_rtxq_len = 0;
     dtp->flags                        = 0;
@@ -54,10 +55,37 @@ dtp_fini(struct dtp *dtp)
     dtp_dump(dtp);
 #endif
     if (dtp->flags & DTP_F_TIMERS_INITIALIZED) {
-        del_timer_sync(&dtp->snd_inact_tmr);
-        del_timer_sync(&dtp->rcv_inact_tmr);
-        del_timer_sync(&dtp->rtx_tmr);
-        del_timer_sync(&dtp->a_tmr);
+        /* Drop the retransmission queue first, so that the rtx tasklet
+         * does not rearm the timer. The tasklet may still restart the
+         * sender inactivity timer, which is removed afterwards. */
+        spin_lock_bh(&dtp->lock);
+        rb_list_foreach_safe (rb, tmp, &dtp->rtxq) {
+            rb_list_del(rb);
+            rl_buf_free(rb);
+        }
+        dtp->rtxq_len = 0;
+        spin_unlock_bh(&dtp->lock);
+        hrtimer_cancel(&dtp->rtx_tmr);
+        tasklet_kill(&dtp->rtx_tasklet);
+        rl_wtimer_del_sync(&dtp->snd_inact_tmr);
+        rl_wtimer_del_sync(&dtp->rcv_inact_tmr);
+        rl_wtimer_del_sync(&dtp->a_tmr);
+        hrtimer_cancel(&dtp->ack_tmr);
+        tasklet_kill(&dtp->ack_tasklet);
+    }
+
+    if (dtp->flags & DTP_F_PACING) {
+        /* Drop the pacing queue first, so that the pacing tasklet does
+         * not rearm the timer. */
+        spin_lock_bh(&dtp->lock);
+        rb_list_foreach_safe (rb, tmp, &dtp->tkbk.q) {
+            rb_list_del(rb);
+            rl_buf_free(rb);
+        }
+        dtp->tkbk.qlen = 0;
+        spin_unlock_bh(&dtp->lock);
+        hrtimer_cancel(&dtp->tkbk.timer);
+        tasklet_kill(&dtp->tkbk.tasklet);
     }
 
     spin_lock_bh(&dtp->lock);
@@ -73,11 +101,11 @@ dtp_fini(struct dtp *dtp)
     }
     dtp->cwq_len = 0;
 
-    rb_list_foreach_safe (rb, tmp, &dtp->seqq) {
-        rb_list_del(rb);
-        rl_buf_free(rb);
+    dtp_seqq_flush(dtp);
+    if (dtp->seqq) {
+        rl_free(dtp->seqq, RL_MT_FLOW);
+        dtp->seqq = NULL;
     }
-    dtp->seqq_len = 0;
 
     rb_list_foreach_safe (rb, tmp, &dtp->rtxq) {
         rb_list_del(rb);
@@ -89,6 +117,67 @@ dtp_fini(struct dtp *dtp)
 }
 EXPORT_SYMBOL(dtp_fini);
 
+/* The sequencing queue is a ring of PDU pointers indexed by sequence
+ * number. The PDUs in the queue always have sequence numbers in the
+ * range [rcv_next_seq_num, rcv_next_seq_num + seqq_max_len), so that
+ * each slot is used by at most one PDU, and insertion, duplicate
+ * detection and in-order extraction do not need to scan the queue. */
+int
+dtp_seqq_init(struct dtp *dtp, unsigned int max_len)
+{
+    struct rl_buf **seqq, **old;
+    unsigned int size;
+
+    if (max_len == 0) {
+        max_len = RL_SEQQ_MAX_LEN_DFLT;
+    } else if (max_len > RL_SEQQ_MAX_LEN_MAX) {
+        max_len = RL_SEQQ_MAX_LEN_MAX;
+    }
+    size = roundup_pow_of_two(max_len);
+
+    seqq = rl_alloc(size * sizeof(seqq[0]), GFP_ATOMIC | __GFP_ZERO,
+                    RL_MT_FLOW);
+    if (!seqq) {
+        PE("Out of memory\n");
+        return -ENOMEM;
+    }
+
+    spin_lock_bh(&dtp->lock);
+    dtp_seqq_flush(dtp);
+    old               = dtp->seqq;
+    dtp->seqq         = seqq;
+    dtp->seqq_mask    = size - 1;
+    dtp->seqq_max_len = max_len;
+    spin_unlock_bh(&dtp->lock);
+
+    if (old) {
+        rl_free(old, RL_MT_FLOW);
+    }
+
+    return 0;
+}
+EXPORT_SYMBOL(dtp_seqq_init);
+
+/* Drop all the PDUs in the sequencing queue, returning the number of
+ * PDUs dropped. Must be called with the DTP lock held. */
+unsigned int
+dtp_seqq_flush(struct dtp *dtp)
+{
+    unsigned int dropped = dtp->seqq_len;
+    unsigned int i;
+
+    for (i = 0; dtp->seqq_len && i <= dtp->seqq_mask; i++) {
+        if (dtp->seqq[i]) {
+            rl_buf_free(dtp->seqq[i]);
+            dtp->seqq[i] = NULL;
+            dtp->seqq_len--;
+        }
+    }
+
+    return dropped;
+}
+EXPORT_SYMBOL(dtp_seqq_flush);
+
 void
 dtp_dump(struct dtp *dtp)
 {
@@ -105,9 +194,10 @@ dtp_dump(struct dtp *dtp)
            "    max_cwq_len=%lu\n"
            "    rtxq_len=%lu\n"
            "    max_rtxq_len=%lu\n"
-           "    rtt=%lu\n"
-           "    rtt_stddev=%lu\n"
+           "    rtt=%luus\n"
+           "    rtt_stddev=%luus\n"
            "    cgwin=%lu\n"
+           "    ssthresh=%lu\n"
            "    rcv_lwe=%lu\n"
            "    rcv_next_seq_num=%lu\n"
            "    rcv_rwe=%lu\n"
@@ -115,32 +205,419 @@ dtp_dump(struct dtp *dtp)
            "    last_lwe_sent=%lu\n"
            "    last_seq_num_acked=%lu\n"
            "    next_snd_ctl_seq=%lu\n"
-           "    seqq_len=%lu\n",
+           "    seqq_len=%lu\n"
+           "    seqq_hwm=%lu\n",
            (long unsigned)flow->local_port, dtp->flags,
            (long unsigned)dtp->snd_lwe, (long unsigned)dtp->snd_rwe,
            (long unsigned)dtp->next_seq_num_to_use,
-           (long unsigned)dtp->last_seq_num_sent,
+           (long unsigned)dtp_last_seq_num_sent(dtp),
            (long unsigned)dtp->last_ctrl_seq_num_rcvd,
            (long unsigned)dtp->cwq_len, (long unsigned)dtp->max_cwq_len,
            (long unsigned)dtp->rtxq_len, (long unsigned)dtp->max_rtxq_len,
-           (long unsigned)dtp->rtt, (long unsigned)dtp->rtt_stddev,
-           (long unsigned)dtp->cgwin, (long unsigned)dtp->rcv_lwe,
+           (long unsigned)div_u64(dtp->rtt, NSEC_PER_USEC),
+           (long unsigned)div_u64(dtp->rtt_stddev, NSEC_PER_USEC),
+           (long unsigned)dtp->cgwin, (long unsigned)dtp->ssthresh,
+           (long unsigned)dtp->rcv_lwe,
            (long unsigned)dtp->rcv_next_seq_num, (long unsigned)dtp->rcv_rwe,
            (long unsigned)dtp->max_seq_num_rcvd,
            (long unsigned)dtp->last_lwe_sent,
            (long unsigned)dtp->last_seq_num_acked,
-           (long unsigned)dtp->next_snd_ctl_seq, (long unsigned)dtp->seqq_len);
+           (long unsigned)dtp->next_snd_ctl_seq, (long unsigned)dtp->seqq_len,
+           (long unsigned)dtp->seqq_hwm);
 }
 EXPORT_SYMBOL(dtp_dump);
 
+#define RL_TMR_WHEEL_MASK (RL_TMR_WHEEL_SLOTS - 1)
+#define RL_TMR_WHEEL_L1_MASK (RL_TMR_WHEEL_L1_SLOTS - 1)
+#define RL_TMR_WHEEL_NOSLOT RL_TMR_WHEEL_ALL_SLOTS
+
+/* To be called under the wheel lock. Insert the timer in the first level
+ * slot of its expiry, if it falls within the next RL_TMR_WHEEL_SLOTS
+ * jiffies, or in the second level slot it will be cascaded from. */
+static void
+rl_wtimer_link(struct rl_tmr_wheel *wheel, struct rl_wtimer *w)
+{
+    unsigned long expires = READ_ONCE(w->expires);
+    unsigned int slot;
+
+    if (expires - wheel->clk < RL_TMR_WHEEL_SLOTS) {
+        slot = expires & RL_TMR_WHEEL_MASK;
+    } else {
+        slot = RL_TMR_WHEEL_SLOTS +
+               ((expires >> RL_TMR_WHEEL_BITS) & RL_TMR_WHEEL_L1_MASK);
+    }
+    hlist_add_head(&w->node, &wheel->slots[slot]);
+    __set_bit(slot, wheel->busy);
+    WRITE_ONCE(w->slot, slot);
+}
+
+/* To be called under the wheel lock. */
+static void
+rl_wtimer_unlink(struct rl_tmr_wheel *wheel, struct rl_wtimer *w)
+{
+    unsigned int slot = w->slot;
+
+    hlist_del_init(&w->node);
+    /* A timer on the expired list of rl_tmr_wheel_tick() has no slot. */
+    if (slot != RL_TMR_WHEEL_NOSLOT && hlist_empty(&wheel->slots[slot])) {
+        __clear_bit(slot, wheel->busy);
+    }
+    w->slot = RL_TMR_WHEEL_NOSLOT;
+    wheel->armed--;
+}
+
+void
+rl_wtimer_setup(struct rl_wtimer *w, struct rl_tmr_wheel *wheel,
+                void (*func)(struct rl_wtimer *))
+{
+    INIT_HLIST_NODE(&w->node);
+    w->expires = 0;
+    w->slot    = RL_TMR_WHEEL_NOSLOT;
+    w->wheel   = wheel;
+    w->func    = func;
+}
+EXPORT_SYMBOL(rl_wtimer_setup);
+
+/* Same semantics as mod_timer(). */
+int
+rl_wtimer_mod(struct rl_wtimer *w, unsigned long expires)
+{
+    struct rl_tmr_wheel *wheel = w->wheel;
+    int pending;
+
+    /* Fast path for the inactivity timers, which are postponed on every
+     * PDU: a pending timer whose expiry moves later is left in its slot
+     * without taking the wheel lock, and rl_tmr_wheel_tick() relinks it
+     * when it finds it not due yet. The barrier pairs with the one in
+     * rl_tmr_wheel_tick(): either the tick sees the new expiry, or we see
+     * that the timer is being fired and fall back to the slow path. */
+    if (rl_wtimer_pending(w) &&
+        !time_before(expires, READ_ONCE(w->expires))) {
+        WRITE_ONCE(w->expires, expires);
+        smp_mb();
+        if (READ_ONCE(w->slot) != RL_TMR_WHEEL_NOSLOT &&
+            rl_wtimer_pending(w)) {
+            return 1;
+        }
+    }
+
+    spin_lock_bh(&wheel->lock);
+    pending = rl_wtimer_pending(w);
+    if (pending) {
+        rl_wtimer_unlink(wheel, w);
+    }
+    if (!wheel->armed) {
+        wheel->clk = jiffies;
+    }
+    if (time_before(expires, wheel->clk)) {
+        /* Already expired, fire on the next tick. */
+        expires = wheel->clk;
+    }
+    WRITE_ONCE(w->expires, expires);
+    rl_wtimer_link(wheel, w);
+    wheel->armed++;
+    if (!timer_pending(&wheel->tmr) ||
+        time_before(expires, wheel->tmr.expires)) {
+        mod_timer(&wheel->tmr, expires);
+    }
+    spin_unlock_bh(&wheel->lock);
+
+    return pending;
+}
+EXPORT_SYMBOL(rl_wtimer_mod);
+
+/* Same semantics as del_timer(). */
+int
+rl_wtimer_del(struct rl_wtimer *w)
+{
+    struct rl_tmr_wheel *wheel = w->wheel;
+    int pending;
+
+    if (!wheel || !rl_wtimer_pending(w)) {
+        return 0; /* never set up, or not armed */
+    }
+
+    spin_lock_bh(&wheel->lock);
+    pending = rl_wtimer_pending(w);
+    if (pending) {
+        rl_wtimer_unlink(wheel, w);
+    }
+    spin_unlock_bh(&wheel->lock);
+
+    return pending;
+}
+EXPORT_SYMBOL(rl_wtimer_del);
+
+/* Same semantics as del_timer_sync(): on return the timer is not pending
+ * and its callback is not running. Must be called from process context,
+ * and not from the timer callback. */
+void
+rl_wtimer_del_sync(struct rl_wtimer *w)
+{
+    struct rl_tmr_wheel *wheel = w->wheel;
+
+    if (!wheel) {
+        return;
+    }
+
+    do {
+        rl_wtimer_del(w);
+        wait_event(wheel->running_wq, READ_ONCE(wheel->running) != w);
+        /* The callback may have rearmed the timer. */
+    } while (rl_wtimer_pending(w));
+}
+EXPORT_SYMBOL(rl_wtimer_del_sync);
+
+/* To be called under the wheel lock. Return the number of jiffies from
+ * wheel->clk to the next busy first level slot or to the next cascade of
+ * a busy second level slot, whichever comes first, or ULONG_MAX if the
+ * wheel is empty. */
+static unsigned long
+rl_tmr_wheel_next(struct rl_tmr_wheel *wheel)
+{
+    unsigned int idx0 = wheel->clk & RL_TMR_WHEEL_MASK;
+    unsigned long next = ULONG_MAX;
+    unsigned long blk;
+    unsigned int b0, b;
+
+    b = find_next_bit(wheel->busy, RL_TMR_WHEEL_SLOTS, idx0);
+    if (b >= RL_TMR_WHEEL_SLOTS) {
+        b = find_first_bit(wheel->busy, RL_TMR_WHEEL_SLOTS);
+    }
+    if (b < RL_TMR_WHEEL_SLOTS) {
+        next = (b - idx0) & RL_TMR_WHEEL_MASK;
+    }
+
+    /* Second level slots are cascaded when the clock reaches the start
+     * of their block, including the current jiffy. */
+    blk = (wheel->clk + RL_TMR_WHEEL_MASK) >> RL_TMR_WHEEL_BITS;
+    b0  = RL_TMR_WHEEL_SLOTS + (blk & RL_TMR_WHEEL_L1_MASK);
+    b   = find_next_bit(wheel->busy, RL_TMR_WHEEL_ALL_SLOTS, b0);
+    if (b >= RL_TMR_WHEEL_ALL_SLOTS) {
+        b = find_next_bit(wheel->busy, b0, RL_TMR_WHEEL_SLOTS);
+        if (b >= b0) {
+            b = RL_TMR_WHEEL_ALL_SLOTS; /* none */
+        }
+    }
+    if (b < RL_TMR_WHEEL_ALL_SLOTS) {
+        blk += (b - b0) & RL_TMR_WHEEL_L1_MASK;
+        next = min(next, (blk << RL_TMR_WHEEL_BITS) - wheel->clk);
+    }
+
+    return next;
+}
+
+static void
+rl_tmr_wheel_tick(
+#ifdef RL_HAVE_TIMER_SETUP
+    struct timer_list *tmr
+#else  /* !RL_HAVE_TIMER_SETUP */
+    long unsigned arg
+#endif /* !RL_HAVE_TIMER_SETUP */
+)
+{
+#ifdef RL_HAVE_TIMER_SETUP
+    struct rl_tmr_wheel *wheel = from_timer(wheel, tmr, tmr);
+#else  /* !RL_HAVE_TIMER_SETUP */
+    struct rl_tmr_wheel *wheel = (struct rl_tmr_wheel *)arg;
+#endif /* !RL_HAVE_TIMER_SETUP */
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(wheel->ipcp->stats);
+    ktime_t t_start             = ktime_get();
+    unsigned int fired          = 0;
+    struct hlist_head expired;
+    struct hlist_head slot;
+    struct hlist_node *tmp;
+    struct rl_wtimer *w;
+    unsigned long now;
+
+    INIT_HLIST_HEAD(&expired);
+
+    spin_lock_bh(&wheel->lock);
+
+    /* Advance the clock up to the current jiffy, skipping the idle ones.
+     * At the start of each block the corresponding second level slot is
+     * cascaded into the first level. */
+    now = jiffies;
+    while (!time_after(wheel->clk, now)) {
+        unsigned int idx = wheel->clk & RL_TMR_WHEEL_MASK;
+        unsigned long skip;
+
+        if (idx == 0) {
+            unsigned int l1 =
+                RL_TMR_WHEEL_SLOTS +
+                ((wheel->clk >> RL_TMR_WHEEL_BITS) & RL_TMR_WHEEL_L1_MASK);
+
+            hlist_move_list(&wheel->slots[l1], &slot);
+            __clear_bit(l1, wheel->busy);
+            hlist_for_each_entry_safe (w, tmp, &slot, node) {
+                hlist_del(&w->node);
+                rl_wtimer_link(wheel, w);
+            }
+        }
+
+        if (test_bit(idx, wheel->busy)) {
+            hlist_move_list(&wheel->slots[idx], &slot);
+            __clear_bit(idx, wheel->busy);
+            hlist_for_each_entry_safe (w, tmp, &slot, node) {
+                hlist_del(&w->node);
+                WRITE_ONCE(w->slot, RL_TMR_WHEEL_NOSLOT);
+                smp_mb(); /* pairs with rl_wtimer_mod() */
+                if (time_before(now, READ_ONCE(w->expires))) {
+                    /* Postponed by rl_wtimer_mod(). */
+                    rl_wtimer_link(wheel, w);
+                } else {
+                    hlist_add_head(&w->node, &expired);
+                }
+            }
+        }
+
+        wheel->clk++;
+        skip = rl_tmr_wheel_next(wheel);
+        wheel->clk += min(skip, now + 1 - wheel->clk);
+    }
+
+    /* Run the callbacks without holding the lock, since they may
+     * rearm or delete timers. A concurrent rl_wtimer_mod() or
+     * rl_wtimer_del() may remove a timer from the expired list. */
+    while (!hlist_empty(&expired)) {
+        w = hlist_entry(expired.first, struct rl_wtimer, node);
+        hlist_del_init(&w->node);
+        wheel->armed--;
+        wheel->running = w;
+        spin_unlock_bh(&wheel->lock);
+        w->func(w);
+        fired++;
+        spin_lock_bh(&wheel->lock);
+        wheel->running = NULL;
+        wake_up(&wheel->running_wq);
+    }
+
+    /* Wake up again at the next busy slot. */
+    if (wheel->armed) {
+        unsigned long next = rl_tmr_wheel_next(wheel);
+
+        if (next != ULONG_MAX) {
+            mod_timer(&wheel->tmr, wheel->clk + next);
+        }
+    }
+
+    spin_unlock_bh(&wheel->lock);
+
+    stats->tmr_ticks++;
+    stats->tmr_fired += fired;
+    stats->tmr_ns += ktime_to_ns(ktime_sub(ktime_get(), t_start));
+}
+
+void
+rl_tmr_wheel_init(struct rl_tmr_wheel *wheel, struct ipcp_entry *ipcp)
+{
+    unsigned int i;
+
+    spin_lock_init(&wheel->lock);
+#ifdef RL_HAVE_TIMER_SETUP
+    timer_setup(&wheel->tmr, rl_tmr_wheel_tick, 0);
+#else  /* !RL_HAVE_TIMER_SETUP */
+    setup_timer(&wheel->tmr, rl_tmr_wheel_tick, (unsigned long)wheel);
+#endif /* !RL_HAVE_TIMER_SETUP */
+    wheel->clk     = jiffies;
+    wheel->armed   = 0;
+    wheel->running = NULL;
+    init_waitqueue_head(&wheel->running_wq);
+    wheel->ipcp = ipcp;
+    bitmap_zero(wheel->busy, RL_TMR_WHEEL_ALL_SLOTS);
+    for (i = 0; i < RL_TMR_WHEEL_ALL_SLOTS; i++) {
+        INIT_HLIST_HEAD(&wheel->slots[i]);
+    }
+}
+EXPORT_SYMBOL(rl_tmr_wheel_init);
+
+void
+rl_tmr_wheel_fini(struct rl_tmr_wheel *wheel)
+{
+    /* All the flows are gone, so no timer can be armed. */
+    del_timer_sync(&wheel->tmr);
+    if (wheel->armed) {
+        PE("%u timers still armed\n", wheel->armed);
+    }
+}
+EXPORT_SYMBOL(rl_tmr_wheel_fini);
+
+/*
+ * The PDUFT is an hash table whose readers (the datapath) run under
+ * RCU, while writers are serialized by pduft_lock. The table grows as
+ * entries are added. Each entry has two hash nodes, so that a new table
+ * can be linked through the spare node while RCU readers are still
+ * walking the old table through the other one.
+ * An entry holds up to RL_PDUFT_NHOPS_MAX next hops. Writers never
+ * clear a next hop slot that readers may still select: a next hop is
+ * removed by moving the last one into its slot, and only then the
+ * number of next hops is decreased.
+ */
+
+static struct pduft_table *
+pduft_table_alloc(unsigned int bits, unsigned int idx, gfp_t gfp)
+{
+    struct pduft_table *tbl;
+    unsigned int i;
+
+    tbl = rl_alloc(sizeof(*tbl) + (1U << bits) * sizeof(tbl->buckets[0]), gfp,
+                   RL_MT_PDUFT);
+    if (!tbl) {
+        return NULL;
+    }
+
+    tbl->bits = bits;
+    tbl->idx  = idx;
+    for (i = 0; i < (1U << bits); i++) {
+        INIT_HLIST_HEAD(&tbl->buckets[i]);
+    }
+
+    return tbl;
+}
+
+static inline struct hlist_head *
+pduft_bucket(struct pduft_table *tbl, rlm_addr_t dst_addr)
+{
+    return &tbl->buckets[hash_min(dst_addr, tbl->bits)];
+}
+
+int
+rl_pduft_init(struct rl_normal *priv)
+{
+    struct pduft_table *tbl;
+
+    tbl = pduft_table_alloc(PDUFT_BITS_MIN, 0, GFP_KERNEL);
+    if (!tbl) {
+        return -ENOMEM;
+    }
+    RCU_INIT_POINTER(priv->pduft, tbl);
+    priv->pduft_count    = 0;
+    priv->pduft_resizing = false;
+    priv->pduft_dflt     = NULL;
+    spin_lock_init(&priv->pduft_lock);
+
+    return 0;
+}
+
+void
+rl_pduft_fini(struct rl_normal *priv)
+{
+    /* Wait for any pending resize or entry release. */
+    rcu_barrier();
+    rl_free(rcu_dereference_protected(priv->pduft, 1), RL_MT_PDUFT);
+    RCU_INIT_POINTER(priv->pduft, NULL);
+}
+
+/* Called under pduft_lock. */
 static struct pduft_entry *
 pduft_lookup_internal(struct rl_normal *priv, rlm_addr_t dst_addr)
 {
+    struct pduft_table *tbl = rcu_dereference_protected(
+        priv->pduft, lockdep_is_held(&priv->pduft_lock));
     struct pduft_entry *entry;
-    struct hlist_head *head;
 
-    head = &priv->pdu_ft[hash_min(dst_addr, HASH_BITS(priv->pdu_ft))];
-    hlist_for_each_entry (entry, head, node) {
+    hlist_for_each_entry (entry, pduft_bucket(tbl, dst_addr),
+                          node[tbl->idx]) {
         if (entry->address == dst_addr) {
             return entry;
         }
@@ -149,21 +626,195 @@ pduft_lookup_internal(struct rl_normal *priv, rlm_addr_t dst_addr)
     return NULL;
 }
 
+/* Collect into @up the next hops of @entry of the given kind (primary
+ * or backup) whose lower flow is not down. */
+static inline unsigned int
+pduft_nhops_up(struct pduft_entry *entry, unsigned int n, bool backup,
+               struct flow_entry **up)
+{
+    unsigned int nup = 0;
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        struct flow_entry *flow = READ_ONCE(entry->nhops[i].flow);
+
+        if (READ_ONCE(entry->nhops[i].backup) == backup &&
+            !READ_ONCE(flow->down)) {
+            up[nup++] = flow;
+        }
+    }
+
+    return nup;
+}
+
+/* Select one of the next hops of @entry, hashing among the primary
+ * next hops that are up, or among the backup ones that are up if all
+ * the primaries are down. Called under RCU. */
+static struct flow_entry *
+pduft_entry_select(struct rl_normal *priv, struct pduft_entry *entry,
+                   uint32_t hash)
+{
+    unsigned int n = READ_ONCE(entry->num_nhops);
+    struct flow_entry *up[RL_PDUFT_NHOPS_MAX];
+    unsigned int nup;
+
+    if (likely(n == 1)) {
+        /* Fast path, nothing to choose from. */
+        return READ_ONCE(entry->nhops[0].flow);
+    }
+
+    nup = pduft_nhops_up(entry, n, /*backup=*/false, up);
+    if (unlikely(!nup)) {
+        nup = pduft_nhops_up(entry, n, /*backup=*/true, up);
+        if (!nup) {
+            /* Everything is down, stick to the first next hop. */
+            return n ? READ_ONCE(entry->nhops[0].flow) : NULL;
+        }
+        raw_cpu_ptr(priv->ipcp->stats)->rmt.frr_pkt++;
+    }
+
+    return up[nup == 1 ? 0 : hash % nup];
+}
+
+/* Pick one of the next hops towards @dst_addr, using @hash to select
+ * among equal-cost next hops. */
 struct flow_entry *
-rl_pduft_lookup(struct rl_normal *priv, rlm_addr_t dst_addr)
+rl_pduft_lookup(struct rl_normal *priv, rlm_addr_t dst_addr, uint32_t hash)
 {
+    struct flow_entry *flow = NULL;
     struct pduft_entry *entry;
-    struct flow_entry *flow;
+    struct pduft_table *tbl;
 
-    read_lock_bh(&priv->pduft_lock);
-    entry = pduft_lookup_internal(priv, dst_addr);
-    flow  = entry ? entry->flow : priv->pduft_dflt;
-    read_unlock_bh(&priv->pduft_lock);
+    rcu_read_lock();
+    tbl = rcu_dereference(priv->pduft);
+    hlist_for_each_entry_rcu(entry, pduft_bucket(tbl, dst_addr),
+                             node[tbl->idx])
+    {
+        if (entry->address == dst_addr) {
+            flow = pduft_entry_select(priv, entry, hash);
+            break;
+        }
+    }
+    if (!flow) {
+        flow = READ_ONCE(priv->pduft_dflt);
+    }
+    rcu_read_unlock();
 
     return flow;
 }
 EXPORT_SYMBOL(rl_pduft_lookup);
 
+static void
+pduft_table_free_rcu(struct rcu_head *rcu)
+{
+    struct pduft_table *tbl = container_of(rcu, struct pduft_table, rcu);
+
+    /* The entries have already been moved to the new table. */
+    WRITE_ONCE(tbl->priv->pduft_resizing, false);
+    rl_free(tbl, RL_MT_PDUFT);
+}
+
+/* Grow the table if the load factor is too high. Called under pduft_lock.
+ * Only one resize can be in progress, since the old table must stop being
+ * walked through node[idx] before the entries can be relinked again. */
+static void
+pduft_maybe_grow(struct rl_normal *priv)
+{
+    struct pduft_table *old = rcu_dereference_protected(
+        priv->pduft, lockdep_is_held(&priv->pduft_lock));
+    struct pduft_table *tbl;
+    struct pduft_entry *entry;
+    unsigned int nidx = !old->idx;
+    unsigned int i;
+
+    if (priv->pduft_count <= (2U << old->bits) ||
+        old->bits >= PDUFT_BITS_MAX || READ_ONCE(priv->pduft_resizing)) {
+        return;
+    }
+
+    tbl = pduft_table_alloc(min(old->bits + 2, (unsigned int)PDUFT_BITS_MAX),
+                            nidx, GFP_ATOMIC);
+    if (!tbl) {
+        /* Not fatal, we will try again with the next insertion. */
+        RPD(1, "Failed to grow PDUFT to %u entries\n", priv->pduft_count);
+        return;
+    }
+
+    for (i = 0; i < (1U << old->bits); i++) {
+        hlist_for_each_entry (entry, &old->buckets[i], node[old->idx]) {
+            hlist_add_head_rcu(&entry->node[nidx],
+                               pduft_bucket(tbl, entry->address));
+        }
+    }
+
+    priv->pduft_resizing = true;
+    old->priv            = priv;
+    rcu_assign_pointer(priv->pduft, tbl);
+    call_rcu(&old->rcu, pduft_table_free_rcu);
+}
+
+static void
+pduft_entry_free_rcu(struct rcu_head *rcu)
+{
+    rl_free(container_of(rcu, struct pduft_entry, rcu), RL_MT_PDUFT);
+}
+
+static struct pduft_entry *
+pduft_entry_alloc(rlm_addr_t dst_addr, struct flow_entry *flow, gfp_t gfp)
+{
+    struct pduft_entry *entry;
+    unsigned int i;
+
+    entry = rl_alloc(sizeof(*entry), gfp, RL_MT_PDUFT);
+    if (!entry) {
+        return NULL;
+    }
+
+    entry->address = dst_addr;
+    for (i = 0; i < RL_PDUFT_NHOPS_MAX; i++) {
+        entry->nhops[i].flow   = NULL;
+        entry->nhops[i].backup = false;
+        entry->nhops[i].entry  = entry;
+        INIT_LIST_HEAD(&entry->nhops[i].fnode);
+    }
+    entry->nhops[0].flow = flow;
+    entry->num_nhops     = 1;
+
+    return entry;
+}
+
+static bool
+pduft_entry_has_flow(struct pduft_entry *entry, struct flow_entry *flow)
+{
+    unsigned int i;
+
+    for (i = 0; i < entry->num_nhops; i++) {
+        if (entry->nhops[i].flow == flow) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Remove a next hop from an entry that has at least two of them.
+ * Called under pduft_lock. */
+static void
+pduft_nhop_remove(struct pduft_entry *entry, struct pduft_nhop *nhop)
+{
+    struct pduft_nhop *last = &entry->nhops[entry->num_nhops - 1];
+    struct flow_entry *flow = nhop->flow;
+
+    list_del_init(&nhop->fnode);
+    if (nhop != last) {
+        list_replace_init(&last->fnode, &nhop->fnode);
+        WRITE_ONCE(nhop->flow, last->flow);
+        WRITE_ONCE(nhop->backup, last->backup);
+    }
+    WRITE_ONCE(entry->num_nhops, entry->num_nhops - 1);
+    flow_put(flow);
+}
+
 int
 rl_pduft_set(struct ipcp_entry *ipcp, rlm_addr_t dst_addr,
              struct flow_entry *flow)
@@ -171,34 +822,50 @@ rl_pduft_set(struct ipcp_entry *ipcp, rlm_addr_t dst_addr,
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
     struct pduft_entry *entry;
 
-    write_lock_bh(&priv->pduft_lock);
+    spin_lock_bh(&priv->pduft_lock);
 
     if (dst_addr == RL_ADDR_NULL) {
         /* Default entry. */
-        priv->pduft_dflt = flow;
+        if (priv->pduft_dflt) {
+            flow_put(priv->pduft_dflt);
+        }
+        WRITE_ONCE(priv->pduft_dflt, flow);
     } else {
         entry = pduft_lookup_internal(priv, dst_addr);
 
         if (!entry) {
-            entry = rl_alloc(sizeof(*entry), GFP_ATOMIC, RL_MT_PDUFT);
+            struct pduft_table *tbl;
+
+            entry = pduft_entry_alloc(dst_addr, flow, GFP_ATOMIC);
             if (!entry) {
-                write_unlock_bh(&priv->pduft_lock);
+                spin_unlock_bh(&priv->pduft_lock);
                 return -ENOMEM;
             }
 
-            hash_add(priv->pdu_ft, &entry->node, dst_addr);
-            list_add_tail(&entry->fnode, &flow->pduft_entries);
+            tbl = rcu_dereference_protected(priv->pduft, 1);
+            hlist_add_head_rcu(&entry->node[tbl->idx],
+                               pduft_bucket(tbl, dst_addr));
+            list_add_tail(&entry->nhops[0].fnode, &flow->pduft_entries);
+            priv->pduft_count++;
+            pduft_maybe_grow(priv);
         } else {
-            /* Move from the old list to the new one. */
-            list_del_init(&entry->fnode);
-            list_add_tail_safe(&entry->fnode, &flow->pduft_entries);
-            flow_put(entry->flow);
-        }
+            struct pduft_nhop *nhop = &entry->nhops[0];
 
-        entry->flow    = flow;
-        entry->address = dst_addr;
+            /* The new flow becomes the only next hop. Move the first
+             * next hop from the old list to the new one, and drop
+             * the others. */
+            while (entry->num_nhops > 1) {
+                pduft_nhop_remove(entry,
+                                  &entry->nhops[entry->num_nhops - 1]);
+            }
+            list_del_init(&nhop->fnode);
+            list_add_tail_safe(&nhop->fnode, &flow->pduft_entries);
+            flow_put(nhop->flow);
+            WRITE_ONCE(nhop->flow, flow);
+            WRITE_ONCE(nhop->backup, false);
+        }
     }
-    write_unlock_bh(&priv->pduft_lock);
+    spin_unlock_bh(&priv->pduft_lock);
 
     flow_get_ref(flow);
 
@@ -206,12 +873,20 @@ rl_pduft_set(struct ipcp_entry *ipcp, rlm_addr_t dst_addr,
 }
 EXPORT_SYMBOL(rl_pduft_set);
 
+/* Called under pduft_lock. The entry must be released with
+ * call_rcu(). */
 static void
-pduft_entry_unlink(struct pduft_entry *entry)
+pduft_entry_unlink(struct rl_normal *priv, struct pduft_entry *entry)
 {
-    list_del_init(&entry->fnode);
-    hash_del(&entry->node);
-    flow_put(entry->flow);
+    struct pduft_table *tbl = rcu_dereference_protected(priv->pduft, 1);
+    unsigned int i;
+
+    hlist_del_rcu(&entry->node[tbl->idx]);
+    priv->pduft_count--;
+    for (i = 0; i < entry->num_nhops; i++) {
+        list_del_init(&entry->nhops[i].fnode);
+        flow_put(entry->nhops[i].flow);
+    }
 }
 
 int
@@ -219,37 +894,52 @@ rl_pduft_flush(struct ipcp_entry *ipcp)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
     struct pduft_entry *entry;
+    struct pduft_table *tbl;
     struct hlist_node *tmp;
-    int bucket;
+    unsigned int i;
 
-    write_lock_bh(&priv->pduft_lock);
+    spin_lock_bh(&priv->pduft_lock);
 
     if (priv->pduft_dflt) {
         flow_put(priv->pduft_dflt);
-        priv->pduft_dflt = NULL;
+        WRITE_ONCE(priv->pduft_dflt, NULL);
     }
-    hash_for_each_safe(priv->pdu_ft, bucket, tmp, entry, node)
-    {
-        pduft_entry_unlink(entry);
-        rl_free(entry, RL_MT_PDUFT);
+    tbl = rcu_dereference_protected(priv->pduft, 1);
+    for (i = 0; i < (1U << tbl->bits); i++) {
+        hlist_for_each_entry_safe (entry, tmp, &tbl->buckets[i],
+                                   node[tbl->idx]) {
+            pduft_entry_unlink(priv, entry);
+            call_rcu(&entry->rcu, pduft_entry_free_rcu);
+        }
     }
 
-    write_unlock_bh(&priv->pduft_lock);
+    spin_unlock_bh(&priv->pduft_lock);
 
     return 0;
 }
 EXPORT_SYMBOL(rl_pduft_flush);
 
+/* Remove a single next hop, and the whole entry if that was the
+ * last one. */
 int
-rl_pduft_del(struct ipcp_entry *ipcp, struct pduft_entry *entry)
+rl_pduft_del(struct ipcp_entry *ipcp, struct pduft_nhop *nhop)
 {
-    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    struct rl_normal *priv    = (struct rl_normal *)ipcp->priv;
+    struct pduft_entry *entry = nhop->entry;
+    bool last;
 
-    write_lock_bh(&priv->pduft_lock);
-    pduft_entry_unlink(entry);
-    write_unlock_bh(&priv->pduft_lock);
+    spin_lock_bh(&priv->pduft_lock);
+    last = entry->num_nhops == 1;
+    if (last) {
+        pduft_entry_unlink(priv, entry);
+    } else {
+        pduft_nhop_remove(entry, nhop);
+    }
+    spin_unlock_bh(&priv->pduft_lock);
 
-    rl_free(entry, RL_MT_PDUFT);
+    if (last) {
+        call_rcu(&entry->rcu, pduft_entry_free_rcu);
+    }
 
     return 0;
 }
@@ -262,27 +952,162 @@ rl_pduft_del_addr(struct ipcp_entry *ipcp, rlm_addr_t dst_addr)
     struct pduft_entry *entry = NULL;
     int ret                   = -1;
 
-    write_lock_bh(&priv->pduft_lock);
+    spin_lock_bh(&priv->pduft_lock);
     if (dst_addr == RL_ADDR_NULL) {
         /* Default entry. */
         if (priv->pduft_dflt) {
             flow_put(priv->pduft_dflt);
-            priv->pduft_dflt = NULL;
-            ret              = 0;
+            WRITE_ONCE(priv->pduft_dflt, NULL);
+            ret = 0;
         }
     } else {
         entry = pduft_lookup_internal(priv, dst_addr);
         if (entry) {
-            pduft_entry_unlink(entry);
+            pduft_entry_unlink(priv, entry);
             ret = 0;
         }
     }
-    write_unlock_bh(&priv->pduft_lock);
+    spin_unlock_bh(&priv->pduft_lock);
 
     if (entry) {
-        rl_free(entry, RL_MT_PDUFT);
+        call_rcu(&entry->rcu, pduft_entry_free_rcu);
     }
 
     return ret;
 }
 EXPORT_SYMBOL(rl_pduft_del_addr);
+
+/* Replace the whole PDUFT with the @n entries specified by @addrs and
+ * @flows, atomically with respect to the datapath. An RL_ADDR_NULL
+ * address specifies the default entry. Repeated addresses specify
+ * equal-cost next hops, up to RL_PDUFT_NHOPS_MAX, and @nhflags (which
+ * may be NULL) marks some of them as backups. The caller must hold a
+ * reference to each flow; called in process context. */
+int
+rl_pduft_replace(struct ipcp_entry *ipcp, const rlm_addr_t *addrs,
+                 struct flow_entry **flows, const uint8_t *nhflags,
+                 unsigned int n)
+{
+    struct rl_normal *priv      = (struct rl_normal *)ipcp->priv;
+    struct flow_entry *dflt     = NULL;
+    struct flow_entry *old_dflt = NULL;
+    unsigned int bits           = PDUFT_BITS_MIN;
+    struct pduft_table *tbl, *old;
+    struct pduft_entry *entry;
+    struct hlist_node *tmp;
+    unsigned int count = 0;
+    unsigned int i, j;
+
+    while (bits < PDUFT_BITS_MAX && n > (2U << bits)) {
+        bits += 2;
+    }
+    bits = min(bits, (unsigned int)PDUFT_BITS_MAX);
+
+    /* Build the new table privately, without holding the lock. */
+    tbl = pduft_table_alloc(bits, 0, GFP_KERNEL);
+    if (!tbl) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < n; i++) {
+        bool backup = nhflags && (nhflags[i] & RL_PDUFT_NH_F_BACKUP);
+
+        if (addrs[i] == RL_ADDR_NULL) {
+            dflt = flows[i];
+            continue;
+        }
+
+        hlist_for_each_entry (entry, pduft_bucket(tbl, addrs[i]), node[0]) {
+            if (entry->address == addrs[i]) {
+                break;
+            }
+        }
+        if (entry) {
+            /* Duplicate address, add another next hop. */
+            if (entry->num_nhops < RL_PDUFT_NHOPS_MAX &&
+                !pduft_entry_has_flow(entry, flows[i])) {
+                entry->nhops[entry->num_nhops].flow   = flows[i];
+                entry->nhops[entry->num_nhops].backup = backup;
+                entry->num_nhops++;
+            }
+            continue;
+        }
+
+        entry = pduft_entry_alloc(addrs[i], flows[i], GFP_KERNEL);
+        if (!entry) {
+            goto nomem;
+        }
+        entry->nhops[0].backup = backup;
+        hlist_add_head(&entry->node[0], pduft_bucket(tbl, addrs[i]));
+        count++;
+    }
+
+    /* Swap the tables. */
+    spin_lock_bh(&priv->pduft_lock);
+    while (READ_ONCE(priv->pduft_resizing)) {
+        /* Wait for the pending resize to complete, as it references
+         * the current table. */
+        spin_unlock_bh(&priv->pduft_lock);
+        rcu_barrier();
+        spin_lock_bh(&priv->pduft_lock);
+    }
+
+    old = rcu_dereference_protected(priv->pduft, 1);
+    for (i = 0; i < (1U << tbl->bits); i++) {
+        hlist_for_each_entry (entry, &tbl->buckets[i], node[0]) {
+            for (j = 0; j < entry->num_nhops; j++) {
+                struct pduft_nhop *nhop = &entry->nhops[j];
+
+                list_add_tail(&nhop->fnode, &nhop->flow->pduft_entries);
+                flow_get_ref(nhop->flow);
+            }
+        }
+    }
+    if (dflt) {
+        flow_get_ref(dflt);
+    }
+    old_dflt = priv->pduft_dflt;
+    WRITE_ONCE(priv->pduft_dflt, dflt);
+    priv->pduft_count = count;
+    rcu_assign_pointer(priv->pduft, tbl);
+
+    /* Detach the old entries from their flows. */
+    for (i = 0; i < (1U << old->bits); i++) {
+        hlist_for_each_entry_safe (entry, tmp, &old->buckets[i],
+                                   node[old->idx]) {
+            for (j = 0; j < entry->num_nhops; j++) {
+                list_del_init(&entry->nhops[j].fnode);
+            }
+        }
+    }
+    spin_unlock_bh(&priv->pduft_lock);
+
+    /* Wait for the readers of the old table, and release it. */
+    synchronize_rcu();
+    for (i = 0; i < (1U << old->bits); i++) {
+        hlist_for_each_entry_safe (entry, tmp, &old->buckets[i],
+                                   node[old->idx]) {
+            for (j = 0; j < entry->num_nhops; j++) {
+                flow_put(entry->nhops[j].flow);
+            }
+            rl_free(entry, RL_MT_PDUFT);
+        }
+    }
+    rl_free(old, RL_MT_PDUFT);
+    if (old_dflt) {
+        flow_put(old_dflt);
+    }
+
+    return 0;
+
+nomem:
+    for (i = 0; i < (1U << tbl->bits); i++) {
+        hlist_for_each_entry_safe (entry, tmp, &tbl->buckets[i], node[0]) {
+            rl_free(entry, RL_MT_PDUFT);
+        }
+    }
+    rl_free(tbl, RL_MT_PDUFT);
+
+    return -ENOMEM;
+}
+EXPORT_SYMBOL(rl_pduft_replace);
@@ -37,10 +37,16 @@
 #include <linux/spinlock.h>
 #include <linux/delay.h>
 #include <linux/poll.h>
+#include <linux/math64.h>
+#include <linux/jhash.h>
+#include <linux/crc32c.h>
+#include <linux/random.h>
+#include <net/checksum.h>
 
 #define RMTQ_MAX_SIZE (1 << 17)
 
 static LIST_HEAD(rl_pdu_schedulers);
+static LIST_HEAD(rl_cc_algos);
 
 /* PCI header to be used for transfer PDUs.
  * The order of the fields is extremely important, because we only
@@ -72,6 +78,16 @@ struct rina_pci_ctrl {
     rl_seq_t my_rwe; /* sent but unused */
 } __attribute__((__packed__));
 
+/* In SACK control PDUs the control PCI is followed by up to
+ * RL_SACK_BLOCKS_MAX blocks, sorted by ascending sequence number.
+ * Each block acknowledges the PDUs in the range [start, end). */
+struct rina_sack_block {
+    rl_seq_t start;
+    rl_seq_t end;
+} __attribute__((__packed__));
+
+#define RL_SACK_BLOCKS_MAX 8
+
 static inline void
 rl_buf_pci_pop(struct rl_buf *rb)
 {
@@ -137,32 +153,50 @@ struct rl_sched_pfifo {
     rl_qosid_t num_queues;
 };
 
-static int
-sched_pfifo_do_config(struct rl_sched *sched, unsigned int max_queue_size,
-                      rl_qosid_t num_queues)
+static void
+pfifo_flush(struct rl_sched_pfifo *pf)
 {
-    struct rl_sched_pfifo *sched_priv = RL_SCHED_PRIV(sched);
-    int i;
+    rl_qosid_t i;
 
-    if (num_queues == 0 || max_queue_size == 0) {
-        /* Invalid parameters. */
-        return -1;
+    if (!pf->queues) {
+        return;
     }
 
+    for (i = 0; i < pf->num_queues; i++) {
+        struct rl_sched_pfifo_queue *pq = pf->queues + i;
+        struct rl_buf *rb, *tmp;
+
+        rb_list_foreach_safe (rb, tmp, &pq->q) {
+            rb_list_del(rb);
+            rl_buf_free(rb);
+        }
+        pq->qlen = 0;
+    }
+
+    rl_free(pf->queues, RL_MT_SHIM);
+    pf->queues = NULL;
+}
+
+static int
+pfifo_setup(struct rl_sched_pfifo *pf, unsigned int max_queue_size,
+            rl_qosid_t num_queues)
+{
+    int i;
+
     /* Clean up the old queues (if any). */
-    sched->ops.fini(sched);
+    pfifo_flush(pf);
 
     /* Build the new queues. */
-    sched_priv->max_queue_size = max_queue_size;
-    sched_priv->num_queues     = num_queues;
-    sched_priv->queues = rl_alloc(num_queues * sizeof(sched_priv->queues[0]),
+    pf->max_queue_size = max_queue_size;
+    pf->num_queues     = num_queues;
+    pf->queues         = rl_alloc(num_queues * sizeof(pf->queues[0]),
                                   GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
-    if (!sched_priv->queues) {
+    if (!pf->queues) {
         return -ENOMEM;
     }
 
     for (i = 0; i < num_queues; i++) {
-        struct rl_sched_pfifo_queue *pq = sched_priv->queues + i;
+        struct rl_sched_pfifo_queue *pq = pf->queues + i;
 
         rb_list_init(&pq->q);
         pq->qlen = 0;
@@ -171,6 +205,56 @@ sched_pfifo_do_config(struct rl_sched *sched, unsigned int max_queue_size,
     return 0;
 }
 
+static int
+pfifo_enq(struct rl_sched_pfifo *pf, struct rl_buf *rb)
+{
+    rl_qosid_t qos_class =
+        min((rl_qosid_t)(pf->num_queues - 1), RL_BUF_PCI(rb)->qos_id);
+    struct rl_sched_pfifo_queue *pq = pf->queues + qos_class;
+
+    if (pq->qlen > pf->max_queue_size) {
+        return -1;
+    }
+
+    rb_list_enq(rb, &pq->q);
+    pq->qlen += rl_buf_truesize(rb);
+
+    return 0;
+}
+
+static struct rl_buf *
+pfifo_deq(struct rl_sched_pfifo *pf)
+{
+    rl_qosid_t qos_class;
+
+    for (qos_class = 0; qos_class < pf->num_queues; qos_class++) {
+        struct rl_sched_pfifo_queue *pq = pf->queues + qos_class;
+
+        if (!rb_list_empty(&pq->q)) {
+            struct rl_buf *rb = rb_list_front(&pq->q);
+
+            rb_list_del(rb);
+            pq->qlen -= rl_buf_truesize(rb);
+            BUG_ON(pq->qlen < 0);
+            return rb;
+        }
+    }
+
+    return NULL;
+}
+
+static int
+sched_pfifo_do_config(struct rl_sched *sched, unsigned int max_queue_size,
+                      rl_qosid_t num_queues)
+{
+    if (num_queues == 0 || max_queue_size == 0) {
+        /* Invalid parameters. */
+        return -1;
+    }
+
+    return pfifo_setup(RL_SCHED_PRIV(sched), max_queue_size, num_queues);
+}
+
 static int
 sched_pfifo_config(struct rl_sched *sched, const struct rl_msg_base *bmsg)
 {
@@ -190,75 +274,145 @@ sched_pfifo_init(struct rl_sched *sched)
 static void
 sched_pfifo_fini(struct rl_sched *sched)
 {
-    struct rl_sched_pfifo *sched_priv = RL_SCHED_PRIV(sched);
-    rl_qosid_t i;
+    pfifo_flush(RL_SCHED_PRIV(sched));
+}
 
-    if (!sched_priv->queues) {
+static int
+sched_pfifo_enq(struct rl_sched *sched, unsigned int sq, struct rl_buf *rb)
+{
+    return pfifo_enq(RL_SCHED_PRIV(sched), rb);
+}
+
+static struct rl_buf *
+sched_pfifo_deq(struct rl_sched *sched, unsigned int sq)
+{
+    return pfifo_deq(RL_SCHED_PRIV(sched));
+}
+
+static struct rl_sched_ops rl_sched_pfifo_ops = {
+    .name      = "pfifo",
+    .priv_size = sizeof(struct rl_sched_pfifo),
+    .init      = sched_pfifo_init,
+    .fini      = sched_pfifo_fini,
+    .config    = sched_pfifo_config,
+    .enq       = sched_pfifo_enq,
+    .deq       = sched_pfifo_deq};
+
+/* Multi-queue priority FIFO. Each sub-queue is a pfifo with its own lock
+ * and dequeue worker. PDUs are spread across the sub-queues by hashing
+ * (dst_addr, qos_id), so that the PDUs of a given class towards a given
+ * destination are always served in order by the same sub-queue. */
+struct rl_sched_mqpfifo {
+    /* Array indexed by sub-queue. */
+    struct rl_sched_pfifo *sub;
+    unsigned int num_sq;
+};
+
+static void
+sched_mqpfifo_fini(struct rl_sched *sched)
+{
+    struct rl_sched_mqpfifo *sched_priv = RL_SCHED_PRIV(sched);
+    unsigned int i;
+
+    if (!sched_priv->sub) {
         return;
     }
 
-    for (i = 0; i < sched_priv->num_queues; i++) {
-        struct rl_sched_pfifo_queue *pq = sched_priv->queues + i;
-        struct rl_buf *rb, *tmp;
-
-        rb_list_foreach_safe (rb, tmp, &pq->q) {
-            rb_list_del(rb);
-            rl_buf_free(rb);
-        }
-        pq->qlen = 0;
+    for (i = 0; i < sched_priv->num_sq; i++) {
+        pfifo_flush(sched_priv->sub + i);
     }
 
-    rl_free(sched_priv->queues, RL_MT_SHIM);
+    rl_free(sched_priv->sub, RL_MT_SHIM);
+    sched_priv->sub = NULL;
 }
 
 static int
-sched_pfifo_enq(struct rl_sched *sched, struct rl_buf *rb)
+sched_mqpfifo_do_config(struct rl_sched *sched, unsigned int max_queue_size,
+                        rl_qosid_t num_queues)
 {
-    struct rl_sched_pfifo *sched_priv = RL_SCHED_PRIV(sched);
-    rl_qosid_t qos_class =
-        min((rl_qosid_t)(sched_priv->num_queues - 1), RL_BUF_PCI(rb)->qos_id);
-    struct rl_sched_pfifo_queue *pq = sched_priv->queues + qos_class;
+    struct rl_sched_mqpfifo *sched_priv = RL_SCHED_PRIV(sched);
+    unsigned int i;
 
-    if (pq->qlen > sched_priv->max_queue_size) {
+    if (num_queues == 0 || max_queue_size == 0) {
+        /* Invalid parameters. */
         return -1;
     }
 
-    rb_list_enq(rb, &pq->q);
-    pq->qlen += rl_buf_truesize(rb);
+    sched_mqpfifo_fini(sched);
+
+    sched_priv->num_sq = sched->num_sq;
+    sched_priv->sub    = rl_alloc(sched->num_sq * sizeof(sched_priv->sub[0]),
+                                  GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
+    if (!sched_priv->sub) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < sched_priv->num_sq; i++) {
+        int ret = pfifo_setup(sched_priv->sub + i, max_queue_size, num_queues);
+
+        if (ret) {
+            sched_mqpfifo_fini(sched);
+            return ret;
+        }
+    }
 
     return 0;
 }
 
-static struct rl_buf *
-sched_pfifo_deq(struct rl_sched *sched)
+static int
+sched_mqpfifo_config(struct rl_sched *sched, const struct rl_msg_base *bmsg)
 {
-    struct rl_sched_pfifo *sched_priv = RL_SCHED_PRIV(sched);
-    rl_qosid_t qos_class;
+    struct rl_kmsg_ipcp_sched_pfifo *req =
+        (struct rl_kmsg_ipcp_sched_pfifo *)bmsg;
 
-    for (qos_class = 0; qos_class < sched_priv->num_queues; qos_class++) {
-        struct rl_sched_pfifo_queue *pq = sched_priv->queues + qos_class;
+    return sched_mqpfifo_do_config(sched, req->max_queue_size,
+                                   req->prio_levels);
+}
 
-        if (!rb_list_empty(&pq->q)) {
-            struct rl_buf *rb = rb_list_front(&pq->q);
+static int
+sched_mqpfifo_init(struct rl_sched *sched)
+{
+    return sched_mqpfifo_do_config(sched, /*max_queue_size=*/RMTQ_MAX_SIZE,
+                                   /*num_queues=*/1);
+}
 
-            rb_list_del(rb);
-            pq->qlen -= rl_buf_truesize(rb);
-            BUG_ON(pq->qlen < 0);
-            return rb;
-        }
-    }
+static unsigned int
+sched_mqpfifo_select(struct rl_sched *sched, struct rl_buf *rb)
+{
+    struct rina_pci *pci = RL_BUF_PCI(rb);
+    uint64_t dst_addr    = pci->dst_addr;
 
-    return NULL;
+    return jhash_2words((uint32_t)dst_addr,
+                        (uint32_t)(dst_addr >> 32) ^ pci->qos_id, 0) %
+           sched->num_sq;
 }
 
-static struct rl_sched_ops rl_sched_pfifo_ops = {
-    .name      = "pfifo",
-    .priv_size = sizeof(struct rl_sched_pfifo),
-    .init      = sched_pfifo_init,
-    .fini      = sched_pfifo_fini,
-    .config    = sched_pfifo_config,
-    .enq       = sched_pfifo_enq,
-    .deq       = sched_pfifo_deq};
+static int
+sched_mqpfifo_enq(struct rl_sched *sched, unsigned int sq, struct rl_buf *rb)
+{
+    struct rl_sched_mqpfifo *sched_priv = RL_SCHED_PRIV(sched);
+
+    return pfifo_enq(sched_priv->sub + sq, rb);
+}
+
+static struct rl_buf *
+sched_mqpfifo_deq(struct rl_sched *sched, unsigned int sq)
+{
+    struct rl_sched_mqpfifo *sched_priv = RL_SCHED_PRIV(sched);
+
+    return pfifo_deq(sched_priv->sub + sq);
+}
+
+static struct rl_sched_ops rl_sched_mqpfifo_ops = {
+    .name      = "mqpfifo",
+    .priv_size = sizeof(struct rl_sched_mqpfifo),
+    .init      = sched_mqpfifo_init,
+    .fini      = sched_mqpfifo_fini,
+    .config    = sched_mqpfifo_config,
+    .select    = sched_mqpfifo_select,
+    .enq       = sched_mqpfifo_enq,
+    .deq       = sched_mqpfifo_deq,
+};
 
 struct rl_sched_wrr {
     /* Array indexed by qos_id. */
@@ -385,7 +539,7 @@ sched_wrr_fini(struct rl_sched *sched)
 }
 
 static int
-sched_wrr_enq(struct rl_sched *sched, struct rl_buf *rb)
+sched_wrr_enq(struct rl_sched *sched, unsigned int sq, struct rl_buf *rb)
 {
     struct rl_sched_wrr *sched_priv = RL_SCHED_PRIV(sched);
     rl_qosid_t qos_class =
@@ -412,7 +566,7 @@ sched_next_class(rl_qosid_t qos_class, rl_qosid_t num_classes)
 }
 
 static struct rl_buf *
-sched_wrr_deq(struct rl_sched *sched)
+sched_wrr_deq(struct rl_sched *sched, unsigned int sq)
 {
     struct rl_sched_wrr *sched_priv = RL_SCHED_PRIV(sched);
     rl_qosid_t n                    = sched_priv->num_queues;
@@ -439,34 +593,516 @@ sched_wrr_deq(struct rl_sched *sched)
         }
     }
 
-    /* Update the current class. */
-    sched_priv->cur_class = qos_class;
+    /* Update the current class. */
+    sched_priv->cur_class = qos_class;
+
+    return rb;
+}
+
+static struct rl_sched_ops rl_sched_wrr_ops = {
+    .name      = "wrr",
+    .priv_size = sizeof(struct rl_sched_wrr),
+    .init      = sched_wrr_init,
+    .fini      = sched_wrr_fini,
+    .config    = sched_wrr_config,
+    .enq       = sched_wrr_enq,
+    .deq       = sched_wrr_deq,
+};
+
+/* Deficit Round Robin. Each backlogged queue is given 'quantum' bytes of
+ * credit per round, so that bandwidth is shared in proportion to the
+ * quanta regardless of the PDU sizes. The hybrid variant (prio-drr)
+ * serves queue 0 with strict priority, and the other ones with DRR. */
+struct rl_sched_drr {
+    /* Array indexed by qos_id. */
+    struct rl_sched_drr_queue {
+        struct rb_list q;
+        int qlen;
+        unsigned int quantum;
+        unsigned int deficit;
+        struct list_head active; /* in the active list if backlogged */
+    } * queues;
+
+    /* Backlogged queues served by DRR, in round robin order. */
+    struct list_head active;
+
+    /* Maximum size of each queue, in bytes. */
+    unsigned int max_queue_size;
+
+    /* Number of queues (traffic classes). */
+    rl_qosid_t num_queues;
+
+    /* Serve queue 0 with strict priority. */
+    bool prio;
+};
+
+static void
+sched_drr_fini(struct rl_sched *sched)
+{
+    struct rl_sched_drr *sched_priv = RL_SCHED_PRIV(sched);
+    int i;
+
+    if (!sched_priv->queues) {
+        return;
+    }
+
+    for (i = 0; i < sched_priv->num_queues; i++) {
+        struct rl_sched_drr_queue *dq = sched_priv->queues + i;
+        struct rl_buf *rb, *tmp;
+
+        rb_list_foreach_safe (rb, tmp, &dq->q) {
+            rb_list_del(rb);
+            rl_buf_free(rb);
+        }
+        dq->qlen = 0;
+    }
+
+    rl_free(sched_priv->queues, RL_MT_SHIM);
+    sched_priv->queues = NULL;
+    INIT_LIST_HEAD(&sched_priv->active);
+}
+
+static int
+sched_drr_do_config(struct rl_sched *sched, unsigned int max_queue_size,
+                    rl_qosid_t num_queues, unsigned int quanta[])
+{
+    struct rl_sched_drr *sched_priv = RL_SCHED_PRIV(sched);
+    int i;
+
+    if (num_queues == 0 || max_queue_size == 0) {
+        /* Invalid parameters. */
+        return -1;
+    }
+
+    for (i = 0; i < num_queues; i++) {
+        if (quanta[i] == 0 && !(sched_priv->prio && i == 0)) {
+            return -1;
+        }
+    }
+
+    /* Clean up the old queues (if any). */
+    sched_drr_fini(sched);
+
+    /* Build the new queues. */
+    sched_priv->max_queue_size = max_queue_size;
+    sched_priv->num_queues     = num_queues;
+    sched_priv->queues = rl_alloc(num_queues * sizeof(sched_priv->queues[0]),
+                                  GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
+    if (!sched_priv->queues) {
+        return -ENOMEM;
+    }
+
+    INIT_LIST_HEAD(&sched_priv->active);
+    for (i = 0; i < num_queues; i++) {
+        struct rl_sched_drr_queue *dq = sched_priv->queues + i;
+
+        rb_list_init(&dq->q);
+        INIT_LIST_HEAD(&dq->active);
+        dq->qlen    = 0;
+        dq->quantum = quanta[i];
+        dq->deficit = 0;
+    }
+
+    return 0;
+}
+
+static int
+sched_drr_config(struct rl_sched *sched, const struct rl_msg_base *bmsg)
+{
+    struct rl_kmsg_ipcp_sched_drr *req = (struct rl_kmsg_ipcp_sched_drr *)bmsg;
+    unsigned int n = req->quanta.num_elements;
+
+    if (req->quanta.elem_size != sizeof(uint32_t) || (rl_qosid_t)n != n) {
+        return -EINVAL;
+    }
+
+    return sched_drr_do_config(sched, req->max_queue_size, n,
+                               req->quanta.slots.dwords);
+}
+
+static int
+sched_drr_init(struct rl_sched *sched)
+{
+    unsigned int quanta[2] = {1500, 1500};
+
+    return sched_drr_do_config(sched, /*max_queue_size=*/RMTQ_MAX_SIZE,
+                               /*num_queues=*/2, /*quanta=*/quanta);
+}
+
+static int
+sched_prio_drr_init(struct rl_sched *sched)
+{
+    struct rl_sched_drr *sched_priv = RL_SCHED_PRIV(sched);
+    unsigned int quanta[3]          = {0, 1500, 1500};
+
+    sched_priv->prio = true;
+
+    return sched_drr_do_config(sched, /*max_queue_size=*/RMTQ_MAX_SIZE,
+                               /*num_queues=*/3, /*quanta=*/quanta);
+}
+
+static int
+sched_drr_enq(struct rl_sched *sched, unsigned int sq, struct rl_buf *rb)
+{
+    struct rl_sched_drr *sched_priv = RL_SCHED_PRIV(sched);
+    rl_qosid_t qos_class =
+        min((rl_qosid_t)(sched_priv->num_queues - 1), RL_BUF_PCI(rb)->qos_id);
+    struct rl_sched_drr_queue *dq = sched_priv->queues + qos_class;
+
+    if (dq->qlen > sched_priv->max_queue_size) {
+        return -1;
+    }
+
+    if (rb_list_empty(&dq->q) && !(sched_priv->prio && qos_class == 0)) {
+        /* The queue becomes backlogged, append it to the active list. */
+        dq->deficit = 0;
+        list_add_tail(&dq->active, &sched_priv->active);
+    }
+    rb_list_enq(rb, &dq->q);
+    dq->qlen += rl_buf_truesize(rb);
+
+    return 0;
+}
+
+static struct rl_buf *
+sched_drr_deq(struct rl_sched *sched, unsigned int sq)
+{
+    struct rl_sched_drr *sched_priv = RL_SCHED_PRIV(sched);
+    struct rl_sched_drr_queue *dq;
+    struct rl_buf *rb;
+
+    if (sched_priv->prio && !rb_list_empty(&sched_priv->queues[0].q)) {
+        dq = sched_priv->queues;
+        rb = rb_list_front(&dq->q);
+        rb_list_del(rb);
+        dq->qlen -= rl_buf_truesize(rb);
+        BUG_ON(dq->qlen < 0);
+        return rb;
+    }
+
+    while (!list_empty(&sched_priv->active)) {
+        dq = list_first_entry(&sched_priv->active, struct rl_sched_drr_queue,
+                              active);
+        rb = rb_list_front(&dq->q);
+        if (rb->len > dq->deficit) {
+            /* Not enough credit: give this queue its quantum, and move
+             * it to the end of the round. */
+            dq->deficit += dq->quantum;
+            list_move_tail(&dq->active, &sched_priv->active);
+            continue;
+        }
+
+        rb_list_del(rb);
+        dq->qlen -= rl_buf_truesize(rb);
+        BUG_ON(dq->qlen < 0);
+        dq->deficit -= rb->len;
+        if (rb_list_empty(&dq->q)) {
+            /* Idle queues don't accumulate credit. */
+            dq->deficit = 0;
+            list_del_init(&dq->active);
+        }
+        return rb;
+    }
+
+    return NULL;
+}
+
+static struct rl_sched_ops rl_sched_drr_ops = {
+    .name      = "drr",
+    .priv_size = sizeof(struct rl_sched_drr),
+    .init      = sched_drr_init,
+    .fini      = sched_drr_fini,
+    .config    = sched_drr_config,
+    .enq       = sched_drr_enq,
+    .deq       = sched_drr_deq,
+};
+
+static struct rl_sched_ops rl_sched_prio_drr_ops = {
+    .name      = "prio-drr",
+    .priv_size = sizeof(struct rl_sched_drr),
+    .init      = sched_prio_drr_init,
+    .fini      = sched_drr_fini,
+    .config    = sched_drr_config,
+    .enq       = sched_drr_enq,
+    .deq       = sched_drr_deq,
+};
+
+/* In general RL_PCI_LEN != sizeof(struct rina_pci) and
+ * RL_PCI_CTRL_LEN != sizeof(struct rina_pci_ctrl), since
+ * compiler may need to insert padding. */
+#define RL_PCI_LEN                                                             \
+    (8 + 2 * sizeof(rl_addr_t) + 2 * sizeof(rl_cepid_t) + sizeof(rl_qosid_t) + \
+     sizeof(rl_pdulen_t) + sizeof(rl_seq_t))
+
+#define RL_PCI_CTRL_LEN (RL_PCI_LEN + 6 * sizeof(rl_seq_t))
+
+/* Maximum and minimum values for the congestion control window. */
+#define RL_CGWIN_MIN 4
+#define RL_CGWIN_MAX (1U << 16)
+
+static inline void
+cc_cgwin_clamp(struct dtp *dtp)
+{
+    if (unlikely(dtp->cgwin < RL_CGWIN_MIN)) {
+        dtp->cgwin = RL_CGWIN_MIN;
+    } else if (unlikely(dtp->cgwin > RL_CGWIN_MAX)) {
+        dtp->cgwin = RL_CGWIN_MAX;
+    }
+}
+
+static void
+cc_init(struct flow_entry *flow)
+{
+    struct dtp *dtp = &flow->dtp;
+
+    dtp->cgwin       = RL_CGWIN_MIN;
+    dtp->ssthresh    = RL_CGWIN_MAX;
+    dtp->cc_acked    = 0;
+    dtp->rtt_min     = 0;
+    dtp->cc_epoch    = ktime_get_ns();
+    dtp->pacing_rate = 0;
+}
+
+/* Multiplicative decrease, at most once per RTT. */
+static void
+cc_backoff(struct dtp *dtp, bool force)
+{
+    s64 now = ktime_get_ns();
+
+    if (!force && now < dtp->cc_epoch) {
+        return;
+    }
+    dtp->cgwin >>= 1;
+    cc_cgwin_clamp(dtp);
+    dtp->ssthresh = dtp->cgwin;
+    dtp->cc_acked = 0;
+    dtp->cc_epoch = now + dtp->rtt;
+}
+
+static void
+cc_on_loss(struct flow_entry *flow, bool timeout)
+{
+    /* Retransmission timeouts always halve the window, while SACK
+     * losses are already notified once per recovery episode. */
+    cc_backoff(&flow->dtp, /*force=*/true);
+}
+
+/* AIMD with slow start, which also backs off on ECN marks. */
+static void
+cc_aimd_on_ack(struct flow_entry *flow, unsigned int acked, uint64_t rtt,
+               bool ecn)
+{
+    struct dtp *dtp = &flow->dtp;
+
+    if (ecn) {
+        cc_backoff(dtp, /*force=*/false);
+        return;
+    }
+
+    if (dtp->cgwin < dtp->ssthresh) {
+        /* Slow start. */
+        dtp->cgwin += acked;
+    } else {
+        /* Congestion avoidance, one PDU per window of acked PDUs. */
+        dtp->cc_acked += acked;
+        if (dtp->cc_acked >= dtp->cgwin) {
+            dtp->cc_acked -= dtp->cgwin;
+            dtp->cgwin++;
+        }
+    }
+    cc_cgwin_clamp(dtp);
+}
+
+static struct rl_cc_ops rl_cc_aimd_ops = {
+    .name    = "aimd",
+    .init    = cc_init,
+    .on_ack  = cc_aimd_on_ack,
+    .on_loss = cc_on_loss,
+};
+
+/* Delay-based (Vegas-like): once per RTT, estimate the number of PDUs
+ * queued in the network as cgwin * (rtt - rtt_min) / rtt, and keep it
+ * between ALPHA and BETA. */
+#define CC_DELAY_ALPHA 2
+#define CC_DELAY_BETA 4
+#define CC_DELAY_GAMMA 1
+
+static void
+cc_delay_on_ack(struct flow_entry *flow, unsigned int acked, uint64_t rtt,
+                bool ecn)
+{
+    struct dtp *dtp = &flow->dtp;
+    s64 now         = ktime_get_ns();
+    uint64_t srtt;
+    unsigned int diff;
+
+    if (ecn) {
+        cc_backoff(dtp, /*force=*/false);
+        return;
+    }
+
+    if (rtt && (!dtp->rtt_min || rtt < dtp->rtt_min)) {
+        dtp->rtt_min = rtt;
+    }
+
+    dtp->cc_acked += acked;
+    if (!dtp->rtt_min || now < dtp->cc_epoch) {
+        return;
+    }
+
+    srtt = max(dtp->rtt, dtp->rtt_min);
+    diff = (unsigned int)div64_u64((uint64_t)dtp->cgwin * (srtt - dtp->rtt_min),
+                                   srtt);
+
+    if (dtp->cgwin < dtp->ssthresh) {
+        if (diff > CC_DELAY_GAMMA) {
+            /* Queues are building up, leave slow start. */
+            dtp->ssthresh = dtp->cgwin;
+        } else {
+            dtp->cgwin += dtp->cc_acked;
+        }
+    } else if (diff < CC_DELAY_ALPHA) {
+        dtp->cgwin++;
+    } else if (diff > CC_DELAY_BETA) {
+        dtp->cgwin--;
+    }
+    cc_cgwin_clamp(dtp);
+    dtp->cc_acked = 0;
+    dtp->cc_epoch = now + srtt;
+}
+
+static struct rl_cc_ops rl_cc_delay_ops = {
+    .name    = "delay",
+    .init    = cc_init,
+    .on_ack  = cc_delay_on_ack,
+    .on_loss = cc_on_loss,
+};
+
+static const struct rl_cc_ops *
+rl_cc_lookup(const char *name)
+{
+    struct rl_cc_ops *cur;
+
+    list_for_each_entry (cur, &rl_cc_algos, node) {
+        if (!strncmp(name, cur->name, RL_CC_NAME_MAX)) {
+            return cur;
+        }
+    }
+
+    return NULL;
+}
+
+/* The pacing rate is the congestion window spread over the RTT, with
+ * some headroom to let the window grow (2x in slow start, 1.25x
+ * otherwise). To be called under DTP lock. */
+static void
+cc_pacing_update(struct dtp *dtp)
+{
+    uint64_t rate;
+
+    if (!dtp->rtt) {
+        return;
+    }
+    rate = (uint64_t)dtp->cgwin * dtp->pdu_len_avg * NSEC_PER_SEC;
+    rate = div64_u64(rate, dtp->rtt);
+    if (dtp->cgwin < dtp->ssthresh) {
+        rate <<= 1;
+    } else {
+        rate += rate >> 2;
+    }
+    dtp->pacing_rate = rate;
+}
+
+/* Internet checksum of a PDU, to be stored into the pdu_csum field (which
+ * must be zero while the checksum is computed). The checksum computation
+ * is endianness independent, so it is performed in host order, like the
+ * PCI fields. */
+static inline uint16_t
+pdu_csum_inet(const void *pdu, unsigned int len)
+{
+    return (__force uint16_t)csum_fold(csum_partial(pdu, len, 0));
+}
+
+/* Update the Internet checksum of a PDU after a 16 bit word of the PCI
+ * changed from 'old' to 'new' (RFC 1624, eqn. 3). */
+static inline uint16_t
+pdu_csum_update(uint16_t csum, uint16_t old, uint16_t new)
+{
+    uint32_t sum = (uint16_t)~csum + (uint16_t)~old + new;
+
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
 
-    return rb;
+    return ~sum;
 }
 
-static struct rl_sched_ops rl_sched_wrr_ops = {
-    .name      = "wrr",
-    .priv_size = sizeof(struct rl_sched_wrr),
-    .init      = sched_wrr_init,
-    .fini      = sched_wrr_fini,
-    .config    = sched_wrr_config,
-    .enq       = sched_wrr_enq,
-    .deq       = sched_wrr_deq,
-};
+/* CRC32C of a PDU, folded to fit the pdu_csum field. The fields that
+ * relaying IPCPs modify (TTL and ECN flag) are not covered, so that the
+ * CRC does not need to be updated on the relay path. */
+static uint16_t
+pdu_csum_crc32c(const struct rina_pci *pci, unsigned int len)
+{
+    const uint8_t *pdu = (const uint8_t *)pci;
+    uint16_t flags     = pci->pdu_flags & ~PDU_F_ECN;
+    u32 crc;
 
-/* In general RL_PCI_LEN != sizeof(struct rina_pci) and
- * RL_PCI_CTRL_LEN != sizeof(struct rina_pci_ctrl), since
- * compiler may need to insert padding. */
-#define RL_PCI_LEN                                                             \
-    (8 + 2 * sizeof(rl_addr_t) + 2 * sizeof(rl_cepid_t) + sizeof(rl_qosid_t) + \
-     sizeof(rl_pdulen_t) + sizeof(rl_seq_t))
+    crc = crc32c(~0U, pdu, offsetof(struct rina_pci, pdu_flags));
+    crc = crc32c(crc, &flags, sizeof(flags));
+    crc = crc32c(crc, pdu + offsetof(struct rina_pci, seqnum),
+                 len - offsetof(struct rina_pci, seqnum));
+    crc = ~crc;
 
-#define RL_PCI_CTRL_LEN (RL_PCI_LEN + 6 * sizeof(rl_seq_t))
+    return (uint16_t)(crc ^ (crc >> 16));
+}
 
-/* Maximum and minimum values for the congestion control window. */
-#define RL_CGWIN_MIN 4
-#define RL_CGWIN_MAX (1U << 16)
+/* Fill in the checksum of an outgoing PDU, whose pdu_csum field is zero. */
+static inline void
+pdu_csum_set(struct rl_normal *priv, struct rina_pci *pci, unsigned int len)
+{
+    switch (priv->csum) {
+    case RL_CSUM_INET:
+        pci->pdu_csum = pdu_csum_inet(pci, len);
+        break;
+    case RL_CSUM_CRC32C:
+        pci->pdu_csum = pdu_csum_crc32c(pci, len);
+        break;
+    }
+}
+
+/* Verify the checksum of an incoming PDU. */
+static inline bool
+pdu_csum_ok(struct rl_normal *priv, const struct rina_pci *pci,
+            unsigned int len)
+{
+    switch (priv->csum) {
+    case RL_CSUM_INET:
+        return pdu_csum_inet(pci, len) == 0;
+    case RL_CSUM_CRC32C:
+        return pdu_csum_crc32c(pci, len) == pci->pdu_csum;
+    }
+
+    return true;
+}
+
+/* Mark a data PDU as congestion experienced, fixing the checksum
+ * incrementally. */
+static void
+rmt_ecn_mark(struct ipcp_entry *ipcp, struct rl_buf *rb)
+{
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    struct rina_pci *pci   = RL_BUF_PCI(rb);
+    uint16_t old_flags     = pci->pdu_flags;
+
+    if (pci->pdu_type != PDU_T_DT || (pci->pdu_flags & PDU_F_ECN)) {
+        return;
+    }
+    pci->pdu_flags |= PDU_F_ECN;
+    if (priv->csum == RL_CSUM_INET) {
+        pci->pdu_csum =
+            pdu_csum_update(pci->pdu_csum, old_flags, pci->pdu_flags);
+    }
+    raw_cpu_ptr(ipcp->stats)->rmt.ecn_mark++;
+}
 
 /* To be called under DTP lock */
 static void
@@ -481,10 +1117,12 @@ dtp_snd_reset(struct flow_entry *flow)
     dtp->snd_lwe = dtp->snd_rwe = dtp->next_seq_num_to_use;
     dtp->last_seq_num_sent      = -1;
     dtp->last_ctrl_seq_num_rcvd = 0;
+    dtp->sack_rtx_next          = 0;
+    dtp->flags &= ~DTP_F_SACK_RECOVERY;
     if (dc->fc.fc_type == RLITE_FC_T_WIN) {
         dtp->snd_rwe += dc->fc.cfg.w.initial_credit;
-        dtp->cgwin = RL_CGWIN_MIN;
     }
+    dtp->cc->init(flow);
 }
 
 /* To be called under DTP lock */
@@ -505,30 +1143,24 @@ dtp_rcv_reset(struct flow_entry *flow)
         dtp->rcv_rwe += dc->fc.cfg.w.initial_credit;
     }
     dtp->last_lwe_sent      = 0;
+    dtp->last_rwe_sent      = dtp->rcv_rwe;
     dtp->last_seq_num_acked = 0;
+    dtp->rcvbuf_seq         = 0;
+    dtp->rcvbuf_stamp       = jiffies;
 }
 
 static void
-snd_inact_tmr_cb(
-#ifdef RL_HAVE_TIMER_SETUP
-    struct timer_list *tmr
-#else  /* !RL_HAVE_TIMER_SETUP */
-    long unsigned arg
-#endif /* !RL_HAVE_TIMER_SETUP */
-)
-{
-#ifdef RL_HAVE_TIMER_SETUP
-    struct flow_entry *flow = from_timer(flow, tmr, dtp.snd_inact_tmr);
-#else  /* !RL_HAVE_TIMER_SETUP */
-    struct flow_entry *flow = (struct flow_entry *)arg;
-#endif /* !RL_HAVE_TIMER_SETUP */
+snd_inact_tmr_cb(struct rl_wtimer *tmr)
+{
+    struct flow_entry *flow =
+        container_of(tmr, struct flow_entry, dtp.snd_inact_tmr);
     struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
     struct dtp *dtp             = &flow->dtp;
     struct rl_buf *rb, *tmp;
 
     spin_lock_bh(&dtp->lock);
 
-    del_timer(&dtp->rtx_tmr);
+    hrtimer_try_to_cancel(&dtp->rtx_tmr);
 
     dtp_dump(dtp);
 
@@ -566,22 +1198,12 @@ snd_inact_tmr_cb(
 }
 
 static void
-rcv_inact_tmr_cb(
-#ifdef RL_HAVE_TIMER_SETUP
-    struct timer_list *tmr
-#else  /* !RL_HAVE_TIMER_SETUP */
-    long unsigned arg
-#endif /* !RL_HAVE_TIMER_SETUP */
-)
-{
-#ifdef RL_HAVE_TIMER_SETUP
-    struct flow_entry *flow = from_timer(flow, tmr, dtp.rcv_inact_tmr);
-#else  /* !RL_HAVE_TIMER_SETUP */
-    struct flow_entry *flow = (struct flow_entry *)arg;
-#endif /* !RL_HAVE_TIMER_SETUP */
+rcv_inact_tmr_cb(struct rl_wtimer *tmr)
+{
+    struct flow_entry *flow =
+        container_of(tmr, struct flow_entry, dtp.rcv_inact_tmr);
     struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
     struct dtp *dtp             = &flow->dtp;
-    struct rl_buf *rb, *tmp;
 
     spin_lock_bh(&dtp->lock);
 
@@ -590,12 +1212,7 @@ rcv_inact_tmr_cb(
 
     /* Flush sequencing queue. */
     PD("dropping %u PDUs from seqq\n", dtp->seqq_len);
-    rb_list_foreach_safe (rb, tmp, &dtp->seqq) {
-        rb_list_del(rb);
-        rl_buf_free(rb);
-        stats->rx_err++;
-        dtp->seqq_len--;
-    }
+    stats->rx_err += dtp_seqq_flush(dtp);
 
     spin_unlock_bh(&dtp->lock);
 }
@@ -607,26 +1224,14 @@ static struct rl_buf *sdu_rx_sv_update(struct ipcp_entry *ipcp,
                                        struct flow_entry *flow,
                                        bool ack_immediate);
 
+/* Send the control PDU held back by the receiver. */
 static void
-a_tmr_cb(
-#ifdef RL_HAVE_TIMER_SETUP
-    struct timer_list *tmr
-#else  /* !RL_HAVE_TIMER_SETUP */
-    long unsigned arg
-#endif /* !RL_HAVE_TIMER_SETUP */
-)
-{
-#ifdef RL_HAVE_TIMER_SETUP
-    struct flow_entry *flow = from_timer(flow, tmr, dtp.a_tmr);
-#else  /* !RL_HAVE_TIMER_SETUP */
-    struct flow_entry *flow = (struct flow_entry *)arg;
-#endif /* !RL_HAVE_TIMER_SETUP */
+dtp_ack_flush(struct flow_entry *flow)
+{
     struct ipcp_entry *ipcp = flow->txrx.ipcp;
     struct dtp *dtp         = &flow->dtp;
     struct rl_buf *crb;
 
-    RPV(1, "A tmr callback\n");
-
     spin_lock_bh(&dtp->lock);
     crb = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/true);
     spin_unlock_bh(&dtp->lock);
@@ -636,42 +1241,66 @@ a_tmr_cb(
     }
 }
 
-/*
- * Compute the RTX timeout interval using the estimate of RTT mean
- * and standard deviation. However, we have to make sure that the
- * interval is bigger than the A timeout interval by a good margin, otherwise
- * the sender will incur into unnecessary retransmits.
- */
-static inline unsigned long
-rtt_to_rtx(struct flow_entry *flow)
+static void
+a_tmr_cb(struct rl_wtimer *tmr)
 {
-    struct dtp *dtp    = &flow->dtp;
-    unsigned long x    = dtp->rtt + (dtp->rtt_stddev << 1);
-    unsigned int two_a = flow->cfg.dtcp.initial_a << 1;
+    struct flow_entry *flow = container_of(tmr, struct flow_entry, dtp.a_tmr);
+
+    RPV(1, "A tmr callback\n");
+    dtp_ack_flush(flow);
+}
 
-    return x > (two_a) ? x : (two_a);
+static enum hrtimer_restart
+ack_tmr_cb(struct hrtimer *timer)
+{
+    struct dtp *dtp = container_of(timer, struct dtp, ack_tmr);
+
+    /* We are in hardirq context, defer the ACK. */
+    tasklet_schedule(&dtp->ack_tasklet);
+
+    return HRTIMER_NORESTART;
+}
+
+static void
+ack_tasklet(unsigned long arg)
+{
+    RPV(1, "ACK tmr callback\n");
+    dtp_ack_flush((struct flow_entry *)arg);
+}
+
+/* Slack granted to the retransmission timer, to let the kernel coalesce
+ * timer expirations. */
+#define RTX_TMR_SLACK_NSEC 20000
+
+static inline void
+rtx_tmr_start(struct dtp *dtp, s64 expires)
+{
+    hrtimer_start_range_ns(&dtp->rtx_tmr, ns_to_ktime(expires),
+                           RTX_TMR_SLACK_NSEC, HRTIMER_MODE_ABS);
+}
+
+static enum hrtimer_restart
+rtx_tmr_cb(struct hrtimer *timer)
+{
+    struct dtp *dtp = container_of(timer, struct dtp, rtx_tmr);
+
+    /* We are in hardirq context, defer the retransmissions. */
+    tasklet_schedule(&dtp->rtx_tasklet);
+
+    return HRTIMER_NORESTART;
 }
 
 static void
-rtx_tmr_cb(
-#ifdef RL_HAVE_TIMER_SETUP
-    struct timer_list *tmr
-#else  /* !RL_HAVE_TIMER_SETUP */
-    long unsigned arg
-#endif /* !RL_HAVE_TIMER_SETUP */
-)
-{
-#ifdef RL_HAVE_TIMER_SETUP
-    struct flow_entry *flow = from_timer(flow, tmr, dtp.rtx_tmr);
-#else  /* !RL_HAVE_TIMER_SETUP */
-    struct flow_entry *flow = (struct flow_entry *)arg;
-#endif /* !RL_HAVE_TIMER_SETUP */
+rtx_tasklet(unsigned long arg)
+{
+    struct flow_entry *flow     = (struct flow_entry *)arg;
     struct ipcp_entry *ipcp     = flow->txrx.ipcp;
     struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
     struct dtp *dtp             = &flow->dtp;
+    s64 now                     = ktime_get_ns();
     struct rl_buf *rb, *crb, *tmp;
-    long unsigned next_exp = ~0U;
-    bool next_exp_set      = false;
+    s64 next_exp      = 0;
+    bool next_exp_set = false;
     struct rb_list rrbq;
 
     rb_list_init(&rrbq);
@@ -681,18 +1310,18 @@ rtx_tmr_cb(
     /* Stop the sender inactivity timer, it will be restarted
      * at the end of the function, after the burst of
      * retransmissions. */
-    del_timer(&dtp->snd_inact_tmr);
+    rl_wtimer_del(&dtp->snd_inact_tmr);
 
     /* We scan all the elements in the retransmission list, since they are
      * sorted by ascending sequence number, and not by ascending expiration
      * time. */
     rb_list_foreach (rb, &dtp->rtxq) {
-        if (!time_before(jiffies, RL_BUF_RTX(rb).rtx_jiffies)) {
+        if (now >= RL_BUF_RTX(rb).t_rtx) {
             /* This rb should be retransmitted. We also invalidate
-             * RL_BUF_RTX(rb).jiffies, so that RTT is not updated on
+             * RL_BUF_RTX(rb).t_tx, so that RTT is not updated on
              * retransmitted packets. */
-            RL_BUF_RTX(rb).rtx_jiffies += rtt_to_rtx(flow);
-            RL_BUF_RTX(rb).jiffies = 0;
+            RL_BUF_RTX(rb).t_rtx = now + rtt_to_rtx(flow);
+            RL_BUF_RTX(rb).t_tx  = 0;
 
             crb = rl_buf_clone(rb, GFP_ATOMIC);
             if (unlikely(!crb)) {
@@ -703,24 +1332,20 @@ rtx_tmr_cb(
                 stats->rtx_byte += rb->len;
             }
         }
-        if (!next_exp_set ||
-            time_before(RL_BUF_RTX(rb).rtx_jiffies, next_exp)) {
-            next_exp     = RL_BUF_RTX(rb).rtx_jiffies;
+        if (!next_exp_set || RL_BUF_RTX(rb).t_rtx < next_exp) {
+            next_exp     = RL_BUF_RTX(rb).t_rtx;
             next_exp_set = true;
         }
     }
 
     if (!rb_list_empty(&rrbq)) {
-        /* Halve the congestion window on retransmission. */
-        dtp->cgwin >>= 1;
-        if (unlikely(dtp->cgwin < RL_CGWIN_MIN)) {
-            dtp->cgwin = RL_CGWIN_MIN;
-        }
+        dtp->cc->on_loss(flow, /*timeout=*/true);
+        cc_pacing_update(dtp);
     }
 
     if (next_exp_set) {
-        NPD("Forward rtx timer by %u\n", jiffies_to_msecs(next_exp - jiffies));
-        mod_timer(&dtp->rtx_tmr, next_exp);
+        NPD("Forward rtx timer by %lld ns\n", next_exp - now);
+        rtx_tmr_start(dtp, next_exp);
     }
 
     spin_unlock_bh(&dtp->lock);
@@ -735,26 +1360,165 @@ rtx_tmr_cb(
     }
 
     spin_lock_bh(&dtp->lock);
-    mod_timer(&dtp->snd_inact_tmr, jiffies + 3 * dtp->mpl_r_a);
+    rl_wtimer_mod(&dtp->snd_inact_tmr, jiffies + 3 * dtp->mpl_r_a);
     spin_unlock_bh(&dtp->lock);
 }
 
 static int rl_normal_sdu_rx_consumed(struct flow_entry *flow, rlm_seq_t seqnum,
                                      bool maysleep);
 
-#define TKBK_INTVAL_MSEC 2
+/* Slack granted to the pacing timer, so that the kernel can coalesce
+ * timer expirations. The shaper can also run up to this amount of time
+ * behind its schedule without losing rate. */
+#define TKBK_SLACK_NSEC 200000
+/* Writers are blocked when the pacing queue holds more than this amount
+ * of transmission time. */
+#define TKBK_HORIZON_NSEC 20000000
+
+/* Time needed to transmit 'len' bytes at the shaper rate. */
+static inline s64
+tkbk_tx_time(const struct tkbk *tk, unsigned int len)
+{
+    return div64_u64((uint64_t)len * 8 * NSEC_PER_SEC, tk->rate);
+}
+
+static inline bool
+tkbk_full(const struct tkbk *tk)
+{
+    return tk->qlen && tk->t_next - (s64)ktime_get_ns() > TKBK_HORIZON_NSEC;
+}
+
+static inline void
+tkbk_timer_start(struct tkbk *tk, s64 expires)
+{
+    hrtimer_start_range_ns(&tk->timer, ns_to_ktime(expires), TKBK_SLACK_NSEC,
+                           HRTIMER_MODE_ABS);
+}
+
+/* Assign a departure time to a PDU. Returns true if the PDU has been
+ * queued (ownership passed), false if it can be transmitted immediately.
+ * Must be called under the DTP lock. */
+static bool
+tkbk_pace(struct dtp *dtp, struct rl_buf *rb)
+{
+    struct tkbk *tk = &dtp->tkbk;
+    s64 now         = ktime_get_ns();
+    s64 t_tx;
+
+    if (tk->qlen == 0 && tk->t_next < now - tk->burst_ns) {
+        /* The flow has been idle. Don't let it accumulate more credit
+         * than the burst allowance. */
+        tk->t_next = now - tk->burst_ns;
+    }
+    t_tx = tk->t_next;
+    tk->t_next += tkbk_tx_time(tk, rb->len);
+    tk->pkts++;
+
+    if (tk->qlen == 0 && t_tx <= now) {
+        return false;
+    }
+
+    RL_BUF_PACE(rb).t_enq = now;
+    RL_BUF_PACE(rb).t_tx  = t_tx;
+    rb_list_enq(rb, &tk->q);
+    if (tk->qlen++ == 0) {
+        tkbk_timer_start(tk, t_tx);
+    }
+
+    return true;
+}
+
+static enum hrtimer_restart
+tkbk_timer_cb(struct hrtimer *timer)
+{
+    struct tkbk *tk = container_of(timer, struct tkbk, timer);
+
+    /* We are in hardirq context, defer the transmission. */
+    tasklet_schedule(&tk->tasklet);
+
+    return HRTIMER_NORESTART;
+}
+
+/* Release the PDUs of the pacing queue that are due. */
+static void
+tkbk_tasklet(unsigned long arg)
+{
+    struct flow_entry *flow     = (struct flow_entry *)arg;
+    struct ipcp_entry *ipcp     = flow->txrx.ipcp;
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+    struct dtp *dtp             = &flow->dtp;
+    struct tkbk *tk             = &dtp->tkbk;
+    s64 now                     = ktime_get_ns();
+    bool restart                = false;
+    struct rl_buf *rb, *tmp;
+    struct rb_list rbs;
+
+    rb_list_init(&rbs);
+
+    spin_lock_bh(&dtp->lock);
+    rb_list_foreach_safe (rb, tmp, &tk->q) {
+        uint64_t delay;
+
+        if (RL_BUF_PACE(rb).t_tx > now) {
+            tkbk_timer_start(tk, RL_BUF_PACE(rb).t_tx);
+            break;
+        }
+        rb_list_del(rb);
+        tk->qlen--;
+        rb_list_enq(rb, &rbs);
+
+        delay = now - RL_BUF_PACE(rb).t_enq;
+        tk->delay_sum_ns += delay;
+        if (delay > tk->delay_max_ns) {
+            tk->delay_max_ns = delay;
+        }
+    }
+    if (tk->blocked && !tkbk_full(tk)) {
+        tk->blocked = false;
+        restart     = true;
+    }
+    spin_unlock_bh(&dtp->lock);
+
+    rb_list_foreach_safe (rb, tmp, &rbs) {
+        unsigned int len = rb->len;
+
+        rb_list_del(rb);
+        rmt_tx(ipcp, flow->remote_addr, rb, RL_RMT_F_CONSUME);
+        stats->tx_pkt++;
+        stats->tx_byte += len;
+    }
+
+    if (restart) {
+        rl_write_restart_flow(flow);
+    }
+}
 
 static int
 rl_normal_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
 {
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
     struct dtp *dtp        = &flow->dtp;
     struct dtcp_config *dc = &flow->cfg.dtcp;
     unsigned long mpl      = 0;
     unsigned long r;
 
+    dtp->cc = priv->cc;
+    if (flow->cfg.cc_algo[0] != '\0') {
+        dtp->cc = rl_cc_lookup(flow->cfg.cc_algo);
+        if (!dtp->cc) {
+            PE("Unknown congestion control algorithm '%.*s'\n",
+               RL_CC_NAME_MAX, flow->cfg.cc_algo);
+            return -EINVAL;
+        }
+    }
+
     dtp_snd_reset(flow);
     dtp_rcv_reset(flow);
 
+    if (dtp_seqq_init(dtp, flow->cfg.seqq_max_len)) {
+        return -ENOMEM;
+    }
+
     if (ipcp->dif) {
         mpl = msecs_to_jiffies(ipcp->dif->max_pdu_life);
     }
@@ -790,21 +1554,33 @@ rl_normal_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
     dtp->mpl_r_a = mpl + r + msecs_to_jiffies(flow->cfg.dtcp.initial_a);
     PV("MPL+R+A = %u ms\n", jiffies_to_msecs(dtp->mpl_r_a));
 
-#ifdef RL_HAVE_TIMER_SETUP
-    timer_setup(&dtp->snd_inact_tmr, snd_inact_tmr_cb, 0);
-    timer_setup(&dtp->rcv_inact_tmr, rcv_inact_tmr_cb, 0);
-    timer_setup(&dtp->rtx_tmr, rtx_tmr_cb, 0);
-    timer_setup(&dtp->a_tmr, a_tmr_cb, 0);
-#else  /* !RL_HAVE_TIMER_SETUP */
-    setup_timer(&dtp->snd_inact_tmr, snd_inact_tmr_cb, (unsigned long)flow);
-    setup_timer(&dtp->rcv_inact_tmr, rcv_inact_tmr_cb, (unsigned long)flow);
-    setup_timer(&dtp->rtx_tmr, rtx_tmr_cb, (unsigned long)flow);
-    setup_timer(&dtp->a_tmr, a_tmr_cb, (unsigned long)flow);
-#endif /* !RL_HAVE_TIMER_SETUP */
+    rl_wtimer_setup(&dtp->snd_inact_tmr, &priv->wheel, snd_inact_tmr_cb);
+    rl_wtimer_setup(&dtp->rcv_inact_tmr, &priv->wheel, rcv_inact_tmr_cb);
+    rl_wtimer_setup(&dtp->a_tmr, &priv->wheel, a_tmr_cb);
+#ifdef RL_HAVE_HRTIMER_SETUP
+    hrtimer_setup(&dtp->rtx_tmr, rtx_tmr_cb, CLOCK_MONOTONIC,
+                  HRTIMER_MODE_ABS);
+#else  /* !RL_HAVE_HRTIMER_SETUP */
+    hrtimer_init(&dtp->rtx_tmr, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    dtp->rtx_tmr.function = rtx_tmr_cb;
+#endif /* !RL_HAVE_HRTIMER_SETUP */
+    tasklet_init(&dtp->rtx_tasklet, rtx_tasklet, (unsigned long)flow);
+#ifdef RL_HAVE_HRTIMER_SETUP
+    hrtimer_setup(&dtp->ack_tmr, ack_tmr_cb, CLOCK_MONOTONIC,
+                  HRTIMER_MODE_ABS);
+#else  /* !RL_HAVE_HRTIMER_SETUP */
+    hrtimer_init(&dtp->ack_tmr, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    dtp->ack_tmr.function = ack_tmr_cb;
+#endif /* !RL_HAVE_HRTIMER_SETUP */
+    tasklet_init(&dtp->ack_tasklet, ack_tasklet, (unsigned long)flow);
     dtp->flags |= DTP_F_TIMERS_INITIALIZED;
 
-    dtp->rtt        = msecs_to_jiffies(flow->cfg.dtcp.rtx.initial_rtx_timeout);
-    dtp->rtt_stddev = 1;
+    /* Until the first RTT sample is taken, the RTO is the initial
+     * retransmission timeout. */
+    dtp->rtt =
+        (uint64_t)flow->cfg.dtcp.rtx.initial_rtx_timeout * NSEC_PER_MSEC;
+    dtp->rtt_stddev = 0;
+    dtp->rto_min    = (uint64_t)priv->rto_min_us * NSEC_PER_USEC;
 
     if (dc->fc.fc_type == RLITE_FC_T_WIN) {
         dtp->max_cwq_len = dc->fc.cfg.w.max_cwq_len;
@@ -815,76 +1591,125 @@ rl_normal_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
     }
 
     if (flow->cfg.dtcp.bandwidth) {
-        /* With the following definitions:
-         *      R := requested bandwidth in bps
-         *      M := token bucket timer period in milliseconds
-         *      B := refill amount in bytes for each timer period
-         * the following holds
-         *      B = R * M / 8000
-         * If the bandwidth is large enough, we can choose M = TKBK_INTVAL_MSEC
-         * and will be B >= 250. If B is not large enough, we choose a larger
-         * M, in such a way that B is still 250.
-         */
-        if (flow->cfg.dtcp.bandwidth < 4000) {
-            /* We don't accept to provide less than 4 Kbps, so that intval_ms
-             * can be always <= 500 milliseconds. */
-            flow->cfg.dtcp.bandwidth = 4000;
-        }
-        if (flow->cfg.dtcp.bandwidth < (2000000 / TKBK_INTVAL_MSEC)) {
-            dtp->tkbk.intval_ms = (2000000) / flow->cfg.dtcp.bandwidth;
-        } else {
-            dtp->tkbk.intval_ms = TKBK_INTVAL_MSEC;
-        }
-        dtp->tkbk.bucket_size =
-            (flow->cfg.dtcp.bandwidth * dtp->tkbk.intval_ms) / 8000;
-        dtp->tkbk.t_last_refill = ktime_get();
+        struct tkbk *tk = &dtp->tkbk;
+
+        tk->rate     = flow->cfg.dtcp.bandwidth;
+        tk->burst_ns = max_t(s64, tkbk_tx_time(tk, flow->cfg.dtcp.burst),
+                             TKBK_SLACK_NSEC);
+        tk->t_next   = ktime_get_ns();
+        rb_list_init(&tk->q);
+#ifdef RL_HAVE_HRTIMER_SETUP
+        hrtimer_setup(&tk->timer, tkbk_timer_cb, CLOCK_MONOTONIC,
+                      HRTIMER_MODE_ABS);
+#else  /* !RL_HAVE_HRTIMER_SETUP */
+        hrtimer_init(&tk->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+        tk->timer.function = tkbk_timer_cb;
+#endif /* !RL_HAVE_HRTIMER_SETUP */
+        tasklet_init(&tk->tasklet, tkbk_tasklet, (unsigned long)flow);
+        dtp->flags |= DTP_F_PACING;
+    }
+
+    if (!DTCP_PRESENT(flow->cfg.dtcp) && !(dtp->flags & DTP_F_PACING)) {
+        /* No sender state to protect apart from the sequence number,
+         * rl_normal_sdu_write() can avoid the DTP lock. */
+        dtp->flags |= DTP_F_LOCKLESS;
     }
 
     return 0;
 }
 
-/* Internet checksum computation is endianness independent, so it can be
- * peformed in host order. The caller is expected to store the result in
- * host order. */
+#define CSUM_BENCH_LEN 1400
+#define CSUM_BENCH_ITER 20000
+
+/* Reference implementation of the Internet checksum, summing 16 bits at
+ * a time. Only used by the checksum benchmark, as a baseline. */
 static uint32_t
-inet_csum(const void *data, uint16_t len, uint32_t sum /* host endianness */)
+inet_csum_ref(const void *data, uint16_t len, uint32_t sum)
 {
     const uint8_t *addr = data;
     uint32_t i;
-#if 0
-    char *sbuf = kmalloc(len * 2 + 10, GFP_ATOMIC);
-    for (i = 0; i < len; i++) {
-        sprintf(sbuf + 2 * i, "%02x", addr[i]);
-    }
-    printk("pkt: %s\n", sbuf);
-    kfree(sbuf);
-#endif
 
-    /* Checksum all the pairs of bytes first... */
     for (i = 0; i < (len & ~1U); i += 2) {
-        sum += (u_int16_t)(*((u_int16_t *)(addr + i)));
+        sum += *((uint16_t *)(addr + i));
         if (sum > 0xFFFF)
             sum -= 0xFFFF;
     }
-    /*
-     * If there's a single byte left over, checksum it, too.
-     * Network byte order is big-endian, but we need to interpret
-     * it in host order.
-     */
     if (i < len) {
         sum += ntohs(addr[i] << 8);
         if (sum > 0xFFFF)
             sum -= 0xFFFF;
     }
 
-    return sum;
+    return ~sum & 0xFFFF;
 }
 
-static inline uint16_t
-inet_wrapsum(uint32_t sum)
+/* Run all the checksum variants on a PDU, reporting the average time
+ * spent on each PDU in nanoseconds. */
+static void
+pdu_csum_bench(char *buf, int buflen)
+{
+    unsigned long ns[4];
+    struct rina_pci *pci;
+    uint8_t *pdu;
+    uint32_t sink = 0;
+    int v, i;
+
+    pdu = rl_alloc(CSUM_BENCH_LEN, GFP_KERNEL, RL_MT_MISC);
+    if (!pdu) {
+        snprintf(buf, buflen, "out of memory");
+        return;
+    }
+    get_random_bytes(pdu, CSUM_BENCH_LEN);
+    pci = (struct rina_pci *)pdu;
+
+    for (v = 0; v < ARRAY_SIZE(ns); v++) {
+        s64 t = ktime_get_ns();
+
+        for (i = 0; i < CSUM_BENCH_ITER; i++) {
+            switch (v) {
+            case 0:
+                sink += inet_csum_ref(pdu, CSUM_BENCH_LEN, 0);
+                break;
+            case 1:
+                sink += pdu_csum_inet(pdu, CSUM_BENCH_LEN);
+                break;
+            case 2:
+                pci->pdu_csum = pdu_csum_update(pci->pdu_csum, pci->pdu_ttl,
+                                                pci->pdu_ttl - 1);
+                pci->pdu_ttl--;
+                break;
+            case 3:
+                sink += pdu_csum_crc32c(pci, CSUM_BENCH_LEN);
+                break;
+            }
+            OPTIMIZER_HIDE_VAR(sink);
+        }
+        ns[v] = (unsigned long)div_u64((ktime_get_ns() - t) * 100,
+                                       CSUM_BENCH_ITER);
+    }
+    rl_free(pdu, RL_MT_MISC);
+
+    snprintf(buf, buflen,
+             "ref=%lu.%02lu inet=%lu.%02lu incr=%lu.%02lu crc32c=%lu.%02lu",
+             ns[0] / 100, ns[0] % 100, ns[1] / 100, ns[1] % 100, ns[2] / 100,
+             ns[2] % 100, ns[3] / 100, ns[3] % 100);
+}
+
+/* Class of a PDU, for the per-class RMT statistics. */
+static inline unsigned int
+rmt_class(struct rl_buf *rb)
+{
+    return min_t(unsigned int, RL_BUF_PCI(rb)->qos_id,
+                 RL_RMT_STATS_CLASSES - 1);
+}
+
+/* Account for a PDU leaving the PDU scheduler. */
+static inline void
+rmt_class_deq(struct ipcp_entry *ipcp, struct rl_buf *rb)
 {
-    sum = ~sum & 0xFFFF;
-    return sum; /* host endianness */
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+
+    stats->rmt.class_backlog[rmt_class(rb)] -= rl_buf_truesize(rb);
 }
 
 static int
@@ -910,9 +1735,11 @@ rmt_tx_to_lower(struct ipcp_entry *ipcp, struct flow_entry *lower_flow,
                                         flags & (~RL_RMT_F_CONSUME));
 
         if (ret == -EAGAIN) {
-            /* The lower IPCP cannot transmit it for the time being. If we
+            /* The lower IPCP cannot transmit it for the time being. Tell
+             * the sender that its PDU experienced congestion. If we
              * can, we sleep waiting for the IPCP to become available
              * again. */
+            rmt_ecn_mark(ipcp, rb);
             if (maysleep) {
                 if (signal_pending(current)) {
                     rl_buf_free(rb);
@@ -928,6 +1755,7 @@ rmt_tx_to_lower(struct ipcp_entry *ipcp, struct flow_entry *lower_flow,
             if (flags & RL_RMT_F_CONSUME) {
                 struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
                 stats->rmt.queue_drop++;
+                stats->rmt.class_drop[rmt_class(rb)]++;
                 rl_buf_free(rb);
                 rb = NULL;
                 /* The rb was managed somehow (dropped), so we must reset the
@@ -953,6 +1781,27 @@ rmt_tx_to_lower(struct ipcp_entry *ipcp, struct flow_entry *lower_flow,
     return ret;
 }
 
+static inline void
+rl_sched_kick(struct rl_sched_sq *sq)
+{
+    int cpu = sq->cpu;
+
+    if (cpu != WORK_CPU_UNBOUND && !cpu_online(cpu)) {
+        cpu = WORK_CPU_UNBOUND;
+    }
+    queue_work_on(cpu, system_wq, &sq->deq_work);
+}
+
+/* Hash used to select among equal-cost next hops. All the PDUs of a
+ * connection hash to the same value, so that they follow the same path
+ * and are not reordered by the RMT. */
+static inline uint32_t
+pdu_path_hash(const struct rina_pci *pci)
+{
+    return jhash_3words((uint32_t)pci->src_addr, (uint32_t)pci->dst_addr,
+                        ((uint32_t)pci->src_cep << 16) ^ pci->dst_cep, 0);
+}
+
 static int
 rmt_tx(struct ipcp_entry *ipcp, rl_addr_t remote_addr, struct rl_buf *rb,
        unsigned flags)
@@ -962,7 +1811,8 @@ rmt_tx(struct ipcp_entry *ipcp, rl_addr_t remote_addr, struct rl_buf *rb,
     struct rl_sched *sched;
     int ret = 0;
 
-    lower_flow = rl_pduft_lookup(priv, remote_addr);
+    lower_flow =
+        rl_pduft_lookup(priv, remote_addr, pdu_path_hash(RL_BUF_PCI(rb)));
     if (unlikely(!lower_flow && remote_addr != ipcp->addr)) {
         struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
 
@@ -995,8 +1845,17 @@ rmt_tx(struct ipcp_entry *ipcp, rl_addr_t remote_addr, struct rl_buf *rb,
         /* PDU scheduler path. */
         struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
         bool maysleep               = flags & RL_RMT_F_MAYSLEEP;
+        unsigned int idx            = 0;
+        unsigned int cls            = rmt_class(rb);
+        unsigned int truesize       = rl_buf_truesize(rb);
+        struct rl_sched_sq *sq;
         DECLARE_WAITQUEUE(wait, current);
 
+        /* Multi-queue schedulers pick the sub-queue for this PDU. */
+        if (sched->ops.select) {
+            idx = sched->ops.select(sched, rb);
+        }
+        sq                        = sched->sq + idx;
         RL_BUF_RMT(rb).lower_flow = lower_flow;
 
         if (!maysleep) {
@@ -1005,18 +1864,23 @@ rmt_tx(struct ipcp_entry *ipcp, rl_addr_t remote_addr, struct rl_buf *rb,
 
             rb_list_init(&drbs);
 
-            spin_lock_bh(&sched->qlock);
-            while (sched->ops.enq(sched, rb)) {
+            spin_lock_bh(&sq->qlock);
+            while (sched->ops.enq(sched, idx, rb)) {
                 /* The queue backlog is becoming too large.
                  * Since we cannot sleep, we help the dequeuer to do its
                  * job, rather than dropping. */
-                struct rl_buf *drb = sched->ops.deq(sched);
+                struct rl_buf *drb = sched->ops.deq(sched, idx);
+
+                rmt_ecn_mark(ipcp, rb);
 
                 BUG_ON(!drb);
+                rmt_class_deq(ipcp, drb);
                 rb_list_enq(drb, &drbs);
             }
             stats->rmt.queued_pkt++;
-            spin_unlock_bh(&sched->qlock);
+            stats->rmt.class_enq[cls]++;
+            stats->rmt.class_backlog[cls] += truesize;
+            spin_unlock_bh(&sq->qlock);
             rb = NULL;
 
             /* We cannot backpressure here, so we need to force consumption. */
@@ -1033,16 +1897,20 @@ rmt_tx(struct ipcp_entry *ipcp, rl_addr_t remote_addr, struct rl_buf *rb,
                 int err;
 
                 current->state = TASK_INTERRUPTIBLE;
-                spin_lock_bh(&sched->qlock);
-                err = sched->ops.enq(sched, rb);
-                spin_unlock_bh(&sched->qlock);
+                spin_lock_bh(&sq->qlock);
+                err = sched->ops.enq(sched, idx, rb);
+                spin_unlock_bh(&sq->qlock);
                 if (err == 0) {
                     /* PDU enqueued to the scheduler. */
                     stats->rmt.queued_pkt++;
+                    stats->rmt.class_enq[cls]++;
+                    stats->rmt.class_backlog[cls] += truesize;
                     break;
                 }
+                rmt_ecn_mark(ipcp, rb);
 
                 if (signal_pending(current)) {
+                    stats->rmt.class_drop[cls]++;
                     rl_buf_free(rb);
                     ret = -EINTR; /* -ERESTARTSYS */
                     break;
@@ -1057,7 +1925,7 @@ rmt_tx(struct ipcp_entry *ipcp, rl_addr_t remote_addr, struct rl_buf *rb,
         }
 
         /* Kick the dequeuer, since we (most likely) enqueued a new PDU. */
-        schedule_work(&priv->sched_deq_work);
+        rl_sched_kick(sq);
     }
 
     return ret;
@@ -1066,14 +1934,10 @@ rmt_tx(struct ipcp_entry *ipcp, rl_addr_t remote_addr, struct rl_buf *rb,
 static void
 sched_deq_worker(struct work_struct *w)
 {
-    struct rl_normal *priv = container_of(w, struct rl_normal, sched_deq_work);
-    struct rl_sched *sched = priv->sched;
+    struct rl_sched_sq *sq = container_of(w, struct rl_sched_sq, deq_work);
+    struct rl_sched *sched = sq->sched;
     struct rb_list ready;
 
-    if (unlikely(!sched)) {
-        return;
-    }
-
     rb_list_init(&ready);
 
     for (;;) {
@@ -1081,15 +1945,16 @@ sched_deq_worker(struct work_struct *w)
         int i;
 
         /* Dequeue a batch of PDUs. */
-        spin_lock_bh(&sched->qlock);
+        spin_lock_bh(&sq->qlock);
         for (i = 0; i < 8; i++) {
-            rb = sched->ops.deq(sched);
+            rb = sched->ops.deq(sched, sq->idx);
             if (!rb) {
                 break;
             }
+            rmt_class_deq(sched->ipcp, rb);
             rb_list_enq(rb, &ready);
         }
-        spin_unlock_bh(&sched->qlock);
+        spin_unlock_bh(&sq->qlock);
 
         if (rb_list_empty(&ready)) {
             /* No more PDUs to dequeue, we can stop. */
@@ -1100,7 +1965,7 @@ sched_deq_worker(struct work_struct *w)
         rb_list_foreach_safe (rb, tmp, &ready) {
             rb_list_del(rb);
             BUG_ON(!RL_BUF_RMT(rb).lower_flow);
-            rmt_tx_to_lower(priv->ipcp, RL_BUF_RMT(rb).lower_flow, rb,
+            rmt_tx_to_lower(sched->ipcp, RL_BUF_RMT(rb).lower_flow, rb,
                             RL_RMT_F_MAYSLEEP | RL_RMT_F_CONSUME);
         }
 
@@ -1113,6 +1978,33 @@ sched_deq_worker(struct work_struct *w)
     }
 }
 
+static void
+rl_sched_free(struct rl_sched *sched)
+{
+    unsigned int i;
+
+    if (sched->sq) {
+        for (i = 0; i < sched->num_sq; i++) {
+            struct rl_buf *rb;
+
+            cancel_work_sync(&sched->sq[i].deq_work);
+            /* Drop the PDUs still queued, keeping the backlog
+             * statistics consistent. */
+            while ((rb = sched->ops.deq(sched, i)) != NULL) {
+                rmt_class_deq(sched->ipcp, rb);
+                rl_buf_free(rb);
+            }
+        }
+    }
+    if (sched->ops.fini) {
+        sched->ops.fini(sched);
+    }
+    if (sched->sq) {
+        rl_free(sched->sq, RL_MT_SHIM);
+    }
+    rl_free(sched, RL_MT_SHIM);
+}
+
 /* Replace the current PDU scheduler with a new one ('ops'), which
  * can be NULL if we want to remove the scheduler.
  * TODO Eventually we would like to support run-time replacement,
@@ -1152,6 +2044,9 @@ rl_sched_replace(struct rl_normal *priv, const char *sched_name)
     }
 
     if (ops) {
+        int cpu = cpumask_first(cpu_online_mask);
+        unsigned int i;
+
         sched = rl_alloc(sizeof(*sched) + ops->priv_size,
                          GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
         if (!sched) {
@@ -1160,22 +2055,44 @@ rl_sched_replace(struct rl_normal *priv, const char *sched_name)
 
         sched->ops = *ops;
         INIT_LIST_HEAD(&sched->ops.node);
+        sched->ipcp   = priv->ipcp;
+        sched->num_sq = ops->select ? num_online_cpus() : 1;
+        sched->sq     = rl_alloc(sched->num_sq * sizeof(sched->sq[0]),
+                             GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
+        if (!sched->sq) {
+            rl_free(sched, RL_MT_SHIM);
+            return -1;
+        }
+
+        /* Bind the dequeue worker of each sub-queue to a different
+         * online CPU. */
+        for (i = 0; i < sched->num_sq; i++) {
+            struct rl_sched_sq *sq = sched->sq + i;
+
+            spin_lock_init(&sq->qlock);
+            INIT_WORK(&sq->deq_work, sched_deq_worker);
+            sq->sched = sched;
+            sq->idx   = i;
+            sq->cpu   = WORK_CPU_UNBOUND;
+            if (ops->select && cpu < nr_cpu_ids) {
+                sq->cpu = cpu;
+                cpu     = cpumask_next(cpu, cpu_online_mask);
+            }
+        }
+
         if (sched->ops.init(sched)) {
+            rl_free(sched->sq, RL_MT_SHIM);
             rl_free(sched, RL_MT_SHIM);
             return -1;
         }
 
-        spin_lock_init(&sched->qlock);
         init_waitqueue_head(&sched->wqh);
     }
 
     priv->sched = sched;
 
     if (old) {
-        if (old->ops.fini) {
-            old->ops.fini(old);
-        }
-        rl_free(old, RL_MT_SHIM);
+        rl_sched_free(old);
     }
 
     return 0;
@@ -1194,17 +2111,19 @@ rl_rtxq_push(struct flow_entry *flow, struct rl_buf *rb)
     }
 
     /* Record the rtx expiration time and current time. */
-    RL_BUF_RTX(crb).jiffies     = jiffies;
-    RL_BUF_RTX(crb).rtx_jiffies = RL_BUF_RTX(crb).jiffies + rtt_to_rtx(flow);
+    RL_BUF_RTX(crb).t_tx  = ktime_get_ns();
+    RL_BUF_RTX(crb).t_rtx = RL_BUF_RTX(crb).t_tx + rtt_to_rtx(flow);
 
     /* Add to the rtx queue and start the rtx timer if not already
      * started. */
     rb_list_enq(crb, &dtp->rtxq);
     dtp->rtxq_len++;
-    if (!timer_pending(&dtp->rtx_tmr)) {
-        NPD("Forward rtx timer by %u\n",
-            jiffies_to_msecs(RL_BUF_RTX(crb).rtx_jiffies - jiffies));
-        mod_timer(&dtp->rtx_tmr, RL_BUF_RTX(crb).rtx_jiffies);
+    /* Track the average PDU length, for the pacing rate. */
+    dtp->pdu_len_avg = dtp->pdu_len_avg
+                           ? (dtp->pdu_len_avg * 7 + crb->len) >> 3
+                           : crb->len;
+    if (!hrtimer_is_queued(&dtp->rtx_tmr)) {
+        rtx_tmr_start(dtp, RL_BUF_RTX(crb).t_rtx);
     }
     NPD("cloning [%lu] into rtxq\n", (long unsigned)RL_BUF_PCI(crb)->seqnum);
 
@@ -1219,7 +2138,8 @@ flow_blocked(struct rl_flow_config *cfg, struct dtp *dtp)
             dtp->cwq_len >= dtp->max_cwq_len) ||
            ((cfg->dtcp.flags & DTCP_CFG_RTX_CTRL) &&
             ((dtp->next_seq_num_to_use - dtp->snd_lwe) > dtp->cgwin ||
-             dtp->rtxq_len >= dtp->max_rtxq_len));
+             dtp->rtxq_len >= dtp->max_rtxq_len)) ||
+           ((dtp->flags & DTP_F_PACING) && tkbk_full(&dtp->tkbk));
 }
 
 static bool
@@ -1228,6 +2148,61 @@ rl_normal_flow_writeable(struct flow_entry *flow)
     return !flow_blocked(&flow->cfg, &flow->dtp);
 }
 
+/* Transmit path for flows without flow control, retransmission control
+ * and shaping. The sequence number is the only sender state, and it is
+ * allocated atomically, so that concurrent writers do not serialize on
+ * the DTP lock. */
+static int
+rl_normal_sdu_write_lockless(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                             struct rl_buf *rb, unsigned flags)
+{
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+    struct rl_normal *priv      = (struct rl_normal *)ipcp->priv;
+    struct dtp *dtp             = &flow->dtp;
+    struct rina_pci *pci;
+    rlm_seq_t seqnum;
+    unsigned len;
+    int ret;
+
+    if (unlikely(rl_buf_pci_push(rb))) {
+        PE("pci_push() failed\n");
+        stats->tx_err++;
+        rl_buf_free(rb);
+
+        return -ENOSPC;
+    }
+
+    pci            = RL_BUF_PCI(rb);
+    pci->dst_addr  = flow->remote_addr;
+    pci->src_addr  = ipcp->addr;
+    pci->qos_id    = flow->qos_id;
+    pci->dst_cep   = flow->remote_cep;
+    pci->src_cep   = flow->local_cep;
+    pci->pdu_type  = PDU_T_DT;
+    pci->pdu_flags = 0;
+    pci->pdu_len = len = rb->len;
+    pci->pdu_ttl       = priv->ttl;
+    pci->pdu_csum      = 0;
+    seqnum             = atomic64_inc_return(&dtp->next_seq_num_atomic) - 1;
+    pci->seqnum        = seqnum;
+
+    if (unlikely(seqnum == 0)) {
+        /* The sender state of these flows is never reset, so the DRF
+         * is only needed on the first PDU. */
+        pci->pdu_flags |= PDU_F_DRF;
+    }
+
+    pdu_csum_set(priv, pci, len);
+
+    ret = rmt_tx(ipcp, flow->remote_addr, rb, flags);
+    if (likely(ret != -EAGAIN)) {
+        stats->tx_pkt++;
+        stats->tx_byte += len;
+    }
+
+    return ret;
+}
+
 static int
 rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
                     struct rl_buf *rb, unsigned flags)
@@ -1241,46 +2216,24 @@ rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
     unsigned len;
     int ret;
 
-    spin_lock_bh(&dtp->lock);
-
-    /* Token bucket traffic shaping. */
-    if (flow->cfg.dtcp.bandwidth) {
-        len = rb->len;
-        while (dtp->tkbk.bucket_size < len) {
-            ktime_t now;
-            unsigned long us;
-
-            if (!(flags & RL_RMT_F_MAYSLEEP)) {
-                spin_unlock_bh(&dtp->lock);
-                return -EAGAIN;
-            }
-
-            /* We are going to sleep, stop the inactivity timer
-             * (see below). */
-            del_timer(&dtp->snd_inact_tmr);
-
-            spin_unlock_bh(&dtp->lock);
-            msleep(dtp->tkbk.intval_ms);
-            spin_lock_bh(&dtp->lock);
-
-            now = ktime_get();
-            us  = ktime_to_us(ktime_sub(now, dtp->tkbk.t_last_refill));
-            if (dtp->tkbk.bucket_size < len &&
-                us >= dtp->tkbk.intval_ms * 1000) {
-                dtp->tkbk.bucket_size +=
-                    ((flow->cfg.dtcp.bandwidth / 8) * us) / 1000000;
-                dtp->tkbk.t_last_refill = now;
-            }
-        }
-        dtp->tkbk.bucket_size -= len;
+    if (dtp->flags & DTP_F_LOCKLESS) {
+        return rl_normal_sdu_write_lockless(ipcp, flow, rb, flags);
     }
 
+    spin_lock_bh(&dtp->lock);
+
     if (unlikely(flow_blocked(&flow->cfg, dtp))) {
         /* POL: FlowControlOverrun */
 
         /* Stop the sender inactivity timer. It will be
          * started again when we will be invoked again. */
-        del_timer(&dtp->snd_inact_tmr);
+        rl_wtimer_del(&dtp->snd_inact_tmr);
+
+        if (dtp->flags & DTP_F_PACING) {
+            /* Ask the shaper to wake us up when the pacing queue
+             * drains. */
+            dtp->tkbk.blocked = true;
+        }
 
         spin_unlock_bh(&dtp->lock);
 
@@ -1316,9 +2269,7 @@ rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
         pci->pdu_flags |= PDU_F_DRF;
     }
 
-    if (priv->csum) {
-        pci->pdu_csum = inet_wrapsum(inet_csum(pci, len, 0));
-    }
+    pdu_csum_set(priv, pci, len);
 
     if (!dtcp_present) {
         /* DTCP not present */
@@ -1369,7 +2320,15 @@ rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
             flags |= RL_RMT_F_CONSUME;
         }
 
-        mod_timer(&dtp->snd_inact_tmr, jiffies + 3 * dtp->mpl_r_a);
+        rl_wtimer_mod(&dtp->snd_inact_tmr, jiffies + 3 * dtp->mpl_r_a);
+    }
+
+    /* Token bucket traffic shaping. The PDU may be delayed by the shaper,
+     * but it is never refused. */
+    if ((dtp->flags & DTP_F_PACING) && tkbk_pace(dtp, rb)) {
+        spin_unlock_bh(&dtp->lock);
+
+        return 0; /* Ownership passed. */
     }
 
     spin_unlock_bh(&dtp->lock);
@@ -1397,7 +2356,7 @@ rl_normal_mgmt_sdu_build(struct ipcp_entry *ipcp,
     rl_addr_t dst_addr = RL_ADDR_NULL; /* Not valid. */
 
     if (mhdr->type == RLITE_MGMT_HDR_T_OUT_DST_ADDR) {
-        *lower_flow = rl_pduft_lookup(priv, mhdr->remote_addr);
+        *lower_flow = rl_pduft_lookup(priv, mhdr->remote_addr, 0);
         if (unlikely(!(*lower_flow))) {
             RPD(1, "No route to IPCP %lu, dropping packet\n",
                 (long unsigned)mhdr->remote_addr);
@@ -1445,9 +2404,7 @@ rl_normal_mgmt_sdu_build(struct ipcp_entry *ipcp,
     pci->pdu_csum  = 0;
     pci->seqnum    = 0; /* Not valid. */
 
-    if (priv->csum) {
-        pci->pdu_csum = inet_wrapsum(inet_csum(pci, rb->len, 0));
-    }
+    pdu_csum_set(priv, pci, rb->len);
 
     /* Caller can proceed and send the mgmt PDU. */
     return 0;
@@ -1467,19 +2424,34 @@ rl_normal_config(struct ipcp_entry *ipcp, const char *param_name,
         ret = rl_configstr_to_u16(param_value, &priv->ttl, NULL);
     } else if (strcmp(param_name, "csum") == 0) {
         if (strcmp(param_value, "none") == 0 || strcmp(param_value, "") == 0) {
-            priv->csum = false;
+            priv->csum = RL_CSUM_NONE;
             ret        = 0;
         } else if (strcmp(param_value, "inet") == 0) {
-            priv->csum = true;
+            priv->csum = RL_CSUM_INET;
+            ret        = 0;
+        } else if (strcmp(param_value, "crc32c") == 0) {
+            priv->csum = RL_CSUM_CRC32C;
             ret        = 0;
         } else {
             ret = -EINVAL;
         }
+    } else if (strcmp(param_name, "rto-min-us") == 0) {
+        /* Only affects the flows allocated from now on. */
+        ret = rl_configstr_to_u32(param_value, &priv->rto_min_us, NULL);
     } else if (strcmp(param_name, "sched") == 0) {
         if (!strcmp(param_value, "none")) {
             param_value = NULL;
         }
         ret = rl_sched_replace(priv, param_value);
+    } else if (strcmp(param_name, "cc") == 0) {
+        const struct rl_cc_ops *cc = rl_cc_lookup(param_value);
+
+        /* Only affects the flows allocated from now on. */
+        ret = -EINVAL;
+        if (cc) {
+            priv->cc = cc;
+            ret      = 0;
+        }
     }
 
     return ret;
@@ -1497,11 +2469,17 @@ rl_normal_config_get(struct ipcp_entry *ipcp, const char *param_name, char *buf,
     } else if (strcmp(param_name, "ttl") == 0) {
         snprintf(buf, buflen, "%u", priv->ttl);
     } else if (strcmp(param_name, "csum") == 0) {
-        const char *value = priv->csum ? "inet" : "none";
-        snprintf(buf, buflen, "%s", value);
+        static const char *names[] = {"none", "inet", "crc32c"};
+        snprintf(buf, buflen, "%s", names[priv->csum]);
+    } else if (strcmp(param_name, "csum-bench") == 0) {
+        pdu_csum_bench(buf, buflen);
+    } else if (strcmp(param_name, "rto-min-us") == 0) {
+        snprintf(buf, buflen, "%u", priv->rto_min_us);
     } else if (strcmp(param_name, "sched") == 0) {
         const char *value = priv->sched ? priv->sched->ops.name : "none";
         snprintf(buf, buflen, "%s", value);
+    } else if (strcmp(param_name, "cc") == 0) {
+        snprintf(buf, buflen, "%s", priv->cc->name);
     } else {
         ret = -ENOSYS; /* don't know how to manage this parameter */
     }
@@ -1535,7 +2513,16 @@ rl_normal_sched_config(struct ipcp_entry *ipcp, struct rl_msg_base *bmsg)
         }
         break;
     case RLITE_KER_IPCP_SCHED_PFIFO:
-        if (strcmp(rl_sched_pfifo_ops.name, priv->sched->ops.name)) {
+        /* Also used to configure the multi-queue pfifo. */
+        if (strcmp(rl_sched_pfifo_ops.name, priv->sched->ops.name) &&
+            strcmp(rl_sched_mqpfifo_ops.name, priv->sched->ops.name)) {
+            return -ENXIO;
+        }
+        break;
+    case RLITE_KER_IPCP_SCHED_DRR:
+        /* Used by both the DRR variants. */
+        if (strcmp(rl_sched_drr_ops.name, priv->sched->ops.name) &&
+            strcmp(rl_sched_prio_drr_ops.name, priv->sched->ops.name)) {
             return -ENXIO;
         }
         break;
@@ -1561,18 +2548,70 @@ rl_normal_qos_supported(struct ipcp_entry *ipcp, struct rina_flow_spec *spec)
     return 0;
 }
 
+static inline struct rl_buf **
+seqq_slot(struct dtp *dtp, rl_seq_t seqnum)
+{
+    return &dtp->seqq[seqnum & dtp->seqq_mask];
+}
+
+/* Fill in up to 'max' SACK blocks describing the PDUs currently
+ * stored in the seqq. Returns the number of blocks. */
+static unsigned int
+seqq_sack_blocks(struct dtp *dtp, struct rina_sack_block *blocks,
+                 unsigned int max)
+{
+    unsigned int found = 0;
+    unsigned int n     = 0;
+    bool in_block      = false;
+    rl_seq_t seqnum;
+
+    for (seqnum = dtp->rcv_next_seq_num + 1;
+         found < dtp->seqq_len &&
+         seqnum - dtp->rcv_next_seq_num < dtp->seqq_max_len;
+         seqnum++) {
+        if (*seqq_slot(dtp, seqnum)) {
+            if (!in_block) {
+                if (n == max) {
+                    break;
+                }
+                blocks[n].start = seqnum;
+                in_block        = true;
+            }
+            blocks[n].end = seqnum + 1;
+            found++;
+        } else if (in_block) {
+            in_block = false;
+            n++;
+        }
+    }
+
+    return in_block ? n + 1 : n;
+}
+
 static struct rl_buf *
 ctrl_pdu_alloc(struct ipcp_entry *ipcp, struct flow_entry *flow,
                uint8_t pdu_type)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
-    struct rl_buf *rb =
-        rl_buf_alloc(sizeof(struct rina_pci_ctrl), ipcp->txhdroom,
-                     ipcp->tailroom, GFP_ATOMIC);
+    struct rina_sack_block blocks[RL_SACK_BLOCKS_MAX];
+    unsigned int nblocks = 0;
     struct rina_pci_ctrl *pcic;
+    struct rl_buf *rb;
+    size_t len;
+
+    if ((pdu_type & PDU_T_ACK_BIT) &&
+        (pdu_type & PDU_T_ACK_MASK) == PDU_T_SACK) {
+        nblocks = seqq_sack_blocks(&flow->dtp, blocks, RL_SACK_BLOCKS_MAX);
+        if (!nblocks) {
+            /* Nothing to report, fall back to a conventional ACK. */
+            pdu_type &= ~PDU_T_ACK_MASK;
+        }
+    }
 
+    len = sizeof(struct rina_pci_ctrl) + nblocks * sizeof(blocks[0]);
+    rb  = rl_buf_alloc(len, ipcp->txhdroom, ipcp->tailroom, GFP_ATOMIC);
     if (likely(rb)) {
-        rl_buf_append(rb, sizeof(struct rina_pci_ctrl));
+        rl_buf_append(rb, len);
         pcic                         = (struct rina_pci_ctrl *)RL_BUF_DATA(rb);
         pcic->base.dst_addr          = flow->remote_addr;
         pcic->base.src_addr          = ipcp->addr;
@@ -1581,6 +2620,12 @@ ctrl_pdu_alloc(struct ipcp_entry *ipcp, struct flow_entry *flow,
         pcic->base.src_cep           = flow->local_cep;
         pcic->base.pdu_type          = pdu_type;
         pcic->base.pdu_flags         = 0;
+        if ((pdu_type & PDU_T_ACK_BIT) &&
+            (flow->dtp.flags & DTP_F_ECN_ECHO)) {
+            /* Echo the congestion marks received since the last ACK. */
+            pcic->base.pdu_flags |= PDU_F_ECN;
+            flow->dtp.flags &= ~DTP_F_ECN_ECHO;
+        }
         pcic->base.pdu_len           = rb->len;
         pcic->base.pdu_ttl           = priv->ttl;
         pcic->base.pdu_csum          = 0;
@@ -1588,18 +2633,132 @@ ctrl_pdu_alloc(struct ipcp_entry *ipcp, struct flow_entry *flow,
         pcic->last_ctrl_seq_num_rcvd = flow->dtp.last_ctrl_seq_num_rcvd;
         pcic->ack_nack_seq_num       = flow->dtp.last_seq_num_acked =
             flow->dtp.rcv_next_seq_num;
-        pcic->new_rwe = flow->dtp.rcv_rwe;
+        pcic->new_rwe = flow->dtp.last_rwe_sent = flow->dtp.rcv_rwe;
         pcic->new_lwe = flow->dtp.last_lwe_sent = flow->dtp.rcv_lwe;
         pcic->my_rwe                            = flow->dtp.snd_rwe;
         pcic->my_lwe                            = flow->dtp.snd_lwe;
-        if (priv->csum) {
-            pcic->base.pdu_csum = inet_wrapsum(inet_csum(pcic, rb->len, 0));
+        if (nblocks) {
+            memcpy(pcic + 1, blocks, nblocks * sizeof(blocks[0]));
         }
+        pdu_csum_set(priv, &pcic->base, rb->len);
+        flow->dtp.ack_bytes = 0;
+        flow->dtp.ctrl_pdus_sent++;
     }
 
     return rb;
 }
 
+/* Minimum duration of a receive buffer autotuning interval. */
+#define RCV_TUNE_INTVAL_MIN msecs_to_jiffies(10)
+
+/* Compute the credit (in PDUs) to be advertised to the sender, so that
+ * the SDUs in flight and the ones already sitting in the userspace
+ * receive queue fit the memory budget of the flow. The credit can grow
+ * above the configured one as the budget grows. */
+static rl_seq_t
+rcv_credit(struct flow_entry *flow, rl_seq_t win_size)
+{
+    struct txrx *txrx   = &flow->txrx;
+    unsigned int qsize  = READ_ONCE(txrx->rx_qsize);
+    unsigned int budget = READ_ONCE(txrx->rx_qbudget);
+    unsigned int avgsz  = READ_ONCE(txrx->rx_avgsz);
+    rl_seq_t credit_max;
+
+    if (flow->upper.ipcp || !avgsz) {
+        /* SDUs are not queued to userspace, or no SDU has been
+         * queued yet. */
+        return win_size;
+    }
+
+    if (qsize >= budget) {
+        return 0;
+    }
+
+    credit_max = div_u64((uint64_t)win_size * budget, RL_RXQ_BUDGET_INIT);
+
+    return min_t(rl_seq_t, (budget - qsize) / avgsz,
+                 max(credit_max, win_size));
+}
+
+/* Receive buffer autotuning: let the memory budget of the userspace
+ * receive queue hold twice the bytes read by the application in a
+ * round trip time. This must be called under DTP lock. */
+static void
+rcv_autotune(struct flow_entry *flow)
+{
+    struct dtp *dtp   = &flow->dtp;
+    struct txrx *txrx = &flow->txrx;
+    unsigned long intval =
+        max_t(unsigned long, nsecs_to_jiffies(dtp->rtt), RCV_TUNE_INTVAL_MIN);
+    uint64_t copied;
+
+    if (time_before(jiffies, dtp->rcvbuf_stamp + intval)) {
+        return;
+    }
+
+    copied = (uint64_t)(dtp->rcv_lwe - dtp->rcvbuf_seq) *
+             READ_ONCE(txrx->rx_avgsz);
+    if (2 * copied > txrx->rx_qbudget) {
+        WRITE_ONCE(txrx->rx_qbudget,
+                   min_t(uint64_t, 2 * copied, RL_RXQ_BUDGET_MAX));
+        NPD("rx_qbudget --> %u\n", txrx->rx_qbudget);
+    }
+    dtp->rcvbuf_seq   = dtp->rcv_lwe;
+    dtp->rcvbuf_stamp = jiffies;
+}
+
+/* With adaptive ACK thinning, the receiver still sends at least this
+ * number of ACKs per window advertised to the sender. This matches the
+ * default rule, which ACKs every half initial window, and thins the
+ * ACKs when the advertised window grows beyond that. */
+#define RL_ACK_ADAPTIVE_DIV 2
+
+/* Upper bound for the ACK delay when coalescing ACKs with a zero A.
+ * The sender RTO is then only floored by rto_min (assuming the same
+ * rto-min-us on both ends), so we leave it a good margin, as the 2*A
+ * floor does for the A timer. */
+static inline s64
+ack_delay_max(const struct dtp *dtp)
+{
+    return dtp->rto_min >> 2;
+}
+
+/* ACK coalescing: the number of PDUs that can be left unacknowledged,
+ * or 0 if there is no limit. This replaces the default half initial
+ * window rule, but it never goes beyond half of the window the sender
+ * was last allowed to use (the advertised window, or the retransmission
+ * queue without flow control), otherwise the sender would stall until
+ * the ACK timer fires. */
+static inline rl_seq_t
+ack_thresh_pdus(const struct flow_entry *flow)
+{
+    const struct dtcp_config *dc = &flow->cfg.dtcp;
+    const struct dtp *dtp        = &flow->dtp;
+    rl_seq_t n                   = flow->cfg.ack.pdus;
+    rl_seq_t win                 = 0;
+
+    if ((dc->flags & DTCP_CFG_FLOW_CTRL) &&
+        dc->fc.fc_type == RLITE_FC_T_WIN) {
+        win = dtp->last_rwe_sent > dtp->last_lwe_sent
+                  ? dtp->last_rwe_sent - dtp->last_lwe_sent
+                  : dc->fc.cfg.w.initial_credit;
+    } else if (dc->flags & DTCP_CFG_RTX_CTRL) {
+        win = dc->rtx.max_rtxq_len;
+    }
+
+    if (flow->cfg.ack.flags & RL_ACK_F_ADAPTIVE) {
+        /* The sender cannot have more PDUs in flight than the window
+         * we advertised last. Thin the ACKs as the window grows. */
+        n = max(n, win / RL_ACK_ADAPTIVE_DIV);
+    }
+
+    if (win && (!n || n > win / RL_ACK_ADAPTIVE_DIV)) {
+        n = win / RL_ACK_ADAPTIVE_DIV;
+    }
+
+    return n ? n : (win ? 1 : 0);
+}
+
 /* This must be called under DTP lock and after rcv_next_seq_num and rcv_lwe
  * have been updated.
  * POL: RcvrFlowControl, ReceivingFlowControl, RcvrAck
@@ -1611,30 +2770,62 @@ sdu_rx_sv_update(struct ipcp_entry *ipcp, struct flow_entry *flow,
     const struct dtcp_config *dc = &flow->cfg.dtcp;
     rl_seq_t win_size            = dc->fc.cfg.w.initial_credit;
     unsigned int a               = dc->initial_a;
-    bool ack                     = ack_immediate || !a;
     uint8_t pdu_type             = 0;
+    rl_seq_t ack_thresh          = win_size >> 1;
+    bool ack_thresh_on           = true;
+    bool coalesce;
+    bool ack;
+
+    /* Coalesce ACKs if the ACK policy sets any threshold. */
+    coalesce = DTCP_PRESENT(*dc) &&
+               (flow->cfg.ack.pdus || flow->cfg.ack.bytes ||
+                (flow->cfg.ack.flags & RL_ACK_F_ADAPTIVE));
+    ack = ack_immediate || (!a && !coalesce);
+
+    if (coalesce) {
+        /* ACK every N PDUs (delivered or consumed) or every N bytes
+         * received, as asked by the ACK policy, instead of every half
+         * initial window. */
+        ack_thresh    = ack_thresh_pdus(flow);
+        ack_thresh_on = ack_thresh != 0;
+        ack |= flow->cfg.ack.bytes &&
+               flow->dtp.ack_bytes >= flow->cfg.ack.bytes;
+    }
 
     /* We send a flow control ack if we have more than an half window of PDUs
      * that have been correctly consumed by the flow user but yet not published
      * to the sender, i.e.
      *     rcv_lwe - last_lwe_sent >= win_size/2
      */
-    ack |= (flow->dtp.rcv_lwe - flow->dtp.last_lwe_sent >= (win_size >> 1));
+    ack |= ack_thresh_on &&
+           (flow->dtp.rcv_lwe - flow->dtp.last_lwe_sent >= ack_thresh);
 
     /* We send a retransmission ack if we have more than an half
      * window of PDUs that have been correctly delivered to the
      * receive queue, but yet unacked, i.e.
      *     rcv_next_seq_num - last_seq_num_acked >= win_size/2
      */
-    ack |= (flow->dtp.rcv_next_seq_num - flow->dtp.last_seq_num_acked >=
-            (win_size >> 1));
+    ack |= ack_thresh_on &&
+           (flow->dtp.rcv_next_seq_num - flow->dtp.last_seq_num_acked >=
+            ack_thresh);
 
     if ((dc->flags & DTCP_CFG_FLOW_CTRL) &&
         (dc->fc.fc_type == RLITE_FC_T_WIN)) {
-        /* Update the rcv_rwe, as rcv_lwe may have changed. */
-        NPD("rcv_rwe [%lu] --> [%lu]\n", (long unsigned)flow->dtp.rcv_rwe,
-            (long unsigned)(flow->dtp.rcv_lwe + win_size));
-        flow->dtp.rcv_rwe = flow->dtp.rcv_lwe + win_size;
+        rl_seq_t rwe = flow->dtp.rcv_lwe + rcv_credit(flow, win_size);
+
+        /* Update the rcv_rwe, as rcv_lwe or the receive queue may have
+         * changed. The window is never shrunk, since the sender would
+         * reject that: it just stops advancing. */
+        if (rwe > flow->dtp.rcv_rwe) {
+            NPD("rcv_rwe [%lu] --> [%lu]\n", (long unsigned)flow->dtp.rcv_rwe,
+                (long unsigned)rwe);
+            flow->dtp.rcv_rwe = rwe;
+        }
+
+        /* Also send a flow control ack if the window reopened by more
+         * than an half window since the last advertisement. */
+        ack |= ack_thresh_on &&
+               (flow->dtp.rcv_rwe - flow->dtp.last_rwe_sent >= ack_thresh);
 
         if (ack) {
             pdu_type |= PDU_T_CTRL | PDU_T_FC_BIT;
@@ -1642,7 +2833,12 @@ sdu_rx_sv_update(struct ipcp_entry *ipcp, struct flow_entry *flow,
     }
 
     if (ack && (dc->flags & DTCP_CFG_RTX_CTRL)) {
-        pdu_type |= PDU_T_CTRL | PDU_T_ACK_BIT | PDU_T_ACK;
+        /* Use a SACK if the peer supports it and there are PDUs
+         * waiting in the seqq. */
+        pdu_type |= PDU_T_CTRL | PDU_T_ACK_BIT |
+                    (((dc->flags & DTCP_CFG_SACK) && flow->dtp.seqq_len)
+                         ? PDU_T_SACK
+                         : PDU_T_ACK);
     }
 
     if (pdu_type) {
@@ -1654,81 +2850,179 @@ sdu_rx_sv_update(struct ipcp_entry *ipcp, struct flow_entry *flow,
             (long unsigned)flow->dtp.rcv_next_seq_num,
             (long unsigned)flow->dtp.last_lwe_sent + win_size);
         /* Stop the A timer, we are going to send a control PDU. */
-        del_timer(&flow->dtp.a_tmr);
+        rl_wtimer_del(&flow->dtp.a_tmr);
+        hrtimer_try_to_cancel(&flow->dtp.ack_tmr);
         return ctrl_pdu_alloc(ipcp, flow, pdu_type);
     }
 
     /* We are not sending an immediate control PDU, so we need
-     * to start the A timer (if it was not already started). */
-    if (a && !timer_pending(&flow->dtp.a_tmr)) {
-        mod_timer(&flow->dtp.a_tmr, jiffies + msecs_to_jiffies(a));
+     * to start the A timer (if it was not already started). When
+     * coalescing ACKs with a zero A, the sender RTO is only floored by
+     * rto-min-us (see rtt_to_rtx()), so the ACK delay is bounded by the
+     * (high resolution) ACK timer instead. */
+    if (a && !rl_wtimer_pending(&flow->dtp.a_tmr)) {
+        rl_wtimer_mod(&flow->dtp.a_tmr, jiffies + msecs_to_jiffies(a));
         RPV(1, "start A timer\n");
+    } else if (!a && coalesce && !hrtimer_is_queued(&flow->dtp.ack_tmr)) {
+        hrtimer_start_range_ns(
+            &flow->dtp.ack_tmr,
+            ns_to_ktime(ktime_get_ns() + ack_delay_max(&flow->dtp)),
+            RTX_TMR_SLACK_NSEC, HRTIMER_MODE_ABS);
+        RPV(1, "start ACK timer\n");
     }
 
     return NULL;
 }
 
-#define SEQQ_MAX_LEN 64
-
-/* Takes the ownership of the rb. */
+/* Takes the ownership of the rb. The caller guarantees that
+ * seqnum > rcv_next_seq_num. */
 static void
 seqq_push(struct flow_entry *flow, struct rl_buf *rb)
 {
     struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
     rl_seq_t seqnum             = RL_BUF_PCI(rb)->seqnum;
     struct dtp *dtp             = &flow->dtp;
-    struct rb_list *pos         = &dtp->seqq;
-    struct rl_buf *cur;
+    struct rl_buf **slot;
 
-    if (unlikely(dtp->seqq_len >= SEQQ_MAX_LEN)) {
+    if (unlikely(!dtp->seqq ||
+                 seqnum - dtp->rcv_next_seq_num >= dtp->seqq_max_len)) {
         RPD(1, "seqq overrun: dropping PDU [%lu]\n", (long unsigned)seqnum);
         stats->rx_err++;
         rl_buf_free(rb);
         return;
     }
 
-    rb_list_foreach (cur, &dtp->seqq) {
-        struct rina_pci *pci = RL_BUF_PCI(cur);
-
-        if (seqnum < pci->seqnum) {
-            pos = rl_buf_listnode(cur);
-            break;
-        } else if (seqnum == pci->seqnum) {
-            /* This is a duplicate amongst the gaps, we can
-             * drop it. */
-            stats->rx_err++;
-            rl_buf_free(rb);
-            RPD(1, "Duplicate amongst the gaps [%lu] dropped\n",
-                (long unsigned)seqnum);
+    slot = seqq_slot(dtp, seqnum);
+    if (unlikely(*slot != NULL)) {
+        /* This is a duplicate amongst the gaps, we can
+         * drop it. */
+        stats->rx_err++;
+        rl_buf_free(rb);
+        RPD(1, "Duplicate amongst the gaps [%lu] dropped\n",
+            (long unsigned)seqnum);
 
-            return;
-        }
+        return;
     }
 
-    /* Insert the rb right before 'pos'. */
-    rb_list_enq(rb, pos);
-    dtp->seqq_len++;
+    *slot = rb;
+    if (++dtp->seqq_len > dtp->seqq_hwm) {
+        dtp->seqq_hwm = dtp->seqq_len;
+    }
     stats->rx_pkt++;
     stats->rx_byte += rb->len;
     RPD(1, "[%lu] inserted\n", (long unsigned)seqnum);
 }
 
+/* Extract from the seqq all the PDUs that can be delivered, i.e.
+ * those that are at most max_sdu_gap positions after the next
+ * expected sequence number. */
 static void
 seqq_pop_many(struct dtp *dtp, rl_seq_t max_sdu_gap, struct rb_list *qrbs)
 {
-    struct rl_buf *qrb, *tmp;
+    rl_seq_t i = 0;
 
     rb_list_init(qrbs);
-    rb_list_foreach_safe (qrb, tmp, &dtp->seqq) {
-        struct rina_pci *pci = RL_BUF_PCI(qrb);
+    while (dtp->seqq_len && i <= max_sdu_gap && i < dtp->seqq_max_len) {
+        struct rl_buf **slot = seqq_slot(dtp, dtp->rcv_next_seq_num + i);
+        struct rl_buf *qrb   = *slot;
 
-        if (pci->seqnum - dtp->rcv_next_seq_num <= max_sdu_gap) {
-            rb_list_del(qrb);
-            dtp->seqq_len--;
-            rb_list_enq(qrb, qrbs);
-            dtp->rcv_next_seq_num = pci->seqnum + 1;
-            RPD(1, "[%lu] popped out from seqq\n", (long unsigned)pci->seqnum);
+        if (!qrb) {
+            i++;
+            continue;
+        }
+        *slot = NULL;
+        dtp->seqq_len--;
+        rb_list_enq(qrb, qrbs);
+        dtp->rcv_next_seq_num += i + 1;
+        i = 0;
+        RPD(1, "[%lu] popped out from seqq\n",
+            (long unsigned)RL_BUF_PCI(qrb)->seqnum);
+    }
+}
+
+/* Process the SACK blocks carried by a control PDU. The PDUs covered
+ * by the blocks are removed from the rtxq, while the holes below the
+ * highest block are retransmitted right away (at most once), without
+ * waiting for the rtx timer. Must be called under DTP lock. */
+static void
+rtxq_sack(struct ipcp_entry *ipcp, struct flow_entry *flow,
+          struct rl_buf *rb, struct rb_list *rrbq)
+{
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+    struct rina_sack_block *blocks =
+        (struct rina_sack_block *)(RL_BUF_PCI_CTRL(rb) + 1);
+    struct dtp *dtp = &flow->dtp;
+    struct rl_buf *cur, *tmp;
+    unsigned int nblocks;
+    unsigned int b = 0;
+    rl_seq_t high;
+
+    if (unlikely(rb->len <= sizeof(struct rina_pci_ctrl))) {
+        return;
+    }
+
+    nblocks = (rb->len - sizeof(struct rina_pci_ctrl)) / sizeof(blocks[0]);
+    if (unlikely(nblocks > RL_SACK_BLOCKS_MAX)) {
+        RPD(1, "Too many SACK blocks (%u)\n", nblocks);
+        nblocks = RL_SACK_BLOCKS_MAX;
+    }
+    if (!nblocks) {
+        return;
+    }
+    high = blocks[nblocks - 1].end;
+
+    rb_list_foreach_safe (cur, tmp, &dtp->rtxq) {
+        rl_seq_t seqnum = RL_BUF_PCI(cur)->seqnum;
+        struct rl_buf *crb;
+
+        if (seqnum >= high) {
+            break;
+        }
+
+        while (b < nblocks && blocks[b].end <= seqnum) {
+            b++;
         }
+
+        if (b < nblocks && seqnum >= blocks[b].start) {
+            /* Already received by the peer. */
+            NPD("Remove [%lu] from rtxq (SACK)\n", (long unsigned)seqnum);
+            rb_list_del(cur);
+            dtp->rtxq_len--;
+            rl_buf_free(cur);
+            continue;
+        }
+
+        if (seqnum < dtp->sack_rtx_next) {
+            /* This hole has already been retransmitted. */
+            continue;
+        }
+        dtp->sack_rtx_next = seqnum + 1;
+
+        /* Retransmit the missing PDU, and invalidate RL_BUF_RTX(rb).t_tx
+         * so that RTT is not updated on this PDU. */
+        RL_BUF_RTX(cur).t_rtx = ktime_get_ns() + rtt_to_rtx(flow);
+        RL_BUF_RTX(cur).t_tx  = 0;
+        crb                   = rl_buf_clone(cur, GFP_ATOMIC);
+        if (unlikely(!crb)) {
+            RPV(1, "Out of memory\n");
+            continue;
+        }
+        rb_list_enq(crb, rrbq);
+        stats->rtx_pkt++;
+        stats->rtx_byte += cur->len;
+
+        if (!(dtp->flags & DTP_F_SACK_RECOVERY)) {
+            /* Entering loss recovery: notify the congestion control
+             * once for all the losses in the current window. */
+            dtp->flags |= DTP_F_SACK_RECOVERY;
+            dtp->sack_recover = dtp->next_seq_num_to_use;
+            dtp->cc->on_loss(flow, /*timeout=*/false);
+            cc_pacing_update(dtp);
+        }
+    }
+
+    if (rb_list_empty(&dtp->rtxq)) {
+        hrtimer_try_to_cancel(&dtp->rtx_tmr);
     }
 }
 
@@ -1738,7 +3032,7 @@ sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb)
     struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
     struct rina_pci_ctrl *pcic  = RL_BUF_PCI_CTRL(rb);
     struct dtp *dtp             = &flow->dtp;
-    struct rb_list qrbs;
+    struct rb_list qrbs, rrbq;
     struct rl_buf *qrb, *tmp;
 
     if (unlikely((pcic->base.pdu_type & PDU_T_CTRL) != PDU_T_CTRL)) {
@@ -1749,6 +3043,7 @@ sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb)
     }
 
     rb_list_init(&qrbs);
+    rb_list_init(&rrbq);
 
     spin_lock_bh(&dtp->lock);
 
@@ -1808,13 +3103,17 @@ sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb)
                 }
                 rb_list_del(qrb);
                 dtp->cwq_len--;
-                rb_list_enq(qrb, &qrbs);
                 dtp->last_seq_num_sent++;
 
                 if (flow->cfg.dtcp.flags & DTCP_CFG_RTX_CTRL) {
                     rl_rtxq_push(flow, qrb);
                 }
 
+                if ((dtp->flags & DTP_F_PACING) && tkbk_pace(dtp, qrb)) {
+                    continue;
+                }
+
+                rb_list_enq(qrb, &qrbs);
                 stats->tx_pkt++;
                 stats->tx_byte += qrb->len;
             }
@@ -1823,12 +3122,15 @@ sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb)
 
     if (pcic->base.pdu_type & PDU_T_ACK_BIT) {
         struct rl_buf *cur, *tmp;
-        unsigned now = jiffies;
-        unsigned cur_rtt;
-        int cur_rttdev;
+        s64 now            = ktime_get_ns();
+        uint64_t cur_rtt   = 0;
+        unsigned int acked = 0;
+        bool ecn           = pcic->base.pdu_flags & PDU_F_ECN;
+        uint64_t cur_rttdev;
 
         switch (pcic->base.pdu_type & PDU_T_ACK_MASK) {
         case PDU_T_ACK:
+        case PDU_T_SACK:
             rb_list_foreach_safe (cur, tmp, &dtp->rtxq) {
                 struct rina_pci *pci = RL_BUF_PCI(cur);
 
@@ -1836,27 +3138,27 @@ sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb)
                     NPD("Remove [%lu] from rtxq\n", (long unsigned)pci->seqnum);
                     rb_list_del(cur);
                     dtp->rtxq_len--;
+                    acked++;
 
-                    if (RL_BUF_RTX(cur).jiffies) {
+                    if (RL_BUF_RTX(cur).t_tx) {
                         /* Update our RTT estimate. */
-                        cur_rtt = now - RL_BUF_RTX(cur).jiffies;
-                        if (!cur_rtt) {
-                            cur_rtt = 1;
-                        }
-                        cur_rttdev = (int)cur_rtt - dtp->rtt;
-                        if (cur_rttdev < 0) {
-                            cur_rttdev = -cur_rttdev;
-                        } else if (!cur_rttdev) {
-                            cur_rttdev = 1;
+                        cur_rtt = max_t(s64, now - RL_BUF_RTX(cur).t_tx, 1);
+                        if (!(dtp->flags & DTP_F_RTT_SAMPLED)) {
+                            /* First sample, as in RFC 6298. */
+                            dtp->flags |= DTP_F_RTT_SAMPLED;
+                            dtp->rtt        = cur_rtt;
+                            dtp->rtt_stddev = cur_rtt >> 1;
+                        } else {
+                            cur_rttdev = cur_rtt > dtp->rtt
+                                             ? cur_rtt - dtp->rtt
+                                             : dtp->rtt - cur_rtt;
+                            /* RTT <== RTT * (7/8) + SAMPLE * (1/8) */
+                            dtp->rtt = (dtp->rtt * 7 + cur_rtt) >> 3;
+                            dtp->rtt_stddev =
+                                (dtp->rtt_stddev * 3 + cur_rttdev) >> 2;
                         }
-
-                        /* RTT <== RTT * (112/128) + SAMPLE * (16/128)*/
-                        dtp->rtt = (dtp->rtt * 112 + (cur_rtt << 4)) >> 7;
-                        dtp->rtt_stddev =
-                            (dtp->rtt_stddev * 3 + cur_rttdev) >> 2;
-                        NPD(1, "RTT est %u msecs +/- %u msecs\n",
-                            jiffies_to_msecs(dtp->rtt),
-                            jiffies_to_msecs(dtp->rtt_stddev));
+                        NPD("RTT est %llu ns +/- %llu ns\n", dtp->rtt,
+                            dtp->rtt_stddev);
                     }
 
                     rl_buf_free(cur);
@@ -1864,34 +3166,37 @@ sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb)
                     /* The rtxq is sorted by seqnum, so we can safely
                      * stop here. Let's update the rtx timer
                      * expiration time, if necessary. */
-                    NPD("Forward rtx timer by %u\n",
-                        jiffies_to_msecs(RL_BUF_RTX(cur).rtx_jiffies -
-                                         jiffies));
-                    mod_timer(&dtp->rtx_tmr, RL_BUF_RTX(cur).rtx_jiffies);
+                    rtx_tmr_start(dtp, RL_BUF_RTX(cur).t_rtx);
                     break;
                 }
             }
 
             if (rb_list_empty(&dtp->rtxq)) {
                 /* Everything has been acked, we can stop the rtx timer. */
-                del_timer(&dtp->rtx_tmr);
+                hrtimer_try_to_cancel(&dtp->rtx_tmr);
             }
 
-            /* Update the congestion control window size (up to a maximum).
-             * In case we never experienced retransmissions we double the
-             * size, otherwise we increment it linearly. */
-            if (dtp->cgwin < RL_CGWIN_MAX) {
-                if (stats->rtx_pkt) {
-                    dtp->cgwin++;
-                } else {
-                    dtp->cgwin <<= 1;
-                }
+            if ((dtp->flags & DTP_F_SACK_RECOVERY) &&
+                pcic->ack_nack_seq_num >= dtp->sack_recover) {
+                /* All the PDUs outstanding when the loss recovery
+                 * started have been acked. */
+                dtp->flags &= ~DTP_F_SACK_RECOVERY;
+            }
+
+            /* Let the congestion control algorithm update the window,
+             * unless we are recovering from losses. */
+            if ((acked || ecn) && !(dtp->flags & DTP_F_SACK_RECOVERY)) {
+                dtp->cc->on_ack(flow, acked, cur_rtt, ecn);
+                cc_pacing_update(dtp);
+            }
+
+            if ((pcic->base.pdu_type & PDU_T_ACK_MASK) == PDU_T_SACK) {
+                rtxq_sack(ipcp, flow, rb, &rrbq);
             }
 
             break;
 
         case PDU_T_NACK:
-        case PDU_T_SACK:
         case PDU_T_SNACK:
             PI("Missing support for PDU type [%X]\n", pcic->base.pdu_type);
             break;
@@ -1916,29 +3221,38 @@ out:
         stats->tx_byte += len;
     }
 
+    /* Send PDUs selectively retransmitted because of SACK, if any. */
+    rb_list_foreach_safe (qrb, tmp, &rrbq) {
+        struct rina_pci *pci = RL_BUF_PCI(qrb);
+
+        RPD(1, "sending [%lu] from rtxq (SACK)\n", (long unsigned)pci->seqnum);
+        rb_list_del(qrb);
+        rmt_tx(ipcp, pci->dst_addr, qrb, RL_RMT_F_CONSUME);
+    }
+
     /* This could be done conditionally. */
     rl_write_restart_flow(flow);
 
     return 0;
 }
 
-static struct rl_buf *
-rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
-                 struct flow_entry *lower_flow)
+/* First stage of the receive datapath: PDU validation, management PDUs,
+ * forwarding and control PDUs. If *@prb is a data transfer PDU for a
+ * local flow, the flow is returned with a reference held. Otherwise NULL
+ * is returned, and *@prb is either NULL (PDU consumed) or a management
+ * SDU to be queued to userspace. */
+static struct flow_entry *
+sdu_rx_classify(struct ipcp_entry *ipcp, struct rl_buf **prb,
+                struct flow_entry *lower_flow)
 {
     struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
     struct rl_normal *priv      = ipcp->priv;
+    struct rl_buf *rb           = *prb;
     struct rina_pci *pci        = RL_BUF_PCI(rb);
     struct flow_entry *flow;
-    rl_seq_t seqnum    = pci->seqnum;
-    struct rl_buf *crb = NULL;
-    unsigned int a     = 0;
-    rl_seq_t gap;
-    struct dtp *dtp;
-    bool deliver;
-    bool drop;
-    bool qlimit;
-    int ret = 0;
+    int ret;
+
+    *prb = NULL;
 
     if (pci->pdu_len < rb->len) {
         /* Make up for tail padding introduced at lower layers. */
@@ -1952,13 +3266,15 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         return NULL; /* -EINVAL */
     }
 
-    if (priv->csum) {
-        if (unlikely(inet_csum(pci, rb->len, 0) != 0xFFFF)) {
-            RPD(1, "Dropping PDU on wrong checksum\n");
-            rl_buf_free(rb);
-            stats->rmt.csum_drop++;
-            return NULL;
-        }
+    /* The checksum is only verified by the destination IPCP. Relaying
+     * IPCPs update it incrementally, which preserves any corruption for
+     * the destination to detect. */
+    if ((pci->dst_addr == ipcp->addr || pci->dst_addr == RL_ADDR_NULL) &&
+        unlikely(!pdu_csum_ok(priv, pci, rb->len))) {
+        RPD(1, "Dropping PDU on wrong checksum\n");
+        rl_buf_free(rb);
+        stats->rmt.csum_drop++;
+        return NULL;
     }
 
     if (unlikely(
@@ -1973,7 +3289,8 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
             /* The caller is rl_sdu_rx_shortcut(): don't touch the
              * rb and return -ENOMSG to tell him the shortcut is not
              * possible. */
-            return rb;
+            *prb = rb;
+            return NULL;
         }
 
         if (!ipcp->mgmt_txrx) {
@@ -2010,7 +3327,8 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         mhdr->remote_addr = src_addr;
 
         /* Tell the caller to queue this rb to userspace. */
-        return rb;
+        *prb = rb;
+        return NULL;
 
     } else {
         /* PDU which is not PDU_T_MGMT or it is to be forwarded. */
@@ -2029,15 +3347,9 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
             return NULL; /* -EINVAL */
         }
         /* Update the checksum incrementally. */
-        if (priv->csum) {
-            uint32_t sum = pci->pdu_csum;
-            /* We need to use ntohs() on the increment, as we are doing
-             * swapped order computations on little endian machines. */
-            sum += ntohs(0x0100);
-            if (sum > 0xFFFF) {
-                sum -= 0xFFFF;
-            }
-            pci->pdu_csum = (uint16_t)sum;
+        if (priv->csum == RL_CSUM_INET) {
+            pci->pdu_csum = pdu_csum_update(pci->pdu_csum, pci->pdu_ttl + 1,
+                                            pci->pdu_ttl);
         }
 
         rmt_tx(ipcp, pci->dst_addr, rb, RL_RMT_F_CONSUME);
@@ -2063,19 +3375,36 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         return NULL; /* ret */
     }
 
-    /* This is data transfer PDU. */
-
-    dtp = &flow->dtp;
+    *prb = rb;
 
-    /* Ask rl_sdu_rx_flow() to limit the userspace queue only
-     * if this flow does not use flow control. If flow control
-     * is used, it will limit the userspace queue automatically. */
-    qlimit = !(flow->cfg.dtcp.flags & DTCP_CFG_FLOW_CTRL);
+    return flow;
+}
 
-    spin_lock_bh(&dtp->lock);
+/* Process a data transfer PDU received on @flow. This must be called
+ * under the DTP lock. The SDUs that can be delivered are appended to
+ * @rxq, the control PDUs to be sent are appended to @crbs. */
+static void
+sdu_rx_dt(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb,
+          struct rb_list *rxq, struct rb_list *crbs)
+{
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+    struct rina_pci *pci        = RL_BUF_PCI(rb);
+    struct dtp *dtp             = &flow->dtp;
+    rl_seq_t seqnum             = pci->seqnum;
+    struct rl_buf *crb          = NULL;
+    unsigned int a              = 0;
+    rl_seq_t gap;
+    bool deliver;
+    bool drop;
 
     if (DTCP_PRESENT(flow->cfg.dtcp)) {
-        mod_timer(&dtp->rcv_inact_tmr, jiffies + 2 * dtp->mpl_r_a);
+        rl_wtimer_mod(&dtp->rcv_inact_tmr, jiffies + 2 * dtp->mpl_r_a);
+    }
+    dtp->data_pdus_rcvd++;
+    dtp->ack_bytes += rb->len;
+
+    if (unlikely(pci->pdu_flags & PDU_F_ECN)) {
+        dtp->flags |= DTP_F_ECN_ECHO;
     }
 
     if (unlikely((dtp->flags & DTP_F_DRF_EXPECTED) ||
@@ -2087,13 +3416,20 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
          * packet was lost and can retransmit it. */
         dtp->flags &= ~DTP_F_DRF_EXPECTED;
 
-        /* Flush reassembly queue */
+        /* Flush reassembly queue, since the PDUs in there belong
+         * to the previous run. */
+        stats->rx_err += dtp_seqq_flush(dtp);
 
-        /* Init receiver state. The rcv_rwe is not initialized here, but the
-         * first time sdu_rx_sv_update is called. */
+        /* Init receiver state. The rcv_rwe is set to the window assumed
+         * by the sender after its reset, and advanced the first time
+         * sdu_rx_sv_update is called. */
         dtp->last_lwe_sent = dtp->rcv_lwe = dtp->rcv_next_seq_num =
             dtp->last_seq_num_acked       = seqnum + 1;
         dtp->max_seq_num_rcvd             = seqnum;
+        dtp->rcv_rwe = dtp->last_rwe_sent =
+            seqnum + flow->cfg.dtcp.fc.cfg.w.initial_credit;
+        dtp->rcvbuf_seq   = dtp->rcv_lwe;
+        dtp->rcvbuf_stamp = jiffies;
 
         crb = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/false);
 
@@ -2116,14 +3452,11 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
                dtp->next_snd_ctl_seq);
         }
 
-        spin_unlock_bh(&dtp->lock);
-
         RL_BUF_RX(rb).cons_seqnum = seqnum;
         rl_buf_pci_pop(rb);
+        rb_list_enq(rb, rxq);
 
-        rl_sdu_rx_flow(ipcp, flow, rb, qlimit);
-
-        goto snd_crb;
+        goto out;
     }
 
     if (unlikely(seqnum < dtp->rcv_next_seq_num)) {
@@ -2141,9 +3474,7 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
                 PDU_T_CTRL | PDU_T_ACK_BIT | PDU_T_ACK | PDU_T_FC_BIT);
         }
 
-        spin_unlock_bh(&dtp->lock);
-
-        goto snd_crb;
+        goto out;
     }
 
     if (unlikely(dtp->rcv_next_seq_num < seqnum &&
@@ -2196,12 +3527,14 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
     if (deliver) {
         struct rb_list qrbs;
         struct rl_buf *qrb, *tmp;
+        bool gap_filled;
 
         /* Update rcv_next_seq_num only if this PDU is going to be
          * delivered. */
         dtp->rcv_next_seq_num = seqnum + 1;
 
         seqq_pop_many(dtp, flow->cfg.max_sdu_gap, &qrbs);
+        gap_filled = !rb_list_empty(&qrbs);
 
         /* If this flow is used by an application, this SDU will be acked
          * when the application reads it, since rl_normal_sdu_rx_consumed()
@@ -2211,28 +3544,30 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         if (flow->upper.ipcp) {
             dtp->rcv_lwe = dtp->rcv_next_seq_num;
         }
-        crb = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/false);
-        spin_unlock_bh(&dtp->lock);
+        /* If the ACK policy asks so, let the sender know right away
+         * that a gap has been filled. */
+        crb = sdu_rx_sv_update(ipcp, flow,
+                               gap_filled &&
+                                   (flow->cfg.ack.flags & RL_ACK_F_OOO));
 
         stats->rx_pkt++;
         stats->rx_byte += rb->len;
 
         RL_BUF_RX(rb).cons_seqnum = seqnum;
         rl_buf_pci_pop(rb);
-
-        ret = rl_sdu_rx_flow(ipcp, flow, rb, qlimit);
+        rb_list_enq(rb, rxq);
 
         /* Also deliver PDUs just extracted from the seqq. Note
          * that we must use the safe version of list scanning, since
-         * rl_sdu_rx_flow() will modify qrb->node. */
+         * rb_list_enq() will modify qrb->node. */
         rb_list_foreach_safe (qrb, tmp, &qrbs) {
             rb_list_del(qrb);
             RL_BUF_RX(qrb).cons_seqnum = seqnum;
             rl_buf_pci_pop(qrb);
-            ret |= rl_sdu_rx_flow(ipcp, flow, qrb, qlimit);
+            rb_list_enq(qrb, rxq);
         }
 
-        goto snd_crb;
+        goto out;
     }
 
     if (drop) {
@@ -2248,18 +3583,154 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
          * Don't ack here, we have to wait for the gap to be filled. */
         seqq_push(flow, rb);
         rb = NULL;
+        if ((flow->cfg.dtcp.flags & DTCP_CFG_SACK) ||
+            (flow->cfg.ack.flags & RL_ACK_F_OOO)) {
+            /* Report the gap to the sender right away. With SACK, the
+             * sender can retransmit the missing PDUs only. */
+            crb = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/true);
+        }
     }
 
-    spin_unlock_bh(&dtp->lock);
-
-snd_crb:
+out:
     if (crb) {
+        rb_list_enq(crb, crbs);
+    }
+}
+
+/* Deliver the SDUs in @rxq to the flow user and send the control PDUs
+ * in @crbs, out of the DTP lock. */
+static void
+sdu_rx_dt_complete(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                   struct rb_list *rxq, struct rb_list *crbs)
+{
+    /* Ask rl_sdu_rx_flow_batch() to limit the userspace queue only
+     * if this flow does not use flow control. If flow control
+     * is used, it will limit the userspace queue automatically. */
+    bool qlimit = !(flow->cfg.dtcp.flags & DTCP_CFG_FLOW_CTRL);
+    struct rl_buf *crb, *tmp;
+
+    if (!rb_list_empty(rxq)) {
+        rl_sdu_rx_flow_batch(ipcp, flow, rxq, qlimit);
+    }
+
+    rb_list_foreach_safe (crb, tmp, crbs) {
+        rb_list_del(crb);
         rmt_tx(ipcp, flow->remote_addr, crb, RL_RMT_F_CONSUME);
     }
+}
+
+static struct rl_buf *
+rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
+                 struct flow_entry *lower_flow)
+{
+    struct rb_list rxq, crbs;
+    struct flow_entry *flow;
+
+    flow = sdu_rx_classify(ipcp, &rb, lower_flow);
+    if (!flow) {
+        return rb;
+    }
 
+    rb_list_init(&rxq);
+    rb_list_init(&crbs);
+    spin_lock_bh(&flow->dtp.lock);
+    sdu_rx_dt(ipcp, flow, rb, &rxq, &crbs);
+    spin_unlock_bh(&flow->dtp.lock);
+    sdu_rx_dt_complete(ipcp, flow, &rxq, &crbs);
     flow_put(flow);
 
-    return NULL; /* ret */
+    return NULL;
+}
+
+/* Maximum number of distinct flows handled at once by
+ * rl_normal_sdu_rx_batch(). */
+#define RL_RX_BATCH_FLOWS 8
+
+struct sdu_rx_group {
+    struct flow_entry *flow;
+    struct rb_list rbs;
+};
+
+/* Process the data transfer PDUs of each group, taking the DTP lock
+ * only once per group. The flow references are released. */
+static void
+sdu_rx_groups_flush(struct ipcp_entry *ipcp, struct sdu_rx_group *groups,
+                    unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        struct flow_entry *flow = groups[i].flow;
+        struct rl_buf *rb, *tmp;
+        struct rb_list rxq, crbs;
+
+        rb_list_init(&rxq);
+        rb_list_init(&crbs);
+        spin_lock_bh(&flow->dtp.lock);
+        rb_list_foreach_safe (rb, tmp, &groups[i].rbs) {
+            rb_list_del(rb);
+            sdu_rx_dt(ipcp, flow, rb, &rxq, &crbs);
+        }
+        spin_unlock_bh(&flow->dtp.lock);
+        sdu_rx_dt_complete(ipcp, flow, &rxq, &crbs);
+        flow_put(flow);
+    }
+}
+
+/* Batched version of rl_normal_sdu_rx(). The data transfer PDUs are
+ * grouped by destination flow, preserving their relative order. On
+ * return @rbs contains the management SDUs to be queued to userspace. */
+static void
+rl_normal_sdu_rx_batch(struct ipcp_entry *ipcp, struct rb_list *rbs,
+                       struct flow_entry *lower_flow)
+{
+    struct sdu_rx_group groups[RL_RX_BATCH_FLOWS];
+    struct rl_buf *rb, *tmp;
+    struct rb_list mgmtq;
+    unsigned int ng = 0;
+
+    rb_list_init(&mgmtq);
+
+    rb_list_foreach_safe (rb, tmp, rbs) {
+        struct flow_entry *flow;
+        unsigned int i;
+
+        rb_list_del(rb);
+        flow = sdu_rx_classify(ipcp, &rb, lower_flow);
+        if (!flow) {
+            if (rb) {
+                rb_list_enq(rb, &mgmtq);
+            }
+            continue;
+        }
+
+        for (i = 0; i < ng; i++) {
+            if (groups[i].flow == flow) {
+                break;
+            }
+        }
+
+        if (i < ng) {
+            /* The group already holds a reference. */
+            flow_put(flow);
+        } else {
+            if (ng == RL_RX_BATCH_FLOWS) {
+                sdu_rx_groups_flush(ipcp, groups, ng);
+                ng = 0;
+            }
+            i              = ng++;
+            groups[i].flow = flow;
+            rb_list_init(&groups[i].rbs);
+        }
+        rb_list_enq(rb, &groups[i].rbs);
+    }
+
+    sdu_rx_groups_flush(ipcp, groups, ng);
+
+    rb_list_foreach_safe (rb, tmp, &mgmtq) {
+        rb_list_del(rb);
+        rb_list_enq(rb, rbs);
+    }
 }
 
 static int
@@ -2275,7 +3746,8 @@ rl_normal_sdu_rx_consumed(struct flow_entry *flow, rlm_seq_t seqnum,
     /* Update the advertised rcv_lwe and possibly send a an FC ACK
      * control PDU. */
     dtp->rcv_lwe = seqnum + 1;
-    crb          = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/false);
+    rcv_autotune(flow);
+    crb = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/false);
 
     spin_unlock_bh(&dtp->lock);
 
@@ -2310,13 +3782,16 @@ rl_normal_create(struct ipcp_entry *ipcp)
     ipcp->max_sdu_size = (1 << 16) - 1 - ipcp->txhdroom;
 
     priv->ipcp = ipcp;
-    hash_init(priv->pdu_ft);
-    priv->pduft_dflt = NULL;
-    rwlock_init(&priv->pduft_lock);
+    if (rl_pduft_init(priv)) {
+        rl_free(priv, RL_MT_SHIM);
+        return NULL;
+    }
     priv->ttl  = RL_TTL_DFLT;
-    priv->csum = false;
+    priv->csum       = RL_CSUM_NONE;
+    priv->rto_min_us = RL_RTO_MIN_US_DFLT;
+    priv->cc         = &rl_cc_aimd_ops;
 
-    INIT_WORK(&priv->sched_deq_work, sched_deq_worker);
+    rl_tmr_wheel_init(&priv->wheel, ipcp);
 
     PD("New IPC created [%p]\n", priv);
 
@@ -2328,10 +3803,11 @@ rl_normal_destroy(struct ipcp_entry *ipcp)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
 
-    cancel_work_sync(&priv->sched_deq_work);
     rl_sched_replace(priv, NULL);
 
     rl_pduft_flush(ipcp);
+    rl_pduft_fini(priv);
+    rl_tmr_wheel_fini(&priv->wheel);
     rl_free(priv, RL_MT_SHIM);
 
     PD("IPC [%p] destroyed\n", priv);
@@ -2364,8 +3840,10 @@ static struct ipcp_factory normal_factory = {
     .ops.pduft_flush        = rl_pduft_flush,
     .ops.pduft_del          = rl_pduft_del,
     .ops.pduft_del_addr     = rl_pduft_del_addr,
+    .ops.pduft_replace      = rl_pduft_replace,
     .ops.mgmt_sdu_build     = rl_normal_mgmt_sdu_build,
     .ops.sdu_rx             = rl_normal_sdu_rx,
+    .ops.sdu_rx_batch       = rl_normal_sdu_rx_batch,
     .ops.flow_writeable     = rl_normal_flow_writeable,
     .ops.qos_supported      = rl_normal_qos_supported,
     .ops.sched_config       = rl_normal_sched_config,
@@ -2395,6 +3873,13 @@ rl_normal_init(void)
     /* Build the (static) list of PDU schedulers. */
     list_add_tail(&rl_sched_pfifo_ops.node, &rl_pdu_schedulers);
     list_add_tail(&rl_sched_wrr_ops.node, &rl_pdu_schedulers);
+    list_add_tail(&rl_sched_mqpfifo_ops.node, &rl_pdu_schedulers);
+    list_add_tail(&rl_sched_drr_ops.node, &rl_pdu_schedulers);
+    list_add_tail(&rl_sched_prio_drr_ops.node, &rl_pdu_schedulers);
+
+    /* Build the (static) list of congestion control algorithms. */
+    list_add_tail(&rl_cc_aimd_ops.node, &rl_cc_algos);
+    list_add_tail(&rl_cc_delay_ops.node, &rl_cc_algos);
 
     return rl_ipcp_factory_register(&normal_factory);
 }
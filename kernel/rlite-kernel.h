@@ -42,6 +42,8 @@
 #include <linux/uaccess.h>
 #include <linux/uio.h>
 #include <linux/hashtable.h>
+#include <linux/bitmap.h>
+#include <linux/rcupdate.h>
 
 #include "kerconfig.h"
 
@@ -159,12 +161,23 @@ struct rl_buf *rl_buf_clone(struct rl_buf *rb, gfp_t gfp);
 
 void __rl_buf_free(struct rl_buf *rb);
 
+#ifndef RL_SKB
+struct sk_buff *rl_buf_to_skb(struct rl_buf *rb, size_t hdroom,
+                              size_t tailroom);
+#endif /* !RL_SKB */
+
+int rl_bufcache_init(void);
+
+void rl_bufcache_fini(void);
+
+void rl_bufcache_stats(uint64_t *hit, uint64_t *miss);
+
 union rl_buf_ctx {
     struct {
         /* Used in the TX datapath when this rb ends up into
-         * a retransmission queue. */
-        unsigned long rtx_jiffies;
-        unsigned long jiffies;
+         * a retransmission queue. Times are in nanoseconds. */
+        s64 t_rtx; /* retransmission deadline */
+        s64 t_tx;  /* first transmission, 0 if retransmitted */
     } rtx;
 
     struct {
@@ -177,6 +190,18 @@ union rl_buf_ctx {
         /* Used in the RX datapath for flow control. */
         rlm_seq_t cons_seqnum;
     } rx;
+
+    struct {
+        /* Used by the shim IPCPs on PDU aggregates. */
+        unsigned int pdus;
+    } agg;
+
+    struct {
+        /* Used in the TX datapath when this rb ends up into
+         * a pacing queue. Times are in nanoseconds. */
+        s64 t_enq;
+        s64 t_tx;
+    } pace;
 };
 
 #ifndef RL_SKB
@@ -203,6 +228,8 @@ struct rl_buf {
 #define RL_BUF_RTX(rb) (rb)->u.rtx
 #define RL_BUF_RX(rb) (rb)->u.rx
 #define RL_BUF_RMT(rb) (rb)->u.rmt
+#define RL_BUF_AGG(rb) (rb)->u.agg
+#define RL_BUF_PACE(rb) (rb)->u.pace
 
 /* Amount of memory consumed by this packet. */
 static inline unsigned int
@@ -246,6 +273,15 @@ rl_buf_append(struct rl_buf *rb, size_t len)
     BUG_ON((uint8_t *)(rb->pci) + rb->len > rb->raw->buf + rb->raw->size);
 }
 
+/* Shrink the data to 'len' bytes. */
+static inline void
+rl_buf_trim(struct rl_buf *rb, size_t len)
+{
+    if (len < rb->len) {
+        rb->len = len;
+    }
+}
+
 #ifdef RL_HAVE_CHRDEV_RW_ITER
 static inline int
 rl_buf_copy_to_user(struct rl_buf *rb, struct iov_iter *to, size_t bytes)
@@ -262,6 +298,18 @@ rl_buf_copy_to_user(struct rl_buf *rb, const struct iovec *to, size_t bytes)
 }
 #endif /* AIO_RW */
 
+static inline int
+rl_buf_copy_to_ubuf(struct rl_buf *rb, void __user *ubuf, size_t bytes)
+{
+    return copy_to_user(ubuf, RL_BUF_DATA(rb), bytes) ? -EFAULT : bytes;
+}
+
+static inline void
+rl_buf_copy_bits(struct rl_buf *rb, void *dst, size_t bytes)
+{
+    memcpy(dst, RL_BUF_DATA(rb), bytes);
+}
+
 #define rl_buf_free(_rb)                                                       \
     do {                                                                       \
         BUG_ON((_rb) == NULL);                                                 \
@@ -273,6 +321,7 @@ rl_buf_copy_to_user(struct rl_buf *rb, const struct iovec *to, size_t bytes)
 #define rb_list list_head
 #define rb_list_init(l) INIT_LIST_HEAD((l))
 #define rb_list_enq(rb, q) list_add_tail_safe(&(rb)->node, q)
+#define rb_list_enq_head(rb, q) list_add_safe(&(rb)->node, q)
 #define rb_list_del(rb) list_del_init(&(rb)->node)
 #define rb_list_empty(l) list_empty(l)
 #define rb_list_front(l) list_first_entry(l, struct rl_buf, node)
@@ -291,6 +340,8 @@ rl_buf_copy_to_user(struct rl_buf *rb, const struct iovec *to, size_t bytes)
 #define RL_BUF_RTX(rb) ((union rl_buf_ctx *)((rb)->cb))->rtx
 #define RL_BUF_RX(rb) ((union rl_buf_ctx *)((rb)->cb))->rx
 #define RL_BUF_RMT(rb) ((union rl_buf_ctx *)((rb)->cb))->rmt
+#define RL_BUF_AGG(rb) ((union rl_buf_ctx *)((rb)->cb))->agg
+#define RL_BUF_PACE(rb) ((union rl_buf_ctx *)((rb)->cb))->pace
 
 static inline unsigned int
 rl_buf_truesize(struct rl_buf *rb)
@@ -325,6 +376,7 @@ rl_buf_custom_push(struct rl_buf *rb, size_t len)
 }
 
 #define rl_buf_append(_rb, _len) skb_put(_rb, _len)
+#define rl_buf_trim(_rb, _len) skb_trim(_rb, _len)
 
 #ifdef RL_HAVE_CHRDEV_RW_ITER
 static inline int
@@ -344,6 +396,22 @@ rl_buf_copy_to_user(struct rl_buf *rb, const struct iovec *to, size_t bytes)
 }
 #endif /* AIO_RW */
 
+static inline int
+rl_buf_copy_to_ubuf(struct rl_buf *rb, void __user *ubuf, size_t bytes)
+{
+    if (unlikely(skb_linearize(rb))) {
+        return -ENOMEM;
+    }
+
+    return copy_to_user(ubuf, RL_BUF_DATA(rb), bytes) ? -EFAULT : bytes;
+}
+
+static inline void
+rl_buf_copy_bits(struct rl_buf *rb, void *dst, size_t bytes)
+{
+    skb_copy_bits(rb, 0, dst, bytes);
+}
+
 #define rl_buf_free(_rb)                                                       \
     do {                                                                       \
         BUG_ON((_rb) == NULL);                                                 \
@@ -380,6 +448,16 @@ rb_list_enq(struct rl_buf *elem, struct rb_list *list)
     list->prev       = elem;
 }
 
+static inline void
+rb_list_enq_head(struct rl_buf *elem, struct rb_list *list)
+{
+    BUG_ON(elem->prev != NULL || elem->next != NULL);
+    list->next->prev = elem;
+    elem->prev       = (struct rl_buf *)list;
+    elem->next       = list->next;
+    list->next       = elem;
+}
+
 static inline void
 rb_list_del(struct rl_buf *elem)
 {
@@ -406,6 +484,46 @@ rb_list_front(struct rb_list *list)
 
 #endif /* RL_SKB */
 
+/*
+ * PDU aggregation, used by the shim IPCPs to pack multiple PDUs headed
+ * to the same lower flow into a single frame or datagram. Each PDU is
+ * prefixed by its length (16 bits, network order); a zero length (e.g.
+ * Ethernet padding) terminates the aggregate.
+ */
+#define RL_AGG_PFXLEN 2
+
+/* Maximum number of complete aggregates waiting for transmission,
+ * before backpressure is applied to the writers. */
+#define RL_AGG_READY_MAX 16
+
+struct rl_agg {
+    spinlock_t lock;
+    struct rl_buf *cur;   /* aggregate being filled, or NULL */
+    struct rb_list ready; /* complete aggregates */
+    unsigned int ready_len;
+    bool stalled; /* a writer got -EAGAIN */
+};
+
+void rl_agg_init(struct rl_agg *agg);
+
+void rl_agg_fini(struct rl_agg *agg);
+
+int rl_agg_enq(struct rl_agg *agg, struct rl_buf *rb, size_t budget,
+               size_t hdrlen, size_t hdroom, size_t tailroom);
+
+struct rl_buf *rl_agg_deq(struct rl_agg *agg);
+
+bool rl_agg_unstall(struct rl_agg *agg);
+
+static inline bool
+rl_agg_writeable(struct rl_agg *agg)
+{
+    return READ_ONCE(agg->ready_len) < RL_AGG_READY_MAX;
+}
+
+int rl_agg_split(const uint8_t *buf, size_t len, size_t hdroom,
+                 size_t tailroom, struct rb_list *pdus);
+
 /*
  * Kernel data-structures.
  */
@@ -413,7 +531,7 @@ rb_list_front(struct rb_list *list)
 struct ipcp_entry;
 struct flow_entry;
 struct rl_ctrl;
-struct pduft_entry;
+struct pduft_nhop;
 
 struct ipcp_ops {
     bool (*flow_writeable)(struct flow_entry *flow);
@@ -447,15 +565,22 @@ struct ipcp_ops {
                      struct rl_buf *rb, unsigned flags);
     struct rl_buf *(*sdu_rx)(struct ipcp_entry *ipcp, struct rl_buf *rb,
                              struct flow_entry *lower_flow);
+    /* Optional batched version of sdu_rx, which consumes the PDUs in
+     * @rbs. On return @rbs contains the SDUs to be queued to userspace. */
+    void (*sdu_rx_batch)(struct ipcp_entry *ipcp, struct rb_list *rbs,
+                         struct flow_entry *lower_flow);
     int (*config)(struct ipcp_entry *ipcp, const char *param_name,
                   const char *param_value, int *notify);
     int (*config_get)(struct ipcp_entry *ipcp, const char *param_name,
                       char *buf, int buflen);
     int (*pduft_set)(struct ipcp_entry *ipcp, rlm_addr_t dst_addr,
                      struct flow_entry *flow);
-    int (*pduft_del)(struct ipcp_entry *ipcp, struct pduft_entry *entry);
+    int (*pduft_del)(struct ipcp_entry *ipcp, struct pduft_nhop *nhop);
     int (*pduft_del_addr)(struct ipcp_entry *ipcp, rlm_addr_t dst_addr);
     int (*pduft_flush)(struct ipcp_entry *ipcp);
+    int (*pduft_replace)(struct ipcp_entry *ipcp, const rlm_addr_t *addrs,
+                         struct flow_entry **flows, const uint8_t *nhflags,
+                         unsigned int n);
     int (*mgmt_sdu_build)(struct ipcp_entry *ipcp,
                           const struct rl_mgmt_hdr *hdr, struct rl_buf *rb,
                           struct ipcp_entry **lower_ipcp,
@@ -465,10 +590,19 @@ struct ipcp_ops {
     int (*sched_config)(struct ipcp_entry *ipcp, struct rl_msg_base *bmsg);
 };
 
+/* Memory budget for the userspace receive queue of a flow, used to
+ * size the advertised flow control window. The budget starts from
+ * RL_RXQ_BUDGET_INIT and grows with the rate at which the application
+ * reads, up to RL_RXQ_BUDGET_MAX. */
+#define RL_RXQ_BUDGET_INIT (256 << 10)
+#define RL_RXQ_BUDGET_MAX (4 << 20)
+
 struct txrx {
     /* Read operation support. */
     struct rb_list rx_q;
-    unsigned int rx_qsize; /* in bytes */
+    unsigned int rx_qsize;   /* in bytes */
+    unsigned int rx_qbudget; /* in bytes */
+    unsigned int rx_avgsz;   /* average truesize of the queued SDUs */
     wait_queue_head_t rx_wqh;
     spinlock_t rx_lock;
 #define RL_TXRX_EOF (1 << 0)
@@ -555,11 +689,47 @@ struct upper_ref {
     struct ipcp_entry *ipcp;
 };
 
-/* Support for token bucket traffic shaping. */
+/* Timer serviced by the timer wheel of a normal IPCP. */
+struct rl_tmr_wheel;
+
+struct rl_wtimer {
+    struct hlist_node node;
+    unsigned long expires; /* absolute time in jiffies */
+    unsigned int slot;     /* wheel slot, valid if pending */
+    struct rl_tmr_wheel *wheel;
+    void (*func)(struct rl_wtimer *);
+};
+
+static inline bool
+rl_wtimer_pending(const struct rl_wtimer *w)
+{
+    return !hlist_unhashed(&w->node);
+}
+
+void rl_wtimer_setup(struct rl_wtimer *w, struct rl_tmr_wheel *wheel,
+                     void (*func)(struct rl_wtimer *));
+int rl_wtimer_mod(struct rl_wtimer *w, unsigned long expires);
+int rl_wtimer_del(struct rl_wtimer *w);
+void rl_wtimer_del_sync(struct rl_wtimer *w);
+
+/* Support for token bucket traffic shaping. PDUs are paced according to a
+ * virtual clock (t_next), which advances by the transmission time of each
+ * PDU at the configured rate. PDUs that are not due yet are queued and
+ * released by an hrtimer. */
 struct tkbk {
-    ktime_t t_last_refill;
-    unsigned long bucket_size;
-    unsigned long intval_ms;
+    uint64_t rate;  /* in bits per second */
+    s64 burst_ns;   /* how much t_next can lag behind the current time */
+    s64 t_next;     /* departure time of the next PDU, in nanoseconds */
+    struct rb_list q;
+    unsigned int qlen;
+    bool blocked; /* a writer is waiting for the queue to drain */
+    struct hrtimer timer;
+    struct tasklet_struct tasklet;
+
+    /* Statistics. */
+    uint64_t pkts;         /* PDUs that went through the shaper */
+    uint64_t delay_sum_ns; /* total pacing delay */
+    uint64_t delay_max_ns; /* maximum pacing delay */
 };
 
 struct dtp {
@@ -570,21 +740,39 @@ struct dtp {
     /* Sender state. */
     rlm_seq_t snd_lwe;
     rlm_seq_t snd_rwe;
-    rlm_seq_t next_seq_num_to_use;
+    union {
+        rlm_seq_t next_seq_num_to_use;
+        /* Used instead of next_seq_num_to_use by lockless flows
+         * (DTP_F_LOCKLESS), without holding the DTP lock. */
+        atomic64_t next_seq_num_atomic;
+    };
     rlm_seq_t last_seq_num_sent;
     rlm_seq_t last_ctrl_seq_num_rcvd;
     struct rb_list cwq;
     unsigned int cwq_len;
     unsigned int max_cwq_len;
-    struct timer_list snd_inact_tmr;
+    struct rl_wtimer snd_inact_tmr;
     struct rb_list rtxq;
     unsigned int rtxq_len;
     unsigned int max_rtxq_len;
-    struct timer_list rtx_tmr;
+    struct hrtimer rtx_tmr;
+    struct tasklet_struct rtx_tasklet;
     struct rl_buf *rtx_tmr_next; /* the packet is going to expire next */
-    unsigned rtt;                /* estimated round trip time, in jiffies. */
-    unsigned rtt_stddev;
-    unsigned cgwin; /* number of PDUs in the congestion window */
+    rlm_seq_t sack_rtx_next;     /* first PDU that SACK can retransmit */
+    rlm_seq_t sack_recover;      /* SACK loss recovery ends at this PDU */
+    uint64_t rtt;                /* estimated round trip time, in ns */
+    uint64_t rtt_stddev;         /* in ns */
+    uint64_t rto_min;            /* lower bound for the RTO, in ns */
+    unsigned cgwin;    /* number of PDUs in the congestion window */
+    unsigned ssthresh; /* slow start threshold, in PDUs */
+
+    /* Congestion control state. */
+    const struct rl_cc_ops *cc;
+    unsigned cc_acked;      /* PDUs acked in the current round */
+    uint64_t rtt_min;       /* minimum RTT sample, in ns */
+    unsigned pdu_len_avg;   /* average length of the PDUs sent */
+    s64 cc_epoch;           /* don't react to congestion before this (ns) */
+    uint64_t pacing_rate;   /* in bytes per second */
     struct tkbk tkbk;
 
     /* Receiver state. */
@@ -593,19 +781,46 @@ struct dtp {
     rlm_seq_t rcv_rwe;
     rlm_seq_t max_seq_num_rcvd;
     rlm_seq_t last_lwe_sent;
+    rlm_seq_t last_rwe_sent;
     rlm_seq_t last_seq_num_acked;
     rlm_seq_t next_snd_ctl_seq;
-    struct timer_list rcv_inact_tmr;
-    struct rb_list seqq;
+    rlm_seq_t rcvbuf_seq;       /* rcv_lwe at the start of rcvbuf_stamp */
+    unsigned long rcvbuf_stamp; /* start of the autotuning interval */
+    unsigned int ack_bytes;     /* bytes received since the last ACK */
+    uint64_t data_pdus_rcvd;
+    uint64_t ctrl_pdus_sent;
+    struct rl_wtimer rcv_inact_tmr;
+    struct rl_buf **seqq; /* ring of PDUs indexed by sequence number */
+    unsigned int seqq_mask;
+    unsigned int seqq_max_len;
     unsigned int seqq_len;
-    struct timer_list a_tmr;
+    unsigned int seqq_hwm; /* seqq_len high-water mark */
+    struct rl_wtimer a_tmr;
+    struct hrtimer ack_tmr; /* bounds coalesced ACKs when A is zero */
+    struct tasklet_struct ack_tasklet;
 
 #define DTP_F_DRF_SET (1 << 0)
 #define DTP_F_DRF_EXPECTED (1 << 1)
 #define DTP_F_TIMERS_INITIALIZED (1 << 2)
+#define DTP_F_SACK_RECOVERY (1 << 3)
+#define DTP_F_ECN_ECHO (1 << 4)
+#define DTP_F_PACING (1 << 5)
+#define DTP_F_LOCKLESS (1 << 6)
+#define DTP_F_RTT_SAMPLED (1 << 7)
     uint8_t flags;
 };
 
+/* Lockless flows do not update last_seq_num_sent, since it would be
+ * written by all the CPUs transmitting on the flow. */
+static inline rlm_seq_t
+dtp_last_seq_num_sent(struct dtp *dtp)
+{
+    if (dtp->flags & DTP_F_LOCKLESS) {
+        return atomic64_read(&dtp->next_seq_num_atomic) - 1;
+    }
+    return dtp->last_seq_num_sent;
+}
+
 struct flow_entry {
     rl_port_t local_port; /* flow table key */
     rl_port_t remote_port;
@@ -641,15 +856,50 @@ struct flow_entry {
 #define RL_FLOW_DEL_POSTPONED (1 << 4) /* flow removal has been postponed */
 #define RL_FLOW_INITIATOR (1 << 5)     /* local node initiated this flow */
     uint8_t flags;
+    uint8_t down; /* lower flow reported down, see rl_flow_state_set() */
     struct hlist_node node;
     struct hlist_node node_cep;
 };
 
+/*
+ * Compute the RTX timeout interval (in nanoseconds) using the estimate of
+ * RTT mean and standard deviation. However, we have to make sure that the
+ * interval is bigger than the A timeout interval by a good margin, otherwise
+ * the sender will incur into unnecessary retransmits. The rto_min floor
+ * protects against spurious retransmissions on very short RTTs.
+ */
+static inline s64
+rtt_to_rtx(const struct flow_entry *flow)
+{
+    const struct dtp *dtp = &flow->dtp;
+    uint64_t x            = dtp->rtt + (dtp->rtt_stddev << 1);
+    uint64_t two_a = (uint64_t)flow->cfg.dtcp.initial_a * 2 * NSEC_PER_MSEC;
+
+    return max3(x, two_a, dtp->rto_min);
+}
+
+/* A PDUFT entry maps an address to a small set of equal-cost next
+ * hops (lower flows). The datapath picks one of them by hashing the
+ * PCI, so that the PDUs of a given connection always take the same
+ * path, while different connections are spread across the paths.
+ * Backup next hops (e.g. Loop Free Alternates) can be preinstalled, and
+ * are selected in the same way when all the primary next hops are
+ * down. */
+#define RL_PDUFT_NHOPS_MAX 4
+
+struct pduft_nhop {
+    struct flow_entry *flow;
+    bool backup;               /* only used if the primaries are down */
+    struct pduft_entry *entry; /* backpointer */
+    struct list_head fnode;    /* for the flow->pduft_entries list */
+};
+
 struct pduft_entry {
     rlm_addr_t address; /* pdu_ft key */
-    struct flow_entry *flow;
-    struct hlist_node node; /* for the pdu_ft hash table */
-    struct list_head fnode; /* for the flow->pduft_entries list */
+    unsigned int num_nhops;
+    struct pduft_nhop nhops[RL_PDUFT_NHOPS_MAX];
+    struct hlist_node node[2]; /* for the pdu_ft hash table */
+    struct rcu_head rcu;
 };
 
 int __ipcp_put(struct ipcp_entry *entry);
@@ -680,6 +930,9 @@ int rl_ipcp_factory_unregister(const char *dif_type);
 struct net *rl_ipcp_net(struct ipcp_entry *ipcp);
 
 bool rl_ipcp_has_flows(struct ipcp_entry *ipcp, bool report);
+
+int rl_ipcp_update_notify(struct ipcp_entry *ipcp);
+int rl_flow_state_set(struct flow_entry *flow, uint16_t state);
 int rl_fa_req_arrived(struct ipcp_entry *ipcp, uint32_t kevent_id,
                       rl_port_t remote_port, rlm_cepid_t remote_cep,
                       rlm_qosid_t qos_id, rlm_addr_t remote_addr,
@@ -701,6 +954,9 @@ int rl_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb, rl_port_t local_port);
 int rl_sdu_rx_flow(struct ipcp_entry *ipcp, struct flow_entry *flow,
                    struct rl_buf *rb, bool qlimit);
 
+int rl_sdu_rx_flow_batch(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                         struct rb_list *rbs, bool qlimit);
+
 struct rl_buf *rl_sdu_rx_shortcut(struct ipcp_entry *ipcp, struct rl_buf *rb);
 
 void rl_write_restart_flow(struct flow_entry *flow);
@@ -748,7 +1004,9 @@ txrx_init(struct txrx *txrx, struct ipcp_entry *ipcp)
 {
     spin_lock_init(&txrx->rx_lock);
     rb_list_init(&txrx->rx_q);
-    txrx->rx_qsize = 0;
+    txrx->rx_qsize   = 0;
+    txrx->rx_qbudget = RL_RXQ_BUDGET_INIT;
+    txrx->rx_avgsz   = 0;
     init_waitqueue_head(&txrx->rx_wqh);
     txrx->ipcp = ipcp;
     init_waitqueue_head(&txrx->__tx_wqh);
@@ -758,54 +1016,145 @@ txrx_init(struct txrx *txrx, struct ipcp_entry *ipcp)
 
 struct rl_sched;
 
+/* The enq() and deq() callbacks operate on a sub-queue, and are invoked
+ * under the sub-queue lock. Schedulers providing the select() callback
+ * are multi-queue, with one sub-queue (and dequeue worker) per online
+ * CPU; the other ones only use sub-queue 0. */
 struct rl_sched_ops {
     const char *name;
     size_t priv_size;
     int (*init)(struct rl_sched *);
     void (*fini)(struct rl_sched *);
     int (*config)(struct rl_sched *, const struct rl_msg_base *bmsg);
-    int (*enq)(struct rl_sched *, struct rl_buf *);
-    struct rl_buf *(*deq)(struct rl_sched *);
+    unsigned int (*select)(struct rl_sched *, struct rl_buf *);
+    int (*enq)(struct rl_sched *, unsigned int sq, struct rl_buf *);
+    struct rl_buf *(*deq)(struct rl_sched *, unsigned int sq);
     struct list_head node;
 };
 
+struct rl_sched_sq {
+    spinlock_t qlock;
+    struct work_struct deq_work;
+    struct rl_sched *sched;
+    unsigned int idx;
+    int cpu; /* where the dequeue worker runs, or WORK_CPU_UNBOUND */
+};
+
 struct rl_sched {
     struct rl_sched_ops ops;
+    struct ipcp_entry *ipcp;
     wait_queue_head_t wqh;
-    spinlock_t qlock;
+    unsigned int num_sq;
+    struct rl_sched_sq *sq;
 #define RL_SCHED_PRIV(_sched) ((void *)(_sched)->priv)
     /* Private data allocated at the end of the struct. */
     char priv[0];
 };
 
+/* Congestion control algorithm, used by flows with retransmission
+ * control. The callbacks are invoked under the DTP lock, and are in
+ * charge of updating dtp->cgwin and dtp->ssthresh. */
+struct rl_cc_ops {
+    const char *name;
+    void (*init)(struct flow_entry *flow);
+    /* Some PDUs have been acked. The 'rtt' sample is in nanoseconds (0 if
+     * not available), and 'ecn' is set if the receiver echoed a congestion
+     * mark. */
+    void (*on_ack)(struct flow_entry *flow, unsigned int acked, uint64_t rtt,
+                   bool ecn);
+    /* A loss has been detected, by the retransmission timer or by a
+     * selective ACK. */
+    void (*on_loss)(struct flow_entry *flow, bool timeout);
+    struct list_head node;
+};
+
+/* PDUFT hash table, with a variable number of buckets. Entries are
+ * linked through their node[idx] hash node. */
+struct pduft_table {
+    unsigned int bits;
+    unsigned int idx;
+    struct rl_normal *priv; /* used when freeing an old table */
+    struct rcu_head rcu;
+    struct hlist_head buckets[0];
+};
+
+/* A two-level hashed timer wheel, servicing all the DTP timers of a
+ * normal IPCP with a single timer_list. The first level has one-jiffy
+ * slots, covering the next RL_TMR_WHEEL_SLOTS jiffies. The second level
+ * has slots of RL_TMR_WHEEL_SLOTS jiffies, which are cascaded into the
+ * first level as the wheel turns. Timers expiring beyond a whole second
+ * level round are kept in their slot until the wheel comes around. */
+#define RL_TMR_WHEEL_BITS 8
+#define RL_TMR_WHEEL_SLOTS (1 << RL_TMR_WHEEL_BITS)
+#define RL_TMR_WHEEL_L1_BITS 6
+#define RL_TMR_WHEEL_L1_SLOTS (1 << RL_TMR_WHEEL_L1_BITS)
+#define RL_TMR_WHEEL_ALL_SLOTS (RL_TMR_WHEEL_SLOTS + RL_TMR_WHEEL_L1_SLOTS)
+struct rl_tmr_wheel {
+    spinlock_t lock;
+    struct timer_list tmr;
+    unsigned long clk;            /* next jiffy to be processed */
+    unsigned int armed;           /* number of pending timers */
+    struct rl_wtimer *running;    /* timer whose callback is running */
+    wait_queue_head_t running_wq; /* for rl_wtimer_del_sync() */
+    struct ipcp_entry *ipcp;      /* for the stats */
+    DECLARE_BITMAP(busy, RL_TMR_WHEEL_ALL_SLOTS);
+    struct hlist_head slots[RL_TMR_WHEEL_ALL_SLOTS];
+};
+
+void rl_tmr_wheel_init(struct rl_tmr_wheel *wheel, struct ipcp_entry *ipcp);
+void rl_tmr_wheel_fini(struct rl_tmr_wheel *wheel);
+
 /* Implementation of the normal IPCP. */
 struct rl_normal {
     struct ipcp_entry *ipcp;
-    uint16_t ttl; /* time to live */
-    bool csum;    /* compute/check internet checksum on each PDU */
+    uint16_t ttl;  /* time to live */
+    uint8_t csum;  /* checksum to compute/check on each PDU */
+#define RL_CSUM_NONE 0
+#define RL_CSUM_INET 1
+#define RL_CSUM_CRC32C 2
+    uint32_t rto_min_us; /* lower bound for the retransmission timeout */
+#define RL_RTO_MIN_US_DFLT 1000
 
     /* Implementation of the PDU Forwarding Table (PDUFT).
-     * An hash table, a default entry and a lock. */
-#define PDUFT_HASHTABLE_BITS 3
-    DECLARE_HASHTABLE(pdu_ft, PDUFT_HASHTABLE_BITS);
+     * An RCU-protected resizable hash table, a default entry and
+     * a lock to serialize the writers. */
+#define PDUFT_BITS_MIN 3
+#define PDUFT_BITS_MAX 14
+    struct pduft_table __rcu *pduft;
+    unsigned int pduft_count;
+    bool pduft_resizing;
     struct flow_entry *pduft_dflt;
-    rwlock_t pduft_lock;
+    spinlock_t pduft_lock;
 
     /* Support for PDU scheduling. May be NULL if no PDU scheduler is
      * actually installed. */
     struct rl_sched *sched;
-    struct work_struct sched_deq_work;
+
+    /* Congestion control algorithm used by flows that do not ask for
+     * a specific one. */
+    const struct rl_cc_ops *cc;
+
+    /* Timer wheel for the DTP timers of all the flows. */
+    struct rl_tmr_wheel wheel;
 };
 
 void dtp_init(struct dtp *dtp);
 void dtp_fini(struct dtp *dtp);
+int dtp_seqq_init(struct dtp *dtp, unsigned int max_len);
+unsigned int dtp_seqq_flush(struct dtp *dtp);
 void dtp_dump(struct dtp *dtp);
 int rl_pduft_del_addr(struct ipcp_entry *ipcp, rlm_addr_t dst_addr);
-int rl_pduft_del(struct ipcp_entry *ipcp, struct pduft_entry *entry);
+int rl_pduft_del(struct ipcp_entry *ipcp, struct pduft_nhop *nhop);
 int rl_pduft_flush(struct ipcp_entry *ipcp);
 int rl_pduft_set(struct ipcp_entry *ipcp, rlm_addr_t dst_addr,
                  struct flow_entry *flow);
-struct flow_entry *rl_pduft_lookup(struct rl_normal *priv, rlm_addr_t dst_addr);
+int rl_pduft_replace(struct ipcp_entry *ipcp, const rlm_addr_t *addrs,
+                     struct flow_entry **flows, const uint8_t *nhflags,
+                     unsigned int n);
+int rl_pduft_init(struct rl_normal *priv);
+void rl_pduft_fini(struct rl_normal *priv);
+struct flow_entry *rl_pduft_lookup(struct rl_normal *priv, rlm_addr_t dst_addr,
+                                   uint32_t hash);
 
 #define RL_UNBOUND_FLOW_TO (msecs_to_jiffies(15000))
 
@@ -815,6 +1164,12 @@ struct flow_entry *rl_pduft_lookup(struct rl_normal *priv, rlm_addr_t dst_addr);
         list_add_tail(e, h);                                                   \
     } while (0)
 
+#define list_add_safe(e, h)                                                    \
+    do {                                                                       \
+        BUG_ON(!list_empty(e));                                                \
+        list_add(e, h);                                                        \
+    } while (0)
+
 typedef enum {
     RL_MT_UTILS = 0,
     RL_MT_BUFHDR,
@@ -839,11 +1194,13 @@ typedef enum {
 void *rl_alloc(size_t size, gfp_t gfp, rl_memtrack_t type);
 char *rl_strdup(const char *s, gfp_t gfp, rl_memtrack_t type);
 void rl_free(void *obj, rl_memtrack_t type);
+void rl_memtrack_release(void *obj, rl_memtrack_t type);
 void rl_memtrack_dump_stats(void);
 #else /* ! RL_MEMTRACK */
 #define rl_alloc(_sz, _gfp, _ty) kmalloc(_sz, _gfp)
 #define rl_strdup(_s, _gfp, _ty) kstrdup(_s, _gfp)
 #define rl_free(_obj, _ty) kfree(_obj)
+#define rl_memtrack_release(_obj, _ty)
 #endif /* ! RL_MEMTRACK */
 
 #endif /* __RLITE_KERNEL_H__ */
@@ -37,10 +37,20 @@
 #include <linux/netdevice.h>
 #include <linux/if_arp.h>
 #include <linux/rtnetlink.h>
-#include <linux/rwlock.h>
+#include <linux/spinlock.h>
 #include <linux/if_ether.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
 
 #define ETH_P_RLITE 0xD1F0
+#define ETH_P_RLITE_AGG 0xD1F1 /* aggregate of PDUs, see rl_agg_enq() */
+
+/* Capabilities advertised in a trailing byte of the ARP messages. Older
+ * implementations don't append it, and the Ethernet padding reads as no
+ * capabilities. */
+#define SHIM_ETH_ARP_CAP_AGG (1 << 0) /* ETH_P_RLITE_AGG frames accepted */
 
 struct arpt_entry {
     /* Targed Hardware Address. Only support 48-bit addresses for now. */
@@ -58,12 +68,31 @@ struct arpt_entry {
     /* The flow entry associated to the remote THA. */
     struct flow_entry *flow;
 
+    /* Whether the remote end accepts aggregated PDUs. */
+    bool peer_agg;
+
+    /* PDUs waiting to be aggregated, and the work item that transmits
+     * them. */
+    struct rl_agg agg;
+    struct work_struct agg_work;
+
     /* Used on flow allocator slave side while the flow is in pending state. */
     struct rb_list rx_tmpq;
     unsigned int rx_tmpq_len;
     bool fa_req_arrived;
 
     struct list_head node;
+
+    /* Linkage in the ARP table indexes. An entry is indexed by THA only
+     * once it is complete. */
+    struct hlist_node tpa_node;
+    struct hlist_node mac_node;
+    struct rcu_head rcu;
+};
+
+struct arpt_stats {
+    uint64_t lookups;
+    uint64_t misses;
 };
 
 /* Per TX-queue structure, padded to the cacheline boundary to avoid false
@@ -81,13 +110,30 @@ struct rl_shim_eth {
 
 #define ETH_UPPER_NAMES 4
     char *upper_names[ETH_UPPER_NAMES];
+
+    /* The ARP table is a list of entries, indexed by TPA and by THA with
+     * two hash tables that can be looked up under RCU. Updates are
+     * serialized by arpt_lock. */
     struct list_head arp_table;
-    rwlock_t arpt_lock;
+#define ARPT_HASH_BITS 8
+    DECLARE_HASHTABLE(arpt_tpa, ARPT_HASH_BITS);
+    DECLARE_HASHTABLE(arpt_mac, ARPT_HASH_BITS);
+    unsigned int arpt_entries;
+    struct arpt_stats __percpu *arpt_stats;
+    spinlock_t arpt_lock;
     struct timer_list arp_resolver_tmr;
     bool arp_tmr_shutdown;
     struct list_head node;
+
+    /* Aggregate PDUs towards peers that support it. */
+    bool agg;
+
+    /* Notifies MTU changes to userspace, out of the RTNL lock. */
+    struct work_struct mtu_work;
 };
 
+static void shim_eth_agg_worker(struct work_struct *w);
+
 static LIST_HEAD(shims);
 static DEFINE_MUTEX(shims_lock);
 
@@ -138,22 +184,135 @@ rl_shim_eth_register(struct ipcp_entry *ipcp, char *appl, int reg)
     return 0;
 }
 
-/* To be called under arpt_lock. */
+static size_t
+arp_name_len(const char *buf, size_t buflen)
+{
+    size_t j = 0;
+
+    while (j < buflen && buf[j] != 0) {
+        j++;
+    }
+
+    return j;
+}
+
+/* Bucket of an ARP table index. Entries are appended to the buckets, so
+ * that lookups return the oldest matching entry. */
+#define arpt_bucket(_ht, _key) (&(_ht)[hash_min(_key, HASH_BITS(_ht))])
+
+static inline uint32_t
+arpt_tpa_hash(const char *tpa, size_t len)
+{
+    return jhash(tpa, len, 0);
+}
+
+static inline uint32_t
+arpt_mac_hash(const uint8_t *mac)
+{
+    return jhash(mac, ETH_ALEN, 0);
+}
+
+/* To be called under arpt_lock or RCU read lock. */
 static struct arpt_entry *
 arpt_tpa_lookup(struct rl_shim_eth *priv, const char *dst_app, int dst_app_len)
 {
+    size_t len = arp_name_len(dst_app, dst_app_len);
     struct arpt_entry *entry;
 
-    list_for_each_entry (entry, &priv->arp_table, node) {
-        if (dst_app_len >= strlen(entry->tpa) &&
-            strncmp(entry->tpa, dst_app, dst_app_len) == 0) {
+    this_cpu_inc(priv->arpt_stats->lookups);
+    hash_for_each_possible_rcu(priv->arpt_tpa, entry, tpa_node,
+                               arpt_tpa_hash(dst_app, len))
+    {
+        if (strlen(entry->tpa) == len &&
+            memcmp(entry->tpa, dst_app, len) == 0) {
             return entry;
         }
     }
+    this_cpu_inc(priv->arpt_stats->misses);
 
     return NULL;
 }
 
+/* Index a complete entry by THA. To be called under arpt_lock. */
+static void
+arpt_complete(struct rl_shim_eth *priv, struct arpt_entry *entry,
+              const void *tha)
+{
+    if (entry->complete) {
+        /* The THA may have changed, index the entry again. */
+        hash_del_rcu(&entry->mac_node);
+    }
+    memcpy(entry->tha, tha, sizeof(entry->tha));
+    entry->complete = true;
+    hlist_add_tail_rcu(&entry->mac_node,
+                       arpt_bucket(priv->arpt_mac, arpt_mac_hash(entry->tha)));
+}
+
+/* To be called under arpt_lock. */
+static void
+arpt_insert(struct rl_shim_eth *priv, struct arpt_entry *entry)
+{
+    list_add_tail(&entry->node, &priv->arp_table);
+    hlist_add_tail_rcu(
+        &entry->tpa_node,
+        arpt_bucket(priv->arpt_tpa,
+                    arpt_tpa_hash(entry->tpa, strlen(entry->tpa))));
+    if (entry->complete) {
+        hlist_add_tail_rcu(
+            &entry->mac_node,
+            arpt_bucket(priv->arpt_mac, arpt_mac_hash(entry->tha)));
+    }
+    priv->arpt_entries++;
+}
+
+/* To be called under arpt_lock. The entry must be freed with
+ * arpt_entry_free_deferred(), since RCU readers may still be using it. */
+static void
+arpt_remove(struct rl_shim_eth *priv, struct arpt_entry *entry)
+{
+    list_del_init(&entry->node);
+    hash_del_rcu(&entry->tpa_node);
+    if (entry->complete) {
+        hash_del_rcu(&entry->mac_node);
+    }
+    priv->arpt_entries--;
+}
+
+static void
+arpt_entry_free(struct arpt_entry *entry)
+{
+    if (entry->spa) {
+        rl_free(entry->spa, RL_MT_SHIMDATA);
+    }
+    if (entry->tpa) {
+        rl_free(entry->tpa, RL_MT_SHIMDATA);
+    }
+    rl_free(entry, RL_MT_SHIMDATA);
+}
+
+static void
+arpt_entry_free_rcu(struct rcu_head *head)
+{
+    arpt_entry_free(container_of(head, struct arpt_entry, rcu));
+}
+
+static inline void
+arpt_entry_free_deferred(struct arpt_entry *entry)
+{
+    call_rcu(&entry->rcu, arpt_entry_free_rcu);
+}
+
+static void
+arpt_entry_init(struct arpt_entry *entry)
+{
+    entry->fa_req_arrived = false;
+    rb_list_init(&entry->rx_tmpq);
+    entry->rx_tmpq_len = 0;
+    entry->peer_agg    = false;
+    rl_agg_init(&entry->agg);
+    INIT_WORK(&entry->agg_work, shim_eth_agg_worker);
+}
+
 /* This function is taken after net/ipv4/arp.c:arp_create() */
 static struct sk_buff *
 arp_create(struct rl_shim_eth *priv, uint16_t op, const char *spa, int spa_len,
@@ -169,7 +328,7 @@ arp_create(struct rl_shim_eth *priv, uint16_t op, const char *spa, int spa_len,
 
     pa_len = (tpa_len > spa_len) ? tpa_len : spa_len;
 
-    arp_msg_len = sizeof(*arp) + 2 * (pa_len + netdev->addr_len);
+    arp_msg_len = sizeof(*arp) + 2 * (pa_len + netdev->addr_len) + 1;
 
     skb = alloc_skb(hhlen + arp_msg_len + netdev->needed_tailroom, gfp);
     if (!skb) {
@@ -217,7 +376,10 @@ arp_create(struct rl_shim_eth *priv, uint16_t op, const char *spa, int spa_len,
     /* Fill in the zero-padded Target Protocol Address. */
     memcpy(ptr, tpa, tpa_len);
     memset(ptr + tpa_len, 0, pa_len - tpa_len);
-    /* ptr += pa_len; */
+    ptr += pa_len;
+
+    /* Fill in the capabilities. */
+    *ptr = READ_ONCE(priv->agg) ? SHIM_ETH_ARP_CAP_AGG : 0;
 
     return skb;
 }
@@ -244,7 +406,7 @@ arp_resolver_cb(
 
     skb_queue_head_init(&skbq);
 
-    write_lock_bh(&priv->arpt_lock);
+    spin_lock_bh(&priv->arpt_lock);
 
     /* Scan the ARP table looking for incomplete entries. For each
      * incomplete entry found, generate a corresponding ARP request message.
@@ -277,7 +439,7 @@ arp_resolver_cb(
                   jiffies + msecs_to_jiffies(ARP_TMR_INT_MS));
     }
 
-    write_unlock_bh(&priv->arpt_lock);
+    spin_unlock_bh(&priv->arpt_lock);
 
     /* Send all the generated requests. */
     for (;;) {
@@ -299,8 +461,8 @@ arpt_flow_bind(struct arpt_entry *entry, struct flow_entry *flow)
      * removed. However, it would not be necessary, since the core
      * will notify us with ops->flow_deallocated, so that we can
      * unbind. */
-    entry->flow = flow;
-    flow->priv  = entry;
+    WRITE_ONCE(entry->flow, flow);
+    flow->priv = entry;
 
     rl_flow_share_tx_wqh(flow);
 }
@@ -322,7 +484,7 @@ rl_shim_eth_fa_req(struct ipcp_entry *ipcp, struct flow_entry *flow,
         return -EINVAL;
     }
 
-    write_lock_bh(&priv->arpt_lock);
+    spin_lock_bh(&priv->arpt_lock);
 
     entry = arpt_tpa_lookup(priv, flow->remote_appl, strlen(flow->remote_appl));
     if (entry) {
@@ -336,7 +498,7 @@ rl_shim_eth_fa_req(struct ipcp_entry *ipcp, struct flow_entry *flow,
             ret = 0;
         }
 
-        write_unlock_bh(&priv->arpt_lock);
+        spin_unlock_bh(&priv->arpt_lock);
 
         if (ret == 0) {
             rl_fa_resp_arrived(ipcp, flow->local_port, 0, 0, 0, 0, 0, NULL,
@@ -348,58 +510,51 @@ rl_shim_eth_fa_req(struct ipcp_entry *ipcp, struct flow_entry *flow,
 
     entry = rl_alloc(sizeof(*entry), GFP_ATOMIC | __GFP_ZERO, RL_MT_SHIMDATA);
     if (!entry) {
-        write_unlock_bh(&priv->arpt_lock);
+        spin_unlock_bh(&priv->arpt_lock);
         goto nomem;
     }
 
     entry->tpa = rl_strdup(flow->remote_appl, GFP_ATOMIC, RL_MT_SHIMDATA);
     entry->spa = rl_strdup(flow->local_appl, GFP_ATOMIC, RL_MT_SHIMDATA);
     if (!entry->tpa || !entry->spa) {
-        write_unlock_bh(&priv->arpt_lock);
+        spin_unlock_bh(&priv->arpt_lock);
+        arpt_entry_free(entry);
         goto nomem;
     }
 
-    entry->complete       = false; /* Not meaningful. */
-    entry->fa_req_arrived = false;
-    rb_list_init(&entry->rx_tmpq);
-    entry->rx_tmpq_len = 0;
+    entry->complete = false; /* Not meaningful. */
+    arpt_entry_init(entry);
     arpt_flow_bind(entry, flow);
-    list_add_tail(&entry->node, &priv->arp_table);
+    arpt_insert(priv, entry);
 
-    write_unlock_bh(&priv->arpt_lock);
+    spin_unlock_bh(&priv->arpt_lock);
 
     skb = arp_create(priv, ARPOP_REQUEST, flow->local_appl,
                      strlen(flow->local_appl), flow->remote_appl,
                      strlen(flow->remote_appl), NULL, GFP_KERNEL);
     if (!skb) {
+        spin_lock_bh(&priv->arpt_lock);
+        arpt_remove(priv, entry);
+        flow->priv = NULL;
+        spin_unlock_bh(&priv->arpt_lock);
+        arpt_entry_free_deferred(entry);
         goto nomem;
     }
 
     dev_queue_xmit(skb);
 
-    write_lock_bh(&priv->arpt_lock);
+    spin_lock_bh(&priv->arpt_lock);
     if (!timer_pending(&priv->arp_resolver_tmr)) {
         mod_timer(&priv->arp_resolver_tmr,
                   jiffies + msecs_to_jiffies(ARP_TMR_INT_MS));
     }
-    write_unlock_bh(&priv->arpt_lock);
+    spin_unlock_bh(&priv->arpt_lock);
 
     return 0;
 
 nomem:
     RPV(1, "Out of memory\n");
 
-    if (entry) {
-        list_del_init(&entry->node);
-        if (entry->tpa) {
-            rl_free(entry->tpa, RL_MT_SHIMDATA);
-        }
-        if (entry->spa) {
-            rl_free(entry->spa, RL_MT_SHIMDATA);
-        }
-        rl_free(entry, RL_MT_SHIMDATA);
-    }
-
     return -ENOMEM;
 }
 
@@ -409,10 +564,9 @@ rl_shim_eth_fa_resp(struct ipcp_entry *ipcp, struct flow_entry *flow,
 {
     struct rl_shim_eth *priv = ipcp->priv;
     struct arpt_entry *entry;
-    struct rl_buf *rb, *tmp;
     int ret = -ENXIO;
 
-    write_lock_bh(&priv->arpt_lock);
+    spin_lock_bh(&priv->arpt_lock);
 
     entry = arpt_tpa_lookup(priv, flow->remote_appl, strlen(flow->remote_appl));
     if (entry) {
@@ -428,32 +582,17 @@ rl_shim_eth_fa_resp(struct ipcp_entry *ipcp, struct flow_entry *flow,
          * initial phase of the data exchange is quite problematic, so it
          * is better to avoid it. */
         PD("Popping %u PDUs from rx_tmpq\n", entry->rx_tmpq_len);
-        rb_list_foreach_safe (rb, tmp, &entry->rx_tmpq) {
-            rb_list_del(rb);
-            rl_sdu_rx_flow(ipcp, flow, rb, true);
-        }
+        rl_sdu_rx_flow_batch(ipcp, flow, &entry->rx_tmpq, true);
         entry->rx_tmpq_len = 0;
         arpt_flow_bind(entry, flow);
         ret = 0;
     }
 
-    write_unlock_bh(&priv->arpt_lock);
+    spin_unlock_bh(&priv->arpt_lock);
 
     return ret;
 }
 
-static size_t
-arp_name_len(const char *buf, size_t buflen)
-{
-    size_t j = 0;
-
-    while (j < buflen && buf[j] != 0) {
-        j++;
-    }
-
-    return j;
-}
-
 static void
 shim_eth_arp_rx(struct rl_shim_eth *priv, struct arphdr *arp, int len)
 {
@@ -461,15 +600,20 @@ shim_eth_arp_rx(struct rl_shim_eth *priv, struct arphdr *arp, int len)
     const char *spa = (const char *)(arp) + sizeof(*arp) + arp->ar_hln;
     const char *tpa =
         (const char *)(arp) + sizeof(*arp) + 2 * arp->ar_hln + arp->ar_pln;
+    size_t caps_ofs         = sizeof(*arp) + 2 * (arp->ar_pln + arp->ar_hln);
     struct flow_entry *flow = NULL;
     struct sk_buff *skb     = NULL;
+    uint8_t caps            = 0;
 
-    if (len < sizeof(*arp) + 2 * (arp->ar_pln + arp->ar_hln)) {
+    if (len < caps_ofs) {
         PI("Dropping truncated ARP message\n");
         return;
     }
+    if (len > caps_ofs) {
+        caps = *((const uint8_t *)arp + caps_ofs);
+    }
 
-    write_lock_bh(&priv->arpt_lock);
+    spin_lock_bh(&priv->arpt_lock);
 
     if (ntohs(arp->ar_op) == ARPOP_REQUEST) {
         struct arpt_entry *entry;
@@ -506,15 +650,14 @@ shim_eth_arp_rx(struct rl_shim_eth *priv, struct arphdr *arp, int len)
                 entry = NULL;
             } else {
                 memcpy(entry->tpa, spa, spa_len);
-                entry->tpa[spa_len]   = '\0';
-                entry->spa            = NULL; /* Won't be needed. */
-                entry->complete       = true;
-                entry->fa_req_arrived = false;
-                rb_list_init(&entry->rx_tmpq);
-                entry->rx_tmpq_len = 0;
-                entry->flow        = NULL;
+                entry->tpa[spa_len] = '\0';
+                entry->spa          = NULL; /* Won't be needed. */
+                entry->complete     = true;
+                arpt_entry_init(entry);
+                entry->peer_agg = !!(caps & SHIM_ETH_ARP_CAP_AGG);
+                entry->flow     = NULL;
                 memcpy(entry->tha, sha, sizeof(entry->tha));
-                list_add_tail(&entry->node, &priv->arp_table);
+                arpt_insert(priv, entry);
 
                 PD("ARP entry %s --> %02X%02X%02X%02X%02X%02X completed\n",
                    entry->tpa, entry->tha[0], entry->tha[1], entry->tha[2],
@@ -543,8 +686,8 @@ shim_eth_arp_rx(struct rl_shim_eth *priv, struct arphdr *arp, int len)
             goto out;
         }
 
-        memcpy(entry->tha, sha, arp->ar_hln);
-        entry->complete = true;
+        arpt_complete(priv, entry, sha);
+        entry->peer_agg = !!(caps & SHIM_ETH_ARP_CAP_AGG);
         flow            = entry->flow;
 
         PD("ARP entry %s --> %02X%02X%02X%02X%02X%02X completed\n", entry->tpa,
@@ -556,7 +699,7 @@ shim_eth_arp_rx(struct rl_shim_eth *priv, struct arphdr *arp, int len)
     }
 
 out:
-    write_unlock_bh(&priv->arpt_lock);
+    spin_unlock_bh(&priv->arpt_lock);
 
     if (flow) {
         /* This ARP reply is interpreted as a positive flow allocation
@@ -576,46 +719,36 @@ out:
     (*((uint16_t *)(m1) + 2) == *((uint16_t *)(m2) + 2) &&                     \
      *((uint32_t *)m1) == *((uint32_t *)m2))
 
+/* To be called under arpt_lock or RCU read lock. */
 static struct arpt_entry *
-arpt_rx_lookup(struct rl_shim_eth *priv, char *source_mac)
+arpt_rx_lookup(struct rl_shim_eth *priv, const uint8_t *source_mac)
 {
     struct arpt_entry *entry;
 
-    list_for_each_entry (entry, &priv->arp_table, node) {
-        if (entry->complete && mac_equal(source_mac, entry->tha)) {
+    this_cpu_inc(priv->arpt_stats->lookups);
+    hash_for_each_possible_rcu(priv->arpt_mac, entry, mac_node,
+                               arpt_mac_hash(source_mac))
+    {
+        if (mac_equal(source_mac, entry->tha)) {
             return entry;
         }
     }
+    this_cpu_inc(priv->arpt_stats->misses);
 
     return NULL;
 }
 
+/* Deliver a PDU received from the 'source' MAC address. */
 static void
-shim_eth_pdu_rx(struct rl_shim_eth *priv, struct sk_buff *skb)
+shim_eth_rb_rx(struct rl_shim_eth *priv, struct rl_buf *rb,
+               const uint8_t *source)
 {
     struct ipcp_entry *ipcp = priv->ipcp;
-    struct rl_buf *rb;
-    struct ethhdr *hh = eth_hdr(skb);
     struct arpt_entry *entry;
+    struct flow_entry *flow     = NULL;
     struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
     unsigned len;
 
-    NPD("SHIM ETH PDU from %02X:%02X:%02X:%02X:%02X:%02X [%d]\n",
-        hh->h_source[0], hh->h_source[1], hh->h_source[2], hh->h_source[3],
-        hh->h_source[4], hh->h_source[5], skb->len);
-
-#ifndef RL_SKB
-    rb = rl_buf_alloc(skb->len, ipcp->rxhdroom, ipcp->tailroom, GFP_ATOMIC);
-    if (unlikely(!rb)) {
-        RPV(1, "Out of memory\n");
-        return;
-    }
-    skb_copy_bits(skb, 0, RL_BUF_DATA(rb), skb->len);
-    rl_buf_append(rb, skb->len);
-#else /* RL_SKB */
-    rb                       = skb;
-#endif
-
     len = rb->len;
     /* Try to shortcut the packet to the upper IPCP. */
     if ((rb = rl_sdu_rx_shortcut(ipcp, rb)) == NULL) {
@@ -625,34 +758,32 @@ shim_eth_pdu_rx(struct rl_shim_eth *priv, struct sk_buff *skb)
     }
 
     /* Shortcutting was not possible, we have to lookup the flow from
-     * the source MAC address. */
-    read_lock_bh(&priv->arpt_lock);
-
-    entry = arpt_rx_lookup(priv, hh->h_source);
-
-    if (likely(entry && entry->flow)) {
-        struct flow_entry *flow = entry->flow;
+     * the source MAC address. This does not need to take the lock. */
+    rcu_read_lock();
+    entry = arpt_rx_lookup(priv, source);
+    if (likely(entry)) {
+        flow = READ_ONCE(entry->flow);
+    }
+    rcu_read_unlock();
 
-        read_unlock_bh(&priv->arpt_lock);
+    if (likely(flow)) {
         stats->rx_pkt++;
         stats->rx_byte += len;
         rl_sdu_rx_flow(ipcp, flow, rb, true);
 
         return;
     }
-    read_unlock_bh(&priv->arpt_lock);
 
     /* Here we are the flow allocation slave, we cannot be the flow
-     * allocation initiator. We need to do the lookup again, as we
-     * have dropped the read lock. */
-    write_lock_bh(&priv->arpt_lock);
-    entry = arpt_rx_lookup(priv, hh->h_source);
+     * allocation initiator. We need to do the lookup again under the
+     * lock. */
+    spin_lock_bh(&priv->arpt_lock);
+    entry = arpt_rx_lookup(priv, source);
     if (!entry) {
         RPD(1,
             "PDU from unknown source MAC "
             "%02X:%02X:%02X:%02X:%02X:%02X\n",
-            hh->h_source[0], hh->h_source[1], hh->h_source[2], hh->h_source[3],
-            hh->h_source[4], hh->h_source[5]);
+            source[0], source[1], source[2], source[3], source[4], source[5]);
         goto drop;
     }
 
@@ -699,18 +830,100 @@ shim_eth_pdu_rx(struct rl_shim_eth *priv, struct sk_buff *skb)
         rb_list_enq(rb, &entry->rx_tmpq);
         entry->rx_tmpq_len++;
     }
-    write_unlock_bh(&priv->arpt_lock);
+    spin_unlock_bh(&priv->arpt_lock);
 
     stats->rx_pkt++;
     stats->rx_byte += len;
     return;
 
 drop:
-    write_unlock_bh(&priv->arpt_lock);
+    spin_unlock_bh(&priv->arpt_lock);
     stats->rx_err++;
     rl_buf_free(rb);
 }
 
+static void
+shim_eth_pdu_rx(struct rl_shim_eth *priv, struct sk_buff *skb)
+{
+    struct ipcp_entry *ipcp = priv->ipcp;
+    struct ethhdr *hh       = eth_hdr(skb);
+    struct rl_buf *rb;
+
+    NPD("SHIM ETH PDU from %02X:%02X:%02X:%02X:%02X:%02X [%d]\n",
+        hh->h_source[0], hh->h_source[1], hh->h_source[2], hh->h_source[3],
+        hh->h_source[4], hh->h_source[5], skb->len);
+
+#ifndef RL_SKB
+    rb = rl_buf_alloc(skb->len, ipcp->rxhdroom, ipcp->tailroom, GFP_ATOMIC);
+    if (unlikely(!rb)) {
+        RPV(1, "Out of memory\n");
+        return;
+    }
+    skb_copy_bits(skb, 0, RL_BUF_DATA(rb), skb->len);
+    rl_buf_append(rb, skb->len);
+#else /* RL_SKB */
+    (void)ipcp;
+    rb = skb;
+#endif
+
+    shim_eth_rb_rx(priv, rb, hh->h_source);
+}
+
+/* Split an aggregate and deliver its PDUs. */
+static void
+shim_eth_agg_rx(struct rl_shim_eth *priv, struct sk_buff *skb)
+{
+    struct ipcp_entry *ipcp     = priv->ipcp;
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+    struct flow_entry *flow     = NULL;
+    const uint8_t *source;
+    struct arpt_entry *entry;
+    struct rl_buf *rb, *tmp;
+    struct rb_list pdus;
+    int ret;
+
+    if (unlikely(skb_linearize(skb))) {
+        stats->rx_err++;
+        return;
+    }
+
+    rb_list_init(&pdus);
+    ret = rl_agg_split(skb->data, skb->len, ipcp->rxhdroom, ipcp->tailroom,
+                       &pdus);
+    if (unlikely(ret < 0)) {
+        RPD(1, "Malformed aggregate [%d]\n", ret);
+        stats->rx_err++;
+    }
+    if (rb_list_empty(&pdus)) {
+        return;
+    }
+
+    source = eth_hdr(skb)->h_source;
+
+    /* All the PDUs come from the same source, and so they can be
+     * delivered to the flow as a batch. */
+    rcu_read_lock();
+    entry = arpt_rx_lookup(priv, source);
+    if (likely(entry)) {
+        flow = READ_ONCE(entry->flow);
+    }
+    rcu_read_unlock();
+
+    if (likely(flow)) {
+        rb_list_foreach (rb, &pdus) {
+            stats->rx_pkt++;
+            stats->rx_byte += rb->len;
+        }
+        rl_sdu_rx_flow_batch(ipcp, flow, &pdus, true);
+        return;
+    }
+
+    rb_list_foreach_safe (rb, tmp, &pdus) {
+        rb_list_del(rb);
+        shim_eth_rb_rx(priv, rb, source);
+    }
+}
+
 static rx_handler_result_t
 shim_eth_rx_handler(struct sk_buff **skbp)
 {
@@ -745,6 +958,10 @@ shim_eth_rx_handler(struct sk_buff **skbp)
          * the kernel features at configuration time. */
         dev_kfree_skb_any(skb);
 #endif /* !RL_SKB */
+    } else if (ethertype == ETH_P_RLITE_AGG) {
+        /* An aggregate of RLITE shim-eth PDUs. */
+        shim_eth_agg_rx(priv, skb);
+        dev_kfree_skb_any(skb);
     } else {
         /* This frame doesn't belong to us, do not touch it. */
         return RX_HANDLER_PASS;
@@ -772,8 +989,13 @@ static bool
 rl_shim_eth_flow_writeable(struct flow_entry *flow)
 {
     struct rl_shim_eth *priv = (struct rl_shim_eth *)flow->txrx.ipcp->priv;
+    struct arpt_entry *entry = flow->priv;
     int i;
 
+    if (entry && !rl_agg_writeable(&entry->agg)) {
+        return false;
+    }
+
     for (i = 0; i < priv->netdev->num_tx_queues; i++) {
         if (!test_bit(RL_TXQ_XMIT_BUSY, &priv->txq[i].xmit_busy)) {
             return true;
@@ -782,57 +1004,56 @@ rl_shim_eth_flow_writeable(struct flow_entry *flow)
     return false;
 }
 
+/* Transmit a frame containing a PDU (ETH_P_RLITE) or an aggregate of
+ * PDUs (ETH_P_RLITE_AGG). */
 static int
-rl_shim_eth_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
-                      struct rl_buf *rb, unsigned flags)
+shim_eth_xmit(struct ipcp_entry *ipcp, struct flow_entry *flow,
+              struct arpt_entry *entry, struct rl_buf *rb, uint16_t proto)
 {
     struct rl_shim_eth *priv    = ipcp->priv;
     struct net_device *netdev   = priv->netdev;
     struct sk_buff *skb         = NULL;
-    struct arpt_entry *entry    = flow->priv;
     size_t len                  = rb->len;
     struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
     int hhlen;
     int ret;
 
-    if (unlikely(!entry)) {
-        rl_buf_free(rb);
-        stats->tx_err++;
-        RPD(1, "called on deallocated entry\n");
-        return -ENXIO;
-    }
-
-    if (unlikely(len > ETH_DATA_LEN)) {
-        rl_buf_free(rb);
-        stats->tx_err++;
-        RPD(1, "Exceeding maximum ethernet payload (%d)\n", ETH_DATA_LEN);
-        return -EMSGSIZE;
-    }
-
 #ifndef RL_SKB
     hhlen = LL_RESERVED_SPACE(netdev); /* Hardware header length. */
-    skb   = alloc_skb(hhlen + len + netdev->needed_tailroom, GFP_KERNEL);
-    if (!skb) {
-        rl_buf_free(rb);
-        stats->tx_err++;
-        return -ENOMEM;
+    /* Hand the buffer over to the device without copying the PDU. This
+     * is not possible if the buffer is shared (e.g. it is also in a
+     * retransmission queue), or it lacks headroom or tailroom. */
+    skb = rl_buf_to_skb(rb, hhlen, netdev->needed_tailroom);
+    if (skb) {
+        rb = NULL;
+    } else {
+        skb = alloc_skb(hhlen + len + netdev->needed_tailroom, GFP_KERNEL);
+        if (!skb) {
+            rl_buf_free(rb);
+            stats->tx_err++;
+            return -ENOMEM;
+        }
+        skb_reserve(skb, hhlen); /* needed by dev_hard_header */
+        stats->tx_copy++;
     }
-
-    skb_reserve(skb, hhlen); /* needed by dev_hard_header */
-#else                        /* RL_SKB */
+#else  /* RL_SKB */
     (void)hhlen;
     skb = rb;
 #endif                       /* RL_SKB */
     skb_reset_network_header(skb);
     skb->dev      = netdev;
-    skb->protocol = htons(ETH_P_RLITE);
+    skb->protocol = htons(proto);
 
     /* dev_hard_header() will call eth_header(), which skb_push() and
      * initialize the Ethernet header. */
-    ret = dev_hard_header(skb, skb->dev, ETH_P_RLITE, entry->tha,
-                          netdev->dev_addr, skb->len);
+    ret = dev_hard_header(skb, skb->dev, proto, entry->tha, netdev->dev_addr,
+                          skb->len);
     if (unlikely(ret < 0)) {
-        rl_buf_free(rb);
+#ifndef RL_SKB
+        if (rb) {
+            rl_buf_free(rb);
+        }
+#endif /* !RL_SKB */
         kfree_skb(skb);
 
         return ret;
@@ -842,8 +1063,10 @@ rl_shim_eth_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
     skb_shinfo(skb)->destructor_arg = (void *)flow;
 
 #ifndef RL_SKB
-    /* Copy data into the skb. */
-    memcpy(skb_put(skb, len), RL_BUF_DATA(rb), len);
+    if (rb) {
+        /* Copy data into the skb. */
+        memcpy(skb_put(skb, len), RL_BUF_DATA(rb), len);
+    }
 #endif /* !RL_SKB */
 
     /* Send the skb to the device for transmission. */
@@ -865,20 +1088,120 @@ rl_shim_eth_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
             set_bit(RL_TXQ_XMIT_BUSY, &priv->txq[i].xmit_busy);
         }
 #ifndef RL_SKB
-        return -EAGAIN; /* backpressure */
-#endif
+        if (rb) {
+            return -EAGAIN; /* backpressure */
+        }
+        /* The buffer was consumed by the device, we can only set
+         * backpressure for the next PDUs. */
+#endif /* !RL_SKB */
     }
 
     stats->tx_pkt++;
     stats->tx_byte += len;
 
 #ifndef RL_SKB
-    rl_buf_free(rb);
+    if (rb) {
+        rl_buf_free(rb);
+    }
 #endif /* !RL_SKB */
 
     return 0;
 }
 
+/* Transmit an aggregate. Aggregates containing a single PDU are sent as
+ * plain PDUs, like the PDUs that were too big to be aggregated. */
+static void
+shim_eth_agg_xmit(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                  struct arpt_entry *entry, struct rl_buf *rb)
+{
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+    unsigned int pdus           = RL_BUF_AGG(rb).pdus;
+    uint16_t proto              = ETH_P_RLITE_AGG;
+
+    if (pdus <= 1) {
+        if (pdus) {
+            rl_buf_custom_pop(rb, RL_AGG_PFXLEN);
+        }
+        proto = ETH_P_RLITE;
+    }
+    if (pdus) {
+        stats->tx_agg_frames++;
+        stats->tx_agg_pdus += pdus;
+    }
+
+    if (shim_eth_xmit(ipcp, flow, entry, rb, proto) == -EAGAIN) {
+        /* The writers already got the aggregated PDUs, we can only
+         * drop. */
+        rl_buf_free(rb);
+    }
+}
+
+/* Transmit the aggregates pending on an ARP table entry. The PDUs
+ * written while this work item is pending or running end up in the
+ * same aggregate, up to the MTU. */
+static void
+shim_eth_agg_worker(struct work_struct *w)
+{
+    struct arpt_entry *entry = container_of(w, struct arpt_entry, agg_work);
+    struct flow_entry *flow;
+    struct rl_buf *rb;
+
+    while ((rb = rl_agg_deq(&entry->agg)) != NULL) {
+        flow = READ_ONCE(entry->flow);
+        if (unlikely(!flow)) {
+            rl_buf_free(rb);
+            continue;
+        }
+        shim_eth_agg_xmit(flow->txrx.ipcp, flow, entry, rb);
+    }
+
+    flow = READ_ONCE(entry->flow);
+    if (rl_agg_unstall(&entry->agg) && flow) {
+        rl_write_restart_flow(flow);
+    }
+}
+
+static int
+rl_shim_eth_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                      struct rl_buf *rb, unsigned flags)
+{
+    struct rl_shim_eth *priv    = ipcp->priv;
+    struct arpt_entry *entry    = flow->priv;
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+    int ret;
+
+    if (unlikely(!entry)) {
+        rl_buf_free(rb);
+        stats->tx_err++;
+        RPD(1, "called on deallocated entry\n");
+        return -ENXIO;
+    }
+
+    if (unlikely(rb->len > priv->netdev->mtu)) {
+        rl_buf_free(rb);
+        stats->tx_err++;
+        RPD(1, "Exceeding device MTU (%u)\n", priv->netdev->mtu);
+        return -EMSGSIZE;
+    }
+
+    if (!READ_ONCE(priv->agg) || !entry->peer_agg) {
+        return shim_eth_xmit(ipcp, flow, entry, rb, ETH_P_RLITE);
+    }
+
+    ret = rl_agg_enq(&entry->agg, rb, priv->netdev->mtu, 0, ipcp->txhdroom,
+                     ipcp->tailroom);
+    if (unlikely(ret == -ENOMEM)) {
+        rl_buf_free(rb);
+        stats->tx_err++;
+        return ret;
+    }
+    if (ret == 0) {
+        schedule_work(&entry->agg_work);
+    }
+
+    return ret; /* -EAGAIN means backpressure */
+}
+
 static int
 rl_shim_eth_config(struct ipcp_entry *ipcp, const char *param_name,
                    const char *param_value, int *notify)
@@ -888,6 +1211,7 @@ rl_shim_eth_config(struct ipcp_entry *ipcp, const char *param_name,
 
     if (strcmp(param_name, "netdev") == 0) {
         struct net_device *netdev = NULL;
+        unsigned int tailroom;
 
         if (priv->netdev) {
             /* We don't allow to dynamically change netdev to simplify
@@ -919,26 +1243,39 @@ rl_shim_eth_config(struct ipcp_entry *ipcp, const char *param_name,
 
         priv->netdev = netdev;
 
-        /* Set IPCP max_sdu_size using the device MTU. However, MTU can be
-         * changed; we should intercept those changes, reflect the change
-         * in the ipcp_entry and notify userspace. */
+        /* Set IPCP max_sdu_size using the device MTU. MTU changes are
+         * intercepted by shim_eth_netdev_notify(). */
+        tailroom = netdev->needed_tailroom;
+#ifndef RL_SKB
+        /* Also reserve space for the skb_shared_info, so that the upper
+         * IPCPs allocate buffers that we can transmit without a copy. */
+        tailroom += SKB_DATA_ALIGN(sizeof(struct skb_shared_info));
+#endif /* !RL_SKB */
         *notify = (ipcp->max_sdu_size != netdev->mtu) ||
-                  (ipcp->tailroom != netdev->needed_tailroom);
+                  (ipcp->tailroom != tailroom);
         ipcp->max_sdu_size = netdev->mtu;
-        ipcp->tailroom     = netdev->needed_tailroom;
-#ifdef RL_SKB
+        ipcp->tailroom     = tailroom;
         /* Report the headroom needed for Ethernet header. */
         if (ipcp->txhdroom != LL_RESERVED_SPACE(netdev)) {
             *notify = 1;
         }
         ipcp->txhdroom = LL_RESERVED_SPACE(netdev);
-#endif /* RL_SKB */
 
         PD("netdev set to %p [max_sdu_size=%u, txhdroom=%u, rxhdroom=%u, "
            "troom=%u]\n",
            netdev, (unsigned)ipcp->max_sdu_size, ipcp->txhdroom, ipcp->rxhdroom,
            ipcp->tailroom);
 
+    } else if (strcmp(param_name, "aggregation") == 0) {
+        if (strcmp(param_value, "on") == 0) {
+            WRITE_ONCE(priv->agg, true);
+        } else if (strcmp(param_value, "off") == 0) {
+            WRITE_ONCE(priv->agg, false);
+        } else {
+            return -EINVAL;
+        }
+        ret = 0;
+
     } else if (strcmp(param_name, "mss") == 0) {
         if (!priv->netdev) {
             return -ENXIO;
@@ -952,6 +1289,21 @@ rl_shim_eth_config(struct ipcp_entry *ipcp, const char *param_name,
     return ret;
 }
 
+static void
+arpt_stats_get(struct rl_shim_eth *priv, struct arpt_stats *st)
+{
+    int cpu;
+
+    memset(st, 0, sizeof(*st));
+    for_each_possible_cpu(cpu)
+    {
+        struct arpt_stats *pst = per_cpu_ptr(priv->arpt_stats, cpu);
+
+        st->lookups += pst->lookups;
+        st->misses += pst->misses;
+    }
+}
+
 static int
 rl_shim_eth_config_get(struct ipcp_entry *ipcp, const char *param_name,
                        char *buf, int buflen)
@@ -965,6 +1317,20 @@ rl_shim_eth_config_get(struct ipcp_entry *ipcp, const char *param_name,
         } else {
             snprintf(buf, buflen, "%s", priv->netdev->name);
         }
+    } else if (strcmp(param_name, "aggregation") == 0) {
+        snprintf(buf, buflen, "%s", READ_ONCE(priv->agg) ? "on" : "off");
+    } else if (strcmp(param_name, "arp-entries") == 0) {
+        snprintf(buf, buflen, "%u", READ_ONCE(priv->arpt_entries));
+    } else if (strcmp(param_name, "arp-lookups") == 0) {
+        struct arpt_stats st;
+
+        arpt_stats_get(priv, &st);
+        snprintf(buf, buflen, "%llu", (unsigned long long)st.lookups);
+    } else if (strcmp(param_name, "arp-misses") == 0) {
+        struct arpt_stats st;
+
+        arpt_stats_get(priv, &st);
+        snprintf(buf, buflen, "%llu", (unsigned long long)st.misses);
     } else {
         ret = -ENOSYS;
     }
@@ -976,9 +1342,10 @@ static int
 rl_shim_eth_flow_deallocated(struct ipcp_entry *ipcp, struct flow_entry *flow)
 {
     struct rl_shim_eth *priv = (struct rl_shim_eth *)ipcp->priv;
+    struct arpt_entry *unbound = NULL;
     struct arpt_entry *entry;
 
-    write_lock_bh(&priv->arpt_lock);
+    spin_lock_bh(&priv->arpt_lock);
 
     list_for_each_entry (entry, &priv->arp_table, node) {
         if (entry->flow == flow) {
@@ -986,22 +1353,38 @@ rl_shim_eth_flow_deallocated(struct ipcp_entry *ipcp, struct flow_entry *flow)
 
             /* Unbind the flow from this ARP table entry. */
             PD("Unbinding from flow %p\n", entry->flow);
-            flow->priv            = NULL;
-            entry->flow           = NULL;
+            flow->priv = NULL;
+            WRITE_ONCE(entry->flow, NULL);
             entry->fa_req_arrived = false;
             rb_list_foreach_safe (rb, tmp, &entry->rx_tmpq) {
                 rb_list_del(rb);
                 rl_buf_free(rb);
             }
             entry->rx_tmpq_len = 0;
+            unbound            = entry;
         }
     }
 
-    write_unlock_bh(&priv->arpt_lock);
+    spin_unlock_bh(&priv->arpt_lock);
+
+    if (unbound) {
+        /* ARP table entries are only freed on IPCP destruction, so
+         * we can still access it. Drop the pending aggregates. */
+        cancel_work_sync(&unbound->agg_work);
+        rl_agg_fini(&unbound->agg);
+    }
 
     return 0;
 }
 
+static void
+shim_eth_mtu_worker(struct work_struct *w)
+{
+    struct rl_shim_eth *priv = container_of(w, struct rl_shim_eth, mtu_work);
+
+    rl_ipcp_update_notify(priv->ipcp);
+}
+
 /* Called every time an event happens within the netdevice layer,
  * e.g. link goes up or down. */
 static int
@@ -1022,51 +1405,54 @@ shim_eth_netdev_notify(struct notifier_block *nb, unsigned long event,
             continue;
         }
 
+        if (event == NETDEV_CHANGEMTU) {
+            struct ipcp_entry *ipcp = priv->ipcp;
+
+            /* Reflect the new MTU into max_sdu_size, and let userspace
+             * propagate it to the upper IPCPs. We are called under RTNL,
+             * while the netdev configuration takes RTNL under ipcp->lock,
+             * so ipcp->lock cannot be taken here and the notification is
+             * deferred to a work item. */
+            if (READ_ONCE(ipcp->max_sdu_size) != netdev->mtu) {
+                WRITE_ONCE(ipcp->max_sdu_size, netdev->mtu);
+                PD("max_sdu_size set to %u\n", netdev->mtu);
+                schedule_work(&priv->mtu_work);
+            }
+            break;
+        }
+
         /* This netdev is managed by one of our IPCPs. Scan the ARP table
          * to fetch the flows that are being used by upper IPCPs. */
-        write_lock_bh(&priv->arpt_lock);
+        spin_lock_bh(&priv->arpt_lock);
         list_for_each_entry (entry, &priv->arp_table, node) {
             struct flow_entry *flow = entry->flow;
             int ret;
 
             if (entry->complete && flow && flow->upper.ipcp) {
-                struct rl_kmsg_flow_state ntfy;
-                bool filter = false;
-
-                memset(&ntfy, 0, sizeof(ntfy));
-                ntfy.hdr.msg_type = RLITE_KER_FLOW_STATE;
-                ntfy.hdr.event_id = 0;
-                ntfy.ipcp_id      = flow->upper.ipcp->id;
-                ntfy.local_port   = flow->local_port;
+                uint16_t state;
+
                 switch (event) {
                 case NETDEV_UP:
-                    ntfy.flow_state = RL_FLOW_STATE_UP;
+                    state = RL_FLOW_STATE_UP;
                     PD("flow %u goes up\n", flow->local_port);
                     break;
 
                 case NETDEV_DOWN:
-                    ntfy.flow_state = RL_FLOW_STATE_DOWN;
+                    state = RL_FLOW_STATE_DOWN;
                     PD("flow %u goes down\n", flow->local_port);
                     break;
 
                 default:
-                    filter = true;
-                    break;
-                }
-
-                if (filter) {
                     continue;
                 }
 
-                ret =
-                    rl_upqueue_append(flow->upper.ipcp->uipcp,
-                                      (const struct rl_msg_base *)&ntfy, false);
+                ret = rl_flow_state_set(flow, state);
                 if (ret) {
                     PE("failed to append notification [err=%d]\n", ret);
                 }
             }
         }
-        write_unlock_bh(&priv->arpt_lock);
+        spin_unlock_bh(&priv->arpt_lock);
         break;
     }
 
@@ -1085,19 +1471,30 @@ rl_shim_eth_create(struct ipcp_entry *ipcp)
         return NULL;
     }
 
+    priv->arpt_stats = alloc_percpu(struct arpt_stats);
+    if (!priv->arpt_stats) {
+        rl_free(priv, RL_MT_SHIM);
+        return NULL;
+    }
+
     priv->ipcp   = ipcp;
     priv->netdev = NULL;
     priv->txq    = NULL;
     INIT_LIST_HEAD(&priv->arp_table);
-    rwlock_init(&priv->arpt_lock);
+    hash_init(priv->arpt_tpa);
+    hash_init(priv->arpt_mac);
+    priv->arpt_entries = 0;
+    spin_lock_init(&priv->arpt_lock);
 #ifdef RL_HAVE_TIMER_SETUP
     timer_setup(&priv->arp_resolver_tmr, arp_resolver_cb, 0);
 #else  /* !RL_HAVE_TIMER_SETUP */
     setup_timer(&priv->arp_resolver_tmr, arp_resolver_cb, (unsigned long)priv);
 #endif /* !RL_HAVE_TIMER_SETUP */
     priv->arp_tmr_shutdown = false;
+    priv->agg              = false;
     ipcp->txhdroom         = 0;
     ipcp->tailroom         = 0;
+    INIT_WORK(&priv->mtu_work, shim_eth_mtu_worker);
 
     mutex_lock(&shims_lock);
     list_add_tail(&priv->node, &shims);
@@ -1113,25 +1510,32 @@ rl_shim_eth_destroy(struct ipcp_entry *ipcp)
 {
     struct rl_shim_eth *priv = ipcp->priv;
     struct arpt_entry *entry, *tmp;
+    LIST_HEAD(removeq);
     unsigned i;
 
     mutex_lock(&shims_lock);
     list_del(&priv->node);
     mutex_unlock(&shims_lock);
 
-    write_lock_bh(&priv->arpt_lock);
+    spin_lock_bh(&priv->arpt_lock);
     list_for_each_entry_safe (entry, tmp, &priv->arp_table, node) {
-        list_del_init(&entry->node);
-        if (entry->spa) {
-            rl_free(entry->spa, RL_MT_SHIMDATA);
-        }
-        rl_free(entry->tpa, RL_MT_SHIMDATA);
-        rl_free(entry, RL_MT_SHIMDATA);
+        arpt_remove(priv, entry);
+        list_add_tail(&entry->node, &removeq);
     }
     priv->arp_tmr_shutdown = true;
-    write_unlock_bh(&priv->arpt_lock);
+    spin_unlock_bh(&priv->arpt_lock);
+
+    /* The aggregation work items must be stopped out of the lock. */
+    list_for_each_entry_safe (entry, tmp, &removeq, node) {
+        list_del_init(&entry->node);
+        cancel_work_sync(&entry->agg_work);
+        rl_agg_fini(&entry->agg);
+        arpt_entry_free_deferred(entry);
+    }
 
     del_timer_sync(&priv->arp_resolver_tmr);
+    /* No new MTU notifications, since we are out of the shims list. */
+    cancel_work_sync(&priv->mtu_work);
 
     if (priv->netdev) {
         rtnl_lock();
@@ -1150,6 +1554,7 @@ rl_shim_eth_destroy(struct ipcp_entry *ipcp)
         }
     }
 
+    free_percpu(priv->arpt_stats);
     rl_free(priv, RL_MT_SHIM);
 
     PD("IPC [%p] destroyed\n", priv);
@@ -1187,6 +1592,7 @@ rl_shim_eth_fini(void)
     rl_ipcp_factory_unregister(SHIM_DIF_TYPE_WIFI);
     rl_ipcp_factory_unregister(SHIM_DIF_TYPE);
     unregister_netdevice_notifier(&shim_eth_notifier_block);
+    rcu_barrier(); /* wait for ARP table entries to be freed */
 }
 
 static int __init
@@ -61,6 +61,22 @@ struct rl_shim_loopback {
     struct work_struct rcv;
 };
 
+static void
+rcv_deliver(struct rl_shim_loopback *priv, struct flow_entry *rx_flow,
+            struct rb_list *rxq)
+{
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(priv->ipcp->stats);
+    int ret;
+
+    ret = rl_sdu_rx_flow_batch(priv->ipcp, rx_flow, rxq, true);
+    if (unlikely(ret)) {
+        spin_lock_bh(&priv->lock);
+        stats->tx_err++;
+        stats->rx_err++;
+        spin_unlock_bh(&priv->lock);
+    }
+}
+
 static void
 rcv_work(struct work_struct *w)
 {
@@ -69,40 +85,57 @@ rcv_work(struct work_struct *w)
     struct rl_ipcp_stats *stats = raw_cpu_ptr(priv->ipcp->stats);
 
     for (;;) {
-        struct rl_buf *rb = NULL;
-        struct flow_entry *rx_flow;
-        struct flow_entry *tx_flow;
-        int ret;
-
+        struct flow_entry *rx_flow = NULL;
+        unsigned long bytes        = 0;
+        unsigned int pkts          = 0;
+        struct rb_list rxq;
+        unsigned int h, t, i;
+
+        /* The entries between rdh and rdt are not touched by the
+         * producer, so we can process them out of the lock. */
         spin_lock_bh(&priv->lock);
-        if (priv->rdh != priv->rdt) {
-            rb        = priv->rxr[priv->rdh].rb;
-            rx_flow   = priv->rxr[priv->rdh].rx_flow;
-            tx_flow   = priv->rxr[priv->rdh].tx_flow;
-            priv->rdh = (priv->rdh + 1) & (RX_ENTRIES - 1);
-
-            stats->tx_pkt++;
-            stats->tx_byte += rb->len;
-            stats->rx_pkt++;
-            stats->rx_byte += rb->len;
-        }
+        h = priv->rdh;
+        t = priv->rdt;
         spin_unlock_bh(&priv->lock);
 
-        if (!rb) {
+        if (h == t) {
             break;
         }
 
-        ret = rl_sdu_rx_flow(priv->ipcp, rx_flow, rb, true);
-        if (unlikely(ret)) {
-            spin_lock_bh(&priv->lock);
-            stats->tx_err++;
-            stats->rx_err++;
-            spin_unlock_bh(&priv->lock);
+        /* Deliver each run of SDUs directed to the same flow as a
+         * single batch. */
+        rb_list_init(&rxq);
+        for (i = h; i != t; i = (i + 1) & (RX_ENTRIES - 1)) {
+            struct rx_entry *e = &priv->rxr[i];
+
+            if (rx_flow && e->rx_flow != rx_flow) {
+                rcv_deliver(priv, rx_flow, &rxq);
+            }
+            rx_flow = e->rx_flow;
+            pkts++;
+            bytes += e->rb->len;
+            rb_list_enq(e->rb, &rxq);
         }
-        flow_put(rx_flow);
+        rcv_deliver(priv, rx_flow, &rxq);
+
+        /* Release the entries before advancing rdh, since the producer
+         * can reuse them as soon as rdh moves. */
+        for (i = h; i != t; i = (i + 1) & (RX_ENTRIES - 1)) {
+            flow_put(priv->rxr[i].rx_flow);
+            flow_put(priv->rxr[i].tx_flow);
+        }
+
+        spin_lock_bh(&priv->lock);
+        priv->rdh = t;
+        stats->tx_pkt += pkts;
+        stats->tx_byte += bytes;
+        stats->rx_pkt += pkts;
+        stats->rx_byte += bytes;
+        spin_unlock_bh(&priv->lock);
 
+        /* Wake up the writers only once the ring has room, otherwise
+         * they would see it still full and never be restarted. */
         rl_write_restart_flows(priv->ipcp);
-        flow_put(tx_flow);
     }
 }
 
@@ -41,12 +41,29 @@
 #include <linux/version.h>
 #include <net/sock.h>
 
+#define INET4_MAX_TXQ_LEN 64
+
+/* Maximum number of PDUs sent with a single kernel_sendmsg() call. */
+#define TCP4_TX_BATCH 64
+
+/* Size of the buffer used to receive many PDUs with a single
+ * kernel_recvmsg() call. */
+#define TCP4_RX_CHUNK 16384
+
+struct txq_entry;
+
 struct rl_shim_tcp4 {
     struct ipcp_entry *ipcp;
     struct work_struct txw;
     spinlock_t txq_lock;
     unsigned int txq_len;
     struct list_head txq;
+
+    /* Scratch arrays used by the TX worker. */
+    struct txq_entry *tx_qe[TCP4_TX_BATCH];
+    struct rl_buf *tx_rb[TCP4_TX_BATCH];
+    uint16_t tx_lenhdr[TCP4_TX_BATCH];
+    struct kvec tx_iov[2 * TCP4_TX_BATCH];
 };
 
 struct shim_tcp4_flow {
@@ -65,12 +82,11 @@ struct shim_tcp4_flow {
     uint16_t cur_rx_rblen;
     int cur_rx_buflen;
     bool cur_rx_hdr;
+    uint8_t *rxbuf;
 
     struct mutex rxw_lock;
 };
 
-#define INET4_MAX_TXQ_LEN 64
-
 struct txq_entry {
     struct rl_buf *rb;
     struct shim_tcp4_flow *flow_priv;
@@ -117,6 +133,85 @@ rl_shim_tcp4_destroy(struct ipcp_entry *ipcp)
     PD("IPCP [%p] destroyed\n", priv);
 }
 
+/* Deliver the PDU just reassembled (if any) and reset the reader
+ * state machine. */
+static void
+tcp4_rx_complete(struct shim_tcp4_flow *priv)
+{
+    struct flow_entry *flow     = priv->flow;
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
+
+    if (likely(priv->cur_rx_rb)) {
+        rl_sdu_rx_flow(flow->txrx.ipcp, flow, priv->cur_rx_rb, true);
+        stats->rx_pkt++;
+        stats->rx_byte += priv->cur_rx_rblen;
+    }
+
+    priv->cur_rx_rb     = NULL;
+    priv->cur_rx_hdr    = true;
+    priv->cur_rx_rblen  = 0;
+    priv->cur_rx_buflen = 0;
+}
+
+/* Run the reader state machine over @len bytes of the TCP stream, which
+ * may contain any number of (partial) length-prefixed PDUs. */
+static void
+tcp4_rx_parse(struct shim_tcp4_flow *priv, const uint8_t *data, int len)
+{
+    struct ipcp_entry *ipcp     = priv->flow->txrx.ipcp;
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+    int cpy;
+
+    while (len > 0) {
+        if (priv->cur_rx_hdr) {
+            /* We're reading the 2-bytes header containing the SDU length. */
+            cpy = min_t(int, len,
+                        sizeof(priv->cur_rx_rblen) - priv->cur_rx_buflen);
+            memcpy((uint8_t *)&priv->cur_rx_rblen + priv->cur_rx_buflen, data,
+                   cpy);
+            priv->cur_rx_buflen += cpy;
+            data += cpy;
+            len -= cpy;
+            if (priv->cur_rx_buflen < (int)sizeof(priv->cur_rx_rblen)) {
+                break;
+            }
+
+            /* We have completely read the 2-bytes header. */
+            priv->cur_rx_rblen  = ntohs(priv->cur_rx_rblen);
+            priv->cur_rx_buflen = 0;
+            if (unlikely(!priv->cur_rx_rblen)) {
+                PE("Warning: zero lenght packet\n");
+                continue;
+            }
+
+            priv->cur_rx_hdr = false;
+            priv->cur_rx_rb  = rl_buf_alloc(priv->cur_rx_rblen, ipcp->rxhdroom,
+                                           ipcp->tailroom, GFP_ATOMIC);
+            if (unlikely(!priv->cur_rx_rb)) {
+                /* Skip the SDU, to keep the stream in sync. */
+                stats->rx_err++;
+                RPV(1, "Out of memory\n");
+            } else {
+                rl_buf_append(priv->cur_rx_rb, priv->cur_rx_rblen);
+            }
+            continue;
+        }
+
+        /* We're reading the SDU. */
+        cpy = min_t(int, len, priv->cur_rx_rblen - priv->cur_rx_buflen);
+        if (likely(priv->cur_rx_rb)) {
+            memcpy(RL_BUF_DATA(priv->cur_rx_rb) + priv->cur_rx_buflen, data,
+                   cpy);
+        }
+        priv->cur_rx_buflen += cpy;
+        data += cpy;
+        len -= cpy;
+        if (priv->cur_rx_buflen == priv->cur_rx_rblen) {
+            tcp4_rx_complete(priv);
+        }
+    }
+}
+
 /* This must be called in process context. */
 static void
 tcp4_drain_socket_rxq(struct shim_tcp4_flow *priv)
@@ -125,30 +220,39 @@ tcp4_drain_socket_rxq(struct shim_tcp4_flow *priv)
     struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
     struct socket *sock         = priv->sock;
     struct msghdr msghdr;
-    struct iovec iov;
+    struct kvec iov;
+    bool direct;
     int ret;
 
     mutex_lock(&priv->rxw_lock);
 
+    if (unlikely(!priv->rxbuf)) {
+        priv->rxbuf = rl_alloc(TCP4_RX_CHUNK, GFP_KERNEL, RL_MT_SHIMDATA);
+        if (!priv->rxbuf) {
+            RPV(1, "Out of memory\n");
+            mutex_unlock(&priv->rxw_lock);
+            return;
+        }
+    }
+
     for (;;) {
         memset(&msghdr, 0, sizeof(msghdr));
         msghdr.msg_flags = MSG_DONTWAIT;
 
-        if (priv->cur_rx_hdr) {
-            /* We're reading the 2-bytes header containing the SDU length. */
-            iov.iov_base = &priv->cur_rx_rblen;
-            iov.iov_len  = sizeof(priv->cur_rx_rblen);
-
+        /* The remainder of a large SDU is received straight into its
+         * buffer. Otherwise we receive as much of the stream as fits
+         * the chunk buffer, and parse all the PDUs contained there. */
+        direct = !priv->cur_rx_hdr && priv->cur_rx_rb &&
+                 priv->cur_rx_rblen - priv->cur_rx_buflen >= TCP4_RX_CHUNK;
+        if (direct) {
+            iov.iov_base = RL_BUF_DATA(priv->cur_rx_rb) + priv->cur_rx_buflen;
+            iov.iov_len  = priv->cur_rx_rblen - priv->cur_rx_buflen;
         } else {
-            /* We're reading the SDU. */
-            iov.iov_base = RL_BUF_DATA(priv->cur_rx_rb);
-            iov.iov_len  = priv->cur_rx_rblen;
+            iov.iov_base = priv->rxbuf;
+            iov.iov_len  = TCP4_RX_CHUNK;
         }
 
-        iov.iov_base += priv->cur_rx_buflen;
-        iov.iov_len -= priv->cur_rx_buflen;
-
-        ret = kernel_recvmsg(sock, &msghdr, (struct kvec *)&iov, 1, iov.iov_len,
+        ret = kernel_recvmsg(sock, &msghdr, &iov, 1, iov.iov_len,
                              msghdr.msg_flags);
         if (ret == -EAGAIN) {
             break;
@@ -164,42 +268,13 @@ tcp4_drain_socket_rxq(struct shim_tcp4_flow *priv)
 
         NPD("read %d bytes\n", ret);
 
-        priv->cur_rx_buflen += ret;
-
-        if (priv->cur_rx_hdr &&
-            priv->cur_rx_buflen == sizeof(priv->cur_rx_rblen)) {
-            /* We have completely read the 2-bytes header. */
-            priv->cur_rx_rblen = ntohs(priv->cur_rx_rblen);
-            if (unlikely(!priv->cur_rx_rblen)) {
-                PE("Warning: zero lenght packet\n");
-            } else {
-                priv->cur_rx_hdr = false;
-                priv->cur_rx_rb  = rl_buf_alloc(
-                    priv->cur_rx_rblen, priv->flow->txrx.ipcp->rxhdroom,
-                    priv->flow->txrx.ipcp->tailroom, GFP_ATOMIC);
-                if (unlikely(!priv->cur_rx_rb)) {
-                    stats->rx_err++;
-                    RPV(1, "Out of memory\n");
-                    break;
-                }
-                rl_buf_append(priv->cur_rx_rb, priv->cur_rx_rblen);
+        if (direct) {
+            priv->cur_rx_buflen += ret;
+            if (priv->cur_rx_buflen == priv->cur_rx_rblen) {
+                tcp4_rx_complete(priv);
             }
-
-            priv->cur_rx_buflen = 0;
-
-        } else if (!priv->cur_rx_hdr &&
-                   priv->cur_rx_buflen == priv->cur_rx_rblen) {
-            /* We have completely read the SDU. */
-            rl_sdu_rx_flow(flow->txrx.ipcp, flow, priv->cur_rx_rb, true);
-
-            stats->rx_pkt++;
-            stats->rx_byte += priv->cur_rx_rblen;
-
-            priv->cur_rx_rb    = NULL;
-            priv->cur_rx_hdr   = true;
-            priv->cur_rx_rblen = 0;
-
-            priv->cur_rx_buflen = 0;
+        } else {
+            tcp4_rx_parse(priv, priv->rxbuf, ret);
         }
     }
 
@@ -281,6 +356,7 @@ rl_shim_tcp4_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
     priv->cur_rx_rblen  = 0;
     priv->cur_rx_buflen = 0;
     priv->cur_rx_hdr    = true;
+    priv->rxbuf         = NULL;
 
     priv->flow = flow;
     flow->priv = priv;
@@ -321,6 +397,12 @@ rl_shim_tcp4_flow_deallocated(struct ipcp_entry *ipcp, struct flow_entry *flow)
      * match flow_init(). */
     fput(sock->file);
     // mutex_destroy(&priv->rxw_lock);
+    if (priv->cur_rx_rb) {
+        rl_buf_free(priv->cur_rx_rb);
+    }
+    if (priv->rxbuf) {
+        rl_free(priv->rxbuf, RL_MT_SHIMDATA);
+    }
     flow->priv = NULL;
     rl_free(priv, RL_MT_SHIMDATA);
 
@@ -329,26 +411,32 @@ rl_shim_tcp4_flow_deallocated(struct ipcp_entry *ipcp, struct flow_entry *flow)
     return 0;
 }
 
+/* Send @n PDUs with a single kernel_sendmsg() call, each one preceded
+ * by its 2-bytes length header. The caller provides the scratch arrays
+ * @iov (2 * @n entries) and @lenhdr (@n entries). The PDUs are consumed. */
 static int
-tcp4_xmit(struct shim_tcp4_flow *flow_priv, struct rl_buf *rb)
+tcp4_xmit(struct shim_tcp4_flow *flow_priv, struct rl_buf **rbs,
+          unsigned int n, struct kvec *iov, uint16_t *lenhdr, int msg_flags)
 {
     struct rl_ipcp_stats *stats =
         raw_cpu_ptr(flow_priv->flow->txrx.ipcp->stats);
     struct msghdr msghdr;
-    struct iovec iov[2];
-    uint16_t lenhdr = htons(rb->len);
-    int totlen      = rb->len + sizeof(lenhdr);
+    int totlen = 0;
+    unsigned int i;
     int ret;
 
-    memset(&msghdr, 0, sizeof(msghdr));
-    iov[0].iov_base = &lenhdr;
-    iov[0].iov_len  = sizeof(lenhdr);
-    iov[1].iov_base = RL_BUF_DATA(rb);
-    iov[1].iov_len  = rb->len;
+    for (i = 0; i < n; i++) {
+        lenhdr[i]           = htons(rbs[i]->len);
+        iov[2 * i].iov_base = &lenhdr[i];
+        iov[2 * i].iov_len  = sizeof(lenhdr[i]);
+        iov[2 * i + 1].iov_base = RL_BUF_DATA(rbs[i]);
+        iov[2 * i + 1].iov_len  = rbs[i]->len;
+        totlen += rbs[i]->len + sizeof(lenhdr[i]);
+    }
 
-    msghdr.msg_flags = MSG_DONTWAIT;
-    ret =
-        kernel_sendmsg(flow_priv->sock, &msghdr, (struct kvec *)iov, 2, totlen);
+    memset(&msghdr, 0, sizeof(msghdr));
+    msghdr.msg_flags = MSG_DONTWAIT | msg_flags;
+    ret = kernel_sendmsg(flow_priv->sock, &msghdr, iov, 2 * n, totlen);
 
     if (unlikely(ret != totlen)) {
         PD("wspaces: %d, %lu\n", sk_stream_wspace(flow_priv->sock->sk),
@@ -357,17 +445,19 @@ tcp4_xmit(struct shim_tcp4_flow *flow_priv, struct rl_buf *rb)
             PE("kernel_sendmsg(): failed [%d]\n", ret);
 
         } else {
-            PI("kernel_sendmsg(): partial write %d/%d\n", ret, (int)rb->len);
+            PI("kernel_sendmsg(): partial write %d/%d\n", ret, totlen);
         }
 
-        stats->tx_err++;
+        stats->tx_err += n;
     } else {
-        NPD("kernel_sendmsg(%d + 2)\n", (int)rb->len);
-        stats->tx_pkt++;
-        stats->tx_byte += rb->len;
+        NPD("kernel_sendmsg(%d PDUs, %d bytes)\n", n, totlen);
+        stats->tx_pkt += n;
+        stats->tx_byte += totlen - n * sizeof(uint16_t);
     }
 
-    rl_buf_free(rb);
+    for (i = 0; i < n; i++) {
+        rl_buf_free(rbs[i]);
+    }
 
     return ret;
 }
@@ -376,35 +466,64 @@ static void
 tcp4_tx_worker(struct work_struct *w)
 {
     struct rl_shim_tcp4 *priv = container_of(w, struct rl_shim_tcp4, txw);
-    int totlen;
-
-    for (;;) {
-        struct txq_entry *qe = NULL;
+    struct txq_entry *qe, *tmp;
+    LIST_HEAD(txq);
 
-        spin_lock_bh(&priv->txq_lock);
-        if (priv->txq_len) {
-            qe = list_first_entry(&priv->txq, struct txq_entry, node);
+    /* Grab all the queued PDUs at once. */
+    spin_lock_bh(&priv->txq_lock);
+    list_splice_init(&priv->txq, &txq);
+    priv->txq_len = 0;
+    spin_unlock_bh(&priv->txq_lock);
+
+    while (!list_empty(&txq)) {
+        struct shim_tcp4_flow *flow_priv =
+            list_first_entry(&txq, struct txq_entry, node)->flow_priv;
+        int wspace      = sk_stream_wspace(flow_priv->sock->sk);
+        unsigned int nq = 0;
+        unsigned int n  = 0;
+        bool more       = false;
+        unsigned int i;
+
+        /* Collect (in order) the PDUs queued for this socket, so that
+         * they can be sent with a single call. */
+        list_for_each_entry_safe (qe, tmp, &txq, node) {
+            int totlen;
+
+            if (qe->flow_priv != flow_priv) {
+                continue;
+            }
+            if (nq == TCP4_TX_BATCH) {
+                more = true;
+                break;
+            }
             list_del_init(&qe->node);
-            priv->txq_len--;
-        }
-        spin_unlock_bh(&priv->txq_lock);
+            priv->tx_qe[nq++] = qe;
 
-        if (!qe) {
-            break;
+            totlen = qe->rb->len + sizeof(uint16_t);
+            if (wspace < totlen + 2) {
+                /* Cannot backpressure here, we have to drop */
+                RPD(1, "Dropping SDU [len=%d]\n", (int)qe->rb->len);
+                rl_buf_free(qe->rb);
+            } else {
+                wspace -= totlen;
+                priv->tx_rb[n++] = qe->rb;
+            }
+            qe->rb = NULL;
         }
 
-        totlen = qe->rb->len + sizeof(uint16_t);
-
-        if (sk_stream_wspace(qe->flow_priv->sock->sk) < totlen + 2) {
-            /* Cannot backpressure here, we have to drop */
-            RPD(1, "Dropping SDU [len=%d]\n", (int)qe->rb->len);
-            rl_buf_free(qe->rb);
-        } else {
-            tcp4_xmit(qe->flow_priv, qe->rb);
+        if (n) {
+            /* Use MSG_MORE (corking) if another batch follows for this
+             * socket, so that TCP does not push out a partial segment. */
+            tcp4_xmit(flow_priv, priv->tx_rb, n, priv->tx_iov,
+                      priv->tx_lenhdr, more ? MSG_MORE : 0);
         }
 
-        flow_put(qe->flow_priv->flow);
-        rl_free(qe, RL_MT_SHIMDATA);
+        /* Release the flow references only now, since the last one
+         * may take flow_priv away. */
+        for (i = 0; i < nq; i++) {
+            flow_put(priv->tx_qe[i]->flow_priv->flow);
+            rl_free(priv->tx_qe[i], RL_MT_SHIMDATA);
+        }
     }
 }
 
@@ -423,6 +542,8 @@ rl_shim_tcp4_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
     struct shim_tcp4_flow *flow_priv = flow->priv;
     struct rl_shim_tcp4 *shim        = ipcp->priv;
     int totlen                       = rb->len + sizeof(uint16_t);
+    struct kvec iov[2];
+    uint16_t lenhdr;
 
     if (sk_stream_wspace(flow_priv->sock->sk) < totlen + 2) {
         /* Backpressure: We will be called again. */
@@ -463,7 +584,7 @@ rl_shim_tcp4_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
         return 0;
     }
 
-    return tcp4_xmit(flow_priv, rb);
+    return tcp4_xmit(flow_priv, &rb, 1, iov, &lenhdr, 0);
 }
 
 static int
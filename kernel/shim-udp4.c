@@ -42,11 +42,47 @@
 #include <linux/udp.h>
 #include <net/sock.h>
 
-/* This struct is unnecessary, but we keep it to ease future extensions. */
 struct rl_shim_udp4 {
     struct ipcp_entry *ipcp;
+
+    /* Aggregate PDUs on the flows where the peer agrees. */
+    bool agg;
+
+    /* Maximum number of datagrams sent or received by a single work
+     * item, or 0 to transmit directly from sdu_write and drain the whole
+     * socket receive queue. */
+    unsigned int batch;
 };
 
+/* Upper bound for the batch budget. This is also the maximum number of
+ * segments of an UDP GSO datagram. */
+#define UDP4_BATCH_MAX 64
+
+/* Maximum number of PDUs queued for batched transmission on a flow. */
+#define UDP4_TXQ_MAX 256
+
+/* Maximum payload of an UDP GSO datagram. */
+#define UDP4_GSO_MAX_BYTES 60000
+
+/* Header of the datagrams used for PDU aggregation. An end with
+ * aggregation enabled announces it with a HELLO datagram (just the
+ * header), which is shorter than any PDU and therefore dropped by older
+ * implementations. A HELLO is answered with a HELLO until one has been
+ * received from the peer, so that a HELLO lost (e.g. because the peer
+ * socket was not bound yet) is sent again. Once an end has received a
+ * HELLO, all its PDUs are carried by DATA datagrams, each one containing
+ * an aggregate. An end that sent a HELLO also accepts a valid DATA
+ * aggregate as an implicit HELLO, in case the answer was lost. */
+struct udp4_agg_hdr {
+    uint16_t magic;
+    uint8_t type;
+    uint8_t pad1;
+} __attribute__((packed));
+
+#define UDP4_AGG_MAGIC 0xA66E
+#define UDP4_AGG_T_HELLO 1
+#define UDP4_AGG_T_DATA 2
+
 struct shim_udp4_flow {
     struct flow_entry *flow;
     struct socket *sock;
@@ -61,6 +97,20 @@ struct shim_udp4_flow {
     struct sockaddr_in remote_addr;
 
     struct mutex rxw_lock;
+
+    /* PDU aggregation state. */
+    bool hello_sent;
+    bool agg_on; /* HELLO or DATA aggregate received */
+    struct rl_agg agg;
+    struct work_struct aggw;
+
+    /* Batched transmission, see udp4_tx_worker(). */
+    spinlock_t txq_lock;
+    struct rb_list txq;
+    unsigned int txq_len;
+    bool tx_stalled;
+    bool gso_off; /* UDP GSO not supported on this path */
+    struct work_struct txw;
 };
 
 static void *
@@ -130,6 +180,107 @@ peek_head_len(struct sock *sk)
     return len;
 }
 
+static int
+udp4_sendmsg(struct shim_udp4_flow *priv, void *buf, size_t len,
+             unsigned msg_flags)
+{
+    struct msghdr msg;
+    struct iovec iov;
+
+    iov.iov_base = buf;
+    iov.iov_len  = len;
+
+    msg.msg_name       = (struct sockaddr *)&priv->remote_addr;
+    msg.msg_namelen    = sizeof(priv->remote_addr);
+    msg.msg_control    = NULL;
+    msg.msg_controllen = 0;
+    msg.msg_flags      = msg_flags;
+
+    return kernel_sendmsg(priv->sock, &msg, (struct kvec *)&iov, 1, len);
+}
+
+static void
+udp4_agg_hello(struct shim_udp4_flow *priv)
+{
+    struct udp4_agg_hdr hdr;
+    int ret;
+
+    hdr.magic = htons(UDP4_AGG_MAGIC);
+    hdr.type  = UDP4_AGG_T_HELLO;
+    hdr.pad1  = 0;
+    ret       = udp4_sendmsg(priv, &hdr, sizeof(hdr), MSG_DONTWAIT);
+    if (ret != sizeof(hdr)) {
+        PI("Failed to send aggregation HELLO [%d]\n", ret);
+    }
+    priv->hello_sent = true;
+}
+
+/* Process an aggregation datagram, appending the PDUs to 'rxq'. Returns
+ * true if 'rb' was consumed, false if it has to be handled as a PDU. */
+static bool
+udp4_agg_rx(struct shim_udp4_flow *priv, struct rl_buf *rb,
+            struct rb_list *rxq)
+{
+    struct udp4_agg_hdr *hdr    = (struct udp4_agg_hdr *)RL_BUF_DATA(rb);
+    struct flow_entry *flow     = priv->flow;
+    struct ipcp_entry *ipcp     = flow->txrx.ipcp;
+    struct rl_shim_udp4 *shim   = ipcp->priv;
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+    struct rl_buf *pdu, *tmp;
+    struct rb_list pdus;
+    int ret;
+
+    if (rb->len < sizeof(*hdr) || hdr->magic != htons(UDP4_AGG_MAGIC)) {
+        return false;
+    }
+
+    if (hdr->type == UDP4_AGG_T_HELLO && rb->len == sizeof(*hdr)) {
+        if (!priv->agg_on && READ_ONCE(shim->agg)) {
+            /* Answer even if we already sent a HELLO, since the peer
+             * may not have received it. */
+            udp4_agg_hello(priv);
+            PD("Aggregation enabled on sock %p\n", priv->sock);
+            WRITE_ONCE(priv->agg_on, true);
+        }
+        rl_buf_free(rb);
+        return true;
+    }
+
+    if (hdr->type != UDP4_AGG_T_DATA ||
+        (!priv->agg_on && !priv->hello_sent)) {
+        return false;
+    }
+
+    rb_list_init(&pdus);
+    ret = rl_agg_split(RL_BUF_DATA(rb) + sizeof(*hdr), rb->len - sizeof(*hdr),
+                       ipcp->rxhdroom, ipcp->tailroom, &pdus);
+    if (unlikely(ret < 0)) {
+        /* Not a valid aggregate, it may be a PDU sent before the
+         * negotiation completed. */
+        rb_list_foreach_safe (pdu, tmp, &pdus) {
+            rb_list_del(pdu);
+            rl_buf_free(pdu);
+        }
+        return false;
+    }
+
+    if (unlikely(!priv->agg_on)) {
+        /* The peer received our HELLO, but we missed its answer. */
+        PD("Aggregation enabled on sock %p\n", priv->sock);
+        WRITE_ONCE(priv->agg_on, true);
+    }
+
+    rb_list_foreach_safe (pdu, tmp, &pdus) {
+        rb_list_del(pdu);
+        stats->rx_pkt++;
+        stats->rx_byte += pdu->len;
+        rb_list_enq(pdu, rxq);
+    }
+    rl_buf_free(rb);
+
+    return true;
+}
+
 /* This must be called in process context. */
 static void
 udp4_drain_socket_rxq(struct shim_udp4_flow *priv)
@@ -140,38 +291,46 @@ udp4_drain_socket_rxq(struct shim_udp4_flow *priv)
      * packet (i.e., right now).*/
     bool update_port = (priv->remote_addr.sin_port == htons(RL_SHIM_UDP_PORT));
     struct flow_entry *flow     = priv->flow;
-    struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
+    struct ipcp_entry *ipcp     = flow->txrx.ipcp;
+    struct rl_shim_udp4 *shim   = ipcp->priv;
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
     struct socket *sock         = priv->sock;
-    struct msghdr msg           = {
-        .msg_control    = NULL,
-        .msg_controllen = 0,
-        .msg_name       = NULL,
-        .msg_namelen    = 0,
-        .msg_flags      = MSG_DONTWAIT,
-    };
+    unsigned int budget         = READ_ONCE(shim->batch);
+    unsigned int n              = 0;
+    struct rb_list rxq;
+    struct msghdr msg;
 
+    rb_list_init(&rxq);
     mutex_lock(&priv->rxw_lock);
 
     for (;;) {
         struct sockaddr_in remote_addr;
-        struct rl_buf *rb;
-        struct iovec iov;
+        struct rl_buf *rb = NULL;
+        struct kvec iov;
+        size_t size;
         int ret;
 
-        ret = peek_head_len(sock->sk);
-        if (!ret) {
+        if (budget && n == budget) {
+            /* Budget exhausted, continue in another work item. */
+            schedule_work(&priv->rxw);
+            break;
+        }
+
+        /* Size the buffer on the datagram at the head of the queue. */
+        size = peek_head_len(sock->sk);
+        if (!size) {
             break;
         }
 
-        rb = rl_buf_alloc(ret, priv->flow->txrx.ipcp->rxhdroom,
-                          priv->flow->txrx.ipcp->tailroom, GFP_ATOMIC);
+        rb = rl_buf_alloc(size, ipcp->rxhdroom, ipcp->tailroom, GFP_ATOMIC);
         if (unlikely(!rb)) {
             stats->rx_err++;
             RPV(1, "Out of memory\n");
             break;
         }
-        rl_buf_append(rb, ret);
+        rl_buf_append(rb, size);
 
+        memset(&msg, 0, sizeof(msg));
         if (unlikely(update_port)) {
             msg.msg_name    = &remote_addr;
             msg.msg_namelen = sizeof(remote_addr);
@@ -179,9 +338,9 @@ udp4_drain_socket_rxq(struct shim_udp4_flow *priv)
         iov.iov_base = RL_BUF_DATA(rb);
         iov.iov_len  = rb->len;
 
-        ret = kernel_recvmsg(sock, &msg, (struct kvec *)&iov, 1, iov.iov_len,
-                             msg.msg_flags);
+        ret = kernel_recvmsg(sock, &msg, &iov, 1, iov.iov_len, MSG_DONTWAIT);
         if (ret == -EAGAIN) {
+            rl_buf_free(rb);
             break;
         } else if (unlikely(ret <= 0)) {
             if (ret) {
@@ -190,24 +349,43 @@ udp4_drain_socket_rxq(struct shim_udp4_flow *priv)
             } else {
                 PI("Exit rx loop\n");
             }
+            rl_buf_free(rb);
             break;
         }
+        n++;
+
+        if (unlikely(msg.msg_flags & MSG_TRUNC)) {
+            RPD(1, "Dropping datagram larger than %d bytes\n",
+                (int)iov.iov_len);
+            stats->rx_err++;
+            rl_buf_free(rb);
+            continue;
+        }
 
         if (unlikely(update_port)) {
             /* Grab the right (source) UDP port used by the other side. */
             priv->remote_addr.sin_port = remote_addr.sin_port;
             PD("sock %p updated with port %u\n", priv->sock,
                ntohs(priv->remote_addr.sin_port));
-            update_port     = false;
-            msg.msg_name    = NULL;
-            msg.msg_namelen = 0;
+            update_port = false;
         }
 
         NPD("read %d bytes\n", ret);
-        rb->len = ret;
-        rl_sdu_rx_flow(flow->txrx.ipcp, flow, rb, true);
-        stats->rx_pkt++;
-        stats->rx_byte += ret;
+        rl_buf_trim(rb, ret);
+        if (!udp4_agg_rx(priv, rb, &rxq)) {
+            rb_list_enq(rb, &rxq);
+            stats->rx_pkt++;
+            stats->rx_byte += ret;
+        }
+
+        if (n % UDP4_BATCH_MAX == 0 && !rb_list_empty(&rxq)) {
+            /* Deliver what we have so far, to bound the latency. */
+            rl_sdu_rx_flow_batch(ipcp, flow, &rxq, true);
+        }
+    }
+
+    if (!rb_list_empty(&rxq)) {
+        rl_sdu_rx_flow_batch(ipcp, flow, &rxq, true);
     }
 
     mutex_unlock(&priv->rxw_lock);
@@ -221,6 +399,205 @@ udp4_rx_worker(struct work_struct *w)
     udp4_drain_socket_rxq(priv);
 }
 
+/* Transmit the pending aggregates. The PDUs written while this work item
+ * is pending or running end up in the same datagram, up to the maximum
+ * datagram size. */
+static void
+udp4_agg_worker(struct work_struct *w)
+{
+    struct shim_udp4_flow *priv = container_of(w, struct shim_udp4_flow, aggw);
+    struct flow_entry *flow     = priv->flow;
+    struct rl_buf *rb;
+
+    while ((rb = rl_agg_deq(&priv->agg)) != NULL) {
+        struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
+        unsigned int pdus           = RL_BUF_AGG(rb).pdus;
+        int ret;
+
+        if (pdus) {
+            struct udp4_agg_hdr *hdr = (struct udp4_agg_hdr *)RL_BUF_DATA(rb);
+
+            hdr->magic = htons(UDP4_AGG_MAGIC);
+            hdr->type  = UDP4_AGG_T_DATA;
+            hdr->pad1  = 0;
+            stats->tx_agg_frames++;
+            stats->tx_agg_pdus += pdus;
+        }
+
+        ret = udp4_sendmsg(priv, RL_BUF_DATA(rb), rb->len, 0);
+        if (unlikely(ret != rb->len)) {
+            RPD(1, "kernel_sendmsg(%d): failed [%d]\n", (int)rb->len, ret);
+            stats->tx_err++;
+        } else {
+            stats->tx_pkt++;
+            stats->tx_byte += rb->len;
+        }
+        rl_buf_free(rb);
+    }
+
+    if (rl_agg_unstall(&priv->agg)) {
+        rl_write_restart_flow(flow);
+    }
+}
+
+/* Send PDUs rbs[i..j) as a single UDP GSO datagram, which is split by the
+ * stack (or by the device) in one datagram per PDU. All the PDUs must
+ * have the same length, except for the last one that can be shorter. */
+static int
+udp4_send_gso(struct shim_udp4_flow *priv, struct rl_buf **rbs, int num,
+              size_t bytes, unsigned msg_flags)
+{
+#ifdef RL_HAVE_UDP_SEGMENT
+    char cbuf[CMSG_SPACE(sizeof(uint16_t))];
+    struct kvec iov[UDP4_BATCH_MAX];
+    struct cmsghdr *cm = (struct cmsghdr *)cbuf;
+    struct msghdr msg;
+    int i;
+
+    for (i = 0; i < num; i++) {
+        iov[i].iov_base = RL_BUF_DATA(rbs[i]);
+        iov[i].iov_len  = rbs[i]->len;
+    }
+
+    cm->cmsg_level               = SOL_UDP;
+    cm->cmsg_type                = UDP_SEGMENT;
+    cm->cmsg_len                 = CMSG_LEN(sizeof(uint16_t));
+    *((uint16_t *)CMSG_DATA(cm)) = rbs[0]->len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name       = (struct sockaddr *)&priv->remote_addr;
+    msg.msg_namelen    = sizeof(priv->remote_addr);
+    msg.msg_control    = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    msg.msg_flags      = msg_flags;
+
+    return kernel_sendmsg(priv->sock, &msg, iov, num, bytes);
+#else  /* !RL_HAVE_UDP_SEGMENT */
+    return -EOPNOTSUPP;
+#endif /* !RL_HAVE_UDP_SEGMENT */
+}
+
+/* Transmit a batch of PDUs, using UDP GSO for the runs of PDUs with the
+ * same length. Sends do not block: the number of PDUs consumed is
+ * returned, and the PDUs from there on have to be retried when the socket
+ * is writeable again. */
+static int
+udp4_send_batch(struct shim_udp4_flow *priv, struct rl_buf **rbs, int n)
+{
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(priv->flow->txrx.ipcp->stats);
+    int i                       = 0;
+
+    while (i < n) {
+        size_t seglen = rbs[i]->len;
+        size_t bytes  = seglen;
+        int j         = i + 1;
+        int ret;
+
+        while (j < n && rbs[j]->len <= seglen &&
+               bytes + rbs[j]->len <= UDP4_GSO_MAX_BYTES) {
+            bytes += rbs[j]->len;
+            if (rbs[j++]->len < seglen) {
+                break; /* a shorter segment must be the last one */
+            }
+        }
+
+        ret = -EOPNOTSUPP;
+        if (j - i > 1 && !priv->gso_off) {
+            ret = udp4_send_gso(priv, rbs + i, j - i, bytes, MSG_DONTWAIT);
+            if (ret == -EAGAIN) {
+                return i;
+            }
+            if (ret < 0 && ret != -ENOBUFS) {
+                /* E.g. no checksum offload on the egress device. */
+                PD("UDP GSO not available [%d], falling back\n", ret);
+                priv->gso_off = true;
+            }
+        }
+
+        if (ret < 0) {
+            /* Send the PDUs one by one. */
+            for (; i < j; i++) {
+                ret = udp4_sendmsg(priv, RL_BUF_DATA(rbs[i]), rbs[i]->len,
+                                   MSG_DONTWAIT);
+                if (ret == -EAGAIN) {
+                    return i;
+                }
+                if (unlikely(ret != rbs[i]->len)) {
+                    RPD(1, "kernel_sendmsg(%d): failed [%d]\n",
+                        (int)rbs[i]->len, ret);
+                    stats->tx_err++;
+                } else {
+                    stats->tx_pkt++;
+                    stats->tx_byte += ret;
+                }
+            }
+            continue;
+        }
+
+        stats->tx_pkt += j - i;
+        stats->tx_byte += bytes;
+        i = j;
+    }
+
+    return n;
+}
+
+/* Transmit up to 'batch' PDUs from the flow transmission queue. */
+static void
+udp4_tx_worker(struct work_struct *w)
+{
+    struct shim_udp4_flow *priv = container_of(w, struct shim_udp4_flow, txw);
+    struct rl_shim_udp4 *shim   = priv->flow->txrx.ipcp->priv;
+    unsigned int budget         = READ_ONCE(shim->batch);
+    struct rl_buf *rbs[UDP4_BATCH_MAX];
+    bool stalled, more;
+    int sent;
+    int n = 0;
+    int i;
+
+    if (budget == 0 || budget > UDP4_BATCH_MAX) {
+        budget = UDP4_BATCH_MAX;
+    }
+
+    spin_lock_bh(&priv->txq_lock);
+    while (n < budget && !rb_list_empty(&priv->txq)) {
+        rbs[n] = rb_list_front(&priv->txq);
+        rb_list_del(rbs[n]);
+        n++;
+    }
+    priv->txq_len -= n;
+    more             = !rb_list_empty(&priv->txq);
+    stalled          = priv->tx_stalled;
+    priv->tx_stalled = false;
+    spin_unlock_bh(&priv->txq_lock);
+
+    sent = udp4_send_batch(priv, rbs, n);
+    for (i = 0; i < sent; i++) {
+        rl_buf_free(rbs[i]);
+    }
+
+    if (sent < n) {
+        /* The socket send buffer is full. Put the unsent PDUs back at
+         * the head of the queue, and let udp4_write_space() reschedule
+         * us. Check again after requeueing, in case the socket became
+         * writeable in the meantime. */
+        spin_lock_bh(&priv->txq_lock);
+        for (i = n - 1; i >= sent; i--) {
+            rb_list_enq_head(rbs[i], &priv->txq);
+        }
+        priv->txq_len += n - sent;
+        priv->tx_stalled |= stalled;
+        spin_unlock_bh(&priv->txq_lock);
+        more = sock_writeable(priv->sock->sk);
+    } else if (stalled) {
+        rl_write_restart_flow(priv->flow);
+    }
+
+    if (more) {
+        schedule_work(&priv->txw);
+    }
+}
+
 static void
 udp4_data_ready(struct sock *sk
 #ifdef RL_SK_DATA_READY_SECOND_ARG
@@ -242,6 +619,10 @@ udp4_write_space(struct sock *sk)
 {
     struct shim_udp4_flow *priv = sk->sk_user_data;
 
+    if (READ_ONCE(priv->txq_len) && sock_writeable(sk)) {
+        /* Resume a batched transmission stopped by a full socket. */
+        schedule_work(&priv->txw);
+    }
     rl_write_restart_flow(priv->flow);
 }
 
@@ -272,12 +653,27 @@ rl_shim_udp4_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
     priv->sock = sock;
     INIT_WORK(&priv->rxw, udp4_rx_worker);
     mutex_init(&priv->rxw_lock);
+    priv->hello_sent = false;
+    priv->agg_on     = false;
+    rl_agg_init(&priv->agg);
+    INIT_WORK(&priv->aggw, udp4_agg_worker);
+    spin_lock_init(&priv->txq_lock);
+    rb_list_init(&priv->txq);
+    priv->txq_len    = 0;
+    priv->tx_stalled = false;
+    priv->gso_off    = false;
+    INIT_WORK(&priv->txw, udp4_tx_worker);
 
     memset(&priv->remote_addr, 0, sizeof(priv->remote_addr));
     priv->remote_addr.sin_family      = AF_INET;
     priv->remote_addr.sin_port        = flow->cfg.inet_port;
     priv->remote_addr.sin_addr.s_addr = flow->cfg.inet_ip;
 
+    if (READ_ONCE(((struct rl_shim_udp4 *)ipcp->priv)->agg)) {
+        /* Propose aggregation to the remote end. */
+        udp4_agg_hello(priv);
+    }
+
     /* Intercept UDP traffic on this socket. */
     write_lock_bh(&sock->sk->sk_callback_lock);
     priv->sk_data_ready      = sock->sk->sk_data_ready;
@@ -308,6 +704,7 @@ static int
 rl_shim_udp4_flow_deallocated(struct ipcp_entry *ipcp, struct flow_entry *flow)
 {
     struct shim_udp4_flow *priv = flow->priv;
+    struct rl_buf *rb, *tmp;
     struct socket *sock;
 
     if (!priv) {
@@ -315,6 +712,13 @@ rl_shim_udp4_flow_deallocated(struct ipcp_entry *ipcp, struct flow_entry *flow)
     }
 
     cancel_work_sync(&priv->rxw);
+    cancel_work_sync(&priv->aggw);
+    rl_agg_fini(&priv->agg);
+    cancel_work_sync(&priv->txw);
+    rb_list_foreach_safe (rb, tmp, &priv->txq) {
+        rb_list_del(rb);
+        rl_buf_free(rb);
+    }
 
     sock = priv->sock;
 
@@ -342,21 +746,41 @@ rl_shim_udp4_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
 {
     struct rl_ipcp_stats *stats      = raw_cpu_ptr(ipcp->stats);
     struct shim_udp4_flow *flow_priv = flow->priv;
-    struct msghdr msg;
-    struct iovec iov;
     int ret;
 
-    iov.iov_base = RL_BUF_DATA(rb);
-    iov.iov_len  = rb->len;
+    if (READ_ONCE(flow_priv->agg_on)) {
+        ret = rl_agg_enq(&flow_priv->agg, rb,
+                         ipcp->max_sdu_size + sizeof(struct udp4_agg_hdr) +
+                             RL_AGG_PFXLEN,
+                         sizeof(struct udp4_agg_hdr), 0, 0);
+        if (unlikely(ret == -ENOMEM)) {
+            rl_buf_free(rb);
+            stats->tx_err++;
+        } else if (ret == 0) {
+            schedule_work(&flow_priv->aggw);
+        }
 
-    msg.msg_name       = (struct sockaddr *)&flow_priv->remote_addr;
-    msg.msg_namelen    = sizeof(flow_priv->remote_addr);
-    msg.msg_control    = NULL;
-    msg.msg_controllen = 0;
-    msg.msg_flags      = (flags & RL_RMT_F_MAYSLEEP) ? 0 : MSG_DONTWAIT;
+        return ret; /* -EAGAIN means backpressure */
+    }
 
-    ret =
-        kernel_sendmsg(flow_priv->sock, &msg, (struct kvec *)&iov, 1, rb->len);
+    if (READ_ONCE(((struct rl_shim_udp4 *)ipcp->priv)->batch)) {
+        /* Batched mode, queue the PDU for udp4_tx_worker(). */
+        spin_lock_bh(&flow_priv->txq_lock);
+        if (flow_priv->txq_len >= UDP4_TXQ_MAX) {
+            flow_priv->tx_stalled = true;
+            spin_unlock_bh(&flow_priv->txq_lock);
+            return -EAGAIN; /* backpressure */
+        }
+        rb_list_enq(rb, &flow_priv->txq);
+        flow_priv->txq_len++;
+        spin_unlock_bh(&flow_priv->txq_lock);
+        schedule_work(&flow_priv->txw);
+
+        return 0;
+    }
+
+    ret = udp4_sendmsg(flow_priv, RL_BUF_DATA(rb), rb->len,
+                       (flags & RL_RMT_F_MAYSLEEP) ? 0 : MSG_DONTWAIT);
 
     if (unlikely(ret != rb->len)) {
         RPD(1, "wspaces: %d, %lu\n", sk_stream_wspace(flow_priv->sock->sk),
@@ -384,17 +808,66 @@ rl_shim_udp4_flow_writeable(struct flow_entry *flow)
 {
     struct shim_udp4_flow *flow_priv = flow->priv;
 
-    return sock_writeable(flow_priv->sock->sk);
+    return sock_writeable(flow_priv->sock->sk) &&
+           rl_agg_writeable(&flow_priv->agg) &&
+           READ_ONCE(flow_priv->txq_len) < UDP4_TXQ_MAX;
 }
 
 static int
 rl_shim_udp4_config(struct ipcp_entry *ipcp, const char *param_name,
                     const char *param_value, int *notify)
 {
+    struct rl_shim_udp4 *priv = ipcp->priv;
+
     if (strcmp(param_name, "mss") == 0) {
         return -EPERM; /* deny */
     }
 
+    if (strcmp(param_name, "aggregation") == 0) {
+        if (strcmp(param_value, "on") == 0) {
+            WRITE_ONCE(priv->agg, true);
+        } else if (strcmp(param_value, "off") == 0) {
+            WRITE_ONCE(priv->agg, false);
+        } else {
+            return -EINVAL;
+        }
+        return 0;
+    }
+
+    if (strcmp(param_name, "batch") == 0) {
+        uint32_t batch;
+        int ret;
+
+        ret = rl_configstr_to_u32(param_value, &batch, NULL);
+        if (ret) {
+            return ret;
+        }
+        if (batch > UDP4_BATCH_MAX) {
+            return -EINVAL;
+        }
+        WRITE_ONCE(priv->batch, batch);
+        return 0;
+    }
+
+    return -ENOSYS;
+}
+
+static int
+rl_shim_udp4_config_get(struct ipcp_entry *ipcp, const char *param_name,
+                        char *buf, int buflen)
+{
+    struct rl_shim_udp4 *priv = ipcp->priv;
+
+    if (strcmp(param_name, "aggregation") == 0) {
+        snprintf(buf, buflen, "%s", READ_ONCE(priv->agg) ? "on" : "off");
+        return 0;
+    }
+
+    if (strcmp(param_name, "batch") == 0) {
+        snprintf(buf, buflen, "%u", READ_ONCE(priv->batch));
+        return 0;
+    }
+
     return -ENOSYS;
 }
 
@@ -413,6 +886,7 @@ static struct ipcp_factory shim_udp4_factory = {
     .ops.flow_deallocated   = rl_shim_udp4_flow_deallocated,
     .ops.sdu_write          = rl_shim_udp4_sdu_write,
     .ops.config             = rl_shim_udp4_config,
+    .ops.config_get         = rl_shim_udp4_config_get,
     .ops.flow_writeable     = rl_shim_udp4_flow_writeable,
 };
 
@@ -8,9 +8,12 @@ rlite-ctl ipcp-config x flow-del-wait-ms 100
 start_daemon rinaperf -lw -z rpinstance1
 start_daemon rinaperf -lw -z rpinstance2
 start_daemon rinaperf -lw -z rpinstance3
+start_daemon rinaperf -lw -z rpinstance4 -R
 # Run some clients towards the instances, with various QoS
 rinaperf -z rpinstance1 -p 2 -c 6 -i 1
 rinaperf -z rpinstance3 -p 3 -c 3 -i 0 -g 0
+# Perf test using the mmap()ed rings on both sides
+rinaperf -z rpinstance4 -t perf -c 2000 -s 500 -g 0 -R
 # Also test flows-show and ipcp-stats
 rlite-ctl flows-show
 rlite-ctl ipcp-stats x
@@ -0,0 +1,105 @@
+#!/bin/bash -e
+
+source tests/libtest.sh
+
+# Multi-namespace test for fast reroute. The link-state-lfa routing policy
+# preinstalls Loop Free Alternates as backup next hops into the kernel
+# PDUFT, so that the kernel can switch to them as soon as the primary
+# lower flow goes down. Measure the longest interruption seen by a
+# rinaperf ping while the primary link fails.
+
+# Maximum tolerated gap between two consecutive ping responses.
+MAX_GAP_MS=100
+# Responses must keep arriving for at least this long after the link
+# failure. rinaperf gives up after a few consecutive timeouts, so a
+# permanent blackhole would otherwise go unnoticed by the gap check.
+MIN_AFTER_DOWN_MS=1000
+
+# First parameter: link name (e.g. "ab")
+# Second parameter: "up" or "down"
+link_set() {
+    local li=$1
+    local status=$2
+    left=${li:0:1}
+    right=${li:1:1}
+    ip netns exec $left ip link set veth.${li}l $status
+    ip netns exec $right ip link set veth.${li}r $status
+}
+
+# Create four namespaces, connected on the same LAN through a software
+# bridge and veth pairs.
+#
+#     A----B
+#     | \  |
+#     |  \ |
+#     |   \|
+#     C----D
+#
+for cont in a b c d; do
+    create_namespace ${cont}
+    ip netns exec ${cont} rlite-ctl ipcp-create ${cont}.n normal normdif
+    ip netns exec ${cont} rlite-ctl ipcp-config ${cont}.n flow-del-wait-ms 100
+done
+for li in ab ac ad bd cd; do
+    create_veth_pair veth ${li}l ${li}r
+    left=${li:0:1}
+    right=${li:1:1}
+    add_veth_to_namespace ${left} veth.${li}l
+    add_veth_to_namespace ${right} veth.${li}r
+    # Normal over shim setup in all the namespaces
+    ip netns exec $left rlite-ctl ipcp-create ${li}l.eth shim-eth ${li}dif
+    ip netns exec $right rlite-ctl ipcp-create ${li}r.eth shim-eth ${li}dif
+    ip netns exec ${left} rlite-ctl ipcp-config ${li}l.eth netdev veth.${li}l
+    ip netns exec ${right} rlite-ctl ipcp-config ${li}r.eth netdev veth.${li}r
+    ip netns exec ${left} rlite-ctl ipcp-config ${li}l.eth flow-del-wait-ms 100
+    ip netns exec ${right} rlite-ctl ipcp-config ${li}r.eth flow-del-wait-ms 100
+    ip netns exec ${left} rlite-ctl ipcp-register ${left}.n ${li}dif
+    ip netns exec ${right} rlite-ctl ipcp-register ${right}.n ${li}dif
+done
+
+# Carry out the enrollments, with A being the enrollment master.
+ip netns exec a rlite-ctl dif-policy-mod normdif routing link-state-lfa
+ip netns exec a rlite-ctl dif-policy-param-mod normdif addralloc nack-wait 500ms
+ip netns exec a rlite-ctl ipcp-enroller-enable a.n
+for li in ab ac ad; do
+    left=${li:0:1}
+    right=${li:1:1}
+    ip netns exec ${right} rlite-ctl ipcp-enroll ${right}.n normdif ${li}dif ${left}.n
+done
+for li in bd cd; do
+    left=${li:0:1}
+    right=${li:1:1}
+    ip netns exec ${right} rlite-ctl ipcp-lower-flow-alloc ${right}.n normdif ${li}dif ${left}.n
+done
+ip netns exec a rlite-ctl dif-routing-show normdif
+
+# Run a server on D
+start_daemon_namespace d rinaperf -lw -z rpinstd
+# Check that A can connect to D
+ip netns exec a rinaperf -z rpinstd -i 0 -c 1
+
+# Ping D from A every 2 ms for 3 seconds, with timestamps, and bring the
+# primary link AD down in the meanwhile.
+PINGLOG=$(mktemp)
+cumulative_trap "rm -f ${PINGLOG}" "EXIT"
+ip netns exec a rinaperf -z rpinstd -i 2000 -c 1500 -W 20 -T > ${PINGLOG} &
+PINGPID=$!
+sleep 1
+DOWNTS=$(date +%s.%N)
+link_set ad down
+wait ${PINGPID}
+
+# Compute the longest gap between two consecutive responses, and how long
+# the responses kept arriving after the link went down.
+GAP=$(awk -F'[][]' '/bytes from server/ {
+        if (prev) { d = ($2 - prev) * 1000; if (d > max) max = d }
+        prev = $2
+    } END { printf "%d", max }' ${PINGLOG})
+AFTER=$(awk -F'[][]' -v down=${DOWNTS} '/bytes from server/ { last = $2 }
+    END { d = (last - down) * 1000; printf "%d", (d > 0) ? d : 0 }' ${PINGLOG})
+echo "Failover gap: ${GAP} ms, responses up to ${AFTER} ms after link down"
+FRR=$(ip netns exec a rlite-ctl ipcp-stats a.n | awk '/frr_pkt/ { print $3 }')
+echo "PDUs fast rerouted: ${FRR}"
+test ${GAP} -le ${MAX_GAP_MS}
+test ${AFTER} -ge ${MIN_AFTER_DOWN_MS}
+test "${FRR:-0}" -gt 0
@@ -0,0 +1,47 @@
+#!/bin/bash -e
+
+source tests/libtest.sh
+
+# Check that the receiver ACK policy reduces the number of control PDUs
+# sent per data PDU received on reliable flows. With a zero A timeout the
+# receiver acks every PDU by default, while with "ack-every" it sends a
+# control PDU every N PDUs.
+
+# Print the ratio between the control PDUs sent and the data PDUs
+# received, summed over all the reliable flows currently allocated.
+ack_ratio() {
+    local ports=$(rlite-ctl flows-show |
+        sed -n 's/.*addr:port [0-9]*:\([0-9]*\)<-->.* rtx, .*/\1/p')
+    for p in ${ports}; do
+        rlite-ctl flow-dump ${p} || true
+    done | awk -F'[ =\\[\\],]+' '/ctrl_pdus_sent/ {
+            c += $3; r += $5
+        } END { printf "%d", r ? (c * 1000) / r : 1000 }'
+}
+
+# Run a reliable perf test for a couple of seconds, sampling the ratio
+# (in thousandths) while the flows are still allocated.
+measure() {
+    rinaperf -z rpi -t perf -g 0 -D 2 -s 200 > /dev/null &
+    local pid=$!
+    sleep 1
+    ack_ratio
+    wait ${pid}
+}
+
+rlite-ctl ipcp-create x normal dd
+rlite-ctl ipcp-config x flow-del-wait-ms 100
+rlite-ctl dif-policy-param-mod dd flowalloc initial-a 0ms
+start_daemon rinaperf -lw -z rpi
+
+DFLT=$(measure)
+echo "Default policy: ${DFLT}/1000 control PDUs per data PDU"
+
+rlite-ctl dif-policy-param-mod dd flowalloc ack-every 16
+EVERY=$(measure)
+echo "ack-every 16: ${EVERY}/1000 control PDUs per data PDU"
+
+# With ack-every 16, at most one control PDU every 16 data PDUs is
+# expected, plus the few sent by the ACK timer at the end of bursts.
+test ${EVERY} -lt 200
+test ${EVERY} -lt ${DFLT}
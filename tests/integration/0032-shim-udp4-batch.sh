@@ -0,0 +1,38 @@
+#!/bin/bash -e
+
+source tests/libtest.sh
+
+# Compare the throughput of a shim-udp4 flow with and without the batched
+# mode, and check that batching does not make it worse.
+
+create_veth_pair rinau.veth
+ip addr add 10.11.12.13/24 dev rinau.veth.0
+ip addr add 10.11.12.14/24 dev rinau.veth.1
+cp /etc/hosts /etc/hosts.save
+cumulative_trap "cp /etc/hosts.save /etc/hosts" "EXIT"
+echo "10.11.12.13 rpinstance5" > /etc/hosts
+
+rlite-ctl ipcp-create us0 shim-udp4 d0
+rlite-ctl ipcp-create us1 shim-udp4 d1
+rlite-ctl ipcp-config us0 flow-del-wait-ms 100
+rlite-ctl ipcp-config us1 flow-del-wait-ms 100
+start_daemon rinaperf -lw -z rpinstance5 -d d0
+
+# Print the throughput (in Mbps) measured by the receiver.
+measure() {
+    rinaperf -z rpinstance5 -d d1 -t perf -D 3 -s 1000 |
+        awk '/^Receiver/ { print $4 }'
+}
+
+NOBATCH=$(measure)
+echo "batch 0: ${NOBATCH} Mbps"
+
+rlite-ctl ipcp-config us0 batch 32
+rlite-ctl ipcp-config us1 batch 32
+BATCH=$(measure)
+echo "batch 32: ${BATCH} Mbps"
+
+awk -v b=${BATCH} -v n=${NOBATCH} 'BEGIN {
+    printf "speedup: %.2fx\n", n > 0 ? b / n : 0
+    exit !(b > 0 && b >= 0.8 * n)
+}'
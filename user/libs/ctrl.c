@@ -88,16 +88,22 @@ rl_read_next_msg(int rfd, int quiet)
 int
 rl_write_msg(int rfd, const struct rl_msg_base *msg, int quiet)
 {
-    char serbuf[4096];
+    char sbuf[4096];
+    char *serbuf = sbuf;
     unsigned int serlen;
     int ret;
 
     /* Serialize the message. */
     serlen = rl_msg_serlen(rl_ker_numtables, RLITE_KER_MSG_MAX, msg);
-    if (serlen > sizeof(serbuf)) {
-        PE("Serialized message would be too long [%u]\n", serlen);
-        errno = EINVAL;
-        return -1;
+    if (serlen > sizeof(sbuf)) {
+        /* Large messages (e.g. a PDUFT replacement) need a bigger
+         * buffer. */
+        serbuf = malloc(serlen);
+        if (!serbuf) {
+            PE("Out of memory\n");
+            errno = ENOMEM;
+            return -1;
+        }
     }
     serlen =
         serialize_rlite_msg(rl_ker_numtables, RLITE_KER_MSG_MAX, serbuf, msg);
@@ -120,6 +126,10 @@ rl_write_msg(int rfd, const struct rl_msg_base *msg, int quiet)
         ret = 0;
     }
 
+    if (serbuf != sbuf) {
+        free(serbuf);
+    }
+
     return ret;
 }
 
@@ -700,3 +710,54 @@ rina_flow_mss_get(int fd)
 
     return mss;
 }
+
+static int
+rina_flow_batch_common(int fd, unsigned long cmd, struct rina_sdu *sdus,
+                       unsigned int num)
+{
+    struct rl_ioctl_sdu ksdus[RLITE_IO_BATCH_MAX];
+    struct rl_ioctl_batch batch;
+    unsigned int i;
+    int ret;
+
+    if (num > RLITE_IO_BATCH_MAX) {
+        num = RLITE_IO_BATCH_MAX;
+    }
+
+    for (i = 0; i < num; i++) {
+        if (sdus[i].len > UINT32_MAX) {
+            errno = EINVAL;
+            return -1;
+        }
+        ksdus[i].buf  = (uint64_t)(uintptr_t)sdus[i].buf;
+        ksdus[i].len  = (uint32_t)sdus[i].len;
+        ksdus[i].pad1 = 0;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+    batch.sdus = (uint64_t)(uintptr_t)ksdus;
+    batch.num  = num;
+
+    ret = ioctl(fd, cmd, &batch);
+    if (ret > 0 && cmd == RLITE_IOCTL_READ_BATCH) {
+        /* Report the length of the SDUs received. */
+        for (i = 0; i < (unsigned int)ret; i++) {
+            sdus[i].len = ksdus[i].len;
+        }
+    }
+
+    return ret;
+}
+
+int
+rina_flow_write_batch(int fd, const struct rina_sdu *sdus, unsigned int num)
+{
+    return rina_flow_batch_common(fd, RLITE_IOCTL_WRITE_BATCH,
+                                  (struct rina_sdu *)sdus, num);
+}
+
+int
+rina_flow_read_batch(int fd, struct rina_sdu *sdus, unsigned int num)
+{
+    return rina_flow_batch_common(fd, RLITE_IOCTL_READ_BATCH, sdus, num);
+}
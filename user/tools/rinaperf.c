@@ -44,8 +44,12 @@
 #include <semaphore.h>
 #include <fcntl.h>
 #include <math.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 
 #include <rina/api.h>
+#include <rlite/common.h>
+#include <rlite/ring.h>
 
 /*
  * rinaperf: a tool to measure bandwidth and latency of RINA networks.
@@ -106,16 +110,20 @@
 
 #define SDU_SIZE_MAX 65535
 #define RP_MAX_WORKERS 1023
+#define RP_BATCH_MAX 32
+#define RP_RING_SLOTS 256
 
 #define RP_OPCODE_PING 0
 #define RP_OPCODE_RR 1
 #define RP_OPCODE_PERF 2
 #define RP_OPCODE_DATAFLOW 3
-#define RP_OPCODE_STOP 4 /* must be the last */
+#define RP_OPCODE_RATE 4
+#define RP_OPCODE_STOP 5 /* must be the last */
 
 #define CLI_FA_TIMEOUT_MSECS 5000
 #define CLI_RESULT_TIMEOUT_MSECS 5000
 #define RP_DATA_WAIT_MSECS 10000
+#define RP_RATE_TOLERANCE 5 /* percentage */
 
 struct rinaperf;
 struct worker;
@@ -138,7 +146,7 @@ struct rp_result_msg {
                    * as seen by the sender or the receiver */
     uint64_t pps; /* average packet rate measured by the sender or receiver */
     uint64_t bps; /* average bandwidth measured by the sender or receiver */
-    uint64_t latency; /* in nanoseconds */
+    uint64_t latency; /* in nanoseconds (jitter for the rate test) */
 } __attribute__((packed));
 
 typedef int (*perf_fn_t)(struct worker *);
@@ -184,6 +192,9 @@ struct rinaperf {
     int cli_flow_allocated; /* client flows allocated ? */
     int background;         /* server runs as a daemon process */
     int cdf;                /* report CDF percentiles */
+    unsigned int batch;     /* SDUs per syscall in perf tests */
+    int ring;               /* use the mmap()ed rings in perf tests */
+    unsigned int wait_ms;   /* how long to wait for a ping response */
 
     /* Synchronization between client threads and main thread. */
     sem_t cli_barrier;
@@ -306,7 +317,7 @@ ping_client(struct worker *w)
             break;
         }
     repoll:
-        ret = poll(pfd, 2, RP_DATA_WAIT_MSECS);
+        ret = poll(pfd, 2, w->rp->wait_ms);
         if (ret < 0) {
             perror("poll(flow)");
         }
@@ -533,6 +544,119 @@ ping_report(struct worker *w, struct rp_result_msg *snd,
     }
 }
 
+/* Data flow rings used by the perf tests in ring mode, see rlite/ring.h. */
+struct rp_ring {
+    void *mem;
+    size_t size;
+    struct rl_ring *tx;
+    struct rl_ring *rx;
+};
+
+/* Switch the data flow to ring mode, with slots that fit SDUs of 'size'
+ * bytes, and map the rings. */
+static int
+rp_ring_setup(struct worker *w, struct rp_ring *r, int size)
+{
+    struct rl_ioctl_ring req;
+    uint32_t i;
+
+    memset(&req, 0, sizeof(req));
+    req.num_slots = RP_RING_SLOTS;
+    req.slot_size = (sizeof(struct rl_ring_slot) + size + 7) & ~7U;
+    if (ioctl(w->dfd, RLITE_IOCTL_RING_SETUP, &req)) {
+        perror("ioctl(RING_SETUP)");
+        return -1;
+    }
+
+    r->size = req.mmap_size;
+    r->mem =
+        mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, w->dfd, 0);
+    if (r->mem == MAP_FAILED) {
+        perror("mmap(ring)");
+        r->mem = NULL;
+        return -1;
+    }
+    r->tx = (struct rl_ring *)r->mem;
+    r->rx = (struct rl_ring *)((char *)r->mem +
+                               RL_RING_BYTES(req.num_slots, req.slot_size));
+
+    /* The payload of the TX slots never changes. */
+    for (i = 0; i < req.num_slots; i++) {
+        memset(RL_RING_SLOT_DATA(RL_RING_SLOT(r->tx, i)), 'x', size);
+    }
+
+    return 0;
+}
+
+static void
+rp_ring_fini(struct rp_ring *r)
+{
+    if (r->mem) {
+        munmap(r->mem, r->size);
+        r->mem = NULL;
+    }
+}
+
+/* Produce up to 'num' SDUs of 'size' bytes in the TX ring and ring the
+ * doorbell, with the same return values as rina_flow_write_batch(). */
+static int
+rp_ring_write(int fd, struct rp_ring *r, int size, unsigned int num)
+{
+    struct rl_ring *tx = r->tx;
+    uint32_t space     = rl_ring_space(tx);
+    uint32_t k;
+
+    if (space == 0) {
+        /* poll() reports POLLOUT once the kernel drained the ring. */
+        errno = EAGAIN;
+        return -1;
+    }
+    if (num > space) {
+        num = space;
+    }
+    for (k = 0; k < num; k++) {
+        RL_RING_SLOT(tx, tx->head + k)->len = size;
+    }
+    rl_ring_store(&tx->head, tx->head + num);
+
+    if (ioctl(fd, RLITE_IOCTL_RING_SYNC)) {
+        return -1;
+    }
+
+    return num;
+}
+
+/* Consume the SDUs available in the RX ring, pulling them from the flow
+ * if the ring is empty. The SDU lengths are stored in 'lens'. Same
+ * return values as rina_flow_read_batch(). */
+static int
+rp_ring_read(int fd, struct rp_ring *r, uint32_t *lens)
+{
+    struct rl_ring *rx = r->rx;
+    uint32_t avail     = rl_ring_avail(rx);
+    uint32_t k;
+
+    if (avail == 0) {
+        if (ioctl(fd, RLITE_IOCTL_RING_SYNC)) {
+            return -1;
+        }
+        avail = rl_ring_avail(rx);
+    }
+    if (avail == 0) {
+        if (rl_ring_load(&rx->flags) & RL_RING_F_EOF) {
+            return 0;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+    for (k = 0; k < avail; k++) {
+        lens[k] = RL_RING_SLOT(rx, rx->tail + k)->len;
+    }
+    rl_ring_store(&rx->tail, rx->tail + avail);
+
+    return avail;
+}
+
 static int
 perf_client(struct worker *w)
 {
@@ -542,8 +666,11 @@ perf_client(struct worker *w)
     unsigned int burst    = w->burst;
     struct rinaperf *rp   = w->rp;
     unsigned int cdown    = burst;
+    unsigned int batch    = rp->batch;
+    struct rina_sdu sdus[RP_BATCH_MAX];
     struct timespec t_start, t_end;
     struct timespec w1, w2;
+    struct rp_ring ring;
     char buf[SDU_SIZE_MAX];
     long long ns;
     struct pollfd pfd[2];
@@ -559,21 +686,49 @@ perf_client(struct worker *w)
         return -1;
     }
 
+    memset(&ring, 0, sizeof(ring));
+    if (rp->ring && rp_ring_setup(w, &ring, size)) {
+        return -1;
+    }
+
     pfd[0].fd     = w->dfd;
     pfd[1].fd     = w->rp->stop_pipe[0];
     pfd[0].events = POLLOUT;
     pfd[1].events = POLLIN;
 
     memset(buf, 'x', size);
+    for (i = 0; i < batch; i++) {
+        /* All the SDUs of a batch share the same buffer. */
+        sdus[i].buf = buf;
+        sdus[i].len = size;
+    }
 
     clock_gettime(CLOCK_MONOTONIC, &t_start);
 
     for (i = 0; !rp->cli_stop && (!limit || i < limit); i++) {
-        ret = write(w->dfd, buf, size);
+        if (ring.mem || batch > 1) {
+            unsigned int n = ring.mem ? RP_RING_SLOTS : batch;
+
+            if (limit && limit - i < n) {
+                n = limit - i;
+            }
+            if (ring.mem) {
+                ret = rp_ring_write(w->dfd, &ring, size, n);
+            } else {
+                ret = rina_flow_write_batch(w->dfd, sdus, n);
+            }
+            if (ret > 0) {
+                i += ret - 1;
+                ret = size;
+            }
+        } else {
+            ret = write(w->dfd, buf, size);
+        }
         if (ret < 0 && errno == EAGAIN) {
             ret = poll(pfd, 2, RP_DATA_WAIT_MSECS);
             if (ret < 0) {
                 perror("poll(flow)");
+                rp_ring_fini(&ring);
                 return -1;
             } else if (ret == 0) {
                 /* Timeout */
@@ -620,6 +775,16 @@ perf_client(struct worker *w)
         }
     }
 
+    /* Let the kernel push the SDUs left in the TX ring, since they
+     * are already accounted for. */
+    while (ring.mem && rl_ring_load(&ring.tx->tail) != ring.tx->head) {
+        if (poll(pfd, 1, RP_DATA_WAIT_MSECS) <= 0) {
+            PRINTF("Failed to drain the TX ring\n");
+            break;
+        }
+    }
+    rp_ring_fini(&ring);
+
     clock_gettime(CLOCK_MONOTONIC, &t_end);
     ns = nanodiff(&t_end, &t_start);
     if (timeout) {
@@ -684,6 +849,36 @@ rate_print(unsigned long long *bytes, unsigned long long *cnt,
     }
 }
 
+/* Inter-arrival time statistics, for the rate test. */
+struct rp_iat {
+    struct timespec t_first;
+    struct timespec t_last;
+    unsigned long long n; /* number of arrivals */
+    double mean;          /* mean inter-arrival time, in nanoseconds */
+    double m2;            /* sum of squared deviations from the mean */
+};
+
+static void
+iat_update(struct rp_iat *iat)
+{
+    struct timespec now;
+    double delta;
+    double x;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (iat->n++ == 0) {
+        iat->t_first = iat->t_last = now;
+        return;
+    }
+
+    /* Welford's online algorithm. */
+    x     = (double)nanodiff(&now, &iat->t_last);
+    delta = x - iat->mean;
+    iat->mean += delta / (iat->n - 1);
+    iat->m2 += delta * (x - iat->mean);
+    iat->t_last = now;
+}
+
 static int
 perf_server(struct worker *w)
 {
@@ -692,20 +887,43 @@ perf_server(struct worker *w)
     unsigned long long rate_bytes_limit = 1000;
     unsigned long long rate_bytes       = 0;
     struct timespec rate_ts, t_start, t_end;
+    unsigned int batch = w->rp->batch;
+    struct rina_sdu sdus[RP_BATCH_MAX];
+    uint32_t lens[RP_RING_SLOTS];
+    struct rp_ring ring;
+    char *bbuf = NULL;
     char buf[SDU_SIZE_MAX];
     long long ns;
     struct pollfd pfd[2];
+    struct rp_iat iat;
     unsigned int i;
     int verb    = w->rp->verbose;
+    int rate    = w->test_config.opcode == RP_OPCODE_RATE;
     int timeout = 0;
     int n;
 
+    memset(&iat, 0, sizeof(iat));
+
     n = fcntl(w->dfd, F_SETFL, O_NONBLOCK);
     if (n) {
         perror("fcntl(F_SETFL)");
         return -1;
     }
 
+    memset(&ring, 0, sizeof(ring));
+    if (w->rp->ring && rp_ring_setup(w, &ring, w->test_config.size)) {
+        return -1;
+    }
+
+    if (batch > 1) {
+        bbuf = malloc(batch * SDU_SIZE_MAX);
+        if (!bbuf) {
+            PRINTF("Out of memory\n");
+            rp_ring_fini(&ring);
+            return -1;
+        }
+    }
+
     pfd[0].fd     = w->dfd;
     pfd[1].fd     = w->cfd;
     pfd[0].events = pfd[1].events = POLLIN;
@@ -726,11 +944,46 @@ perf_server(struct worker *w)
          * an additional syscall when the receiver is not under pressure, but
          * this is acceptable if we want to maximize throughput.
          */
-        n = read(w->dfd, buf, sizeof(buf));
+        if (ring.mem) {
+            n = rp_ring_read(w->dfd, &ring, lens);
+            if (n > 0) {
+                unsigned int k;
+
+                /* Same accounting as for the batched reads below. */
+                i += n - 1;
+                rate_cnt += n - 1;
+                for (k = 0; k < n - 1; k++) {
+                    rate_bytes += lens[k];
+                }
+                n = lens[n - 1];
+            }
+        } else if (batch > 1) {
+            unsigned int k;
+
+            for (k = 0; k < batch; k++) {
+                sdus[k].buf = bbuf + k * SDU_SIZE_MAX;
+                sdus[k].len = SDU_SIZE_MAX;
+            }
+            n = rina_flow_read_batch(w->dfd, sdus, batch);
+            if (n > 0) {
+                /* Account for all the SDUs but the last one here,
+                 * the last one is accounted below. */
+                i += n - 1;
+                rate_cnt += n - 1;
+                for (k = 0; k < n - 1; k++) {
+                    rate_bytes += sdus[k].len;
+                }
+                n = sdus[n - 1].len;
+            }
+        } else {
+            n = read(w->dfd, buf, sizeof(buf));
+        }
         if (n < 0 && errno == EAGAIN) {
             n = poll(pfd, 2, RP_DATA_WAIT_MSECS);
             if (n < 0) {
                 perror("poll(flow)");
+                rp_ring_fini(&ring);
+                free(bbuf);
                 return -1;
             } else if (n == 0) {
                 /* Timeout */
@@ -758,6 +1011,8 @@ perf_server(struct worker *w)
 
                 ret = config_msg_read(w->cfd, &stop);
                 if (ret) {
+                    rp_ring_fini(&ring);
+                    free(bbuf);
                     return ret;
                 }
 
@@ -788,6 +1043,8 @@ perf_server(struct worker *w)
         }
         if (n < 0) {
             perror("read(flow)");
+            rp_ring_fini(&ring);
+            free(bbuf);
             return -1;
 
         } else if (n == 0) {
@@ -798,6 +1055,10 @@ perf_server(struct worker *w)
         rate_bytes += n;
         rate_cnt++;
 
+        if (rate) {
+            iat_update(&iat);
+        }
+
         if (rate_bytes >= rate_bytes_limit && verb) {
             rate_print(&rate_bytes, &rate_cnt, &rate_bytes_limit, &rate_ts,
                        &w->result);
@@ -821,10 +1082,25 @@ perf_server(struct worker *w)
     w->result.bps = w->result.pps * 8 * w->test_config.size;
     w->result.cnt = i;
 
+    if (rate && iat.n > 2) {
+        /* Measure the rate between the first and the last arrival, so
+         * that the flow setup and the stop timeout are not accounted.
+         * Reads that return a batch count as a single arrival. */
+        double span = (double)nanodiff(&iat.t_last, &iat.t_first);
+
+        w->result.pps     = (double)(i - 1) * 1000000000.0 / span;
+        w->result.bps     = (double)(i - 1) * 8.0 * w->test_config.size *
+                        1000000000.0 / span;
+        w->result.latency = sqrt(iat.m2 / (iat.n - 1));
+    }
+
     if (verb) {
         PRINTF("Received %u PDUs out of %u\n", i, limit);
     }
 
+    rp_ring_fini(&ring);
+    free(bbuf);
+
     return 0;
 }
 
@@ -841,6 +1117,38 @@ perf_report(struct worker *w, struct rp_result_msg *snd,
            (double)rcv->bps / 1000000.0);
 }
 
+static void
+rate_report(struct worker *w, struct rp_result_msg *snd,
+            struct rp_result_msg *rcv)
+{
+    const struct rina_flow_spec *spec = &w->rp->flowspec;
+    double err;
+
+    perf_report(w, snd, rcv);
+
+    /* Compare the rate achieved at the receiver with the one requested in
+     * the flow specification. The SDU rate is slightly lower than the
+     * requested one, because the shaper accounts for the PCI too. */
+    err = 100.0 * ((double)rcv->bps - (double)spec->avg_bandwidth) /
+          (double)spec->avg_bandwidth;
+    PRINTF("Rate: requested %.3f Mbps, achieved %.3f Mbps (%+.2f%%)\n",
+           (double)spec->avg_bandwidth / 1000000.0,
+           (double)rcv->bps / 1000000.0, err);
+    PRINTF("Jitter: %.3f us", (double)rcv->latency / 1000.0);
+    if (spec->max_jitter) {
+        PRINTF(" (max %u us)", spec->max_jitter);
+    }
+    PRINTF("\n");
+
+    if (err > RP_RATE_TOLERANCE || err < -RP_RATE_TOLERANCE ||
+        (spec->max_jitter && rcv->latency > 1000ULL * spec->max_jitter)) {
+        PRINTF("Rate test FAILED\n");
+        w->retcode = -1;
+    } else {
+        PRINTF("Rate test PASSED\n");
+    }
+}
+
 struct rp_test_desc {
     const char *name;
     const char *description;
@@ -850,15 +1158,16 @@ struct rp_test_desc {
     report_fn_t report_fn;
 };
 
+/* Indexed by opcode. */
 static struct rp_test_desc descs[] = {
-    {
+    [RP_OPCODE_PING] = {
         .name      = "ping",
         .opcode    = RP_OPCODE_PING,
         .client_fn = ping_client,
         .server_fn = ping_server,
         .report_fn = ping_report,
     },
-    {
+    [RP_OPCODE_RR] = {
         .name        = "rr",
         .description = "request-response test",
         .opcode      = RP_OPCODE_RR,
@@ -866,7 +1175,7 @@ static struct rp_test_desc descs[] = {
         .server_fn   = ping_server,
         .report_fn   = rr_report,
     },
-    {
+    [RP_OPCODE_PERF] = {
         .name        = "perf",
         .description = "unidirectional throughput test",
         .opcode      = RP_OPCODE_PERF,
@@ -874,6 +1183,14 @@ static struct rp_test_desc descs[] = {
         .server_fn   = perf_server,
         .report_fn   = perf_report,
     },
+    [RP_OPCODE_RATE] = {
+        .name        = "rate",
+        .description = "check the rate and jitter of a shaped flow",
+        .opcode      = RP_OPCODE_RATE,
+        .client_fn   = perf_client,
+        .server_fn   = perf_server,
+        .report_fn   = rate_report,
+    },
 };
 
 static void *
@@ -1092,9 +1409,9 @@ client_worker_function(void *opaque)
     rmsg.bps     = le64toh(rmsg.bps);
     rmsg.latency = le64toh(rmsg.latency);
 
-    w->desc->report_fn(w, &w->result, &rmsg);
-
+    /* The report function may flag a failure. */
     w->retcode = 0;
+    w->desc->report_fn(w, &w->result, &rmsg);
 out:
     worker_fini(w);
 
@@ -1484,7 +1801,7 @@ usage(void)
         "   -h : show this help\n"
         "   -l : run in server mode (listen) instead of client mode\n"
         "   -t TEST : specify the type of the test to be performed "
-        "(ping, perf, rr)\n"
+        "(ping, perf, rr, rate)\n"
         "   -D NUM : test duration in seconds (default 10, except for ping)\n"
         "   -d DIF : name of DIF to which register or ask to allocate a flow\n"
         "   -c NUM : number of SDUs to send during the test\n"
@@ -1494,6 +1811,9 @@ usage(void)
         "   -B NUM : average bandwidth for the data flow, in bits per second\n"
         "   -b NUM : how many SDUs to send before waiting as "
         "specified by -i option (default b=1)\n"
+        "   -k NUM : number of SDUs to read/write with a single system call "
+        "in perf tests (default k=1, max %u)\n"
+        "   -R : use mmap()ed rings to read/write the SDUs in perf tests\n"
         "   -a APNAME : application process name and instance of the rinaperf "
         "client\n"
         "   -z APNAME : application process name and instance of the rinaperf "
@@ -1503,11 +1823,14 @@ usage(void)
         "   -L NUM : maximum loss probability introduced by the flow "
         "(NUM/%u)\n"
         "   -E NUM : maximum delay introduced by the flow (microseconds)\n"
+        "   -J NUM : maximum jitter introduced by the flow (microseconds)\n"
+        "   -W NUM : milliseconds to wait for each response in ping and rr "
+        "tests (default %u)\n"
         "   -T : print timestamp (unix time + microseconds as in gettimeofday) "
         "before each line in ping test\n"
         "   -C : client prints cumulative density function in ping mode\n"
         "   -v : be verbose\n",
-        RINA_FLOW_SPEC_LOSS_MAX);
+        RP_BATCH_MAX, RINA_FLOW_SPEC_LOSS_MAX, RP_DATA_WAIT_MSECS);
 }
 
 int
@@ -1548,12 +1871,15 @@ main(int argc, char **argv)
     pthread_mutex_init(&rp->ticket_lock, NULL);
     rp->background = 0;
     rp->cdf        = 0; /* Don't report CDF percentiles. */
+    rp->batch      = 1;
+    rp->ring       = 0;
+    rp->wait_ms    = RP_DATA_WAIT_MSECS;
 
     /* Start with a default flow configuration (unreliable flow). */
     rina_flow_spec_unreliable(&rp->flowspec);
 
-    while ((opt = getopt(argc, argv, "hlt:d:c:s:i:B:g:b:a:z:p:D:L:E:TwvC")) !=
-           -1) {
+    while ((opt = getopt(argc, argv,
+                         "hlt:d:c:s:i:B:g:b:k:Ra:z:p:D:L:E:J:W:TwvC")) != -1) {
         switch (opt) {
         case 'h':
             usage();
@@ -1615,6 +1941,18 @@ main(int argc, char **argv)
             }
             break;
 
+        case 'k':
+            rp->batch = atoi(optarg);
+            if (rp->batch <= 0 || rp->batch > RP_BATCH_MAX) {
+                PRINTF("    Invalid 'batch' %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'R':
+            rp->ring = 1;
+            break;
+
         case 'a':
             rp->cli_appl_name = optarg;
             break;
@@ -1667,6 +2005,23 @@ main(int argc, char **argv)
             }
             break;
 
+        case 'J':
+            rp->flowspec.max_jitter = atoi(optarg);
+            if (rp->flowspec.max_jitter > 5000000) {
+                PRINTF("    Invalid 'max jitter' %d\n",
+                       rp->flowspec.max_jitter);
+                return -1;
+            }
+            break;
+
+        case 'W':
+            rp->wait_ms = atoi(optarg);
+            if (rp->wait_ms == 0 || rp->wait_ms > RP_DATA_WAIT_MSECS) {
+                PRINTF("    Invalid 'wait time' %d\n", (int)rp->wait_ms);
+                return -1;
+            }
+            break;
+
         case 'C':
             rp->cdf = 1;
             break;
@@ -1687,8 +2042,8 @@ main(int argc, char **argv)
      *   - When not in ping mode, ff user did not specify the number of
      *     packets (or transactions) nor the test duration, use a 10 seconds
      *     test duration.
-     *   - When in perf mode, use the flow MSS as a packet size, unless the
-     *     user has specified the size explicitely.
+     *   - When in perf or rate mode, use the flow MSS as a packet size,
+     *     unless the user has specified the size explicitely.
      */
     if (strcmp(type, "ping") == 0) {
         if (!interval_specified) {
@@ -1706,10 +2061,20 @@ main(int argc, char **argv)
         }
     }
 
-    if (strcmp(type, "perf") != 0) {
+    if (strcmp(type, "perf") != 0 && strcmp(type, "rate") != 0) {
         rp->use_mss_size = 0; /* default MTU size only for perf */
     }
 
+    if (rp->ring && rp->batch > 1) {
+        PRINTF("    Options -k and -R cannot be used together\n");
+        return -1;
+    }
+
+    if (!listen && strcmp(type, "rate") == 0 && !rp->flowspec.avg_bandwidth) {
+        PRINTF("    The rate test needs an average bandwidth (-B)\n");
+        return -1;
+    }
+
     /* Set defaults. */
     wt.interval = interval;
     wt.burst    = burst;
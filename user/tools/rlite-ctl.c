@@ -536,6 +536,50 @@ str_count_elems(const char *s)
     return n;
 }
 
+/* Parse a comma separated list of integers in the [vmin, vmax] range into
+ * a newly allocated array. Returns the number of elements on success,
+ * -1 on error. */
+static int
+str_parse_dwords(const char *s, const char *what, uint32_t vmin, uint32_t vmax,
+                 uint32_t **parr)
+{
+    char *copy = strdup_or_quit(s);
+    char *ctmp = copy;
+    uint32_t *arr;
+    char *saveptr;
+    int n;
+    int i;
+
+    n = str_count_elems(s);
+    if (n <= 0) {
+        PE("No valid %s\n", what);
+        free(copy);
+        return -1;
+    }
+
+    arr = malloc_or_quit(n * sizeof(arr[0]));
+    for (i = 0;; i++, ctmp = NULL) {
+        char *token = strtok_r(ctmp, ", ", &saveptr);
+        int val;
+
+        if (token == NULL) {
+            break;
+        }
+        val = atoi(token);
+        if (val < (int)vmin || val > (int)vmax) {
+            PE("Invalid %s '%s'\n", what, token);
+            free(arr);
+            free(copy);
+            return -1;
+        }
+        arr[i] = val;
+    }
+    free(copy);
+    *parr = arr;
+
+    return n;
+}
+
 static int
 kernel_control_write(struct rl_msg_base *msg)
 {
@@ -617,36 +661,12 @@ ipcp_sched_config(int argc, char **argv, struct cmd_descriptor *cd)
             return -1;
         }
 
-        /* Count weights. */
-        n = str_count_elems(argv[3]);
-        if (n <= 0) {
-            PE("No valid weights\n");
+        /* Parse weights into an array. */
+        n = str_parse_dwords(argv[3], "weights", 1, 999, &arr);
+        if (n < 0) {
             return -1;
         }
 
-        /* Allocate array for weights. */
-        arr = malloc_or_quit(n * sizeof(arr[0]));
-
-        /* Parse weights into the array. */
-        {
-            char *copy = strdup_or_quit(argv[3]);
-            char *ctmp = copy;
-            char *saveptr;
-            int i;
-
-            for (i = 0;; i++, ctmp = NULL) {
-                char *token = strtok_r(ctmp, ", ", &saveptr);
-                if (token == NULL) {
-                    break;
-                }
-                arr[i] = atoi(token);
-                if (arr[i] <= 0 || arr[i] >= 1000) {
-                    PE("Invalid weight '%s'\n", token);
-                    return -1;
-                }
-            }
-        }
-
         /* Build the request. */
         req.ipcp_hdr.hdr.msg_type = RLITE_KER_IPCP_SCHED_WRR;
         req.ipcp_hdr.hdr.event_id = 0;
@@ -658,15 +678,17 @@ ipcp_sched_config(int argc, char **argv, struct cmd_descriptor *cd)
 
         return kernel_control_write(RLITE_MB(&req));
 
-    } else if (!strcmp(sched_name, "pfifo")) {
-        /* Weighted Round Robin configuration. Example:
-         *   ipcp-sched-config x.IPCP qsize 65536 pfifo levels 4
+    } else if (!strcmp(sched_name, "pfifo") ||
+               !strcmp(sched_name, "mqpfifo")) {
+        /* (Multi-queue) Priority FIFO configuration. Example:
+         *   ipcp-sched-config x.IPCP pfifo qsize 65536 levels 4
          * */
         struct rl_kmsg_ipcp_sched_pfifo req;
 
         if (argc < 2) {
-            PE("Not enough arguments for pfifo. Example:\n"
-               "  ipcp-sched-config x.IPCP pfifo qsize 65536 levels 4\n");
+            PE("Not enough arguments for %s. Example:\n"
+               "  ipcp-sched-config x.IPCP %s qsize 65536 levels 4\n",
+               sched_name, sched_name);
             return -1;
         }
 
@@ -686,6 +708,48 @@ ipcp_sched_config(int argc, char **argv, struct cmd_descriptor *cd)
         req.ipcp_hdr.ipcp_id      = attrs->id;
         req.max_queue_size        = qsize;
 
+        return kernel_control_write(RLITE_MB(&req));
+
+    } else if (!strcmp(sched_name, "drr") || !strcmp(sched_name, "prio-drr")) {
+        /* (Strict priority +) Deficit Round Robin configuration. Example:
+         *   ipcp-sched-config x.IPCP drr qsize 65536 quanta 1500,3000
+         * */
+        struct rl_kmsg_ipcp_sched_drr req;
+        uint32_t *arr;
+        int n;
+
+        if (argc < 2) {
+            PE("Not enough arguments for %s. Example:\n"
+               "  ipcp-sched-config x.IPCP %s qsize 65536 "
+               "quanta 1500,3000\n",
+               sched_name, sched_name);
+            return -1;
+        }
+
+        if (strcmp(argv[0], "quanta")) {
+            PE("Missing 'quanta' argument\n");
+            return -1;
+        }
+
+        /* Parse quanta into an array. With prio-drr, the quantum of
+         * queue 0 is not used. */
+        n = str_parse_dwords(argv[1], "quanta",
+                             !strcmp(sched_name, "prio-drr") ? 0 : 1, 1000000,
+                             &arr);
+        if (n < 0) {
+            return -1;
+        }
+
+        /* Build the request. */
+        memset(&req, 0, sizeof(req));
+        req.ipcp_hdr.hdr.msg_type = RLITE_KER_IPCP_SCHED_DRR;
+        req.ipcp_hdr.hdr.event_id = 0;
+        req.ipcp_hdr.ipcp_id      = attrs->id;
+        req.max_queue_size        = qsize;
+        req.quanta.elem_size      = sizeof(arr[0]);
+        req.quanta.num_elements   = n;
+        req.quanta.slots.dwords   = arr;
+
         return kernel_control_write(RLITE_MB(&req));
     }
 
@@ -838,6 +902,7 @@ ipcp_stats(int argc, char **argv, struct cmd_descriptor *cd)
     unsigned long ipcp_id;
     char sbuf[4][32];
     int ret;
+    int i;
 
     if (argc >= 1) {
         attrs = lookup_ipcp_by_name(argv[0]);
@@ -873,6 +938,7 @@ ipcp_stats(int argc, char **argv, struct cmd_descriptor *cd)
            "    rx_err             = %llu\n"
            "    rtx_pkt            = %llu\n"
            "    rtx_byte           = %s\n"
+           "    tx_copy            = %llu\n"
            "    rmt.fwd_pkt        = %llu\n"
            "    rmt.fwd_byte       = %s\n"
            "    rmt.queued_pkt     = %llu\n"
@@ -881,11 +947,14 @@ ipcp_stats(int argc, char **argv, struct cmd_descriptor *cd)
            "    rmt.csum_drop      = %llu\n"
            "    rmt.ttl_drop       = %llu\n"
            "    rmt.noflow_drop    = %llu\n"
-           "    rmt.other_drop     = %llu\n",
+           "    rmt.other_drop     = %llu\n"
+           "    rmt.ecn_mark       = %llu\n"
+           "    rmt.frr_pkt        = %llu\n",
            attrs->name, (unsigned long long)stats.tx_pkt, sbuf[0],
            (unsigned long long)stats.tx_err, (unsigned long long)stats.rx_pkt,
            sbuf[1], (unsigned long long)stats.rx_err,
            (unsigned long long)stats.rtx_pkt, sbuf[2],
+           (unsigned long long)stats.tx_copy,
            (unsigned long long)stats.rmt.fwd_pkt, sbuf[3],
            (unsigned long long)stats.rmt.queued_pkt,
            (unsigned long long)stats.rmt.queue_drop,
@@ -893,7 +962,35 @@ ipcp_stats(int argc, char **argv, struct cmd_descriptor *cd)
            (unsigned long long)stats.rmt.csum_drop,
            (unsigned long long)stats.rmt.ttl_drop,
            (unsigned long long)stats.rmt.noflow_drop,
-           (unsigned long long)stats.rmt.other_drop);
+           (unsigned long long)stats.rmt.other_drop,
+           (unsigned long long)stats.rmt.ecn_mark,
+           (unsigned long long)stats.rmt.frr_pkt);
+    for (i = 0; i < RL_RMT_STATS_CLASSES; i++) {
+        if (!stats.rmt.class_enq[i] && !stats.rmt.class_drop[i]) {
+            continue;
+        }
+        printf("    rmt.class[%d]       = enq %llu drop %llu backlog %llu\n", i,
+               (unsigned long long)stats.rmt.class_enq[i],
+               (unsigned long long)stats.rmt.class_drop[i],
+               (unsigned long long)stats.rmt.class_backlog[i]);
+    }
+    if (stats.tx_agg_frames) {
+        printf("    tx_agg_frames      = %llu\n"
+               "    tx_agg_pdus        = %llu (%.2f PDUs per frame)\n",
+               (unsigned long long)stats.tx_agg_frames,
+               (unsigned long long)stats.tx_agg_pdus,
+               (double)stats.tx_agg_pdus / stats.tx_agg_frames);
+    }
+    printf("    bufcache_hit       = %llu\n"
+           "    bufcache_miss      = %llu\n"
+           "    tmr_ticks          = %llu\n"
+           "    tmr_fired          = %llu\n"
+           "    tmr_usecs          = %llu\n",
+           (unsigned long long)stats.bufcache_hit,
+           (unsigned long long)stats.bufcache_miss,
+           (unsigned long long)stats.tmr_ticks,
+           (unsigned long long)stats.tmr_fired,
+           (unsigned long long)stats.tmr_ns / 1000);
 
     return 0;
 }
@@ -995,8 +1092,12 @@ flow_dump(int argc, char **argv, struct cmd_descriptor *cd)
         "    last_ctrl_seq_num_rcvd = %lu\n"
         "    cwq_len                = %lu [max=%lu]\n"
         "    rtxq_len               = %lu [max=%lu]\n"
-        "    rtt                    = %lums [stddev=%lums]\n"
-        "    cgwin                  = %lu\n"
+        "    rtt                    = %luus [stddev=%luus, min=%luus]\n"
+        "    rto                    = %luus\n"
+        "    cgwin                  = %lu [ssthresh=%lu]\n"
+        "    pacing_rate            = %llu B/s\n"
+        "    paced_pkts             = %llu [qlen=%lu]\n"
+        "    pacing_delay           = %luus [max=%luus]\n"
         "    rcv_lwe                = %lu\n"
         "    rcv_next_seq_num       = %lu\n"
         "    rcv_rwe                = %lu\n"
@@ -1004,20 +1105,35 @@ flow_dump(int argc, char **argv, struct cmd_descriptor *cd)
         "    last_lwe_sent          = %lu\n"
         "    last_seq_num_acked     = %lu\n"
         "    next_snd_ctl_seq       = %lu\n"
-        "    seqq_len               = %lu\n",
+        "    ctrl_pdus_sent         = %llu [data_pdus_rcvd=%llu, "
+        "ratio=%.3f]\n"
+        "    seqq_len               = %lu [hwm=%lu, max=%lu]\n"
+        "    rx_qsize               = %lu B [budget=%lu B]\n",
         (unsigned long)dtp.snd_lwe, (unsigned long)dtp.snd_rwe,
         (unsigned long)dtp.next_seq_num_to_use,
         (unsigned long)dtp.last_seq_num_sent,
         (unsigned long)dtp.last_ctrl_seq_num_rcvd, (unsigned long)dtp.cwq_len,
         (unsigned long)dtp.max_cwq_len, (unsigned long)dtp.rtxq_len,
-        (unsigned long)dtp.max_rtxq_len, (unsigned long)dtp.rtt / 1000,
-        (unsigned long)dtp.rtt_stddev / 1000, (unsigned long)dtp.cgwin,
+        (unsigned long)dtp.max_rtxq_len, (unsigned long)dtp.rtt,
+        (unsigned long)dtp.rtt_stddev, (unsigned long)dtp.rtt_min,
+        (unsigned long)dtp.rto, (unsigned long)dtp.cgwin,
+        (unsigned long)dtp.ssthresh, (unsigned long long)dtp.pacing_rate,
+        (unsigned long long)dtp.paced_pkts, (unsigned long)dtp.pacing_qlen,
+        (unsigned long)dtp.pacing_delay_avg,
+        (unsigned long)dtp.pacing_delay_max,
 
         (unsigned long)dtp.rcv_lwe, (unsigned long)dtp.rcv_next_seq_num,
         (unsigned long)dtp.rcv_rwe, (unsigned long)dtp.max_seq_num_rcvd,
 
         (unsigned long)dtp.last_lwe_sent, (unsigned long)dtp.last_seq_num_acked,
-        (unsigned long)dtp.next_snd_ctl_seq, (unsigned long)dtp.seqq_len);
+        (unsigned long)dtp.next_snd_ctl_seq,
+        (unsigned long long)dtp.ctrl_pdus_sent,
+        (unsigned long long)dtp.data_pdus_rcvd,
+        dtp.data_pdus_rcvd ? (double)dtp.ctrl_pdus_sent / dtp.data_pdus_rcvd
+                           : 0.0,
+        (unsigned long)dtp.seqq_len,
+        (unsigned long)dtp.seqq_hwm, (unsigned long)dtp.seqq_max_len,
+        (unsigned long)dtp.rx_qsize, (unsigned long)dtp.rx_qbudget);
 
     return 0;
 }
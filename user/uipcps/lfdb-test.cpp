@@ -28,6 +28,7 @@
 #include <chrono>
 #include <unistd.h>
 #include <cmath>
+#include <algorithm>
 
 #include "uipcp-normal-lfdb.hpp"
 
@@ -284,5 +285,42 @@ main(int argc, char **argv)
         counter++;
     }
 
+    {
+        /* Equal-cost multipath on a diamond network: node 0 reaches node
+         * 3 through both node 1 and node 2, and both next hops must be
+         * reported. */
+        TestLFDB lfdb(/*links=*/{{0, 1}, {0, 2}, {1, 3}, {2, 3}},
+                      /*lfa_enabled=*/false);
+        const rlite::NodeId dst = "3";
+
+        std::cout << "Test vector #" << counter << std::endl;
+        lfdb.compute_next_hops("0");
+        if (verbosity >= 2) {
+            std::stringstream ss;
+            lfdb.dump_routing(ss, "0");
+            std::cout << ss.str();
+        }
+
+        const auto nhops = lfdb.next_hops.find(dst);
+        if (nhops == lfdb.next_hops.end() || nhops->second.size() != 2 ||
+            std::find(nhops->second.begin(), nhops->second.end(), "1") ==
+                nhops->second.end() ||
+            std::find(nhops->second.begin(), nhops->second.end(), "2") ==
+                nhops->second.end()) {
+            std::cerr << "Expected next hops {1, 2} towards node " << dst
+                      << std::endl;
+            std::cout << "Test # " << counter << " failed" << std::endl;
+            return -1;
+        }
+        if (lfdb.ecmp_width(dst) != 2) {
+            std::cerr << "Expected ECMP width 2 towards node " << dst
+                      << ", got " << lfdb.ecmp_width(dst) << std::endl;
+            std::cout << "Test # " << counter << " failed" << std::endl;
+            return -1;
+        }
+        std::cout << "Test # " << counter << " completed" << std::endl;
+        counter++;
+    }
+
     return 0;
 }
@@ -22,6 +22,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
@@ -155,6 +156,56 @@ uipcp_pduft_flush(struct uipcp *uipcp)
     return ret;
 }
 
+int
+uipcp_pduft_replace(struct uipcp *uipcp, const rlm_addr_t *dst_addrs,
+                    const rl_port_t *local_ports, const uint8_t *nhop_flags,
+                    unsigned int n)
+{
+    struct rl_kmsg_ipcp_pduft_replace req;
+    int ret;
+
+    /* Create a request message. The arrays are released together with
+     * the message. */
+    memset(&req, 0, sizeof(req));
+    req.hdr.msg_type = RLITE_KER_IPCP_PDUFT_REPLACE;
+    req.hdr.event_id = 1;
+    req.ipcp_id      = uipcp->id;
+    if (n) {
+        req.dst_addrs.slots.qwords  = malloc(n * sizeof(dst_addrs[0]));
+        req.local_ports.slots.words = malloc(n * sizeof(local_ports[0]));
+        if (nhop_flags) {
+            req.nhop_flags.slots.bytes = malloc(n * sizeof(nhop_flags[0]));
+        }
+        if (!req.dst_addrs.slots.qwords || !req.local_ports.slots.words ||
+            (nhop_flags && !req.nhop_flags.slots.bytes)) {
+            rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(&req));
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(req.dst_addrs.slots.qwords, dst_addrs, n * sizeof(dst_addrs[0]));
+        memcpy(req.local_ports.slots.words, local_ports,
+               n * sizeof(local_ports[0]));
+        if (nhop_flags) {
+            memcpy(req.nhop_flags.slots.bytes, nhop_flags,
+                   n * sizeof(nhop_flags[0]));
+        }
+    }
+    req.dst_addrs.elem_size      = sizeof(dst_addrs[0]);
+    req.dst_addrs.num_elements   = n;
+    req.local_ports.elem_size    = sizeof(local_ports[0]);
+    req.local_ports.num_elements = n;
+    req.nhop_flags.elem_size     = sizeof(uint8_t);
+    req.nhop_flags.num_elements  = (n && nhop_flags) ? n : 0;
+
+    ret = rl_write_msg(uipcp->cfd, RLITE_MB(&req), 1);
+    if (ret) {
+        UPE(uipcp, "rl_write_msg() failed [%s]\n", strerror(errno));
+    }
+    rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(&req));
+
+    return ret;
+}
+
 /* This function is the inverse of flowspec2flowcfg(), and this property
  * must be manually preserved. */
 static void
@@ -1137,7 +1188,9 @@ uipcps_print(struct uipcps *uipcps)
  *       pushed by the normal IPCPs. Depending on the lower DIFs actually
  *       trasversed by each packet, it can happen that some of the reserved
  *       header space is left unused, but the worst case is covered in any
- *       case.
+ *       case. The same applies to the tailroom required by the shim
+ *       IPCPs (e.g. shim-eth), which is propagated unchanged to the upper
+ *       IPCPs.
  */
 
 /* Compute the size of PCI data transfer PDU. */
@@ -1157,7 +1210,7 @@ topo_visit(struct uipcps *uipcps)
     struct flow_edge *e;
 
     /*
-     * Stage 1: compute txhdroom and mss.
+     * Stage 1: compute txhdroom, tailroom and mss.
      */
     list_for_each_entry (uipcp, &uipcps->uipcps, node) {
         struct ipcp_node *ipn = &uipcp->topo;
@@ -1166,6 +1219,7 @@ topo_visit(struct uipcps *uipcps)
         ipn->marked         = 0;
         ipn->update_kern_tx = 0;
         ipn->txhdroom       = 0;
+        ipn->tailroom       = 0;
         ipn->max_sdu_size   = 65536;
 
         ipn->hdrsize = ipcp_hdrlen(uipcp);
@@ -1175,6 +1229,7 @@ topo_visit(struct uipcps *uipcps)
              * MSS and txhdroom. */
             ipn->max_sdu_size = uipcp->max_sdu_size;
             ipn->txhdroom     = uipcp->txhdroom;
+            ipn->tailroom     = uipcp->tailroom;
         } else {
             /* There are some lowers, so we start from the maximum
              * value, which will be overridden during the minimization
@@ -1219,7 +1274,7 @@ topo_visit(struct uipcps *uipcps)
         }
 
         /* Mark (visit) the node, applying the relaxation rule to
-         * maximize txhdroom and minimize max_sdu_size. */
+         * maximize txhdroom and tailroom, and minimize max_sdu_size. */
         ipn->marked = 1;
 
         list_for_each_entry (e, nexts, node) {
@@ -1231,6 +1286,10 @@ topo_visit(struct uipcps *uipcps)
                     ipn->txhdroom + e->uipcp->topo.hdrsize;
             }
 
+            if (e->uipcp->topo.tailroom < ipn->tailroom) {
+                e->uipcp->topo.tailroom = ipn->tailroom;
+            }
+
             msz = (int)ipn->max_sdu_size - (int)e->uipcp->topo.hdrsize;
             if (msz < 0) {
                 msz = 0; /* just to be on the safe side */
@@ -1316,7 +1375,7 @@ topo_visit(struct uipcps *uipcps)
     }
 }
 
-/* Update kernelspace hdrooms and mss. Called under uipcps lock. */
+/* Update kernelspace hdrooms, tailroom and mss. Called under uipcps lock. */
 static int
 topo_update_kern(struct uipcps *uipcps)
 {
@@ -1343,6 +1402,18 @@ topo_update_kern(struct uipcps *uipcps)
                ipn->txhdroom);
         }
 
+        ret = snprintf(strbuf, sizeof(strbuf), "%u", ipn->tailroom);
+        if (ret <= 0 || ret >= sizeof(strbuf)) {
+            PE("Impossible tailroom %u\n", ipn->tailroom);
+            continue;
+        }
+
+        ret = rl_conf_ipcp_config(uipcp->id, "tailroom", strbuf);
+        if (ret) {
+            PE("'ipcp-config %u tailroom %u' failed\n", uipcp->id,
+               ipn->tailroom);
+        }
+
         ret = snprintf(strbuf, sizeof(strbuf), "%u", ipn->max_sdu_size);
         if (ret <= 0 || ret >= sizeof(strbuf)) {
             PE("Impossible mss %u\n", ipn->max_sdu_size);
@@ -1534,7 +1605,7 @@ int
 uipcp_update(struct uipcps *uipcps, struct rl_kmsg_ipcp_update *upd)
 {
     struct uipcp *uipcp;
-    int mss_changed;
+    int topo_changed;
 
     pthread_mutex_lock(&uipcps->lock);
     uipcp = uipcp_lookup(uipcps, upd->ipcp_id);
@@ -1554,20 +1625,25 @@ uipcp_update(struct uipcps *uipcps, struct rl_kmsg_ipcp_update *upd)
     if (uipcp->dif_name)
         rl_free(uipcp->dif_name, RL_MT_UTILS);
 
+    /* A change in the mss or tailroom (e.g. a shim-eth whose netdev MTU
+     * changed) must be propagated to the upper IPCPs. */
+    topo_changed = (uipcp->max_sdu_size != upd->max_sdu_size) ||
+                   (uipcp->tailroom != upd->tailroom);
+
     uipcp->id           = upd->ipcp_id;
     uipcp->txhdroom     = upd->txhdroom;
     uipcp->rxhdroom     = upd->rxhdroom;
-    mss_changed         = (uipcp->max_sdu_size != upd->max_sdu_size);
+    uipcp->tailroom     = upd->tailroom;
     uipcp->max_sdu_size = upd->max_sdu_size;
     uipcp->dif_name     = upd->dif_name;
     upd->dif_name       = NULL;
     uipcp->pcisizes     = upd->pcisizes;
 
-    if (!mss_changed) {
+    if (!topo_changed) {
         goto out;
     }
 
-    /* A mss was updated, restart topological ordering. */
+    /* Restart topological ordering. */
     topo_compute(uipcps);
 
 out:
@@ -206,6 +206,7 @@ struct ipcp_node {
     unsigned int update_kern_rx; /* should we push rxhdroom to kernel ? */
     unsigned int txhdroom;
     unsigned int rxhdroom;
+    unsigned int tailroom;
     unsigned int max_sdu_size;
     unsigned int hdrsize;
     unsigned int rxcredit; /* used to compute rxhdroom */
@@ -312,6 +313,10 @@ int uipcp_pduft_del(struct uipcp *uipcp, rlm_addr_t dst_addr,
 
 int uipcp_pduft_flush(struct uipcp *uipcp);
 
+int uipcp_pduft_replace(struct uipcp *uipcp, const rlm_addr_t *dst_addrs,
+                        const rl_port_t *local_ports, const uint8_t *nhop_flags,
+                        unsigned int n);
+
 int uipcp_issue_fa_req_arrived(struct uipcp *uipcp, uint32_t kevent_id,
                                rl_port_t remote_port, rlm_cepid_t remote_cep,
                                rlm_qosid_t qos_id, rlm_addr_t remote_addr,
@@ -161,6 +161,10 @@ public:
      * (in PDUs). */
     static constexpr int kRtxQueueMaxLen = 512;
 
+    /* Default value for the maximum length of the sequencing queue
+     * (in PDUs). */
+    static constexpr int kSeqQueueMaxLen = RL_SEQQ_MAX_LEN_DFLT;
+
     /* Default value for the flow control initial credit (windows size in terms
        of PDUs). */
     static constexpr int kFlowControlInitialCredit = 512;
@@ -174,6 +178,7 @@ private:
                           struct rl_flow_config *cfg,
                           rlm_qosid_t *qos_id) const;
     void policies2flowcfg(struct rl_flow_config *cfg, const FlowRequest *freq);
+    void ackpolicy2flowcfg(struct rl_flow_config *cfg) const;
 };
 
 /* Translate a local flow configuration into the standard
@@ -203,6 +208,7 @@ flowcfg2policies(const struct rl_flow_config *cfg, FlowRequest *freq)
     policies->set_allocated_dtcp_cfg(dtcp_cfg);
     dtcp_cfg->set_flow_ctrl(cfg->dtcp.flags & DTCP_CFG_FLOW_CTRL);
     dtcp_cfg->set_rtx_ctrl(cfg->dtcp.flags & DTCP_CFG_RTX_CTRL);
+    dtcp_cfg->set_sack(cfg->dtcp.flags & DTCP_CFG_SACK);
 
     dtcp_cfg->set_allocated_flow_ctrl_cfg(flow_ctrl_cfg);
     flow_ctrl_cfg->set_window_based(cfg->dtcp.fc.fc_type == RLITE_FC_T_WIN);
@@ -229,6 +235,24 @@ flowcfg2policies(const struct rl_flow_config *cfg, FlowRequest *freq)
     rtx_ctrl_cfg->set_initial_rtx_timeout(cfg->dtcp.rtx.initial_rtx_timeout);
 }
 
+/* Fill in the receiver ACK policy, which is a local choice and it is
+ * not negotiated with the remote peer. */
+void
+LocalFlowAllocator::ackpolicy2flowcfg(struct rl_flow_config *cfg) const
+{
+    cfg->ack.pdus =
+        rib->get_param_value<int>(FlowAllocator::Prefix, "ack-every");
+    cfg->ack.bytes =
+        rib->get_param_value<int>(FlowAllocator::Prefix, "ack-bytes");
+    cfg->ack.flags = 0;
+    if (rib->get_param_value<bool>(FlowAllocator::Prefix, "ack-ooo")) {
+        cfg->ack.flags |= RL_ACK_F_OOO;
+    }
+    if (rib->get_param_value<bool>(FlowAllocator::Prefix, "ack-adaptive")) {
+        cfg->ack.flags |= RL_ACK_F_ADAPTIVE;
+    }
+}
+
 /* Translate a standard flow policies specification from FlowRequest
  * CDAP message into a local flow configuration. */
 void
@@ -250,6 +274,11 @@ LocalFlowAllocator::policies2flowcfg(struct rl_flow_config *cfg,
     }
     if (p.dtcp_cfg().rtx_ctrl()) {
         cfg->dtcp.flags |= DTCP_CFG_RTX_CTRL;
+        /* Use selective ACKs only if both ends want them. */
+        if (p.dtcp_cfg().sack() &&
+            rib->get_param_value<bool>(FlowAllocator::Prefix, "sack")) {
+            cfg->dtcp.flags |= DTCP_CFG_SACK;
+        }
     }
 
     cfg->dtcp.fc.fc_type = RLITE_FC_T_NONE;
@@ -277,6 +306,14 @@ LocalFlowAllocator::policies2flowcfg(struct rl_flow_config *cfg,
         cfg->dtcp.rtx.max_rtxq_len =
             rib->get_param_value<int>(FlowAllocator::Prefix, "max-rtxq-len");
     }
+    cfg->dtcp.burst =
+        rib->get_param_value<int>(FlowAllocator::Prefix, "pacing-burst");
+    cfg->seqq_max_len =
+        rib->get_param_value<int>(FlowAllocator::Prefix, "seqq-max-len");
+    snprintf(cfg->cc_algo, sizeof(cfg->cc_algo), "%s",
+             rib->get_param_value<std::string>(FlowAllocator::Prefix, "cc")
+                 .c_str());
+    ackpolicy2flowcfg(cfg);
 }
 
 #ifndef RL_USE_QOS_CUBES
@@ -299,6 +336,14 @@ LocalFlowAllocator::flowspec2flowcfg(const struct rina_flow_spec *spec,
     cfg->in_order_delivery = spec->in_order_delivery;
     cfg->msg_boundaries    = spec->msg_boundaries;
     cfg->dtcp.bandwidth    = spec->avg_bandwidth;
+    cfg->dtcp.burst =
+        rib->get_param_value<int>(FlowAllocator::Prefix, "pacing-burst");
+    cfg->seqq_max_len =
+        rib->get_param_value<int>(FlowAllocator::Prefix, "seqq-max-len");
+    snprintf(cfg->cc_algo, sizeof(cfg->cc_algo), "%s",
+             rib->get_param_value<std::string>(FlowAllocator::Prefix, "cc")
+                 .c_str());
+    ackpolicy2flowcfg(cfg);
 
     if (spec->max_sdu_gap == 0) {
         /* We need retransmission control. */
@@ -313,6 +358,10 @@ LocalFlowAllocator::flowspec2flowcfg(const struct rina_flow_spec *spec,
         cfg->dtcp.rtx.max_rtxq_len =
             rib->get_param_value<int>(FlowAllocator::Prefix, "max-rtxq-len");
         cfg->dtcp.initial_a = initial_a.count();
+        if (rib->get_param_value<bool>(FlowAllocator::Prefix, "sack")) {
+            /* Propose selective ACKs to the remote peer. */
+            cfg->dtcp.flags |= DTCP_CFG_SACK;
+        }
     }
 
     /* Delay, loss and jitter ignored for now. */
@@ -454,6 +503,10 @@ LocalFlowAllocator::flows_handler_create_r(const CDAPMessage *rm)
     freq->set_dst_port(remote_freq.dst_port());
     freq->mutable_connections(0)->set_dst_cep(
         remote_freq.connections(0).dst_cep());
+    if (!remote_freq.policies().dtcp_cfg().sack()) {
+        /* The remote peer did not accept selective ACKs. */
+        freq->flowcfg.dtcp.flags &= ~DTCP_CFG_SACK;
+    }
 
     rib->stats.fa_response_received++;
 
@@ -517,6 +570,10 @@ LocalFlowAllocator::flows_handler_create(const CDAPMessage *rm,
     local_appl  = apname2string(freq->dst_app());
     remote_appl = apname2string(freq->src_app());
     policies2flowcfg(&flowcfg, freq.get());
+    /* Tell the initiator whether we accepted selective ACKs, since
+     * freq is sent back with the M_CREATE_R. */
+    freq->mutable_policies()->mutable_dtcp_cfg()->set_sack(
+        flowcfg.dtcp.flags & DTCP_CFG_SACK);
 
     freq->invoke_id = rm->invoke_id;
     freq->flags     = RL_FLOWREQ_SEND_DEL;
@@ -738,7 +795,16 @@ UipcpRib::fa_lib_init()
           PolicyParam(Msecs(int(LocalFlowAllocator::kATimerMsecsDflt)))},
          {"initial-rtx-timeout",
           PolicyParam(Msecs(int(LocalFlowAllocator::kRtxTimerMsecsDflt)))},
-         {"max-rtxq-len", PolicyParam(LocalFlowAllocator::kRtxQueueMaxLen)}}));
+         {"max-rtxq-len", PolicyParam(LocalFlowAllocator::kRtxQueueMaxLen)},
+         {"sack", PolicyParam(false)},
+         {"seqq-max-len",
+          PolicyParam(LocalFlowAllocator::kSeqQueueMaxLen)},
+         {"cc", PolicyParam(string())},
+         {"pacing-burst", PolicyParam(0)},
+         {"ack-every", PolicyParam(0)},
+         {"ack-bytes", PolicyParam(0)},
+         {"ack-ooo", PolicyParam(false)},
+         {"ack-adaptive", PolicyParam(false)}}));
 }
 
 } // namespace rlite
@@ -25,6 +25,7 @@
 #include <sstream>
 #include <iostream>
 #include <queue>
+#include <algorithm>
 #include <limits>
 
 #include "BaseRIB.pb.h"
@@ -76,6 +77,14 @@ LFDB::dump_routing(std::stringstream &ss, const NodeId &local_node) const
     }
 }
 
+static void
+add_nhop(std::vector<NodeId> &nhops, const NodeId &nhop)
+{
+    if (std::find(nhops.begin(), nhops.end(), nhop) == nhops.end()) {
+        nhops.push_back(nhop);
+    }
+}
+
 void
 LFDB::compute_shortest_paths(
     const NodeId &source_node,
@@ -112,7 +121,10 @@ LFDB::compute_shortest_paths(
         }
 
         DijkstraInfo &info_min = info[closer.node];
-        info_min.dist          = closer.dist;
+        if (closer.dist > info_min.dist) {
+            continue; /* stale frontier entry */
+        }
+        info_min.dist = closer.dist;
 
         if (verbose) {
             std::cout << "Selecting node " << closer.node << std::endl;
@@ -128,12 +140,24 @@ LFDB::compute_shortest_paths(
         /* Apply relaxation rule and update the frontier. */
         for (const Edge &edge : edges) {
             DijkstraInfo &info_to = info[edge.to];
+            unsigned int dist     = info_min.dist + edge.cost;
 
-            if (info_to.dist > info_min.dist + edge.cost) {
-                info_to.dist = info_min.dist + edge.cost;
-                info_to.nhop =
-                    (closer.node == source_node) ? edge.to : info_min.nhop;
-                frontier.push({edge.to, info_to.dist});
+            if (info_to.dist > dist) {
+                info_to.dist = dist;
+                info_to.nhops.clear();
+                frontier.push({edge.to, dist});
+            } else if (info_to.dist < dist) {
+                continue;
+            }
+
+            /* This is a shortest path to edge.to, possibly one of many
+             * with equal cost: merge in its next hops. */
+            if (closer.node == source_node) {
+                add_nhop(info_to.nhops, edge.to);
+            } else {
+                for (const NodeId &nhop : info_min.nhops) {
+                    add_nhop(info_to.nhops, nhop);
+                }
             }
         }
     }
@@ -157,6 +181,7 @@ LFDB::compute_next_hops(const NodeId &local_node)
 
     /* Clean up state left from the previous run. */
     next_hops.clear();
+    num_ecmp.clear();
 
     /* Build the graph from the Lower Flow Database. */
     graph[local_node] = std::vector<Edge>();
@@ -201,7 +226,8 @@ LFDB::compute_next_hops(const NodeId &local_node)
             /* I don't need a next hop for myself. */
             continue;
         }
-        next_hops[kvi.first].push_back(kvi.second.nhop);
+        next_hops[kvi.first] = kvi.second.nhops;
+        num_ecmp[kvi.first]  = kvi.second.nhops.size();
     }
 
     if (lfa_enabled) {
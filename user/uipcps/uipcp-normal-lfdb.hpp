@@ -70,7 +70,7 @@ struct LFDB {
 
     struct DijkstraInfo {
         unsigned int dist;
-        NodeId nhop;
+        std::vector<NodeId> nhops; /* equal-cost next hops */
     };
 
     /* Is Loop Free Alternate algorithm enabled ? */
@@ -97,6 +97,16 @@ public:
     std::unordered_map<NodeId, std::vector<NodeId>> next_hops;
     NodeId dflt_nhop;
 
+    /* Number of equal-cost next hops at the front of each next_hops
+     * entry. The remaining next hops are Loop Free Alternates. */
+    std::unordered_map<NodeId, size_t> num_ecmp;
+
+    size_t ecmp_width(const NodeId &dst_node) const
+    {
+        const auto it = num_ecmp.find(dst_node);
+        return it == num_ecmp.end() ? 1 : it->second;
+    }
+
     const gpb::LowerFlow *find(const NodeId &local_node,
                                const NodeId &remote_node) const
     {
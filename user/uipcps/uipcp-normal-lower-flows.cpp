@@ -78,9 +78,24 @@ public:
     int compute_fwd_table();
 
 private:
+    /* A next hop in the forwarding table. Backup next hops are only
+     * used by the kernel when all the other ones are down. */
+    struct NextPort {
+        rl_port_t port_id;
+        bool backup;
+
+        bool operator==(const NextPort &o) const
+        {
+            return port_id == o.port_id && backup == o.backup;
+        }
+    };
+
     /* The forwarding table computed by compute_fwd_table().
-     * It maps a NodeId --> (dst_addr, local_port). */
-    std::unordered_map<rlm_addr_t, std::pair<NodeId, rl_port_t>> next_ports;
+     * It maps a dst_addr --> (NodeId, local_ports), where local_ports
+     * contains the ports towards all the equal-cost next hops, followed
+     * by the ports towards the backup next hops. */
+    std::unordered_map<rlm_addr_t, std::pair<NodeId, std::vector<NextPort>>>
+        next_ports;
 
     /* Set of ports that are currently down. */
     std::unordered_set<rl_port_t> ports_down;
@@ -127,19 +142,38 @@ RoutingEngine::flow_state_update(struct rl_kmsg_flow_state *upd)
 int
 RoutingEngine::compute_fwd_table()
 {
-    unordered_map<rlm_addr_t, pair<NodeId, rl_port_t>> next_ports_new_,
+    unordered_map<rlm_addr_t, pair<NodeId, vector<NextPort>>> next_ports_new_,
         next_ports_new;
     struct uipcp *uipcp = rib->uipcp;
     unordered_map<rl_port_t, int> port_hits;
     rl_port_t dflt_port;
     int dflt_hits = 0;
 
-    /* Compute the forwarding table by translating the next-hop address
-     * into a port-id towards the next-hop. */
+    /* Compute the forwarding table by translating the next-hop addresses
+     * into port-ids towards the next-hops. All the usable equal-cost next
+     * hops are taken, so that the kernel can spread the traffic across
+     * them. If none of them is usable, the first usable alternate is
+     * taken. The other usable alternates are installed as backups, so
+     * that the kernel can switch to them as soon as the primary next
+     * hops go down, without waiting for a new forwarding table. */
     for (const auto &kvr : next_hops) {
-        for (const NodeId &lfa : kvr.second) {
-            auto neigh = rib->neighbors.find(lfa);
-            rlm_addr_t dst_addr;
+        size_t width = ecmp_width(kvr.first);
+        vector<NextPort> ports;
+        NodeId first_nhop;
+        rlm_addr_t dst_addr;
+
+        /* Make sure we know the address for this destination. */
+        dst_addr = rib->lookup_node_address(kvr.first);
+        if (dst_addr == RL_ADDR_NULL) {
+            /* We still miss the address of this destination. */
+            UPV(uipcp, "Can't find address for destination %s\n",
+                kvr.first.c_str());
+            continue;
+        }
+
+        for (size_t i = 0; i < kvr.second.size(); i++) {
+            const NodeId &lfa = kvr.second[i];
+            auto neigh        = rib->neighbors.find(lfa);
             rl_port_t port_id;
 
             if (neigh == rib->neighbors.end()) {
@@ -164,25 +198,23 @@ RoutingEngine::compute_fwd_table()
                 continue;
             }
 
-            /* Also make sure we know the address for this destination. */
-            dst_addr = rib->lookup_node_address(kvr.first);
-            if (dst_addr == RL_ADDR_NULL) {
-                /* We still miss the address of this destination. */
-                UPV(uipcp, "Can't find address for destination %s\n",
-                    kvr.first.c_str());
-                continue;
+            if (ports.empty()) {
+                first_nhop = lfa;
             }
+            ports.push_back({port_id, /*backup=*/i >= width && !ports.empty()});
+        }
 
-            /* We have found a suitable port for the destination, we can
-             * stop searching. */
-            next_ports_new_[dst_addr] = make_pair(kvr.first, port_id);
-            if (++port_hits[port_id] > dflt_hits) {
-                dflt_hits = port_hits[port_id];
-                dflt_port = port_id;
-                dflt_nhop = lfa;
-            }
-            break;
+        if (ports.empty()) {
+            continue;
+        }
+
+        /* Only single-port entries can be covered by the default entry. */
+        if (ports.size() == 1 && ++port_hits[ports[0].port_id] > dflt_hits) {
+            dflt_hits = port_hits[ports[0].port_id];
+            dflt_port = ports[0].port_id;
+            dflt_nhop = first_nhop;
         }
+        next_ports_new_[dst_addr] = make_pair(kvr.first, std::move(ports));
     }
 
 #if 1 /* Use default forwarding entry. */
@@ -192,80 +224,64 @@ RoutingEngine::compute_fwd_table()
         /* Prune out those entries corresponding to the default port, and
          * replace them with the default entry. */
         for (const auto &kve : next_ports_new_) {
-            if (kve.second.second != dflt_port) {
+            if (kve.second.second.size() != 1 ||
+                kve.second.second[0].port_id != dflt_port) {
                 next_ports_new[kve.first] = kve.second;
             }
         }
-        next_ports_new[RL_ADDR_NULL] = make_pair(any, dflt_port);
-        next_hops[any]               = std::vector<NodeId>(1, dflt_nhop);
+        next_ports_new[RL_ADDR_NULL] =
+            make_pair(any, vector<NextPort>(1, NextPort{dflt_port, false}));
+        next_hops[any] = std::vector<NodeId>(1, dflt_nhop);
     }
 #else /* Avoid using the default forwarding entry. */
     next_ports_new = next_ports_new_;
 #endif
 
-    /* Remove old PDUFT entries first. */
-    for (const auto &kve : next_ports) {
-        rlm_addr_t dst_addr;
-        rl_port_t port_id;
-        NodeId dst_node;
-        int ret;
-
-        auto nf = next_ports_new.find(kve.first);
-        if (nf != next_ports_new.end() &&
-            kve.second.second == nf->second.second) {
-            /* This old entry still exists, nothing to do. */
-            continue;
-        }
+    /* Check if anything changed with respect to the current PDUFT. */
+    bool changed = next_ports.size() != next_ports_new.size();
 
-        /* Delete the old one. */
-        dst_addr = kve.first;
-        dst_node = kve.second.first;
-        port_id  = kve.second.second;
-        ret      = uipcp_pduft_del(uipcp, dst_addr, port_id);
-        if (ret) {
-            UPE(uipcp,
-                "Failed to delete PDUFT entry for %s(%lu) "
-                "(port_id=%u) [%s]\n",
-                node_id_pretty(dst_node).c_str(), (long unsigned)dst_addr,
-                port_id, strerror(errno));
-        } else {
-            UPD(uipcp, "Delete PDUFT entry for %s(%lu) (port_id=%u)\n",
-                node_id_pretty(dst_node).c_str(), (long unsigned)dst_addr,
-                port_id);
+    for (const auto &kve : next_ports_new) {
+        if (changed) {
+            break;
         }
+        auto of = next_ports.find(kve.first);
+        changed = of == next_ports.end() ||
+                  of->second.second != kve.second.second;
     }
 
-    /* Generate new PDUFT entries. */
-    for (auto &kve : next_ports_new) {
-        rlm_addr_t dst_addr;
-        rl_port_t port_id;
-        NodeId dst_node;
+    if (changed) {
+        std::vector<rlm_addr_t> dst_addrs;
+        std::vector<rl_port_t> ports;
+        std::vector<uint8_t> flags;
         int ret;
 
-        auto of = next_ports.find(kve.first);
-        if (of != next_ports.end() && of->second.second == kve.second.second) {
-            /* This entry is already in place. */
-            continue;
+        /* Multiple next hops are specified by repeating the
+         * destination address. */
+        for (const auto &kve : next_ports_new) {
+            for (const NextPort &np : kve.second.second) {
+                dst_addrs.push_back(kve.first);
+                ports.push_back(np.port_id);
+                flags.push_back(np.backup ? RL_PDUFT_NH_F_BACKUP : 0);
+                UPV(uipcp, "PDUFT entry %s(%lu) --> port_id=%u%s\n",
+                    node_id_pretty(kve.second.first).c_str(),
+                    (long unsigned)kve.first, np.port_id,
+                    np.backup ? " (backup)" : "");
+            }
         }
 
-        /* Add the new one. */
-        dst_addr = kve.first;
-        dst_node = kve.second.first;
-        port_id  = kve.second.second;
-        ret      = uipcp_pduft_set(uipcp, dst_addr, port_id);
+        /* Swap in the new PDUFT with a single atomic update. */
+        ret = uipcp_pduft_replace(uipcp, dst_addrs.data(), ports.data(),
+                                  flags.data(), dst_addrs.size());
         if (ret) {
-            UPE(uipcp,
-                "Failed to insert %s(%lu) --> %s (port_id=%u) PDUFT "
-                "entry [%s]\n",
-                node_id_pretty(dst_node).c_str(), (long unsigned)dst_addr,
-                next_hops[dst_node].front().c_str(), port_id, strerror(errno));
-            /* Trigger re insertion next time. */
-            kve.second = make_pair(NodeId(), 0);
-        } else {
-            UPD(uipcp, "Set PDUFT entry %s(%lu) --> %s (port_id=%u)\n",
-                node_id_pretty(dst_node).c_str(), (long unsigned)dst_addr,
-                next_hops[dst_node].front().c_str(), port_id);
+            UPE(uipcp, "Failed to replace the PDUFT (%u entries) [%s]\n",
+                (unsigned)dst_addrs.size(), strerror(errno));
+            /* The old PDUFT is still in place, so that a new replacement
+             * will be tried next time. */
+            rib->stats.fwd_table_compute++;
+            return 0;
         }
+        UPD(uipcp, "Replaced PDUFT with %u entries\n",
+            (unsigned)dst_addrs.size());
     }
 
     next_ports = next_ports_new;
@@ -746,12 +762,14 @@ StaticRouting::route_mod(const struct rl_cmsg_ipcp_route_mod *req)
             }
         }
         re.next_hops[dest_ipcp] = next_hops;
+        re.num_ecmp.erase(dest_ipcp);
     } else { /* RLITE_U_IPCP_ROUTE_DEL */
         if (!re.next_hops.count(dest_ipcp)) {
             UPE(rib->uipcp, "No route to destination '%s'\n", req->dest_name);
             return -1;
         }
         re.next_hops.erase(dest_ipcp);
+        re.num_ecmp.erase(dest_ipcp);
     }
 
     re.compute_fwd_table();